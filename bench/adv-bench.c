@@ -0,0 +1,113 @@
+/*
+ * Advertising benchmark against blz-mock-bluez: registers an advertisement
+ * and changes its manufacturer data in a tight loop for a while, once
+ * without batching and once with an update interval. Prints the
+ * registration latency and how many changes went out as signals.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+static const char* address;
+static const char* adapter = "hci0";
+static int duration_ms = 1000;
+static int interval_ms = 100;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void log_handler(enum loglevel ll, const char* fmt, va_list ap,
+						void* user)
+{
+	if (ll <= LL_WARN) {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+}
+
+static bool bench_rotate(blz* ctx, const char* path, unsigned interval)
+{
+	struct blz_adv_stats st;
+	uint8_t data[8] = {0};
+	uint32_t i = 0;
+
+	blz_adv* adv = blz_adv_new(ctx, path, false);
+	if (adv == NULL) {
+		return false;
+	}
+	blz_adv_set_interval(adv, interval);
+	if (!blz_adv_set_manufacturer_data(adv, 0xffff, data, sizeof(data))
+		|| !blz_adv_register(adv)) {
+		blz_adv_free(adv);
+		return false;
+	}
+
+	uint64_t end = now_us() + duration_ms * 1000ULL;
+	while (now_us() < end) {
+		i++;
+		memcpy(data, &i, sizeof(i));
+		blz_adv_set_manufacturer_data(adv, 0xffff, data, sizeof(data));
+		/* sends what is due without waiting */
+		blz_loop(ctx, 0);
+	}
+	/* the last batch */
+	blz_loop(ctx, interval * 1000ULL);
+
+	blz_adv_get_stats(adv, &st);
+	printf("interval %4u ms: register %.2f ms, %lu changes, %lu sent "
+		   "(%.1f/s)\n",
+		   interval, st.register_us / 1000.0, st.updates, st.sent,
+		   st.sent_hz);
+
+	blz_adv_free(adv);
+	return true;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"Usage: blz-adv-bench [options]\n"
+			"  -a address  bus address, default is the system bus\n"
+			"  -i name     adapter (hci0)\n"
+			"  -d ms       duration of each run (1000)\n"
+			"  -u ms       update interval of the batched run (100)\n");
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:i:d:u:h")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 'i': adapter = optarg; break;
+		case 'd': duration_ms = atoi(optarg); break;
+		case 'u': interval_ms = atoi(optarg); break;
+		default: usage(); return EXIT_FAILURE;
+		}
+	}
+
+	blz* ctx = address ? blz_init_address(address, adapter)
+					   : blz_init(adapter);
+	if (ctx == NULL) {
+		return EXIT_FAILURE;
+	}
+	blz_set_ctx_log_handler(ctx, log_handler, NULL);
+
+	bool ok = bench_rotate(ctx, "/org/blzlib/bench/adv0", 0)
+			  && bench_rotate(ctx, "/org/blzlib/bench/adv1", interval_ms);
+
+	blz_fini(ctx);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
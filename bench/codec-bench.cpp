@@ -0,0 +1,445 @@
+/*
+ * Microbenchmark of the schema codecs of blzlib_codec.hpp against
+ * hand-written parsers for the same characteristics: Heart Rate
+ * Measurement, Health Thermometer Temperature Measurement (FLOAT) and Blood
+ * Pressure Measurement (SFLOAT and packed status bits), on random payloads
+ * with all combinations of their flags. Both results are compared first.
+ * The hand-written parsers use pow() for the exponent of the 11073 floats,
+ * as they usually do.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+
+#include "blzlib_codec.hpp"
+
+using namespace blzpp::codec;
+
+#define DEFAULT_ITER 10000000
+#define NUM_INPUTS	 256
+
+static volatile uint32_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** for the checksums which keep the results alive */
+static uint32_t bits32(double d)
+{
+	uint64_t u;
+	std::memcpy(&u, &d, sizeof(u));
+	return uint32_t(u ^ u >> 32);
+}
+
+/* --- Heart Rate Measurement (0x2a37) --- */
+
+struct hrm {
+	uint8_t flags;
+	uint16_t bpm;
+	uint16_t energy;
+	uint8_t rr_count;
+	std::array<uint16_t, 9> rr;
+};
+
+using hrm_codec = schema<
+	field<&hrm::flags, u8>,
+	field<&hrm::bpm, choose<&hrm::flags, 0x01, u16le, u8>>,
+	when<&hrm::flags, 0x08, field<&hrm::energy, u16le>>,
+	repeat<&hrm::rr, &hrm::rr_count, u16le, when_set<&hrm::flags, 0x10>>>;
+
+static bool ref_hrm(const uint8_t* p, size_t len, hrm& v)
+{
+	size_t off = 1;
+	if (len < 1) {
+		return false;
+	}
+	v.flags = p[0];
+	if (v.flags & 0x01) {
+		if (len < off + 2) {
+			return false;
+		}
+		v.bpm = p[off] | p[off + 1] << 8;
+		off += 2;
+	} else {
+		if (len < off + 1) {
+			return false;
+		}
+		v.bpm = p[off++];
+	}
+	if (v.flags & 0x08) {
+		if (len < off + 2) {
+			return false;
+		}
+		v.energy = p[off] | p[off + 1] << 8;
+		off += 2;
+	}
+	v.rr_count = 0;
+	if (v.flags & 0x10) {
+		while (len >= off + 2 && v.rr_count < v.rr.size()) {
+			v.rr[v.rr_count++] = p[off] | p[off + 1] << 8;
+			off += 2;
+		}
+	}
+	return true;
+}
+
+static uint32_t hrm_sum(const hrm& v)
+{
+	uint32_t s = v.flags + v.bpm * 3 + v.rr_count * 7;
+	if (v.flags & 0x08) {
+		s += v.energy;
+	}
+	for (int i = 0; i < v.rr_count; i++) {
+		s += v.rr[i] * (i + 1);
+	}
+	return s;
+}
+
+static bool hrm_eq(const hrm& a, const hrm& b)
+{
+	return a.flags == b.flags && a.bpm == b.bpm
+		   && (!(a.flags & 0x08) || a.energy == b.energy)
+		   && a.rr_count == b.rr_count
+		   && std::equal(a.rr.begin(), a.rr.begin() + a.rr_count, b.rr.begin());
+}
+
+/** same value, or both NaN. Allows for a different rounding of m * 10^e */
+static bool near(double a, double b)
+{
+	return (std::isnan(a) && std::isnan(b)) || a == b
+		   || std::fabs(a - b) <= std::fabs(a) * 1e-6;
+}
+
+/* --- Temperature Measurement (0x2a1c) --- */
+
+struct temp {
+	uint8_t flags;
+	double value;
+	uint16_t year;
+	uint8_t month, day, hours, minutes, seconds;
+	uint8_t type;
+};
+
+using temp_codec = schema<
+	field<&temp::flags, u8>, field<&temp::value, float32>,
+	when<&temp::flags, 0x02, field<&temp::year, u16le>,
+		 field<&temp::month, u8>, field<&temp::day, u8>,
+		 field<&temp::hours, u8>, field<&temp::minutes, u8>,
+		 field<&temp::seconds, u8>>,
+	when<&temp::flags, 0x04, field<&temp::type, u8>>>;
+
+static double ref_float(const uint8_t* p)
+{
+	int32_t m = p[0] | p[1] << 8 | p[2] << 16;
+	if (p[3] == 0 && m >= 0x7ffffe && m <= 0x800002) {
+		return m == 0x7ffffe ? INFINITY : m == 0x800002 ? -INFINITY : NAN;
+	}
+	if (m & 0x800000) {
+		m -= 0x1000000;
+	}
+	return m * pow(10, (int8_t)p[3]);
+}
+
+static bool ref_temp(const uint8_t* p, size_t len, temp& v)
+{
+	size_t off = 5;
+	if (len < 5) {
+		return false;
+	}
+	v.flags = p[0];
+	v.value = ref_float(p + 1);
+	if (v.flags & 0x02) {
+		if (len < off + 7) {
+			return false;
+		}
+		v.year = p[off] | p[off + 1] << 8;
+		v.month = p[off + 2];
+		v.day = p[off + 3];
+		v.hours = p[off + 4];
+		v.minutes = p[off + 5];
+		v.seconds = p[off + 6];
+		off += 7;
+	}
+	if (v.flags & 0x04) {
+		if (len < off + 1) {
+			return false;
+		}
+		v.type = p[off];
+	}
+	return true;
+}
+
+static uint32_t temp_sum(const temp& v)
+{
+	uint32_t s = v.flags + bits32(v.value);
+	if (v.flags & 0x02) {
+		s += v.year + v.month + v.day + v.hours + v.minutes + v.seconds;
+	}
+	if (v.flags & 0x04) {
+		s += v.type;
+	}
+	return s;
+}
+
+static bool temp_eq(const temp& a, const temp& b)
+{
+	return a.flags == b.flags && near(a.value, b.value)
+		   && (!(a.flags & 0x02)
+			   || (a.year == b.year && a.month == b.month && a.day == b.day
+				   && a.hours == b.hours && a.minutes == b.minutes
+				   && a.seconds == b.seconds))
+		   && (!(a.flags & 0x04) || a.type == b.type);
+}
+
+/* --- Blood Pressure Measurement (0x2a35) --- */
+
+struct bpm {
+	uint8_t flags;
+	float systolic, diastolic, map;
+	uint16_t year;
+	uint8_t month, day, hours, minutes, seconds;
+	float pulse;
+	uint8_t user;
+	bool body_movement, cuff_loose, irregular;
+	uint8_t pulse_range;
+	bool position;
+};
+
+using bpm_codec = schema<
+	field<&bpm::flags, u8>, field<&bpm::systolic, sfloat>,
+	field<&bpm::diastolic, sfloat>, field<&bpm::map, sfloat>,
+	when<&bpm::flags, 0x02, field<&bpm::year, u16le>, field<&bpm::month, u8>,
+		 field<&bpm::day, u8>, field<&bpm::hours, u8>,
+		 field<&bpm::minutes, u8>, field<&bpm::seconds, u8>>,
+	when<&bpm::flags, 0x04, field<&bpm::pulse, sfloat>>,
+	when<&bpm::flags, 0x08, field<&bpm::user, u8>>,
+	when<&bpm::flags, 0x10,
+		 bits<u16le, sub<&bpm::body_movement, 0, 1>,
+			  sub<&bpm::cuff_loose, 1, 1>, sub<&bpm::irregular, 2, 1>,
+			  sub<&bpm::pulse_range, 3, 2>, sub<&bpm::position, 5, 1>>>>;
+
+static float ref_sfloat(const uint8_t* p)
+{
+	uint16_t raw = p[0] | p[1] << 8;
+	if (raw >= 0x07fe && raw <= 0x0802) {
+		return raw == 0x07fe ? INFINITY : raw == 0x0802 ? -INFINITY : NAN;
+	}
+	int m = raw & 0x0fff;
+	int e = raw >> 12;
+	if (m & 0x800) {
+		m -= 0x1000;
+	}
+	if (e & 0x8) {
+		e -= 0x10;
+	}
+	return float(m * pow(10, e));
+}
+
+static bool ref_bpm(const uint8_t* p, size_t len, bpm& v)
+{
+	size_t off = 7;
+	if (len < 7) {
+		return false;
+	}
+	v.flags = p[0];
+	v.systolic = ref_sfloat(p + 1);
+	v.diastolic = ref_sfloat(p + 3);
+	v.map = ref_sfloat(p + 5);
+	if (v.flags & 0x02) {
+		if (len < off + 7) {
+			return false;
+		}
+		v.year = p[off] | p[off + 1] << 8;
+		v.month = p[off + 2];
+		v.day = p[off + 3];
+		v.hours = p[off + 4];
+		v.minutes = p[off + 5];
+		v.seconds = p[off + 6];
+		off += 7;
+	}
+	if (v.flags & 0x04) {
+		if (len < off + 2) {
+			return false;
+		}
+		v.pulse = ref_sfloat(p + off);
+		off += 2;
+	}
+	if (v.flags & 0x08) {
+		if (len < off + 1) {
+			return false;
+		}
+		v.user = p[off++];
+	}
+	if (v.flags & 0x10) {
+		if (len < off + 2) {
+			return false;
+		}
+		uint16_t st = p[off] | p[off + 1] << 8;
+		v.body_movement = st & 0x01;
+		v.cuff_loose = st & 0x02;
+		v.irregular = st & 0x04;
+		v.pulse_range = (st >> 3) & 0x03;
+		v.position = st & 0x20;
+	}
+	return true;
+}
+
+
+static uint32_t bpm_sum(const bpm& v)
+{
+	uint32_t s = v.flags + bits32(v.systolic) + bits32(v.diastolic) + bits32(v.map);
+	if (v.flags & 0x02) {
+		s += v.year + v.month + v.day + v.hours + v.minutes + v.seconds;
+	}
+	if (v.flags & 0x04) {
+		s += bits32(v.pulse);
+	}
+	if (v.flags & 0x08) {
+		s += v.user;
+	}
+	if (v.flags & 0x10) {
+		s += v.body_movement + v.cuff_loose * 2 + v.irregular * 4
+			 + v.pulse_range * 8 + v.position * 32;
+	}
+	return s;
+}
+
+static bool bpm_eq(const bpm& a, const bpm& b)
+{
+	return a.flags == b.flags && near(a.systolic, b.systolic)
+		   && near(a.diastolic, b.diastolic) && near(a.map, b.map)
+		   && (!(a.flags & 0x02)
+			   || (a.year == b.year && a.month == b.month && a.day == b.day
+				   && a.hours == b.hours && a.minutes == b.minutes
+				   && a.seconds == b.seconds))
+		   && (!(a.flags & 0x04) || near(a.pulse, b.pulse))
+		   && (!(a.flags & 0x08) || a.user == b.user)
+		   && (!(a.flags & 0x10)
+			   || (a.body_movement == b.body_movement
+				   && a.cuff_loose == b.cuff_loose
+				   && a.irregular == b.irregular
+				   && a.pulse_range == b.pulse_range
+				   && a.position == b.position));
+}
+
+/* --- inputs and runs --- */
+
+struct input {
+	uint8_t data[32];
+	size_t len;
+};
+
+static input hrm_in[NUM_INPUTS];
+static input temp_in[NUM_INPUTS];
+static input bpm_in[NUM_INPUTS];
+
+static void fill(input& in, uint8_t flags, size_t len)
+{
+	in.data[0] = flags;
+	for (size_t i = 1; i < len; i++) {
+		in.data[i] = rand();
+	}
+	in.len = len;
+}
+
+static void init_inputs(void)
+{
+	srand(1);
+	for (int i = 0; i < NUM_INPUTS; i++) {
+		uint8_t f = rand() & 0x19;
+		size_t len = 1 + (f & 0x01 ? 2 : 1) + (f & 0x08 ? 2 : 0)
+					 + (f & 0x10 ? 2 * (rand() % 10) : 0);
+		fill(hrm_in[i], f, len);
+
+		f = rand() & 0x06;
+		fill(temp_in[i], f, 5 + (f & 0x02 ? 7 : 0) + (f & 0x04 ? 1 : 0));
+
+		f = rand() & 0x1e;
+		fill(bpm_in[i], f,
+			 7 + (f & 0x02 ? 7 : 0) + (f & 0x04 ? 2 : 0) + (f & 0x08 ? 1 : 0)
+				 + (f & 0x10 ? 2 : 0));
+	}
+}
+
+/** schema and hand-written must agree, also for truncated payloads, and
+ * encode must give back the payload */
+template <class Codec, class T, class Ref, class Eq>
+static bool check(const char* name, input* in, Ref ref, Eq eq)
+{
+	for (int i = 0; i < NUM_INPUTS; i++) {
+		for (size_t len = 0; len <= in[i].len; len++) {
+			T a{}, b{};
+			bool ra = Codec::decode(in[i].data, len, a);
+			bool rb = ref(in[i].data, len, b);
+			if (ra != rb || (ra && !eq(a, b))) {
+				std::fprintf(stderr, "%s: mismatch input %d len %zu\n", name,
+							 i, len);
+				return false;
+			}
+		}
+
+		T a{};
+		std::array<std::byte, Codec::max_size> out;
+		Codec::decode(in[i].data, in[i].len, a);
+		size_t n = Codec::encode(a, out);
+		T b{};
+		if (n == 0 || !Codec::decode(std::span(out.data(), n), b)
+			|| !eq(a, b)) {
+			std::fprintf(stderr, "%s: encode mismatch input %d\n", name, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+template <class Codec, class T, class Ref, class Sum>
+static void run(const char* name, input* in, long iter, Ref ref, Sum sum)
+{
+	T v{};
+	uint64_t t0 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		const input& x = in[i % NUM_INPUTS];
+		ref(x.data, x.len, v);
+		sink = sink ^ sum(v);
+	}
+	uint64_t t1 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		const input& x = in[i % NUM_INPUTS];
+		Codec::decode(x.data, x.len, v);
+		sink = sink ^ sum(v);
+	}
+	uint64_t t2 = now_ns();
+
+	double a = double(t1 - t0) / iter;
+	double b = double(t2 - t1) / iter;
+	std::printf("%-16s %10.2f %10.2f %8.2fx\n", name, a, b, a / b);
+}
+
+int main(int argc, char** argv)
+{
+	long iter = argc > 1 ? atol(argv[1]) : DEFAULT_ITER;
+
+	init_inputs();
+	if (!check<hrm_codec, hrm>("hrm", hrm_in, ref_hrm, hrm_eq)
+		|| !check<temp_codec, temp>("temp", temp_in, ref_temp, temp_eq)
+		|| !check<bpm_codec, bpm>("bpm", bpm_in, ref_bpm, bpm_eq)) {
+		return EXIT_FAILURE;
+	}
+
+	/* the sum is part of both loops, so that nothing is optimized away */
+	std::printf("%-16s %10s %10s %9s\n", "ns/op", "by hand", "schema",
+				"speedup");
+	run<hrm_codec, hrm>("heart rate", hrm_in, iter, ref_hrm, hrm_sum);
+	run<temp_codec, temp>("temperature", temp_in, iter, ref_temp, temp_sum);
+	run<bpm_codec, bpm>("blood pressure", bpm_in, iter, ref_bpm, bpm_sum);
+
+	return EXIT_SUCCESS;
+}
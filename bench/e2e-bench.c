@@ -0,0 +1,421 @@
+/*
+ * End-to-end benchmark through the bus against blz-mock-bluez (or a real
+ * BlueZ and device with the default Nordic UART like UUIDs): init, known
+ * devices, connect, GATT discovery, read and write throughput and
+ * notification dispatch rate and latency. Results are printed and written
+ * as JSON so runs with different mock settings can be compared.
+ *
+ * Notification latency is only meaningful with the mock on the same host,
+ * which puts its CLOCK_MONOTONIC send time after a sequence number into
+ * each notification.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+static const char* address;
+static const char* adapter = "hci0";
+static const char* mac = "00:00:00:00:00:00";
+static const char* serv_uuid = "6e400100-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* write_uuid = "6e400101-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* notify_uuid = "6e400102-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* label = "";
+static const char* out_file;
+static int iterations = 1000;
+static int cycles = 10;
+static int duration_ms = 2000;
+
+struct results {
+	double init_ms;
+	double known_ms;
+	int known_devs;
+	double connect_ms;
+	double connect_min_ms;
+	double connect_max_ms;
+	double discover_ms;
+	int discover_objs;
+	double read_ops;
+	double write_ops;
+	double write_fd_ops;
+	double notify_rate;
+	double notify_lat_us;
+	unsigned long notify_lost;
+};
+
+/** the socket is non-blocking, waits until it takes more */
+static bool fd_write(int fd, const uint8_t* buf, size_t len)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+
+	while (write(fd, buf, len) < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			return false;
+		}
+		if (poll(&pfd, 1, 1000) <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+struct notify_state {
+	unsigned long count;
+	unsigned long lost;
+	uint32_t last_seq;
+	uint64_t lat_sum;
+	unsigned long lat_count;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* only warnings and errors, info messages would disturb the measurements */
+static void log_handler(enum loglevel ll, const char* fmt, va_list ap,
+						void* user)
+{
+	if (ll <= LL_WARN) {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+}
+
+static void scan_cb(const uint8_t* mac, enum blz_addr_type atype, int8_t rssi,
+					const uint8_t* data, size_t len, void* user)
+{
+	int* cnt = user;
+	(*cnt)++;
+}
+
+static void notify_cb(const uint8_t* data, size_t len, blz_char* ch,
+					  void* user)
+{
+	struct notify_state* ns = user;
+	uint32_t seq;
+	uint64_t ts;
+
+	ns->count++;
+	if (len < 12) {
+		return;
+	}
+
+	memcpy(&seq, data, 4);
+	memcpy(&ts, data + 4, 8);
+	if (ns->last_seq != 0 && seq > ns->last_seq + 1) {
+		ns->lost += seq - ns->last_seq - 1;
+	}
+	ns->last_seq = seq;
+
+	uint64_t now = now_us();
+	if (now >= ts) {
+		ns->lat_sum += now - ts;
+		ns->lat_count++;
+	}
+}
+
+/** enumerate all services and characteristics, returns number of objects
+ * or -1 on error */
+static int discover(blz_dev* dev)
+{
+	int objs = 0;
+
+	char** servs = blz_list_service_uuids(dev);
+	if (servs == NULL) {
+		return -1;
+	}
+
+	for (int i = 0; servs[i] != NULL; i++) {
+		blz_serv* srv = blz_get_serv_from_uuid(dev, servs[i]);
+		if (srv == NULL) {
+			return -1;
+		}
+		objs++;
+
+		char** chars = blz_list_char_uuids(srv);
+		for (int j = 0; chars != NULL && chars[j] != NULL; j++) {
+			blz_char* ch = blz_get_char_from_uuid(srv, chars[j]);
+			if (ch == NULL) {
+				blz_serv_free(srv);
+				return -1;
+			}
+			objs++;
+			blz_char_free(ch);
+		}
+		blz_serv_free(srv);
+	}
+	return objs;
+}
+
+static bool bench_connect(blz* ctx, struct results* res)
+{
+	double sum = 0;
+
+	res->connect_min_ms = 1e9;
+	for (int i = 0; i < cycles; i++) {
+		uint64_t t = now_us();
+		blz_dev* dev = blz_connect(ctx, mac, BLZ_ADDR_UNKNOWN);
+		double ms = (now_us() - t) / 1000.0;
+		if (dev == NULL) {
+			return false;
+		}
+		sum += ms;
+		res->connect_min_ms = MIN(res->connect_min_ms, ms);
+		res->connect_max_ms = MAX(res->connect_max_ms, ms);
+		blz_disconnect(dev);
+	}
+	res->connect_ms = sum / cycles;
+	return true;
+}
+
+static bool bench_gatt(blz* ctx, blz_dev* dev, struct results* res)
+{
+	uint8_t buf[20] = {0};
+	uint64_t t;
+
+	t = now_us();
+	res->discover_objs = discover(dev);
+	res->discover_ms = (now_us() - t) / 1000.0;
+	if (res->discover_objs < 0) {
+		LOG_ERR("discovery failed");
+		return false;
+	}
+
+	blz_serv* srv = blz_get_serv_from_uuid(dev, serv_uuid);
+	blz_char* wch = srv ? blz_get_char_from_uuid(srv, write_uuid) : NULL;
+	blz_char* nch = srv ? blz_get_char_from_uuid(srv, notify_uuid) : NULL;
+	if (wch == NULL || nch == NULL) {
+		LOG_ERR("service or characteristics not found");
+		goto fail;
+	}
+
+	t = now_us();
+	for (int i = 0; i < iterations; i++) {
+		if (blz_char_read(wch, buf, sizeof(buf)) < 0) {
+			goto fail;
+		}
+	}
+	res->read_ops = iterations * 1e6 / (now_us() - t);
+
+	t = now_us();
+	for (int i = 0; i < iterations; i++) {
+		buf[0] = i;
+		if (!blz_char_write(wch, buf, sizeof(buf))) {
+			goto fail;
+		}
+	}
+	res->write_ops = iterations * 1e6 / (now_us() - t);
+
+	/* fd writes are not acknowledged, this is the rate the socket accepts */
+	int fd = blz_char_write_fd_acquire(wch);
+	if (fd >= 0) {
+		int written = 0;
+		t = now_us();
+		for (; written < iterations; written++) {
+			buf[0] = written;
+			if (!fd_write(fd, buf, sizeof(buf))) {
+				break;
+			}
+		}
+		res->write_fd_ops = written * 1e6 / (now_us() - t);
+		close(fd);
+		if (written < iterations) {
+			LOG_ERR("fd write failed after %d: %s", written, strerror(errno));
+			goto fail;
+		}
+	}
+
+	struct notify_state ns = {0};
+	if (!blz_char_notify_start(nch, notify_cb, &ns)) {
+		goto fail;
+	}
+	t = now_us();
+	uint64_t end = t + duration_ms * 1000ULL;
+	while (now_us() < end) {
+		blz_loop(ctx, end - now_us());
+	}
+	res->notify_rate = ns.count * 1e6 / (now_us() - t);
+	res->notify_lat_us = ns.lat_count ? (double)ns.lat_sum / ns.lat_count : 0;
+	res->notify_lost = ns.lost;
+	blz_char_notify_stop(nch);
+
+	blz_char_free(wch);
+	blz_char_free(nch);
+	blz_serv_free(srv);
+	return true;
+
+fail:
+	blz_char_free(wch);
+	blz_char_free(nch);
+	blz_serv_free(srv);
+	return false;
+}
+
+static void print_results(struct results* r)
+{
+	printf("init             %10.2f ms\n", r->init_ms);
+	printf("known devices    %10.2f ms (%d devices)\n", r->known_ms,
+		   r->known_devs);
+	printf("connect          %10.2f ms (min %.2f max %.2f)\n", r->connect_ms,
+		   r->connect_min_ms, r->connect_max_ms);
+	printf("discovery        %10.2f ms (%d objects)\n", r->discover_ms,
+		   r->discover_objs);
+	printf("read             %10.0f ops/s\n", r->read_ops);
+	printf("write            %10.0f ops/s\n", r->write_ops);
+	printf("write fd         %10.0f ops/s\n", r->write_fd_ops);
+	printf("notify           %10.0f /s (latency %.0f us, lost %lu)\n",
+		   r->notify_rate, r->notify_lat_us, r->notify_lost);
+}
+
+static bool write_json(struct results* r)
+{
+	FILE* f = fopen(out_file, "w");
+	if (f == NULL) {
+		LOG_ERR("can't open %s", out_file);
+		return false;
+	}
+
+	fprintf(f,
+			"{\n"
+			"  \"label\": \"%s\",\n"
+			"  \"iterations\": %d,\n"
+			"  \"init_ms\": %.3f,\n"
+			"  \"known_devices_ms\": %.3f,\n"
+			"  \"known_devices\": %d,\n"
+			"  \"connect_ms\": %.3f,\n"
+			"  \"connect_min_ms\": %.3f,\n"
+			"  \"connect_max_ms\": %.3f,\n"
+			"  \"discovery_ms\": %.3f,\n"
+			"  \"discovery_objects\": %d,\n"
+			"  \"read_ops\": %.1f,\n"
+			"  \"write_ops\": %.1f,\n"
+			"  \"write_fd_ops\": %.1f,\n"
+			"  \"notify_rate\": %.1f,\n"
+			"  \"notify_latency_us\": %.1f,\n"
+			"  \"notify_lost\": %lu\n"
+			"}\n",
+			label, iterations, r->init_ms, r->known_ms, r->known_devs,
+			r->connect_ms, r->connect_min_ms, r->connect_max_ms,
+			r->discover_ms, r->discover_objs, r->read_ops, r->write_ops,
+			r->write_fd_ops, r->notify_rate, r->notify_lat_us, r->notify_lost);
+	fclose(f);
+	return true;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"blz-e2e-bench [-a bus-address] [options]\n"
+			"  -i name   adapter (hci0)\n"
+			"  -m MAC    device (00:00:00:00:00:00, first mock device)\n"
+			"  -s UUID   service with the characteristics below\n"
+			"  -w UUID   characteristic to read and write\n"
+			"  -n UUID   characteristic to get notifications from\n"
+			"  -N num    read and write iterations (1000)\n"
+			"  -c num    connect cycles (10)\n"
+			"  -d ms     notification duration (2000)\n"
+			"  -L label  label for this run in the results\n"
+			"  -o file   write results as JSON\n");
+}
+
+int main(int argc, char** argv)
+{
+	struct results res = {0};
+	int c;
+
+	while ((c = getopt(argc, argv, "a:i:m:s:w:n:N:c:d:L:o:h")) != -1) {
+		switch (c) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'i':
+			adapter = optarg;
+			break;
+		case 'm':
+			mac = optarg;
+			break;
+		case 's':
+			serv_uuid = optarg;
+			break;
+		case 'w':
+			write_uuid = optarg;
+			break;
+		case 'n':
+			notify_uuid = optarg;
+			break;
+		case 'N':
+			iterations = MAX(atoi(optarg), 1);
+			break;
+		case 'c':
+			cycles = MAX(atoi(optarg), 1);
+			break;
+		case 'd':
+			duration_ms = atoi(optarg);
+			break;
+		case 'L':
+			label = optarg;
+			break;
+		case 'o':
+			out_file = optarg;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	uint64_t t = now_us();
+	blz* ctx = address ? blz_init_address(address, adapter) : blz_init(adapter);
+	res.init_ms = (now_us() - t) / 1000.0;
+	if (ctx == NULL) {
+		return EXIT_FAILURE;
+	}
+	blz_set_ctx_log_handler(ctx, log_handler, NULL);
+
+	t = now_us();
+	for (int i = 0; i < cycles; i++) {
+		res.known_devs = 0;
+		if (!blz_known_devices(ctx, scan_cb, &res.known_devs)) {
+			goto fail;
+		}
+	}
+	res.known_ms = (now_us() - t) / 1000.0 / cycles;
+
+	if (!bench_connect(ctx, &res)) {
+		goto fail;
+	}
+
+	blz_dev* dev = blz_connect(ctx, mac, BLZ_ADDR_UNKNOWN);
+	if (dev == NULL) {
+		goto fail;
+	}
+	bool ok = bench_gatt(ctx, dev, &res);
+	blz_disconnect(dev);
+	if (!ok) {
+		goto fail;
+	}
+
+	blz_fini(ctx);
+
+	print_results(&res);
+	if (out_file != NULL && !write_json(&res)) {
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+
+fail:
+	blz_fini(ctx);
+	return EXIT_FAILURE;
+}
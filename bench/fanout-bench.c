@@ -0,0 +1,219 @@
+/*
+ * Fan-out benchmark against blz-mock-bluez: connects a number of devices
+ * and writes the same value to one characteristic of each, once one after
+ * the other with blz_char_write() and once with blz_char_write_fanout()
+ * with and without a limit of writes in flight. Run the mock with a reply
+ * latency (-l) for meaningful numbers.
+ *
+ * The last round frees one characteristic while the fan-out is in
+ * progress, its write has to complete with -ECANCELED.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+static const char* address;
+static const char* adapter = "hci0";
+static const char* serv_uuid = "6e400100-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* char_uuid = "6e400101-b5a3-f393-e0a9-e50e24dcca9e";
+static int num_devs = 10;
+static int rounds = 20;
+static int limit = 4;
+
+struct target {
+	blz_dev* dev;
+	blz_serv* srv;
+	blz_char* ch;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void log_handler(enum loglevel ll, const char* fmt, va_list ap,
+						void* user)
+{
+	if (ll <= LL_WARN) {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+}
+
+static bool connect_all(blz* ctx, struct target* t, blz_char** chars)
+{
+	char mac[18];
+
+	for (int i = 0; i < num_devs; i++) {
+		snprintf(mac, sizeof(mac), "00:00:00:00:00:%02X", i);
+		t[i].dev = blz_connect(ctx, mac, BLZ_ADDR_UNKNOWN);
+		t[i].srv = t[i].dev ? blz_get_serv_from_uuid(t[i].dev, serv_uuid)
+							: NULL;
+		t[i].ch = t[i].srv ? blz_get_char_from_uuid(t[i].srv, char_uuid)
+						   : NULL;
+		if (t[i].ch == NULL) {
+			LOG_ERR("%s: characteristic not found", mac);
+			return false;
+		}
+		chars[i] = t[i].ch;
+	}
+	return true;
+}
+
+static void bench_sequential(struct target* t, const uint8_t* buf,
+							 size_t len)
+{
+	int failed = 0;
+
+	uint64_t start = now_us();
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < num_devs; i++) {
+			failed += !blz_char_write(t[i].ch, buf, len);
+		}
+	}
+	double ms = (now_us() - start) / 1000.0 / rounds;
+
+	printf("sequential    %8.2f ms/round, %d failed\n", ms, failed);
+}
+
+static void bench_fanout(blz* ctx, blz_char** chars, unsigned max_inflight,
+						 const uint8_t* buf, size_t len,
+						 struct blz_fanout_result* res)
+{
+	struct blz_fanout_stats st;
+	uint64_t p50_sum = 0;
+	uint64_t max = 0;
+	int failed = 0;
+
+	uint64_t start = now_us();
+	for (int r = 0; r < rounds; r++) {
+		int f = blz_char_write_fanout(ctx, chars, num_devs, buf, len,
+									  max_inflight, res);
+		failed += f < 0 ? num_devs : f;
+		blz_fanout_stats(res, num_devs, &st);
+		p50_sum += st.p50_us;
+		max = MAX(max, st.max_us);
+	}
+	double ms = (now_us() - start) / 1000.0 / rounds;
+
+	printf("fan-out %4u  %8.2f ms/round, p50 %.2f ms, max %.2f ms, "
+		   "%d failed\n",
+		   max_inflight, ms, p50_sum / 1000.0 / rounds, max / 1000.0,
+		   failed);
+}
+
+static void fanout_done(size_t failed, void* user)
+{
+	*(bool*)user = true;
+}
+
+/** frees the last characteristic while its write is in flight */
+static bool bench_cancel(blz* ctx, struct target* t, blz_char** chars,
+						 const uint8_t* buf, size_t len,
+						 struct blz_fanout_result* res)
+{
+	bool done = false;
+	int last = num_devs - 1;
+
+	uint64_t start = now_us();
+	if (!blz_char_write_fanout_async(ctx, chars, num_devs, buf, len, 0, res,
+									 fanout_done, &done)) {
+		LOG_ERR("fan-out failed to start");
+		return false;
+	}
+	blz_char_free(t[last].ch);
+	t[last].ch = chars[last] = NULL;
+
+	/* bounded, a write which never completes would hang here */
+	while (!done && now_us() - start < 5000000) {
+		blz_loop(ctx, 100000);
+	}
+
+	printf("cancel        %8.2f ms, freed write: %s\n",
+		   (now_us() - start) / 1000.0,
+		   !done								? "hangs"
+		   : res[last].err == -ECANCELED	? "canceled"
+											: "not canceled");
+	return done && res[last].err == -ECANCELED;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"Usage: blz-fanout-bench [options]\n"
+			"  -a address  bus address, default is the system bus\n"
+			"  -i name     adapter (hci0)\n"
+			"  -n num      devices of the mock (10)\n"
+			"  -r num      rounds (20)\n"
+			"  -m num      writes in flight of the limited fan-out (4)\n"
+			"  -s UUID     service\n"
+			"  -c UUID     characteristic to write\n");
+}
+
+int main(int argc, char** argv)
+{
+	uint8_t buf[20] = {0};
+	bool ok = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:i:n:r:m:s:c:h")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 'i': adapter = optarg; break;
+		case 'n': num_devs = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		case 'm': limit = atoi(optarg); break;
+		case 's': serv_uuid = optarg; break;
+		case 'c': char_uuid = optarg; break;
+		default: usage(); return EXIT_FAILURE;
+		}
+	}
+	if (num_devs < 1 || num_devs > 256 || rounds < 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	blz* ctx = address ? blz_init_address(address, adapter)
+					   : blz_init(adapter);
+	if (ctx == NULL) {
+		return EXIT_FAILURE;
+	}
+	blz_set_ctx_log_handler(ctx, log_handler, NULL);
+
+	struct target* t = calloc(num_devs, sizeof(struct target));
+	blz_char** chars = calloc(num_devs, sizeof(blz_char*));
+	struct blz_fanout_result* res = calloc(num_devs,
+										   sizeof(struct blz_fanout_result));
+	if (t == NULL || chars == NULL || res == NULL) {
+		goto exit;
+	}
+
+	if (connect_all(ctx, t, chars)) {
+		bench_sequential(t, buf, sizeof(buf));
+		bench_fanout(ctx, chars, 0, buf, sizeof(buf), res);
+		bench_fanout(ctx, chars, limit, buf, sizeof(buf), res);
+		ok = bench_cancel(ctx, t, chars, buf, sizeof(buf), res);
+	}
+
+	for (int i = 0; i < num_devs; i++) {
+		blz_char_free(t[i].ch);
+		blz_serv_free(t[i].srv);
+		blz_disconnect(t[i].dev);
+	}
+
+exit:
+	free(res);
+	free(chars);
+	free(t);
+	blz_fini(ctx);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
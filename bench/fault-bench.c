@@ -0,0 +1,289 @@
+/*
+ * Latency distribution of library operations, meant to run through
+ * blz-fault-proxy against blz-mock-bluez to see how blzlib behaves when
+ * BlueZ is slow or misbehaves. Measures connect, read and write and
+ * reports p50, p99, p99.9 and the maximum as well as errors and
+ * reconnects. A failed operation counts with the time until it failed.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+static const char* address;
+static const char* adapter = "hci0";
+static const char* mac = "00:00:00:00:00:00";
+static const char* serv_uuid = "6e400100-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* char_uuid = "6e400101-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* label = "";
+static const char* out_file;
+static int iterations = 1000;
+static int cycles = 50;
+static bool quiet = true;
+
+struct op_stats {
+	const char* name;
+	uint32_t* lat_us;
+	int count;
+	int errors;
+	int reconnects;
+};
+
+struct session {
+	blz* ctx;
+	blz_dev* dev;
+	blz_serv* srv;
+	blz_char* ch;
+	bool disconnected;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void log_handler(enum loglevel ll, const char* fmt, va_list ap,
+						void* user)
+{
+	if (!quiet || ll <= LL_CRIT) {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+}
+
+static void disconnect_cb(void* user)
+{
+	struct session* s = user;
+	s->disconnected = true;
+}
+
+static void session_close(struct session* s)
+{
+	blz_char_free(s->ch);
+	blz_serv_free(s->srv);
+	blz_disconnect(s->dev);
+	s->ch = NULL;
+	s->srv = NULL;
+	s->dev = NULL;
+}
+
+static bool session_open(struct session* s)
+{
+	s->disconnected = false;
+	s->dev = blz_connect(s->ctx, mac, BLZ_ADDR_UNKNOWN);
+	if (s->dev == NULL) {
+		return false;
+	}
+	blz_set_disconnect_handler(s->dev, disconnect_cb, s);
+	s->srv = blz_get_serv_from_uuid(s->dev, serv_uuid);
+	s->ch = s->srv ? blz_get_char_from_uuid(s->srv, char_uuid) : NULL;
+	if (s->ch == NULL) {
+		session_close(s);
+		return false;
+	}
+	return true;
+}
+
+/** after a failure: reconnect if the device got disconnected */
+static void session_recover(struct session* s, struct op_stats* st)
+{
+	/* handle pending signals, e.g. Connected = false */
+	blz_loop(s->ctx, 0);
+	if (s->ch != NULL && !s->disconnected) {
+		return;
+	}
+	session_close(s);
+	for (int i = 0; i < 10 && !session_open(s); i++) {
+		st->reconnects++;
+	}
+	st->reconnects++;
+}
+
+static bool op_init(struct op_stats* st, const char* name, int n)
+{
+	st->name = name;
+	st->lat_us = calloc(n, sizeof(uint32_t));
+	return st->lat_us != NULL;
+}
+
+static void op_add(struct op_stats* st, uint64_t t0, bool ok)
+{
+	st->lat_us[st->count++] = MIN(now_us() - t0, UINT32_MAX);
+	if (!ok) {
+		st->errors++;
+	}
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double pct(struct op_stats* st, double q)
+{
+	if (st->count == 0) {
+		return 0;
+	}
+	size_t i = MIN((size_t)(q * st->count), (size_t)st->count - 1);
+	return st->lat_us[i] / 1000.0;
+}
+
+static void op_print(struct op_stats* st)
+{
+	qsort(st->lat_us, st->count, sizeof(uint32_t), cmp_u32);
+	printf("%-8s %6d %6d %6d %10.2f %10.2f %10.2f %10.2f\n", st->name,
+		   st->count, st->errors, st->reconnects, pct(st, 0.5), pct(st, 0.99),
+		   pct(st, 0.999), pct(st, 1));
+}
+
+static void op_json(FILE* f, struct op_stats* st, bool last)
+{
+	fprintf(f,
+			"    \"%s\": {\"count\": %d, \"errors\": %d, \"reconnects\": %d, "
+			"\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, "
+			"\"max_ms\": %.3f}%s\n",
+			st->name, st->count, st->errors, st->reconnects, pct(st, 0.5),
+			pct(st, 0.99), pct(st, 0.999), pct(st, 1), last ? "" : ",");
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"blz-fault-bench [-a bus-address] [options]\n"
+			"  -i name   adapter (hci0)\n"
+			"  -m MAC    device (00:00:00:00:00:00)\n"
+			"  -s UUID   service\n"
+			"  -w UUID   characteristic to read and write\n"
+			"  -N num    read and write iterations (1000)\n"
+			"  -c num    connect cycles (50)\n"
+			"  -L label  label (scenario name) for the results\n"
+			"  -o file   write results as JSON\n"
+			"  -v        show library log\n");
+}
+
+int main(int argc, char** argv)
+{
+	struct session s = {0};
+	struct op_stats ops[3];
+	uint8_t buf[20] = {0};
+	int c;
+
+	while ((c = getopt(argc, argv, "a:i:m:s:w:N:c:L:o:vh")) != -1) {
+		switch (c) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'i':
+			adapter = optarg;
+			break;
+		case 'm':
+			mac = optarg;
+			break;
+		case 's':
+			serv_uuid = optarg;
+			break;
+		case 'w':
+			char_uuid = optarg;
+			break;
+		case 'N':
+			iterations = MAX(atoi(optarg), 1);
+			break;
+		case 'c':
+			cycles = MAX(atoi(optarg), 1);
+			break;
+		case 'L':
+			label = optarg;
+			break;
+		case 'o':
+			out_file = optarg;
+			break;
+		case 'v':
+			quiet = false;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!op_init(&ops[0], "connect", cycles)
+		|| !op_init(&ops[1], "read", iterations)
+		|| !op_init(&ops[2], "write", iterations)) {
+		return EXIT_FAILURE;
+	}
+
+	s.ctx = address ? blz_init_address(address, adapter) : blz_init(adapter);
+	if (s.ctx == NULL) {
+		return EXIT_FAILURE;
+	}
+	blz_set_ctx_log_handler(s.ctx, log_handler, NULL);
+
+	/* connect including GATT lookup, as applications do */
+	for (int i = 0; i < cycles; i++) {
+		uint64_t t = now_us();
+		bool ok = session_open(&s);
+		op_add(&ops[0], t, ok);
+		session_close(&s);
+	}
+
+	session_recover(&s, &ops[1]);
+	ops[1].reconnects = 0;
+
+	for (int i = 0; i < iterations && s.ch != NULL; i++) {
+		uint64_t t = now_us();
+		bool ok = blz_char_read(s.ch, buf, sizeof(buf)) >= 0;
+		op_add(&ops[1], t, ok);
+		if (!ok) {
+			session_recover(&s, &ops[1]);
+		}
+	}
+
+	for (int i = 0; i < iterations && s.ch != NULL; i++) {
+		uint64_t t = now_us();
+		buf[0] = i;
+		bool ok = blz_char_write(s.ch, buf, sizeof(buf));
+		op_add(&ops[2], t, ok);
+		if (!ok) {
+			session_recover(&s, &ops[2]);
+		}
+	}
+
+	session_close(&s);
+	blz_fini(s.ctx);
+
+	printf("%-8s %6s %6s %6s %10s %10s %10s %10s\n", label[0] ? label : "op",
+		   "count", "errors", "reconn", "p50 ms", "p99 ms", "p99.9 ms",
+		   "max ms");
+	for (size_t i = 0; i < ARRAY_SIZE(ops); i++) {
+		op_print(&ops[i]);
+	}
+
+	if (out_file != NULL) {
+		FILE* f = fopen(out_file, "w");
+		if (f == NULL) {
+			LOG_ERR("can't open %s", out_file);
+			return EXIT_FAILURE;
+		}
+		fprintf(f, "{\n  \"label\": \"%s\",\n  \"ops\": {\n", label);
+		for (size_t i = 0; i < ARRAY_SIZE(ops); i++) {
+			op_json(f, &ops[i], i == ARRAY_SIZE(ops) - 1);
+		}
+		fprintf(f, "  }\n}\n");
+		fclose(f);
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(ops); i++) {
+		free(ops[i].lat_us);
+	}
+	return EXIT_SUCCESS;
+}
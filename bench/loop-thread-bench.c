@@ -0,0 +1,143 @@
+/*
+ * Scheduling latency of the loop thread (blz_thread_start()) under load:
+ * busy threads spin on the same CPU as the loop thread while it wakes up
+ * at the probe interval, then blz_thread_get_stats() is printed. Compare a
+ * run with -r 0 with one with a SCHED_FIFO priority, which needs
+ * CAP_SYS_NICE or RLIMIT_RTPRIO.
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define MAX_BUSY 16
+
+static const char* address;
+static const char* adapter = "hci0";
+static int cpu = 0;
+static int priority = 0;
+static int busy = 2;
+static int duration_ms = 5000;
+static unsigned probe_ms = 1;
+static volatile bool stop;
+
+static void* busy_run(void* arg)
+{
+	volatile unsigned long n = 0;
+
+	while (!stop) {
+		n++;
+	}
+	return NULL;
+}
+
+static bool busy_start(pthread_t* threads)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	for (int i = 0; i < busy; i++) {
+		int r = pthread_create(&threads[i], &attr, busy_run, NULL);
+		if (r != 0) {
+			LOG_ERR("busy thread failed: %s", strerror(r));
+			busy = i;
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	return busy > 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"Usage: blz-loop-thread-bench [options]\n"
+			"  -a address  bus address, default is the system bus\n"
+			"  -i name     adapter (hci0)\n"
+			"  -c cpu      CPU of the loop and busy threads (0)\n"
+			"  -r prio     SCHED_FIFO priority, 0 is SCHED_OTHER (0)\n"
+			"  -b num      busy threads (2)\n"
+			"  -P ms       probe interval (1)\n"
+			"  -d ms       duration (5000)\n");
+}
+
+int main(int argc, char** argv)
+{
+	pthread_t threads[MAX_BUSY];
+	struct blz_thread_stats st;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:i:c:r:b:P:d:h")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 'i': adapter = optarg; break;
+		case 'c': cpu = atoi(optarg); break;
+		case 'r': priority = atoi(optarg); break;
+		case 'b': busy = atoi(optarg); break;
+		case 'P': probe_ms = atoi(optarg); break;
+		case 'd': duration_ms = atoi(optarg); break;
+		default: usage(); return EXIT_FAILURE;
+		}
+	}
+	if (busy < 0 || busy > MAX_BUSY || probe_ms == 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	blz* ctx = address ? blz_init_address(address, adapter)
+					   : blz_init(adapter);
+	if (ctx == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	struct blz_thread_conf conf = {
+		.name = "blz-bench-loop",
+		.cpus = &cpu,
+		.num_cpus = 1,
+		.priority = priority,
+		.probe_ms = probe_ms,
+	};
+	if (!blz_thread_start(ctx, &conf)) {
+		blz_fini(ctx);
+		return EXIT_FAILURE;
+	}
+	if (busy > 0 && !busy_start(threads)) {
+		blz_fini(ctx);
+		return EXIT_FAILURE;
+	}
+
+	usleep(duration_ms * 1000);
+	blz_thread_get_stats(ctx, &st);
+
+	stop = true;
+	for (int i = 0; i < busy; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	int err = blz_thread_stop(ctx);
+	blz_fini(ctx);
+
+	printf("cpu %d, priority %d, %d busy: %lu wakeups, avg %llu us, "
+		   "p99 %llu us, max %llu us\n",
+		   cpu, priority, busy, st.wakeups,
+		   (unsigned long long)st.lat_avg_us,
+		   (unsigned long long)st.lat_p99_us,
+		   (unsigned long long)st.lat_max_us);
+	if (err < 0) {
+		LOG_ERR("loop thread ended: %s", strerror(-err));
+	}
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
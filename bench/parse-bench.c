@@ -0,0 +1,611 @@
+/*
+ * Microbenchmark of the message parsers in blzlib_msgs.c without a bus
+ * daemon. Realistic GetManagedObjects replies, InterfacesAdded and
+ * PropertiesChanged signals are built and sealed in-process on a bus over a
+ * socket pair, then parsed over and over. Reports time and heap
+ * allocations per object.
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <systemd/sd-bus.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_util.h"
+
+#define DEFAULT_ITER 2000
+#define ADAPTER_PATH "/org/bluez/hci0"
+#define DEV_PATH	 ADAPTER_PATH "/dev_00_00_00_00_00_00"
+
+/* count heap allocations by wrapping the glibc allocator */
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long allocs;
+
+void* malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+	allocs++;
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+static int num_devs = 50;
+static int num_servs = 8;
+static int num_chars = 4;
+static uint64_t cookie = 1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* --- message synthesis, properties like BlueZ 5.50 sends them --- */
+
+static int append_prop(sd_bus_message* m, const char* name, const char* type,
+					   ...)
+{
+	va_list ap;
+
+	int r = sd_bus_message_open_container(m, 'e', "sv");
+	if (r >= 0) {
+		r = sd_bus_message_append_basic(m, 's', name);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_open_container(m, 'v', type);
+	}
+	if (r >= 0) {
+		va_start(ap, type);
+		r = sd_bus_message_appendv(m, type, ap);
+		va_end(ap);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	return r;
+}
+
+static int append_prop_bytes(sd_bus_message* m, const char* name,
+							 const uint8_t* data, size_t len)
+{
+	int r = sd_bus_message_open_container(m, 'e', "sv");
+	if (r >= 0) {
+		r = sd_bus_message_append_basic(m, 's', name);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_open_container(m, 'v', "ay");
+	}
+	if (r >= 0) {
+		r = sd_bus_message_append_array(m, 'y', data, len);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	return r;
+}
+
+static int open_intf(sd_bus_message* m, const char* intf)
+{
+	int r = sd_bus_message_open_container(m, 'e', "sa{sv}");
+	if (r >= 0) {
+		r = sd_bus_message_append_basic(m, 's', intf);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_open_container(m, 'a', "{sv}");
+	}
+	return r;
+}
+
+static int close_intf(sd_bus_message* m)
+{
+	int r = sd_bus_message_close_container(m);
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	return r;
+}
+
+/* interfaces without properties which BlueZ lists for every object */
+static int append_std_intfs(sd_bus_message* m)
+{
+	int r = open_intf(m, "org.freedesktop.DBus.Introspectable");
+	if (r >= 0) {
+		r = close_intf(m);
+	}
+	if (r >= 0) {
+		r = open_intf(m, "org.freedesktop.DBus.Properties");
+	}
+	if (r >= 0) {
+		r = close_intf(m);
+	}
+	return r;
+}
+
+static void dev_path(char* buf, int d)
+{
+	snprintf(buf, DBUS_PATH_MAX_LEN, ADAPTER_PATH "/dev_00_00_00_00_%02X_%02X",
+			 (d >> 8) & 0xff, d & 0xff);
+}
+
+/** array of interfaces of device d */
+static int append_device_intfs(sd_bus_message* m, int d)
+{
+	char addr[BLZ_MAC_STR_LEN];
+	char name[16];
+	const uint8_t mac[6] = {d & 0xff, (d >> 8) & 0xff, 0, 0, 0, 0};
+
+	blz_mac_to_string(mac, addr);
+	snprintf(name, sizeof(name), "dev%d", d);
+
+	int r = sd_bus_message_open_container(m, 'a', "{sa{sv}}");
+	if (r >= 0) {
+		r = append_std_intfs(m);
+	}
+	if (r >= 0) {
+		r = open_intf(m, "org.bluez.Device1");
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Address", "s", addr);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "AddressType", "s", "random");
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Name", "s", name);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Alias", "s", name);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Paired", "b", 0);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Trusted", "b", 0);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Blocked", "b", 0);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "LegacyPairing", "b", 0);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "RSSI", "n", (int16_t)(-40 - d % 50));
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Connected", "b", d == 0);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "UUIDs", "as", 3,
+						"00001800-0000-1000-8000-00805f9b34fb",
+						"00001801-0000-1000-8000-00805f9b34fb",
+						"6e400001-b5a3-f393-e0a9-e50e24dcca9e");
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Adapter", "o", ADAPTER_PATH);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "ServicesResolved", "b", d == 0);
+	}
+	if (r >= 0) {
+		r = close_intf(m);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	return r;
+}
+
+static int append_object_start(sd_bus_message* m, const char* path)
+{
+	int r = sd_bus_message_open_container(m, 'e', "oa{sa{sv}}");
+	if (r >= 0) {
+		r = sd_bus_message_append_basic(m, 'o', path);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_open_container(m, 'a', "{sa{sv}}");
+	}
+	if (r >= 0) {
+		r = append_std_intfs(m);
+	}
+	return r;
+}
+
+static int append_object_end(sd_bus_message* m)
+{
+	int r = sd_bus_message_close_container(m);
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	return r;
+}
+
+/** GATT objects of the first device */
+static int append_gatt(sd_bus_message* m)
+{
+	char spath[DBUS_PATH_MAX_LEN];
+	char cpath[DBUS_PATH_MAX_LEN];
+	char uuid[BLZ_UUID_STR_LEN];
+	const uint8_t val[20] = {0};
+	int r = 0;
+
+	for (int s = 0; r >= 0 && s < num_servs; s++) {
+		snprintf(spath, sizeof(spath), DEV_PATH "/service%04x", s * 16 + 1);
+		snprintf(uuid, sizeof(uuid), "6e40%02x00-b5a3-f393-e0a9-e50e24dcca9e",
+				 s + 1);
+		r = append_object_start(m, spath);
+		if (r >= 0) {
+			r = open_intf(m, "org.bluez.GattService1");
+		}
+		if (r >= 0) {
+			r = append_prop(m, "UUID", "s", uuid);
+		}
+		if (r >= 0) {
+			r = append_prop(m, "Device", "o", DEV_PATH);
+		}
+		if (r >= 0) {
+			r = append_prop(m, "Primary", "b", 1);
+		}
+		if (r >= 0) {
+			r = append_prop(m, "Includes", "ao", 0);
+		}
+		if (r >= 0) {
+			r = close_intf(m);
+		}
+		if (r >= 0) {
+			r = append_object_end(m);
+		}
+
+		for (int c = 0; r >= 0 && c < num_chars; c++) {
+			snprintf(cpath, sizeof(cpath), "%s/char%04x", spath, c + 2);
+			snprintf(uuid, sizeof(uuid),
+					 "6e40%02x%02x-b5a3-f393-e0a9-e50e24dcca9e", s + 1, c + 1);
+			r = append_object_start(m, cpath);
+			if (r >= 0) {
+				r = open_intf(m, "org.bluez.GattCharacteristic1");
+			}
+			if (r >= 0) {
+				r = append_prop(m, "UUID", "s", uuid);
+			}
+			if (r >= 0) {
+				r = append_prop(m, "Service", "o", spath);
+			}
+			if (r >= 0) {
+				r = append_prop_bytes(m, "Value", val, sizeof(val));
+			}
+			if (r >= 0) {
+				r = append_prop(m, "Notifying", "b", 0);
+			}
+			if (r >= 0) {
+				r = append_prop(m, "Flags", "as", 3, "read", "write",
+								"notify");
+			}
+			if (r >= 0) {
+				r = append_prop(m, "NotifyAcquired", "b", 0);
+			}
+			if (r >= 0) {
+				r = close_intf(m);
+			}
+			if (r >= 0) {
+				r = append_object_end(m);
+			}
+		}
+	}
+	return r;
+}
+
+static sd_bus_message* make_managed_objects(sd_bus* bus, int* objs)
+{
+	sd_bus_message* call = NULL;
+	sd_bus_message* m = NULL;
+	char path[DBUS_PATH_MAX_LEN];
+
+	int r = sd_bus_message_new_method_call(bus, &call, "org.bluez", "/",
+										   "org.freedesktop.DBus.ObjectManager",
+										   "GetManagedObjects");
+	if (r >= 0) {
+		r = sd_bus_message_seal(call, cookie++, 0);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_new_method_return(call, &m);
+	}
+	sd_bus_message_unref(call);
+	if (r >= 0) {
+		r = sd_bus_message_open_container(m, 'a', "{oa{sa{sv}}}");
+	}
+
+	/* root, adapter, devices and GATT of first device */
+	if (r >= 0) {
+		r = append_object_start(m, "/org/bluez");
+	}
+	if (r >= 0) {
+		r = append_object_end(m);
+	}
+	if (r >= 0) {
+		r = append_object_start(m, ADAPTER_PATH);
+	}
+	if (r >= 0) {
+		r = open_intf(m, "org.bluez.Adapter1");
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Address", "s", "00:1A:7D:DA:71:13");
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Powered", "b", 1);
+	}
+	if (r >= 0) {
+		r = append_prop(m, "Discovering", "b", 0);
+	}
+	if (r >= 0) {
+		r = close_intf(m);
+	}
+	if (r >= 0) {
+		r = append_object_end(m);
+	}
+
+	for (int d = 0; r >= 0 && d < num_devs; d++) {
+		dev_path(path, d);
+		r = sd_bus_message_open_container(m, 'e', "oa{sa{sv}}");
+		if (r >= 0) {
+			r = sd_bus_message_append_basic(m, 'o', path);
+		}
+		if (r >= 0) {
+			r = append_device_intfs(m, d);
+		}
+		if (r >= 0) {
+			r = sd_bus_message_close_container(m);
+		}
+		if (d == 0 && r >= 0) {
+			r = append_gatt(m);
+		}
+	}
+
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_seal(m, cookie++, 0);
+	}
+	if (r < 0) {
+		fprintf(stderr, "failed to build GetManagedObjects: %s\n",
+				strerror(-r));
+		return sd_bus_message_unref(m);
+	}
+
+	*objs = 2 + num_devs + num_servs * (1 + num_chars);
+	return m;
+}
+
+static sd_bus_message* make_interfaces_added(sd_bus* bus)
+{
+	sd_bus_message* m = NULL;
+	char path[DBUS_PATH_MAX_LEN];
+
+	dev_path(path, 1);
+	int r = sd_bus_message_new_signal(bus, &m, "/",
+									  "org.freedesktop.DBus.ObjectManager",
+									  "InterfacesAdded");
+	if (r >= 0) {
+		r = sd_bus_message_append_basic(m, 'o', path);
+	}
+	if (r >= 0) {
+		r = append_device_intfs(m, 1);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_seal(m, cookie++, 0);
+	}
+	if (r < 0) {
+		fprintf(stderr, "failed to build InterfacesAdded: %s\n", strerror(-r));
+		return sd_bus_message_unref(m);
+	}
+	return m;
+}
+
+static sd_bus_message* make_properties_changed(sd_bus* bus)
+{
+	sd_bus_message* m = NULL;
+	const uint8_t val[20] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+
+	int r = sd_bus_message_new_signal(bus, &m,
+									  DEV_PATH "/service0001/char0002",
+									  "org.freedesktop.DBus.Properties",
+									  "PropertiesChanged");
+	if (r >= 0) {
+		r = sd_bus_message_append_basic(m, 's',
+										"org.bluez.GattCharacteristic1");
+	}
+	if (r >= 0) {
+		r = sd_bus_message_open_container(m, 'a', "{sv}");
+	}
+	if (r >= 0) {
+		r = append_prop_bytes(m, "Value", val, sizeof(val));
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(m);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_append_strv(m, NULL);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_seal(m, cookie++, 0);
+	}
+	if (r < 0) {
+		fprintf(stderr, "failed to build PropertiesChanged: %s\n",
+				strerror(-r));
+		return sd_bus_message_unref(m);
+	}
+	return m;
+}
+
+/* --- benchmarks --- */
+
+static void scan_cb(const uint8_t* mac, enum blz_addr_type atype, int8_t rssi,
+					const uint8_t* data, size_t len, void* user)
+{
+	int* cnt = user;
+	(*cnt)++;
+}
+
+static void report(const char* name, uint64_t ns, unsigned long a, long iter,
+				   int objs)
+{
+	printf("%-22s %10.1f %10.2f %12.0f\n", name, (double)ns / iter / objs,
+		   (double)a / iter / objs, (double)ns / iter);
+}
+
+/* run expression iter times on rewound message m */
+#define BENCH(name, m, objs, expr)                                             \
+	do {                                                                       \
+		unsigned long a0 = allocs;                                             \
+		uint64_t t0 = now_ns();                                                \
+		for (long i = 0; i < iter; i++) {                                      \
+			sd_bus_message_rewind(m, true);                                    \
+			if ((expr) < 0) {                                                  \
+				fprintf(stderr, "%s failed\n", name);                          \
+				return EXIT_FAILURE;                                           \
+			}                                                                  \
+		}                                                                      \
+		uint64_t t1 = now_ns();                                                \
+		report(name, t1 - t0, allocs - a0, iter, objs);                        \
+	} while (0)
+
+static void usage(void)
+{
+	fprintf(stderr, "blz-parse-bench [-n iterations] [-d devices] "
+					"[-s services] [-c chars-per-service]\n");
+}
+
+int main(int argc, char** argv)
+{
+	struct blz_context ctx = {0};
+	sd_bus* bus = NULL;
+	long iter = DEFAULT_ITER;
+	int sv[2];
+	int c;
+
+	while ((c = getopt(argc, argv, "n:d:s:c:h")) != -1) {
+		switch (c) {
+		case 'n':
+			iter = MAX(atol(optarg), 1);
+			break;
+		case 'd':
+			num_devs = MIN(MAX(atoi(optarg), 1), 0xffff);
+			break;
+		case 's':
+			num_servs = MIN(MAX(atoi(optarg), 1), 0xff);
+			break;
+		case 'c':
+			num_chars = MIN(MAX(atoi(optarg), 1), 0xff);
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* messages need a started bus, but nothing is ever sent on it */
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		return EXIT_FAILURE;
+	}
+	int r = sd_bus_new(&bus);
+	if (r >= 0) {
+		r = sd_bus_set_fd(bus, sv[0], sv[0]);
+	}
+	if (r >= 0) {
+		r = sd_bus_start(bus);
+	}
+	if (r < 0) {
+		fprintf(stderr, "bus setup failed: %s\n", strerror(-r));
+		return EXIT_FAILURE;
+	}
+
+	int objs;
+	sd_bus_message* mo = make_managed_objects(bus, &objs);
+	sd_bus_message* ia = make_interfaces_added(bus);
+	sd_bus_message* pc = make_properties_changed(bus);
+	if (mo == NULL || ia == NULL || pc == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	printf("%d objects, GetManagedObjects %zd bytes\n\n", objs,
+		   msg_size(&ctx, mo));
+	printf("%-22s %10s %10s %12s\n", "", "ns/object", "allocs/obj",
+		   "ns/message");
+
+	/* worst case lookup: UUID not found, every object is parsed */
+	blz_char ch = {.ctx = &ctx};
+	ch.uuid = uuid_intern(&ctx, "0000ffff-0000-1000-8000-00805f9b34fb");
+	BENCH("objects char find", mo, objs,
+		  msg_parse_objects(&ctx, mo, DEV_PATH, MSG_CHAR_FIND, &ch));
+
+	blz_serv srv = {.ctx = &ctx};
+	srv.uuid = uuid_intern(&ctx, "0000ffff-0000-1000-8000-00805f9b34fb");
+	BENCH("objects serv find", mo, objs,
+		  msg_parse_objects(&ctx, mo, DEV_PATH, MSG_SERV_FIND, &srv));
+
+	/* characteristics of the last service */
+	char spath[DBUS_PATH_MAX_LEN];
+	snprintf(spath, sizeof(spath), DEV_PATH "/service%04x",
+			 (num_servs - 1) * 16 + 1);
+	srv.char_uuids = mem_alloc(&ctx, BLZ_MEM_DEVICES,
+							   (num_chars + 1) * sizeof(char*));
+	BENCH("objects chars all", mo, objs,
+		  (srv.chars_idx = 0,
+		   msg_parse_objects(&ctx, mo, spath, MSG_CHARS_ALL, &srv)));
+	mem_free(&ctx, BLZ_MEM_DEVICES, srv.char_uuids,
+			 (num_chars + 1) * sizeof(char*));
+
+	int cnt = 0;
+	ctx.scan_cb = scan_cb;
+	ctx.scan_user = &cnt;
+	BENCH("objects device scan", mo, objs,
+		  msg_parse_objects(&ctx, mo, ADAPTER_PATH, MSG_DEVICE_SCAN, NULL));
+
+	BENCH("object device scan", ia, 1,
+		  msg_parse_object(&ctx, ia, ADAPTER_PATH, MSG_DEVICE_SCAN, NULL));
+
+	blz_dev dev = {.ctx = &ctx};
+	BENCH("object device", ia, 1,
+		  msg_parse_object(&ctx, ia, ADAPTER_PATH, MSG_DEVICE, &dev));
+	uuid_strv_free(&ctx, dev.service_uuids);
+
+	const void* ptr;
+	size_t len;
+	BENCH("notify", pc, 1, msg_parse_notify(&ctx, pc, &ch, &ptr, &len));
+
+	sd_bus_message_unref(mo);
+	sd_bus_message_unref(ia);
+	sd_bus_message_unref(pc);
+	sd_bus_flush_close_unref(bus);
+	close(sv[1]);
+	uuid_table_free(&ctx, &ctx.uuids);
+	return EXIT_SUCCESS;
+}
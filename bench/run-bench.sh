@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Runs blz-bench against blz-mock-bluez with echo on a private bus, for
+# regression tracking without a device. The mock adds no latency unless
+# given in the options, so the results show the overhead of blzlib, sd-bus
+# and the bus daemon.
+#
+# usage: run-bench.sh BUILD-DIR [OUTPUT] [MOCK-OPTIONS...]
+#
+
+set -e
+
+BUILD=${1:?build directory}
+OUT=${2:-bench-results.json}
+[ $# -ge 2 ] && shift 2 || shift $#
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+UUID=b5a3-f393-e0a9-e50e24dcca9e
+
+ADDR=$(dbus-daemon --config-file="$DIR/test-bus.conf" --fork \
+	--print-address=1 --print-pid=3 3>"$TMP/pid")
+"$BUILD/blz-mock-bluez" -a "$ADDR" -e -n 1000 "$@" &
+MOCK=$!
+trap 'kill $MOCK; kill $(cat "$TMP/pid"); rm -rf "$TMP"' EXIT
+
+# wait until org.bluez is on the bus
+for i in $(seq 50); do
+	dbus-send --bus="$ADDR" --print-reply --dest=org.bluez / \
+		org.freedesktop.DBus.Peer.Ping >/dev/null 2>&1 && break
+	sleep 0.1
+done
+
+"$BUILD/blz-bench" -a "$ADDR" -m 00:00:00:00:00:00 -L mock \
+	-s "6e400100-$UUID" -w "6e400101-$UUID" -n "6e400102-$UUID" \
+	-r "6e400101-$UUID" -d 2000 -o "$OUT"
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Runs blz-e2e-bench against blz-mock-bluez on a private bus for a range of
+# GATT tree sizes and collects the results in one JSON array.
+#
+# usage: run-e2e.sh BUILD-DIR [OUTPUT] [MOCK-OPTIONS...]
+#
+
+set -e
+
+BUILD=${1:?build directory}
+OUT=${2:-e2e-results.json}
+[ $# -ge 2 ] && shift 2 || shift $#
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+
+ADDR=$(dbus-daemon --config-file="$DIR/test-bus.conf" --fork \
+	--print-address=1 --print-pid=3 3>"$TMP/pid")
+trap 'kill $(cat "$TMP/pid"); rm -rf "$TMP"' EXIT
+
+# services x characteristics per device
+SIZES="1x4 4x4 8x8 16x16 32x16"
+
+echo "[" > "$OUT"
+SEP=""
+for SIZE in $SIZES; do
+	S=${SIZE%x*}
+	C=${SIZE#*x}
+	"$BUILD/blz-mock-bluez" -a "$ADDR" -s "$S" -c "$C" -n 1000 "$@" &
+	MOCK=$!
+	# wait until org.bluez is on the bus
+	for i in $(seq 50); do
+		dbus-send --bus="$ADDR" --print-reply --dest=org.bluez / \
+			org.freedesktop.DBus.Peer.Ping >/dev/null 2>&1 && break
+		sleep 0.1
+	done
+	echo "== $S services, $C characteristics"
+	"$BUILD/blz-e2e-bench" -a "$ADDR" -L "$SIZE" -o "$TMP/run.json" || true
+	kill $MOCK
+	wait $MOCK || true
+	if [ -f "$TMP/run.json" ]; then
+		printf "%s" "$SEP" >> "$OUT"
+		cat "$TMP/run.json" >> "$OUT"
+		rm "$TMP/run.json"
+		SEP=","
+	fi
+done
+echo "]" >> "$OUT"
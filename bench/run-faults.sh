@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Runs blz-fault-bench through blz-fault-proxy against blz-mock-bluez for a
+# set of fault scenarios and collects the results in one JSON array.
+#
+# usage: run-faults.sh BUILD-DIR [OUTPUT] [SCENARIO...]
+#
+
+set -e
+
+BUILD=${1:?build directory}
+OUT=${2:-fault-results.json}
+[ $# -ge 2 ] && shift 2 || shift $#
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+
+FRONT=$(dbus-daemon --config-file="$DIR/test-bus.conf" --fork \
+	--print-address=1 --print-pid=3 3>"$TMP/pid1")
+BACK=$(dbus-daemon --config-file="$DIR/test-bus.conf" --fork \
+	--print-address=1 --print-pid=3 3>"$TMP/pid2")
+trap 'kill $(cat "$TMP/pid1" "$TMP/pid2"); rm -rf "$TMP"' EXIT
+
+"$BUILD/blz-mock-bluez" -a "$BACK" -l 1 2>"$TMP/mock.log" &
+MOCK=$!
+
+# name and proxy options
+proxy_opts() {
+	case $1 in
+	baseline)	echo "" ;;
+	exp)		echo "-d exp:2" ;;
+	pareto)		echo "-d pareto:1:1.2" ;;
+	errors)		echo "-E InProgress:0.02 -E NotConnected:0.01:ReadValue" ;;
+	signals)	echo "-x 0.05 -X 0.05" ;;
+	storm)		echo "-S 200" ;;
+	timeout)	echo "-E timeout:0.001" ;;
+	esac
+}
+
+wait_bluez() {
+	for i in $(seq 50); do
+		dbus-send --bus="$1" --print-reply --dest=org.bluez / \
+			org.freedesktop.DBus.Peer.Ping >/dev/null 2>&1 && return
+		sleep 0.1
+	done
+	echo "org.bluez did not appear on $1" >&2
+	exit 1
+}
+
+wait_bluez "$BACK"
+
+SCENARIOS=${*:-baseline exp pareto errors signals storm}
+
+echo "[" > "$OUT"
+SEP=""
+for S in $SCENARIOS; do
+	"$BUILD/blz-fault-proxy" -f "$FRONT" -b "$BACK" $(proxy_opts "$S") &
+	PROXY=$!
+	wait_bluez "$FRONT"
+	"$BUILD/blz-fault-bench" -a "$FRONT" -L "$S" -o "$TMP/run.json" || true
+	kill $PROXY
+	wait $PROXY || true
+	if [ -f "$TMP/run.json" ]; then
+		printf "%s" "$SEP" >> "$OUT"
+		cat "$TMP/run.json" >> "$OUT"
+		rm "$TMP/run.json"
+		SEP=","
+	fi
+done
+echo "]" >> "$OUT"
+
+kill $MOCK
@@ -0,0 +1,187 @@
+/*
+ * Runs 1 to N independent contexts on N threads and reports how operations
+ * per second scale with the number of threads.
+ *
+ * Without a device it measures blz_known_devices(), which is a round trip
+ * to BlueZ each time, so BlueZ itself limits scaling. With -m and -s each
+ * context connects to the device and repeatedly lists the characteristics
+ * of the service from its cached object tree, which only uses the calling
+ * thread and should scale linearly.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define MAX_THREADS 64
+
+struct worker {
+	pthread_t thread;
+	int id;
+	long ops;
+	bool ok;
+};
+
+static const char* adapter = "hci0";
+static const char* address;
+static const char* mac;
+static const char* serv_uuid;
+static int duration_ms = 2000;
+static pthread_barrier_t barrier;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void log_handler(enum loglevel ll, const char* fmt, va_list ap,
+						void* user)
+{
+	struct worker* w = user;
+	char buf[256];
+
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	fprintf(stderr, "[%d] %s\n", w->id, buf);
+}
+
+static void scan_cb(const uint8_t* mac, enum blz_addr_type atype, int8_t rssi,
+					const uint8_t* data, size_t len, void* user)
+{
+}
+
+static void* worker_run(void* arg)
+{
+	struct worker* w = arg;
+	blz_dev* dev = NULL;
+	blz_serv* srv = NULL;
+
+	blz* ctx = address ? blz_init_address(address, adapter)
+					   : blz_init_private(adapter);
+	if (ctx != NULL) {
+		blz_set_ctx_log_handler(ctx, log_handler, w);
+	}
+
+	if (ctx != NULL && mac != NULL) {
+		dev = blz_connect(ctx, mac, BLZ_ADDR_UNKNOWN);
+		srv = dev ? blz_get_serv_from_uuid(dev, serv_uuid) : NULL;
+	}
+
+	w->ok = ctx != NULL && (mac == NULL || srv != NULL);
+
+	/* start all threads at the same time, also when setup failed */
+	pthread_barrier_wait(&barrier);
+
+	uint64_t end = now_ms() + duration_ms;
+	while (w->ok && now_ms() < end) {
+		if (srv != NULL) {
+			w->ok = blz_list_char_uuids(srv) != NULL;
+		} else {
+			w->ok = blz_known_devices(ctx, scan_cb, NULL);
+		}
+		w->ops++;
+	}
+
+	/* don't disconnect while other threads still use the device */
+	pthread_barrier_wait(&barrier);
+
+	blz_serv_free(srv);
+	blz_disconnect(dev);
+	blz_fini(ctx);
+	return NULL;
+}
+
+static double run(int n)
+{
+	struct worker w[MAX_THREADS] = {0};
+	long ops = 0;
+
+	pthread_barrier_init(&barrier, NULL, n);
+
+	for (int i = 0; i < n; i++) {
+		w[i].id = i;
+		pthread_create(&w[i].thread, NULL, worker_run, &w[i]);
+	}
+
+	for (int i = 0; i < n; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (!w[i].ok) {
+			LOG_ERR("thread %d failed", i);
+			ops = -1;
+		} else if (ops >= 0) {
+			ops += w[i].ops;
+		}
+	}
+
+	pthread_barrier_destroy(&barrier);
+	return ops < 0 ? -1 : ops * 1000.0 / duration_ms;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "blz-threads-bench [-a bus-address] [-i hci0] [-t threads]"
+					" [-d ms] [-m MAC -s service-uuid]\n");
+}
+
+int main(int argc, char** argv)
+{
+	int max_threads = 4;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:i:t:d:m:s:h")) != -1) {
+		switch (c) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'i':
+			adapter = optarg;
+			break;
+		case 't':
+			max_threads = MIN(MAX(atoi(optarg), 1), MAX_THREADS);
+			break;
+		case 'd':
+			duration_ms = atoi(optarg);
+			break;
+		case 'm':
+			mac = optarg;
+			break;
+		case 's':
+			serv_uuid = optarg;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ((mac == NULL) != (serv_uuid == NULL)) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	printf("%-8s %12s %12s %10s\n", "threads", "ops/s", "ops/s/thr",
+		   "scaling");
+
+	double base = 0;
+	for (int n = 1; n <= max_threads; n++) {
+		double ops = run(n);
+		if (ops < 0) {
+			return EXIT_FAILURE;
+		}
+		if (n == 1) {
+			base = ops;
+		}
+		printf("%-8d %12.0f %12.0f %9.0f%%\n", n, ops, ops / n,
+			   base > 0 ? ops / (base * n) * 100 : 0);
+	}
+
+	return EXIT_SUCCESS;
+}
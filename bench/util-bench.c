@@ -0,0 +1,203 @@
+/*
+ * Microbenchmark of MAC and UUID parse and format functions against the
+ * previous sscanf/sprintf based implementation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blzlib_util.h"
+
+#define DEFAULT_ITER 2000000
+
+/* sink to keep the compiler from optimizing the work away */
+static volatile uint8_t sink;
+
+/* previous implementations for reference */
+
+static bool ref_string_to_mac(const char* str, uint8_t mac[6])
+{
+	int n = sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx", mac + 5, mac + 4,
+				   mac + 3, mac + 2, mac + 1, mac);
+	return (n == 6);
+}
+
+static char* ref_mac_to_string(const uint8_t mac[6], char* buf)
+{
+	sprintf(buf, MAC_FMT, MAC_PARR(mac));
+	return buf;
+}
+
+static bool ref_string_to_uuid(const char* str, uint8_t uuid[16])
+{
+	int n = sscanf(str,
+				   "%2hhx%2hhx%2hhx%2hhx-%2hhx%2hhx-%2hhx%2hhx-%2hhx%2hhx-%"
+				   "2hhx%2hhx%2hhx%2hhx%2hhx%2hhx",
+				   uuid + 15, uuid + 14, uuid + 13, uuid + 12, uuid + 11,
+				   uuid + 10, uuid + 9, uuid + 8, uuid + 7, uuid + 6, uuid + 5,
+				   uuid + 4, uuid + 3, uuid + 2, uuid + 1, uuid);
+	return (n == 16);
+}
+
+static char* ref_uuid_to_string(const uint8_t* uuid, char* buf)
+{
+	sprintf(
+		buf,
+		"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+		uuid[15], uuid[14], uuid[13], uuid[12], uuid[11], uuid[10], uuid[9],
+		uuid[8], uuid[7], uuid[6], uuid[5], uuid[4], uuid[3], uuid[2], uuid[1],
+		uuid[0]);
+	return buf;
+}
+
+/* inputs, varied so branch predictors can't learn a single value */
+
+#define NUM_INPUTS 64
+
+static char mac_str[NUM_INPUTS][BLZ_MAC_STR_LEN];
+static char uuid_str[NUM_INPUTS][BLZ_UUID_STR_LEN];
+static uint8_t mac_bin[NUM_INPUTS][6];
+static uint8_t uuid_bin[NUM_INPUTS][16];
+
+static void init_inputs(void)
+{
+	srand(1);
+	for (int i = 0; i < NUM_INPUTS; i++) {
+		for (int j = 0; j < 6; j++) {
+			mac_bin[i][j] = rand();
+		}
+		for (int j = 0; j < 16; j++) {
+			uuid_bin[i][j] = rand();
+		}
+		ref_mac_to_string(mac_bin[i], mac_str[i]);
+		ref_uuid_to_string(uuid_bin[i], uuid_str[i]);
+	}
+}
+
+static bool check(void)
+{
+	uint8_t b1[16], b2[16];
+	char s1[BLZ_UUID_STR_LEN], s2[BLZ_UUID_STR_LEN];
+	const char* bad[] = {"00:11:22:33:44", "00:11:22:33:44:5x",
+						 "00-11-22-33-44-55", "",
+						 "6e400001-b5a3-f393-e0a9-e50e24dcca9",
+						 "6e400001xb5a3-f393-e0a9-e50e24dcca9e"};
+
+	for (int i = 0; i < NUM_INPUTS; i++) {
+		if (!blz_string_to_mac(mac_str[i], b1) || !ref_string_to_mac(mac_str[i], b2)
+			|| memcmp(b1, b2, 6) != 0
+			|| strcmp(blz_mac_to_string(mac_bin[i], s1),
+					  ref_mac_to_string(mac_bin[i], s2))
+				   != 0
+			|| !blz_string_to_uuid(uuid_str[i], b1)
+			|| !ref_string_to_uuid(uuid_str[i], b2) || memcmp(b1, b2, 16) != 0
+			|| strcmp(blz_uuid_to_string(uuid_bin[i], s1),
+					  ref_uuid_to_string(uuid_bin[i], s2))
+				   != 0) {
+			fprintf(stderr, "mismatch for input %d\n", i);
+			return false;
+		}
+
+		blz_mac_key key;
+		if (!blz_string_to_mac_key(mac_str[i], &key)
+			|| strcmp(blz_mac_key_to_string(key, s1), mac_str[i]) != 0) {
+			fprintf(stderr, "mac key mismatch for input %d\n", i);
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(bad); i++) {
+		if (blz_string_to_mac(bad[i], b1) || blz_string_to_uuid(bad[i], b1)) {
+			fprintf(stderr, "accepted invalid input '%s'\n", bad[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char* name, uint64_t ref_ns, uint64_t new_ns,
+				   long iter)
+{
+	double r = (double)ref_ns / iter;
+	double n = (double)new_ns / iter;
+	printf("%-16s %10.1f %10.1f %8.1fx\n", name, r, n, r / n);
+}
+
+int main(int argc, char** argv)
+{
+	long iter = argc > 1 ? atol(argv[1]) : DEFAULT_ITER;
+	uint8_t buf[16];
+	char str[BLZ_UUID_STR_LEN];
+	uint64_t t0, t1, t2;
+
+	init_inputs();
+	if (!check()) {
+		return EXIT_FAILURE;
+	}
+
+	printf("%-16s %10s %10s %9s\n", "ns/op", "sscanf", "blzlib", "speedup");
+
+	t0 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		ref_string_to_mac(mac_str[i % NUM_INPUTS], buf);
+		sink ^= buf[0];
+	}
+	t1 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		blz_string_to_mac(mac_str[i % NUM_INPUTS], buf);
+		sink ^= buf[0];
+	}
+	t2 = now_ns();
+	report("string_to_mac", t1 - t0, t2 - t1, iter);
+
+	t0 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		ref_mac_to_string(mac_bin[i % NUM_INPUTS], str);
+		sink ^= str[0];
+	}
+	t1 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		blz_mac_to_string(mac_bin[i % NUM_INPUTS], str);
+		sink ^= str[0];
+	}
+	t2 = now_ns();
+	report("mac_to_string", t1 - t0, t2 - t1, iter);
+
+	t0 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		ref_string_to_uuid(uuid_str[i % NUM_INPUTS], buf);
+		sink ^= buf[0];
+	}
+	t1 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		blz_string_to_uuid(uuid_str[i % NUM_INPUTS], buf);
+		sink ^= buf[0];
+	}
+	t2 = now_ns();
+	report("string_to_uuid", t1 - t0, t2 - t1, iter);
+
+	t0 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		ref_uuid_to_string(uuid_bin[i % NUM_INPUTS], str);
+		sink ^= str[0];
+	}
+	t1 = now_ns();
+	for (long i = 0; i < iter; i++) {
+		blz_uuid_to_string(uuid_bin[i % NUM_INPUTS], str);
+		sink ^= str[0];
+	}
+	t2 = now_ns();
+	report("uuid_to_string", t1 - t0, t2 - t1, iter);
+
+	return EXIT_SUCCESS;
+}
@@ -6,8 +6,12 @@
  */
 
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <systemd/sd-bus.h>
 #include <time.h>
 #include <unistd.h>
@@ -17,7 +21,79 @@
 #include "blzlib_log.h"
 #include "blzlib_util.h"
 
-blz* blz_init(const char* dev)
+static void dev_free(blz_dev* dev);
+static void connect_done(blz_dev* dev, int r, bool need_disconnect);
+static uint64_t op_check_retries(blz* ctx);
+static void fini_cancel(blz* ctx);
+static void call_noreply(blz* ctx, const char* path, const char* intf,
+						 const char* member);
+static void char_write_fd_shutdown(blz_char* ch);
+
+static size_t obj_cache_drop(blz* ctx, size_t need)
+{
+	size_t size = ctx->obj_cache_size;
+
+	if (ctx->obj_cache == NULL) {
+		return 0;
+	}
+
+	ctx->obj_cache = sd_bus_message_unref(ctx->obj_cache);
+	ctx->obj_cache_size = 0;
+	mem_release(ctx, BLZ_MEM_OBJ_CACHE, size);
+	return size;
+}
+
+static int obj_cache_signal_cb(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	/* objects were added or removed, cached tree is outdated */
+	obj_cache_drop(user, 0);
+	return 0;
+}
+
+/** cache a GetManagedObjects reply, unless that is not possible within the
+ * memory limits */
+static void obj_cache_store(blz* ctx, sd_bus_message* reply)
+{
+	if (ctx->obj_cache != NULL) {
+		return;
+	}
+
+	ssize_t size = msg_size(ctx, reply);
+	if (size > 0 && mem_reserve(ctx, BLZ_MEM_OBJ_CACHE, size)) {
+		ctx->obj_cache = sd_bus_message_ref(reply);
+		ctx->obj_cache_size = size;
+	}
+}
+
+/** get object tree from the cache or with GetManagedObjects. The cache is
+ * dropped when BlueZ adds or removes objects. unref reply after use */
+static int get_managed_objects(blz* ctx, sd_bus_message** reply)
+{
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	int r;
+
+	if (ctx->obj_cache != NULL) {
+		*reply = sd_bus_message_ref(ctx->obj_cache);
+		return sd_bus_message_rewind(*reply, true);
+	}
+
+	r = sd_bus_call_method(ctx->bus, "org.bluez", "/",
+						   "org.freedesktop.DBus.ObjectManager",
+						   "GetManagedObjects", &error, reply, "");
+
+	if (r < 0) {
+		CLOG_ERR(ctx, "Failed to get managed objects: %s", error.message);
+		sd_bus_error_free(&error);
+		return r;
+	}
+
+	obj_cache_store(ctx, *reply);
+	sd_bus_error_free(&error);
+	return r;
+}
+
+/** takes over the reference to bus */
+static blz* blz_init_bus(const char* dev, sd_bus* bus)
 {
 	int r;
 	struct blz_context* ctx;
@@ -26,20 +102,17 @@ blz* blz_init(const char* dev)
 	ctx = calloc(1, sizeof(struct blz_context));
 	if (ctx == NULL) {
 		LOG_ERR("blz_context: alloc failed");
+		sd_bus_unref(bus);
 		return NULL;
 	}
 
+	ctx->bus = bus;
+	ctx->peer = sd_bus_is_bus_client(bus) <= 0;
+
 	r = snprintf(ctx->path, DBUS_PATH_MAX_LEN, "/org/bluez/%s", dev);
 	if (r < 0 || r >= DBUS_PATH_MAX_LEN) {
-		LOG_ERR("BLZ init failed to construct path");
-		free(ctx);
-		return NULL;
-	}
-
-	/* Connect to the system bus */
-	r = sd_bus_default_system(&ctx->bus);
-	if (r < 0) {
-		LOG_ERR("Failed to connect to system bus: %s", strerror(-r));
+		CLOG_ERR(ctx, "BLZ init failed to construct path");
+		sd_bus_unref(ctx->bus);
 		free(ctx);
 		return NULL;
 	}
@@ -50,9 +123,9 @@ blz* blz_init(const char* dev)
 
 	if (r < 0) {
 		if (sd_bus_error_has_name(&error, SD_BUS_ERROR_UNKNOWN_OBJECT)) {
-			LOG_ERR("Adapter %s not known", dev);
+			CLOG_ERR(ctx, "Adapter %s not known", dev);
 		} else {
-			LOG_ERR("BLZ failed to power on: %s", error.message);
+			CLOG_ERR(ctx, "BLZ failed to power on: %s", error.message);
 		}
 		sd_bus_error_free(&error);
 		sd_bus_unref(ctx->bus);
@@ -60,16 +133,186 @@ blz* blz_init(const char* dev)
 		return NULL;
 	}
 
+	/* outdate object tree cache when objects are added or removed */
+	r = sd_bus_match_signal(ctx->bus, &ctx->obj_slot, bluez_sender(ctx), NULL,
+							"org.freedesktop.DBus.ObjectManager", NULL,
+							obj_cache_signal_cb, ctx);
+	if (r < 0) {
+		CLOG_WARN(ctx, "BLZ failed to add object signal, not caching");
+	} else {
+		mem_set_evict(ctx, BLZ_MEM_OBJ_CACHE, obj_cache_drop);
+	}
+
 	sd_bus_error_free(&error);
 	return ctx;
 }
 
+blz* blz_init(const char* dev)
+{
+	sd_bus* bus = NULL;
+
+	/* Connect to the system bus, shared by all contexts of this thread */
+	int r = sd_bus_default_system(&bus);
+	if (r < 0) {
+		LOG_ERR("Failed to connect to system bus: %s", strerror(-r));
+		return NULL;
+	}
+
+	return blz_init_bus(dev, bus);
+}
+
+blz* blz_init_private(const char* dev)
+{
+	sd_bus* bus = NULL;
+
+	/* Open a new connection to the system bus, only used by this context */
+	int r = sd_bus_open_system(&bus);
+	if (r < 0) {
+		LOG_ERR("Failed to open system bus: %s", strerror(-r));
+		return NULL;
+	}
+
+	return blz_init_bus(dev, bus);
+}
+
+blz* blz_init_with_bus(struct sd_bus* bus, const char* dev)
+{
+	if (bus == NULL) {
+		LOG_ERR("BLZ init no bus");
+		return NULL;
+	}
+
+	/* the context holds its own reference, caller keeps theirs */
+	return blz_init_bus(dev, sd_bus_ref(bus));
+}
+
+static blz* init_address(const char* address, const char* dev,
+						 bool bus_client)
+{
+	sd_bus* bus = NULL;
+
+	int r = sd_bus_new(&bus);
+	if (r < 0) {
+		LOG_ERR("Failed to create bus: %s", strerror(-r));
+		return NULL;
+	}
+
+	r = sd_bus_set_address(bus, address);
+	if (r < 0) {
+		LOG_ERR("Invalid bus address '%s': %s", address, strerror(-r));
+		goto err;
+	}
+
+	/* allow fd passing for AcquireWrite / AcquireNotify */
+	r = sd_bus_set_bus_client(bus, bus_client);
+	if (r >= 0) {
+		r = sd_bus_negotiate_fds(bus, 1);
+	}
+	if (r < 0) {
+		LOG_ERR("Failed to set up bus '%s': %s", address, strerror(-r));
+		goto err;
+	}
+
+	r = sd_bus_start(bus);
+	if (r < 0) {
+		LOG_ERR("Failed to connect to bus '%s': %s", address, strerror(-r));
+		goto err;
+	}
+
+	return blz_init_bus(dev, bus);
+
+err:
+	sd_bus_unref(bus);
+	return NULL;
+}
+
+blz* blz_init_address(const char* address, const char* dev)
+{
+	return init_address(address, dev, true);
+}
+
+blz* blz_init_peer(const char* address, const char* dev)
+{
+	return init_address(address, dev, false);
+}
+
 void blz_fini(blz* ctx)
 {
 	if (ctx == NULL) {
 		return;
 	}
+
+	blz_thread_stop(ctx);
+
+	/* what the user did not free is taken down here: all calls are sent at
+	 * once and the replies of Disconnect are awaited until the deadline */
+	uint64_t deadline = now_usec() + FINI_TIMEOUT * 1000000ULL;
+
+	if (ctx->scan_slot != NULL) {
+		call_noreply(ctx, ctx->path, "org.bluez.Adapter1", "StopDiscovery");
+		ctx->scan_slot = sd_bus_slot_unref(ctx->scan_slot);
+	}
+	for (blz_char* ch = ctx->chars; ch != NULL; ch = ch->next) {
+		char_write_fd_shutdown(ch);
+		if (ch->notify_slot != NULL) {
+			call_noreply(ctx, ch->path, "org.bluez.GattCharacteristic1",
+						 "StopNotify");
+			ch->notify_slot = sd_bus_slot_unref(ch->notify_slot);
+		}
+	}
+	/* cancel connects in progress, BlueZ stops trying */
+	while (ctx->connecting != NULL) {
+		connect_done(ctx->connecting, -ECANCELED, true);
+	}
+	/* and everything else while the devices still exist, the callbacks may
+	 * free them (e.g. plan executions) */
+	fini_cancel(ctx);
+	while (ctx->devices != NULL) {
+		/* unlinks the device, also on error */
+		blz_disconnect_async(ctx->devices, NULL, NULL);
+	}
+
+	uint64_t now = now_usec();
+	while (ctx->disconnecting != NULL && now < deadline) {
+		blz_loop(ctx, deadline - now);
+		now = now_usec();
+	}
+	/* canceled operations which did not complete in the loop */
+	op_check_retries(ctx);
+	/* no reply in time, without callback */
+	while (ctx->disconnecting != NULL) {
+		blz_dev* dev = ctx->disconnecting;
+		ctx->disconnecting = dev->next;
+		dev_free(dev);
+	}
+	while (ctx->chars != NULL) {
+		blz_char* ch = ctx->chars;
+		ctx->chars = ch->next;
+		mem_free(ctx, BLZ_MEM_DEVICES, ch, sizeof(struct blz_char));
+	}
+	while (ctx->servs != NULL) {
+		blz_serv* sv = ctx->servs;
+		ctx->servs = sv->next;
+		mem_free(ctx, BLZ_MEM_DEVICES, sv->char_uuids,
+				 (sv->chars_cnt + 1) * sizeof(char*));
+		mem_free(ctx, BLZ_MEM_DEVICES, sv, sizeof(struct blz_serv));
+	}
+	/* unregisters, BlueZ would call Release of the gone objects later */
+	while (ctx->advs != NULL) {
+		blz_adv_free(ctx->advs);
+	}
+	while (ctx->servers != NULL) {
+		blz_server_free(ctx->servers);
+	}
+	/* send the calls without reply before a shared bus is left alone */
+	sd_bus_flush(ctx->bus);
+
+	obj_cache_drop(ctx, 0);
+	sd_bus_slot_unref(ctx->obj_slot);
 	sd_bus_unref(ctx->bus);
+	events_free(ctx);
+	health_free_all(ctx);
+	uuid_table_free(ctx, &ctx->uuids);
 	free(ctx);
 }
 
@@ -87,11 +330,11 @@ bool blz_known_devices(blz* ctx, blz_scan_handler_t cb, void* user)
 						   "GetManagedObjects", &error, &reply, "");
 
 	if (r < 0) {
-		LOG_ERR("Failed to get managed objects: %s", error.message);
+		CLOG_ERR(ctx, "Failed to get managed objects: %s", error.message);
 		goto exit;
 	}
 
-	r = msg_parse_objects(reply, ctx->path, MSG_DEVICE_SCAN, ctx);
+	r = msg_parse_objects(ctx, reply, ctx->path, MSG_DEVICE_SCAN, ctx);
 	/* error logging done in function */
 
 exit:
@@ -104,13 +347,13 @@ static int blz_intf_cb(sd_bus_message* m, void* user, sd_bus_error* err)
 {
 	blz* ctx = user;
 
-	if (ctx == NULL || ctx->scan_cb == NULL) {
-		LOG_ERR("BLZ scan no callback");
+	if (ctx == NULL || (ctx->scan_cb == NULL && !events_enabled(ctx))) {
+		CLOG_ERR(ctx, "BLZ scan no callback");
 		return -1;
 	}
 
 	/* error logging done in function */
-	return msg_parse_object(m, ctx->path, MSG_DEVICE_SCAN, ctx);
+	return msg_parse_object(ctx, m, ctx->path, MSG_DEVICE_SCAN, ctx);
 }
 
 bool blz_scan_start(blz* ctx, blz_scan_handler_t cb, void* user)
@@ -118,15 +361,20 @@ bool blz_scan_start(blz* ctx, blz_scan_handler_t cb, void* user)
 	sd_bus_error error = SD_BUS_ERROR_NULL;
 	int r;
 
+	if (cb == NULL && !events_enabled(ctx)) {
+		CLOG_ERR(ctx, "BLZ scan no callback");
+		return false;
+	}
+
 	ctx->scan_cb = cb;
 	ctx->scan_user = user;
 
-	r = sd_bus_match_signal(ctx->bus, &ctx->scan_slot, "org.bluez", "/",
+	r = sd_bus_match_signal(ctx->bus, &ctx->scan_slot, bluez_sender(ctx), "/",
 							"org.freedesktop.DBus.ObjectManager",
 							"InterfacesAdded", blz_intf_cb, ctx);
 
 	if (r < 0) {
-		LOG_ERR("BLZ Failed to notify");
+		CLOG_ERR(ctx, "BLZ Failed to notify");
 		goto exit;
 	}
 
@@ -135,7 +383,7 @@ bool blz_scan_start(blz* ctx, blz_scan_handler_t cb, void* user)
 						   "");
 
 	if (r < 0) {
-		LOG_ERR("BLZ failed to scan: %s", error.message);
+		CLOG_ERR(ctx, "BLZ failed to scan: %s", error.message);
 	}
 
 exit:
@@ -153,7 +401,7 @@ bool blz_scan_stop(blz* ctx)
 						   "");
 
 	if (r < 0) {
-		LOG_ERR("BLZ failed to stop scan: %s", error.message);
+		CLOG_ERR(ctx, "BLZ failed to stop scan: %s", error.message);
 	}
 
 	ctx->scan_slot = sd_bus_slot_unref(ctx->scan_slot);
@@ -164,577 +412,1224 @@ bool blz_scan_stop(blz* ctx)
 	return r >= 0;
 }
 
-static int blz_connect_cb(sd_bus_message* m, void* user, sd_bus_error* err)
+uint64_t now_usec(void)
 {
-	struct blz_dev* dev = user;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-	if (dev == NULL) {
-		LOG_ERR("BLZ connect no dev");
-		return -1;
-	}
+/** method call, the reply doesn't matter */
+static void call_noreply(blz* ctx, const char* path, const char* intf,
+						 const char* member)
+{
+	sd_bus_message* call = NULL;
 
-	/* error logging done in function */
-	msg_parse_interface(m, MSG_DEVICE, NULL, dev);
-	return 0;
+	if (sd_bus_message_new_method_call(ctx->bus, &call, "org.bluez", path,
+									   intf, member)
+		>= 0) {
+		sd_bus_call_async(ctx->bus, NULL, call, NULL, NULL, 0);
+	}
+	sd_bus_message_unref(call);
 }
 
-static int connect_known_cb(sd_bus_message* reply, void* userdata,
-							sd_bus_error* error)
+static void dev_free(blz_dev* dev)
 {
-	int r = 0;
-	blz_dev* dev = (blz_dev*)userdata;
+	sd_bus_slot_unref(dev->connect_slot);
+	sd_bus_slot_unref(dev->call_slot);
+	sd_bus_slot_unref(dev->objects_slot);
+	events_forget(dev->ctx, dev);
+	/* free, UUID strings are interned in context */
+	uuid_strv_free(dev->ctx, dev->service_uuids);
+	mem_free(dev->ctx, BLZ_MEM_DEVICES, dev, sizeof(struct blz_dev));
+}
 
-	if (dev == NULL) {
-		LOG_ERR("BLZ connect cb no dev");
-		return -1;
+/** end of blz_connect_async(): pass the device to the callback or free it
+ * and pass NULL */
+static void connect_done(blz_dev* dev, int r, bool need_disconnect)
+{
+	blz* ctx = dev->ctx;
+	blz_connect_cb_t cb = dev->connect_cb;
+	void* user = dev->connect_user;
+	struct dev_health* health = dev->health;
+	struct blz_event* ev;
+
+	for (blz_dev** p = &ctx->connecting; *p != NULL; p = &(*p)->connect_next) {
+		if (*p == dev) {
+			*p = dev->connect_next;
+			break;
+		}
 	}
+	dev->call_slot = sd_bus_slot_unref(dev->call_slot);
+	dev->connect_cb = NULL;
+	dev->wait_resolved = false;
 
-	const sd_bus_error* err = sd_bus_message_get_error(reply);
-	if (err != NULL) {
-		r = -sd_bus_message_get_errno(reply);
-		LOG_INF("BLZ connect error: %s '%s' (%d)", err->name, err->message, r);
+	if (r < 0) {
+		/* connect calls may have failed with timeout, in this situation
+		 * bluez is still trying to open the connection. Calling Disconnect
+		 * cancels the connection attempt, the reply doesn't matter */
+		if (need_disconnect) {
+			call_noreply(ctx, dev->path, "org.bluez.Device1", "Disconnect");
+		}
+		dev_free(dev);
+		dev = NULL;
+	} else {
+		dev->connected = true;
+		dev->next = ctx->devices;
+		ctx->devices = dev;
 	}
 
-	dev->connect_async_result = r;
-	dev->connect_async_done = true;
-	return r;
+	health_connect(health, dev, r);
+	if (cb != NULL) {
+		cb(dev, r, user);
+	} else if ((ev = event_push(ctx, BLZ_EVENT_CONNECT, r, user)) != NULL) {
+		ev->dev = dev;
+	}
 }
 
-static int blz_connect_known(blz_dev* dev, const char* macstr)
+/** method call for the connect in progress, reply goes to cb */
+static int connect_call(blz_dev* dev, const char* path, const char* intf,
+						const char* member, sd_bus_message_handler_t cb,
+						uint64_t timeout_us, const char* types, ...)
 {
-	int r;
 	sd_bus_message* call = NULL;
+	va_list ap;
 
-	r = sd_bus_message_new_method_call(dev->ctx->bus, &call, "org.bluez",
-									   dev->path, "org.bluez.Device1",
-									   "Connect");
-
+	int r = sd_bus_message_new_method_call(dev->ctx->bus, &call, "org.bluez",
+										   path, intf, member);
+	if (r >= 0 && types != NULL) {
+		va_start(ap, types);
+		r = sd_bus_message_appendv(call, types, ap);
+		va_end(ap);
+	}
+	if (r >= 0) {
+		dev->call_slot = sd_bus_slot_unref(dev->call_slot);
+		r = sd_bus_call_async(dev->ctx->bus, &dev->call_slot, call, cb, dev,
+							  timeout_us);
+	}
 	if (r < 0) {
-		LOG_ERR("BLZ connect failed to create message: %d", r);
-		goto exit;
+		CLOG_ERR(dev->ctx, "BLZ connect failed to call %s: %s", member,
+				 strerror(-r));
 	}
+	sd_bus_message_unref(call);
+	return r;
+}
 
-	dev->connect_async_done = false;
+/** connected, now ServicesResolved is needed before services and
+ * characteristics can be looked up */
+static void connect_wait_resolved(blz_dev* dev)
+{
+	if (dev->services_resolved) {
+		connect_done(dev, 0, false);
+		return;
+	}
+	dev->wait_resolved = true;
+	dev->deadline = now_usec() + SERV_RESOLV_TIMEOUT * 1000000ULL;
+}
 
-	/* call it async because it can take longer than the normal sd_bus
-	 * timeout and we want to wait until it is finished or failed */
-	r = sd_bus_call_async(dev->ctx->bus, NULL, call, connect_known_cb, dev,
-						  CONNECT_TIMEOUT * 1000000);
+static int blz_connect_cb(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	struct blz_dev* dev = user;
 
-	if (r < 0) {
-		LOG_ERR("BLZ connect failed: %d", r);
-		goto exit;
+	if (dev == NULL) {
+		LOG_ERR("BLZ connect no dev");
+		return -1;
 	}
 
-	/* wait for callback */
-	r = blz_loop_timeout(dev->ctx, &dev->connect_async_done,
-						 CONNECT_TIMEOUT * 1000);
-	if (r < 0) {
-		LOG_ERR("BLZ connect timeout");
-	} else {
-		r = dev->connect_async_result;
+	/* error logging done in function */
+	msg_parse_interface(dev->ctx, m, MSG_DEVICE, NULL, dev);
+
+	/* we usually receive connected = true before ServicesResolved, but at
+	 * that time we are not ready yet to look up services */
+	if (dev->wait_resolved && dev->services_resolved) {
+		connect_done(dev, 0, false);
 	}
+	return 0;
+}
 
-exit:
-	sd_bus_message_unref(call);
-	return r;
+static int connect_reply_cb(sd_bus_message* reply, void* userdata,
+							sd_bus_error* error)
+{
+	blz_dev* dev = userdata;
+
+	const sd_bus_error* err = sd_bus_message_get_error(reply);
+	if (err != NULL) {
+		int r = -sd_bus_message_get_errno(reply);
+		CLOG_INF(dev->ctx, "BLZ connect error: %s '%s' (%d)", err->name,
+				 err->message, r);
+		connect_done(dev, r, true);
+		return 0;
+	}
+
+	connect_wait_resolved(dev);
+	return 0;
 }
 
+static void connect_new(blz_dev* dev, bool addr_public);
+
 static int connect_new_cb(sd_bus_message* reply, void* userdata,
 						  sd_bus_error* error)
 {
+	blz_dev* dev = userdata;
+	const char* opath;
 	int r;
-	char* opath;
-	blz_dev* dev = (blz_dev*)userdata;
-
-	if (dev == NULL) {
-		LOG_ERR("BLZ connect new cb no dev");
-		return -1;
-	}
 
 	const sd_bus_error* err = sd_bus_message_get_error(reply);
 	if (err != NULL) {
 		if (sd_bus_error_has_name(err, SD_BUS_ERROR_UNKNOWN_METHOD)) {
-			LOG_NOTI("BLZ connect new failed: Bluez < 5.49 (with -E"
-					 " flag) doesn't support ConnectDevice");
-			r = -2;
+			CLOG_NOTI(dev->ctx, "BLZ connect new failed: Bluez < 5.49 (with -E"
+					  " flag) doesn't support ConnectDevice");
+			connect_done(dev, -EOPNOTSUPP, false);
+			return 0;
+		}
+		r = -sd_bus_message_get_errno(reply);
+		CLOG_INF(dev->ctx, "BLZ connect new error: %s '%s' (%d)", err->name,
+				 err->message, r);
+		/* when addr type is unknown and connect failed, try the other type */
+		if (dev->atype == BLZ_ADDR_UNKNOWN && !dev->tried_other) {
+			dev->tried_other = true;
+			connect_new(dev, true);
 		} else {
-			r = -sd_bus_message_get_errno(reply);
-			LOG_INF("BLZ connect new error: %s '%s' (%d)", err->name,
-					err->message, r);
+			connect_done(dev, r, true);
 		}
-		goto exit;
+		return 0;
 	}
 
 	r = sd_bus_message_read_basic(reply, 'o', &opath);
 	if (r < 0) {
-		LOG_ERR("BLZ connect new invalid reply");
-		goto exit;
+		CLOG_ERR(dev->ctx, "BLZ connect new invalid reply");
+		connect_done(dev, r, true);
+		return 0;
 	}
 
 	if (strcmp(opath, dev->path) != 0) {
-		LOG_ERR("BLZ connect new device paths don't match (%s %s)", opath,
-				dev->path);
-		r = -1;
-		goto exit;
+		CLOG_ERR(dev->ctx, "BLZ connect new device paths don't match (%s %s)",
+				 opath, dev->path);
+		connect_done(dev, -EINVAL, true);
+		return 0;
 	}
 
-exit:
-	dev->connect_async_result = r;
-	dev->connect_async_done = true;
-	return r;
+	connect_wait_resolved(dev);
+	return 0;
 }
 
-static int blz_connect_new(blz_dev* dev, const char* macstr, bool addr_public)
+/** connect with the ConnectDevice API (Bluez 5.49) for devices which are
+ * not yet known in the DBus object hierarchy (not discovered) */
+static void connect_new(blz_dev* dev, bool addr_public)
 {
-	int r;
-	sd_bus_message* call = NULL;
-
-	LOG_INF("Connect new to %s (%s)", macstr,
-			addr_public ? "public" : "random");
+	char macstr[MAC_STR_LEN];
 
-	r = sd_bus_message_new_method_call(dev->ctx->bus, &call, "org.bluez",
-									   dev->ctx->path, "org.bluez.Adapter1",
-									   "ConnectDevice");
+	blz_mac_to_string(dev->mac, macstr);
+	CLOG_INF(dev->ctx, "Connect new to %s (%s)", macstr,
+			 addr_public ? "public" : "random");
 
+	/* AddressType must either be public or random for BLE, otherwise a
+	 * Bluetooth classic connection (BR/EDR) is attempted */
+	int r = connect_call(dev, dev->ctx->path, "org.bluez.Adapter1",
+						 "ConnectDevice", connect_new_cb,
+						 CONNECT_TIMEOUT * 1000000ULL, "a{sv}", 2, "Address",
+						 "s", macstr, "AddressType", "s",
+						 addr_public ? "public" : "random");
 	if (r < 0) {
-		LOG_ERR("BLZ connect new failed to create message");
-		goto exit;
+		connect_done(dev, r, false);
 	}
+}
 
-	/* open array */
-	r = sd_bus_message_open_container(call, 'a', "{sv}");
-	if (r < 0) {
-		LOG_ERR("BLZ connect new failed to create message");
-		goto exit;
-	}
+static int connect_resolved_cb(sd_bus_message* reply, void* userdata,
+							   sd_bus_error* error)
+{
+	blz_dev* dev = userdata;
+	int sr;
 
-	r = msg_append_property(call, "Address", 's', macstr);
+	const sd_bus_error* err = sd_bus_message_get_error(reply);
+	int r = err ? -sd_bus_message_get_errno(reply)
+				: sd_bus_message_read(reply, "v", "b", &sr);
 	if (r < 0) {
-		goto exit;
+		CLOG_ERR(dev->ctx, "BLZ failed to get ServicesResolved: %s",
+				 err ? err->message : strerror(-r));
+		connect_done(dev, r, true);
+		return 0;
 	}
 
-	/* AddressType must either be public or random for BLE, otherwise a
-	 * Bluetooth classic connection (BR/EDR) is attempted */
-	r = msg_append_property(call, "AddressType", 's',
-							addr_public ? "public" : "random");
-	if (r < 0) {
-		goto exit;
-	}
+	/* may already have been set by a signal */
+	dev->services_resolved |= sr;
+	connect_wait_resolved(dev);
+	return 0;
+}
 
-	/* close array */
-	r = sd_bus_message_close_container(call);
-	if (r < 0) {
-		LOG_ERR("BLZ connect new failed to create message");
-		goto exit;
-	}
+static int connect_state_cb(sd_bus_message* reply, void* userdata,
+							sd_bus_error* error)
+{
+	blz_dev* dev = userdata;
+	blz* ctx = dev->ctx;
+	int conn;
+	int r;
 
-	dev->connect_async_done = false;
+	const sd_bus_error* err = sd_bus_message_get_error(reply);
+	if (err != NULL) {
+		if (sd_bus_error_has_name(err, SD_BUS_ERROR_UNKNOWN_OBJECT)) {
+			/* device is unknown, use ConnectDevice API */
+			connect_new(dev, dev->atype == BLZ_ADDR_PUBLIC);
+		} else {
+			CLOG_ERR(ctx, "BLZ failed to get connected: %s", err->message);
+			connect_done(dev, -sd_bus_message_get_errno(reply), false);
+		}
+		return 0;
+	}
 
-	/* call ConnectDevice, it is only supported from Bluez 5.49 on.
-	 * call it async because it can take longer than the normal sd_bus
-	 * timeout and we want to wait until it is finished or failed */
-	r = sd_bus_call_async(dev->ctx->bus, NULL, call, connect_new_cb, dev,
-						  CONNECT_TIMEOUT * 1000000);
+	r = sd_bus_message_read(reply, "v", "b", &conn);
 	if (r < 0) {
-		LOG_ERR("BLZ connect new failed: %d", r);
-		goto exit;
+		CLOG_ERR(ctx, "BLZ failed to get connected: %s", strerror(-r));
+		connect_done(dev, r, false);
+		return 0;
 	}
 
-	/* wait for callback */
-	r = blz_loop_timeout(dev->ctx, &dev->connect_async_done,
-						 CONNECT_TIMEOUT * 1000);
-	if (r < 0) {
-		LOG_ERR("BLZ connect new timeout");
+	if (conn) {
+		CLOG_NOTI(ctx, "Device %s already was connected", dev->path);
+		r = connect_call(dev, dev->path, "org.freedesktop.DBus.Properties",
+						 "Get", connect_resolved_cb, 0, "ss",
+						 "org.bluez.Device1", "ServicesResolved");
 	} else {
-		r = dev->connect_async_result;
+		/* call it async because it can take longer than the normal sd_bus
+		 * timeout */
+		r = connect_call(dev, dev->path, "org.bluez.Device1", "Connect",
+						 connect_reply_cb, CONNECT_TIMEOUT * 1000000ULL, NULL);
+	}
+	if (r < 0) {
+		connect_done(dev, r, false);
 	}
+	return 0;
+}
 
-exit:
-	sd_bus_message_unref(call);
-	return r;
+/** fail connects which waited too long for ServicesResolved, returns usec
+ * until the next deadline */
+static uint64_t connect_check_timeouts(blz* ctx)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t now = now_usec();
+	blz_dev* dev = ctx->connecting;
+
+	while (dev != NULL) {
+		/* the callback may start new connects, they are added in front */
+		blz_dev* n = dev->connect_next;
+		if (dev->wait_resolved && dev->deadline <= now) {
+			CLOG_ERR(ctx, "BLZ timeout waiting for ServicesResolved");
+			connect_done(dev, -ETIMEDOUT, true);
+		} else if (dev->wait_resolved) {
+			next = MIN(next, dev->deadline - now);
+		}
+		dev = n;
+	}
+	return next;
 }
 
-blz_dev* blz_connect(blz* ctx, const char* macstr, enum blz_addr_type atype)
+bool blz_connect_async(blz* ctx, const char* macstr, enum blz_addr_type atype,
+					   blz_connect_cb_t cb, void* user)
 {
 	int r;
-	uint8_t mac[6];
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	int conn_status = -2; // invalid
-	bool need_disconnect = false;
 
-	struct blz_dev* dev = calloc(1, sizeof(struct blz_dev));
+	if (cb == NULL && !events_enabled(ctx)) {
+		CLOG_ERR(ctx, "BLZ connect no callback");
+		return false;
+	}
+
+	struct blz_dev* dev = mem_alloc(ctx, BLZ_MEM_DEVICES,
+									sizeof(struct blz_dev));
 	if (dev == NULL) {
-		LOG_ERR("blz_dev: alloc failed");
-		return NULL;
+		CLOG_ERR(ctx, "blz_dev: alloc failed");
+		return false;
 	}
 
 	dev->ctx = ctx;
-	dev->connected = false;
-	dev->services_resolved = false;
+	dev->atype = atype;
+	dev->connect_cb = cb;
+	dev->connect_user = user;
 
 	/* create device path based on MAC address */
-	blz_string_to_mac(macstr, mac);
+	if (!blz_string_to_mac(macstr, dev->mac)) {
+		CLOG_ERR(ctx, "BLZ connect invalid MAC address '%s'", macstr);
+		dev_free(dev);
+		return false;
+	}
+	dev->health = health_get(ctx, dev->mac, true);
 	r = snprintf(dev->path, DBUS_PATH_MAX_LEN,
-				 "%s/dev_%02X_%02X_%02X_%02X_%02X_%02X", ctx->path, mac[5],
-				 mac[4], mac[3], mac[2], mac[1], mac[0]);
+				 "%s/dev_%02X_%02X_%02X_%02X_%02X_%02X", ctx->path,
+				 MAC_PARR(dev->mac));
 
 	if (r < 0 || r >= DBUS_PATH_MAX_LEN) {
-		LOG_ERR("BLZ connect failed to construct device path");
-		free(dev);
-		return NULL;
+		CLOG_ERR(ctx, "BLZ connect failed to construct device path");
+		dev_free(dev);
+		return false;
+	}
+
+	/* connect signal for device properties changed */
+	r = sd_bus_match_signal(ctx->bus, &dev->connect_slot, bluez_sender(ctx),
+							dev->path, "org.freedesktop.DBus.Properties",
+							"PropertiesChanged", blz_connect_cb, dev);
+
+	if (r < 0) {
+		CLOG_ERR(ctx, "BLZ Failed to add connect signal");
+		dev_free(dev);
+		return false;
 	}
 
 	/* check if it already is connected. this also serves as a mean to check
 	 * wether the object path is known in DBus */
-	r = sd_bus_get_property_trivial(dev->ctx->bus, "org.bluez", dev->path,
-									"org.bluez.Device1", "Connected", &error,
-									'b', &conn_status);
-
+	r = connect_call(dev, dev->path, "org.freedesktop.DBus.Properties", "Get",
+					 connect_state_cb, 0, "ss", "org.bluez.Device1",
+					 "Connected");
 	if (r < 0) {
-		if (sd_bus_error_has_name(&error, SD_BUS_ERROR_UNKNOWN_OBJECT)) {
-			/* device is unknown, mark for ConnectDevice API below */
-			conn_status = -1;
-		} else {
-			LOG_ERR("BLZ failed to get connected: %s", error.message);
-			goto exit;
-		}
+		dev_free(dev);
+		return false;
 	}
 
-	if (conn_status == 1) {
-		LOG_NOTI("Device %s already was connected", macstr);
-		/* get ServicesResolved status */
-		int sr;
-		r = sd_bus_get_property_trivial(dev->ctx->bus, "org.bluez", dev->path,
-										"org.bluez.Device1", "ServicesResolved",
-										&error, 'b', &sr);
-		if (r < 0) {
-			LOG_ERR("BLZ failed to get ServicesResolved: %s", error.message);
-			need_disconnect = true;
-			goto exit;
-		}
-		dev->services_resolved = sr;
-	} else if (conn_status != 0 && conn_status != -1) {
-		/* invalid status */
+	dev->connect_next = ctx->connecting;
+	ctx->connecting = dev;
+	return true;
+}
+
+struct connect_wait {
+	bool done;
+	blz_dev* dev;
+};
+
+static void connect_wait_cb(blz_dev* dev, int err, void* user)
+{
+	struct connect_wait* w = user;
+	w->dev = dev;
+	w->done = true;
+}
+
+blz_dev* blz_connect(blz* ctx, const char* macstr, enum blz_addr_type atype)
+{
+	struct connect_wait w = {0};
+
+	if (!blz_connect_async(ctx, macstr, atype, connect_wait_cb, &w)) {
+		return NULL;
+	}
+
+	/* every step has a timeout, either of its call or the deadline checked
+	 * in blz_loop() */
+	while (!w.done) {
+		blz_loop(ctx, UINT64_MAX);
+	}
+	return w.dev;
+}
+
+void blz_set_disconnect_handler(blz_dev* dev, blz_disconn_handler_t cb,
+								void* disconn_user)
+{
+	dev->disconnect_cb = cb;
+	dev->disconn_user = disconn_user;
+}
+
+static bool find_serv_by_uuid(blz_serv* srv)
+{
+	sd_bus_message* reply = NULL;
+	int r;
+
+	r = get_managed_objects(srv->ctx, &reply);
+	if (r < 0) {
 		goto exit;
 	}
 
-	/* connect signal for device properties changed */
-	r = sd_bus_match_signal(ctx->bus, &dev->connect_slot, "org.bluez",
-							dev->path, "org.freedesktop.DBus.Properties",
-							"PropertiesChanged", blz_connect_cb, dev);
+	r = msg_parse_objects(srv->ctx, reply, srv->dev->path, MSG_SERV_FIND, srv);
+	/* error logging done in function */
+
+exit:
+	sd_bus_message_unref(reply);
+	return r == RETURN_FOUND;
+}
+
+blz_serv* blz_get_serv_from_uuid(blz_dev* dev, const char* uuid)
+{
+	/* alloc serv structure for use later */
+	struct blz_serv* srv = mem_alloc(dev->ctx, BLZ_MEM_DEVICES,
+									 sizeof(struct blz_serv));
+	if (srv == NULL) {
+		CLOG_ERR(dev->ctx, "blz_srv: alloc failed");
+		return NULL;
+	}
+
+	srv->ctx = dev->ctx;
+	srv->dev = dev;
+	srv->uuid = uuid_intern(dev->ctx, uuid);
+
+	/* this will try to find the uuid in char, fill required info */
+	bool b = srv->uuid != NULL && find_serv_by_uuid(srv);
+	if (!b) {
+		CLOG_ERR(dev->ctx, "Couldn't find service with UUID %s", uuid);
+		mem_free(dev->ctx, BLZ_MEM_DEVICES, srv, sizeof(struct blz_serv));
+		return NULL;
+	}
+
+	srv->next = dev->ctx->servs;
+	dev->ctx->servs = srv;
+	// CLOG_INF(dev->ctx, "Found service with UUID %s", uuid);
+	return srv;
+}
+
+char** blz_list_service_uuids(blz_dev* dev)
+{
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	char** uuids = NULL;
+
+	int r = sd_bus_get_property_strv(dev->ctx->bus, "org.bluez", dev->path,
+									 "org.bluez.Device1", "UUIDs", &error,
+									 &uuids);
 
 	if (r < 0) {
-		LOG_ERR("BLZ Failed to add connect signal");
+		CLOG_ERR(dev->ctx, "couldnt get services: %s", error.message);
+	} else {
+		/* replace with interned strings */
+		uuid_strv_free(dev->ctx, dev->service_uuids);
+		dev->service_uuids = uuid_intern_strv(dev->ctx, uuids);
+	}
+
+	sd_bus_error_free(&error);
+	return dev->service_uuids;
+}
+
+static bool find_char_by_uuid(blz_char* ch)
+{
+	sd_bus_message* reply = NULL;
+	int r;
+
+	r = get_managed_objects(ch->ctx, &reply);
+	if (r < 0) {
 		goto exit;
 	}
 
-	/* if the device is already known in the DBus object hierarchy, connect
-	 * by the normal Connect API, if not try using the new (Bluez 5.49)
-	 * ConnectDevice API for unknown (not yet discovered) devices */
-	if (conn_status == 0) {
-		r = blz_connect_known(dev, macstr);
-	} else if (conn_status == -1) {
-		r = blz_connect_new(dev, macstr,
-							atype == BLZ_ADDR_PUBLIC ? true : false);
-		/* when addr type is unknown and connect failed, try the other type */
-		if (r < 0 && atype == BLZ_ADDR_UNKNOWN) {
-			r = blz_connect_new(dev, macstr,
-								atype == BLZ_ADDR_PUBLIC ? false : true);
-		}
+	r = msg_parse_objects(ch->ctx, reply, ch->dev->path, MSG_CHAR_FIND, ch);
+	/* error logging done in function */
+
+exit:
+	sd_bus_message_unref(reply);
+	return r == RETURN_FOUND;
+}
+
+char** blz_list_char_uuids(blz_serv* srv)
+{
+	sd_bus_message* reply = NULL;
+	int r;
+
+	r = get_managed_objects(srv->ctx, &reply);
+	if (r < 0) {
+		goto exit;
 	}
 
-	/* connect calls may have failed with timeout, in this situation bluez
-	 * is still trying to open the connection. Calling Disconnect cancels
-	 * the connection attempt */
+	/* first count how many characteristics there are and alloc space */
+	int cnt = 0;
+	r = msg_parse_objects(srv->ctx, reply, srv->path, MSG_CHAR_COUNT, &cnt);
 	if (r < 0) {
-		need_disconnect = true;
 		goto exit;
 	}
 
-	/* wait until ServicesResolved property changed to true for this device.
-	 * we usually receive connected = true before that, but at that time we
-	 * are not ready yet to look up service and characteristic UUIDs */
-	r = blz_loop_timeout(ctx, &dev->services_resolved,
-						 SERV_RESOLV_TIMEOUT * 1000);
+	/* alloc space for them, UUIDs are interned so only the list is freed */
+	mem_free(srv->ctx, BLZ_MEM_DEVICES, srv->char_uuids,
+			 (srv->chars_cnt + 1) * sizeof(char*));
+	srv->chars_idx = 0;
+	srv->chars_cnt = cnt;
+	srv->char_uuids = mem_alloc(srv->ctx, BLZ_MEM_DEVICES,
+								(cnt + 1) * sizeof(char*));
+	if (srv->char_uuids == NULL) {
+		CLOG_ERR(srv->ctx, "BLZ alloc of chars failed");
+		r = -ENOMEM;
+		goto exit;
+	}
+
+	/* now parse all characteristics data */
+	sd_bus_message_rewind(reply, true);
+	r = msg_parse_objects(srv->ctx, reply, srv->path, MSG_CHARS_ALL, srv);
+	/* error logging done in function */
+
+exit:
+	sd_bus_message_unref(reply);
 	if (r < 0) {
-		LOG_ERR("BLZ timeout waiting for ServicesResolved");
-		need_disconnect = true;
+		return NULL;
+	}
+	return srv->char_uuids;
+}
+
+bool blz_dev_enumerate(blz_dev* dev, blz_gatt_handler_t cb, void* user)
+{
+	struct gatt_enum ge = {.cb = cb, .user = user};
+	sd_bus_message* reply = NULL;
+	int r;
+
+	r = get_managed_objects(dev->ctx, &reply);
+	if (r >= 0) {
+		r = msg_parse_objects(dev->ctx, reply, dev->path, MSG_GATT_ALL, &ge);
+		/* error logging done in function */
+	}
+
+	sd_bus_message_unref(reply);
+	return r >= 0;
+}
+
+static int dev_objects_cb(sd_bus_message* reply, void* userdata,
+						  sd_bus_error* error)
+{
+	blz_dev* dev = userdata;
+	objects_cb_t cb = dev->objects_cb;
+	int r = 0;
+
+	const sd_bus_error* err = sd_bus_message_get_error(reply);
+	if (err != NULL) {
+		r = -sd_bus_message_get_errno(reply);
+		CLOG_ERR(dev->ctx, "Failed to get managed objects: %s", err->message);
+		reply = NULL;
 	} else {
-		dev->connected = true;
+		obj_cache_store(dev->ctx, reply);
 	}
 
-exit:
-	sd_bus_error_free(&error);
+	/* the callback may free dev */
+	dev->objects_slot = sd_bus_slot_unref(dev->objects_slot);
+	dev->objects_cb = NULL;
+	cb(dev, MIN(r, 0), reply, dev->objects_user);
+	return 0;
+}
+
+bool dev_objects_async(blz_dev* dev, objects_cb_t cb, void* user)
+{
+	blz* ctx = dev->ctx;
+
+	if (dev->objects_cb != NULL) {
+		CLOG_ERR(ctx, "BLZ object lookup already in progress");
+		return false;
+	}
+
+	if (ctx->obj_cache != NULL) {
+		sd_bus_message* reply = sd_bus_message_ref(ctx->obj_cache);
+		int r = sd_bus_message_rewind(reply, true);
+		cb(dev, MIN(r, 0), r >= 0 ? reply : NULL, user);
+		sd_bus_message_unref(reply);
+		return true;
+	}
+
+	int r = sd_bus_call_method_async(ctx->bus, &dev->objects_slot, "org.bluez",
+									 "/", "org.freedesktop.DBus.ObjectManager",
+									 "GetManagedObjects", dev_objects_cb, dev,
+									 "");
 	if (r < 0) {
-		if (need_disconnect) {
-			blz_disconnect(dev); // frees
-		} else {
-			free(dev);
-		}
+		CLOG_ERR(ctx, "Failed to get managed objects: %s", strerror(-r));
+		return false;
+	}
+
+	dev->objects_cb = cb;
+	dev->objects_user = user;
+	return true;
+}
+
+blz_char* blz_get_char_from_uuid(blz_serv* srv, const char* uuid)
+{
+	if (srv->dev == NULL) {
+		CLOG_ERR(srv->ctx, "BLZ device of service is disconnected");
+		return NULL;
+	}
+
+	/* alloc char structure for use later */
+	struct blz_char* ch = mem_alloc(srv->ctx, BLZ_MEM_DEVICES,
+									sizeof(struct blz_char));
+	if (ch == NULL) {
+		CLOG_ERR(srv->ctx, "blz_char: alloc failed");
 		return NULL;
 	}
-	return dev;
+
+	ch->ctx = srv->dev->ctx;
+	ch->dev = srv->dev;
+	ch->uuid = uuid_intern(ch->ctx, uuid);
+
+	/* this will try to find the uuid in char, fill required info */
+	bool b = ch->uuid != NULL && find_char_by_uuid(ch);
+	if (!b) {
+		CLOG_ERR(srv->ctx, "Couldn't find characteristic with UUID %s", uuid);
+		mem_free(srv->ctx, BLZ_MEM_DEVICES, ch, sizeof(struct blz_char));
+		return NULL;
+	}
+
+	ch->next = ch->ctx->chars;
+	ch->ctx->chars = ch;
+	CLOG_INF(srv->ctx, "Found characteristic with UUID %s", uuid);
+	return ch;
 }
 
-void blz_set_disconnect_handler(blz_dev* dev, blz_disconn_handler_t cb,
-								void* disconn_user)
+/** WriteValue message with the "type" option if type is not NULL
+ * ("request" or "command"), without it BlueZ decides by the characteristic
+ * flags */
+static int char_write_msg(blz_char* ch, const uint8_t* data, size_t len,
+						  const char* type, sd_bus_message** call)
 {
-	dev->disconnect_cb = cb;
-	dev->disconn_user = disconn_user;
+	int r = sd_bus_message_new_method_call(
+		ch->ctx->bus, call, "org.bluez", ch->path,
+		"org.bluez.GattCharacteristic1", "WriteValue");
+
+	if (r >= 0) {
+		r = sd_bus_message_append_array(*call, 'y', data, len);
+	}
+
+	if (r >= 0 && type != NULL) {
+		r = sd_bus_message_append(*call, "a{sv}", 1, "type", "s", type);
+	} else if (r >= 0) {
+		r = sd_bus_message_append(*call, "a{sv}", 0);
+	}
+
+	if (r < 0) {
+		CLOG_ERR(ch->ctx, "BLZ write failed to create message");
+	}
+	return r;
 }
 
-static bool find_serv_by_uuid(blz_serv* srv)
+static bool char_write_value(blz_char* ch, const uint8_t* data, size_t len,
+							 const char* type)
 {
 	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message* call = NULL;
 	sd_bus_message* reply = NULL;
+
+	int r = char_write_msg(ch, data, len, type, &call);
+	if (r < 0) {
+		goto exit;
+	}
+
+	r = sd_bus_call(ch->ctx->bus, call, 0, &error, &reply);
+	if (r < 0) {
+		CLOG_ERR(ch->ctx, "BLZ failed to write: %s", error.message);
+		goto exit;
+	}
+
+exit:
+	sd_bus_error_free(&error);
+	sd_bus_message_unref(call);
+	sd_bus_message_unref(reply);
+	return r >= 0;
+}
+
+bool blz_char_write(blz_char* ch, const uint8_t* data, size_t len)
+{
+	if (!(ch->flags & (BLZ_CHAR_WRITE | BLZ_CHAR_WRITE_WITHOUT_RESPONSE))) {
+		CLOG_ERR(ch->ctx, "BLZ characteristic does not support write");
+		return false;
+	}
+
+	return char_write_value(ch, data, len, NULL);
+}
+
+bool blz_char_write_cmd(blz_char* ch, const uint8_t* data, size_t len)
+{
+	if (!(ch->flags & BLZ_CHAR_WRITE_WITHOUT_RESPONSE)) {
+		CLOG_ERR(ch->ctx,
+				 "BLZ characteristic does not support write-without-response");
+		return false;
+	}
+
+	/* BlueZ replies as soon as the command is queued, versions without the
+	 * "type" option ignore it */
+	return char_write_value(ch, data, len, "command");
+}
+
+/** ReadValue of a characteristic or descriptor */
+static int read_value(blz* ctx, const char* path, const char* intf,
+					  uint8_t* data, size_t len)
+{
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message* reply = NULL;
+	const void* ptr;
+	size_t rlen = -1;
 	int r;
 
-	r = sd_bus_call_method(srv->ctx->bus, "org.bluez", "/",
-						   "org.freedesktop.DBus.ObjectManager",
-						   "GetManagedObjects", &error, &reply, "");
+	r = sd_bus_call_method(ctx->bus, "org.bluez", path, intf, "ReadValue",
+						   &error, &reply, "a{sv}", 0);
 
 	if (r < 0) {
-		LOG_ERR("Failed to get managed objects: %s", error.message);
+		CLOG_ERR(ctx, "BLZ failed to read: %s", error.message);
 		goto exit;
 	}
 
-	r = msg_parse_objects(reply, srv->dev->path, MSG_SERV_FIND, srv);
-	/* error logging done in function */
+	r = sd_bus_message_read_array(reply, 'y', &ptr, &rlen);
+	if (r < 0) {
+		CLOG_ERR(ctx, "BLZ failed to read result: %s", error.message);
+		goto exit;
+	}
+
+	if (rlen > 0) {
+		memcpy(data, ptr, rlen < len ? rlen : len);
+	}
 
 exit:
 	sd_bus_error_free(&error);
 	sd_bus_message_unref(reply);
-	return r == RETURN_FOUND;
+	return rlen;
 }
 
-blz_serv* blz_get_serv_from_uuid(blz_dev* dev, const char* uuid)
+int blz_char_read(blz_char* ch, uint8_t* data, size_t len)
 {
-	/* alloc serv structure for use later */
-	struct blz_serv* srv = calloc(1, sizeof(struct blz_serv));
+	if (!(ch->flags & BLZ_CHAR_READ)) {
+		CLOG_ERR(ch->ctx, "BLZ characteristic does not support read");
+		return false;
+	}
+
+	return read_value(ch->ctx, ch->path, "org.bluez.GattCharacteristic1", data,
+					  len);
+}
+
+uint32_t blz_char_get_flags(blz_char* ch)
+{
+	return ch->flags;
+}
+
+blz_serv* blz_serv_from_attr(blz_dev* dev, const struct blz_gatt_attr* attr)
+{
+	if (attr->type != BLZ_GATT_SERVICE
+		|| strlen(attr->path) >= DBUS_PATH_MAX_LEN) {
+		CLOG_ERR(dev->ctx, "BLZ attribute is no service");
+		return NULL;
+	}
+
+	struct blz_serv* srv = mem_alloc(dev->ctx, BLZ_MEM_DEVICES,
+									 sizeof(struct blz_serv));
 	if (srv == NULL) {
-		LOG_ERR("blz_srv: alloc failed");
+		CLOG_ERR(dev->ctx, "blz_srv: alloc failed");
 		return NULL;
 	}
 
 	srv->ctx = dev->ctx;
 	srv->dev = dev;
-	strncpy(srv->uuid, uuid, UUID_STR_LEN);
+	/* already interned */
+	srv->uuid = attr->uuid;
+	strcpy(srv->path, attr->path);
+	srv->next = dev->ctx->servs;
+	dev->ctx->servs = srv;
+	return srv;
+}
 
-	/* this will try to find the uuid in char, fill required info */
-	bool b = find_serv_by_uuid(srv);
-	if (!b) {
-		LOG_ERR("Couldn't find service with UUID %s", uuid);
-		free(srv);
+blz_char* blz_char_from_attr(blz_dev* dev, const struct blz_gatt_attr* attr)
+{
+	if (attr->type != BLZ_GATT_CHAR
+		|| strlen(attr->path) >= DBUS_PATH_MAX_LEN) {
+		CLOG_ERR(dev->ctx, "BLZ attribute is no characteristic");
 		return NULL;
 	}
 
-	// LOG_INF("Found service with UUID %s", uuid);
-	return srv;
+	struct blz_char* ch = mem_alloc(dev->ctx, BLZ_MEM_DEVICES,
+									sizeof(struct blz_char));
+	if (ch == NULL) {
+		CLOG_ERR(dev->ctx, "blz_char: alloc failed");
+		return NULL;
+	}
+
+	ch->ctx = dev->ctx;
+	ch->dev = dev;
+	ch->uuid = attr->uuid;
+	ch->flags = attr->flags;
+	strcpy(ch->path, attr->path);
+	ch->next = dev->ctx->chars;
+	dev->ctx->chars = ch;
+	return ch;
 }
 
-char** blz_list_service_uuids(blz_dev* dev)
+/*
+ * Asynchronous operations are queued per device in submission order. BlueZ
+ * rejects a second operation on a characteristic while one is pending with
+ * org.bluez.Error.InProgress, so an operation is only sent when no other one
+ * of its characteristic is in flight, and when the device is below its limit
+ * (blz_set_max_inflight()). The next ones are sent when a reply arrives.
+ *
+ * An operation which got InProgress anyway (e.g. because of a blocking call
+ * of the same characteristic) is sent again after a backoff, it keeps its
+ * place in flight meanwhile so that the order stays the same. Operations
+ * which could not be sent complete with the error from the next loop
+ * iteration, callbacks are never called from within blz_*_async().
+ *
+ * Operations which are dropped because their characteristic is freed or
+ * their device disconnected are canceled: they are taken out of the queues
+ * right away and complete with -ECANCELED from the loop, like the ones
+ * which could not be sent, so that everybody waiting for them gets a
+ * callback. If the characteristic is gone by then, the callback gets NULL.
+ */
+
+static void op_retry_unlink(struct blz_op* op)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
+	for (struct blz_op** p = &op->ctx->retrying; *p != NULL;
+		 p = &(*p)->retry_next) {
+		if (*p == op) {
+			*p = op->retry_next;
+			break;
+		}
+	}
+	op->retry_at = 0;
+}
 
-	int r = sd_bus_get_property_strv(dev->ctx->bus, "org.bluez", dev->path,
-									 "org.bluez.Device1", "UUIDs", &error,
-									 &dev->service_uuids);
+static void op_queue_unlink(struct blz_op* op)
+{
+	blz_dev* dev = op->ch->dev;
+	struct blz_op* prev = NULL;
+
+	for (struct blz_op** p = &dev->queue; *p != NULL; p = &(*p)->dev_next) {
+		if (*p == op) {
+			*p = op->dev_next;
+			if (dev->queue_last == op) {
+				dev->queue_last = prev;
+			}
+			break;
+		}
+		prev = *p;
+	}
+}
+
+/** takes the op out of the lists of its characteristic and device */
+static void op_detach(struct blz_op* op)
+{
+	blz_char* ch = op->ch;
+
+	for (struct blz_op** p = &ch->ops; *p != NULL; p = &(*p)->next) {
+		if (*p == op) {
+			*p = op->next;
+			break;
+		}
+	}
+
+	if (ch->busy == op) {
+		/* in flight or waiting for a retry */
+		ch->busy = NULL;
+		ch->dev->inflight--;
+		op_retry_unlink(op);
+	} else {
+		op_queue_unlink(op);
+	}
+}
+
+static void op_free(struct blz_op* op)
+{
+	if (op->canceled) {
+		op_retry_unlink(op);
+	} else {
+		op_detach(op);
+	}
+	sd_bus_slot_unref(op->slot);
+	mem_free(op->ctx, BLZ_MEM_QUEUES, op, sizeof(struct blz_op) + op->len);
+}
+
+static const char* op_name(struct blz_op* op)
+{
+	switch (op->kind) {
+	case OP_READ: return "read";
+	case OP_WRITE: return "write";
+	case OP_NOTIFY: return "start notify";
+	}
+	return "";
+}
+
+static void op_retry_at(struct blz_op* op, uint64_t at)
+{
+	blz* ctx = op->ctx;
+
+	op->retry_at = at;
+	op->retry_next = ctx->retrying;
+	ctx->retrying = op;
+}
+
+static void dev_pump(blz_dev* dev);
 
-	if (r < 0) {
-		LOG_ERR("couldnt get services: %s", error.message);
-	}
+/** drops the op from the queues, it completes with -ECANCELED from the
+ * loop. Its place in flight is free right away, the caller pumps */
+static void op_cancel(struct blz_op* op)
+{
+	op_detach(op);
+	op->slot = sd_bus_slot_unref(op->slot);
+	op->canceled = true;
+	op->err = -ECANCELED;
+	op_retry_at(op, 0);
+}
 
-	sd_bus_error_free(&error);
-	return dev->service_uuids;
+/** frees the op, sends what may go next and calls back */
+static void op_complete(struct blz_op* op, int r, const void* ptr, size_t len)
+{
+	blz_char* ch = op->ch;
+	bool canceled = op->canceled;
+	enum op_kind kind = op->kind;
+	blz_read_cb_t read_cb = op->read_cb;
+	blz_write_cb_t write_cb = op->write_cb;
+	void* user = op->user;
+	blz* ctx = op->ctx;
+	struct blz_event* ev;
+
+	/* before the callback, which may free the characteristic or device */
+	op_free(op);
+	if (!canceled) {
+		dev_pump(ch->dev);
+	}
+
+	/* notifications which could not be enabled don't arrive */
+	if (kind == OP_NOTIFY && r < 0 && ch != NULL) {
+		ch->notify_slot = sd_bus_slot_unref(ch->notify_slot);
+		ch->notify_cb = NULL;
+		ch->notify_user = NULL;
+	}
+
+	if (kind == OP_READ && read_cb != NULL) {
+		read_cb(ch, r, ptr, len, user);
+	} else if (kind != OP_READ && write_cb != NULL) {
+		write_cb(ch, r, user);
+	} else if ((ev = event_push(ctx,
+								kind == OP_READ	   ? BLZ_EVENT_READ
+								: kind == OP_WRITE ? BLZ_EVENT_WRITE
+												   : BLZ_EVENT_NOTIFY_STARTED,
+								r, user))
+			   != NULL) {
+		ev->ch = ch;
+		event_set_data(ev, ptr, len);
+	}
 }
 
-static bool find_char_by_uuid(blz_char* ch)
+static int op_reply_cb(sd_bus_message* reply, void* userdata,
+					   sd_bus_error* error)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	sd_bus_message* reply = NULL;
-	int r;
+	struct blz_op* op = userdata;
+	blz_char* ch = op->ch;
+	const void* ptr = NULL;
+	size_t len = 0;
+	int r = 0;
 
-	r = sd_bus_call_method(ch->ctx->bus, "org.bluez", "/",
-						   "org.freedesktop.DBus.ObjectManager",
-						   "GetManagedObjects", &error, &reply, "");
+	op->slot = sd_bus_slot_unref(op->slot);
 
-	if (r < 0) {
-		LOG_ERR("Failed to get managed objects: %s", error.message);
-		goto exit;
+	const sd_bus_error* err = sd_bus_message_get_error(reply);
+	if (sd_bus_error_has_name(err, "org.bluez.Error.InProgress")
+		&& op->retries < OP_RETRY_MAX) {
+		uint64_t backoff = (OP_RETRY_START * 1000ULL) << op->retries++;
+		CLOG_DBG(ch->ctx, "BLZ %s in progress, retry in %u ms", op_name(op),
+				 (unsigned)(backoff / 1000));
+		op_retry_at(op, now_usec() + backoff);
+		return 0;
+	}
+
+	if (sd_bus_error_has_name(err, "org.bluez.Error.InProgress")) {
+		CLOG_ERR(ch->ctx, "BLZ failed to %s: still in progress", op_name(op));
+		r = -EBUSY;
+	} else if (err != NULL) {
+		r = -sd_bus_message_get_errno(reply);
+		CLOG_ERR(ch->ctx, "BLZ failed to %s: %s", op_name(op), err->message);
+	} else if (op->kind == OP_READ) {
+		r = sd_bus_message_read_array(reply, 'y', &ptr, &len);
+		if (r < 0) {
+			CLOG_ERR(ch->ctx, "BLZ failed to read result");
+		}
 	}
 
-	r = msg_parse_objects(reply, ch->dev->path, MSG_CHAR_FIND, ch);
-	/* error logging done in function */
+	if (ch->dev != NULL) {
+		health_op(ch->dev->health, ch->dev, MIN(r, 0),
+				  now_usec() - op->sent_at);
+	}
 
-exit:
-	sd_bus_error_free(&error);
-	sd_bus_message_unref(reply);
-	return r == RETURN_FOUND;
+	/* the reply and the data it points to stay valid until we return */
+	op_complete(op, MIN(r, 0), ptr, len);
+	return 0;
 }
 
-char** blz_list_char_uuids(blz_serv* srv)
+static int op_send(struct blz_op* op)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	sd_bus_message* reply = NULL;
+	blz_char* ch = op->ch;
+	sd_bus_message* call = NULL;
 	int r;
 
-	r = sd_bus_call_method(srv->ctx->bus, "org.bluez", "/",
-						   "org.freedesktop.DBus.ObjectManager",
-						   "GetManagedObjects", &error, &reply, "");
-
-	if (r < 0) {
-		LOG_ERR("Failed to get managed objects: %s", error.message);
-		goto exit;
+	if (op->kind == OP_WRITE) {
+		r = char_write_msg(ch, op->data, op->len, op->type, &call);
+	} else {
+		r = sd_bus_message_new_method_call(
+			ch->ctx->bus, &call, "org.bluez", ch->path,
+			"org.bluez.GattCharacteristic1",
+			op->kind == OP_READ ? "ReadValue" : "StartNotify");
+		if (r >= 0 && op->kind == OP_READ) {
+			r = sd_bus_message_append(call, "a{sv}", 0);
+		}
 	}
 
-	/* first count how many characteristics there are and alloc space */
-	int cnt = 0;
-	r = msg_parse_objects(reply, srv->path, MSG_CHAR_COUNT, &cnt);
+	if (r >= 0) {
+		op->sent_at = now_usec();
+		r = sd_bus_call_async(ch->ctx->bus, &op->slot, call, op_reply_cb, op,
+							  0);
+	}
 	if (r < 0) {
-		goto exit;
+		CLOG_ERR(ch->ctx, "BLZ failed to start %s: %s", op_name(op),
+				 strerror(-r));
 	}
+	sd_bus_message_unref(call);
+	return r;
+}
 
-	/* alloc space for them */
-	srv->char_uuids = calloc(cnt + 1, sizeof(char*));
-	srv->char_uuids[cnt] = NULL;
-	if (srv->char_uuids == NULL) {
-		LOG_ERR("BLZ alloc of chars failed");
-		goto exit;
+/** sends queued operations in order, as far as the limits allow */
+static void dev_pump(blz_dev* dev)
+{
+	struct blz_op* op = dev->queue;
+	unsigned max = dev->max_inflight;
+
+	/* a bad link would only pile up operations which time out */
+	if (dev->health != NULL && health_score(dev->health) < HEALTH_POOR) {
+		max = 1;
+	}
+
+	while (op != NULL && (max == 0 || dev->inflight < max)) {
+		struct blz_op* next = op->dev_next;
+
+		if (op->ch->busy == NULL) {
+			op_queue_unlink(op);
+			op->ch->busy = op;
+			dev->inflight++;
+			op->err = MIN(op_send(op), 0);
+			if (op->err < 0) {
+				/* fails from the loop, not the caller's stack */
+				op_retry_at(op, 0);
+			}
+		}
+		op = next;
 	}
+}
 
-	/* now parse all characteristics data */
-	sd_bus_message_rewind(reply, true);
-	r = msg_parse_objects(reply, srv->path, MSG_CHARS_ALL, srv);
-	/* error logging done in function */
+/** completes operations which are due after a backoff, returns usec until
+ * the next one */
+static uint64_t op_check_retries(blz* ctx)
+{
+	uint64_t now = now_usec();
+	uint64_t next;
+
+restart:
+	next = UINT64_MAX;
+	for (struct blz_op* op = ctx->retrying; op != NULL; op = op->retry_next) {
+		if (op->retry_at > now) {
+			next = MIN(next, op->retry_at - now);
+			continue;
+		}
 
-exit:
-	sd_bus_error_free(&error);
-	sd_bus_message_unref(reply);
-	if (r < 0) {
-		return NULL;
+		/* callbacks may change the list */
+		op_retry_unlink(op);
+		if (op->err == 0) {
+			op->err = MIN(op_send(op), 0);
+		}
+		if (op->err < 0) {
+			op_complete(op, op->err, NULL, 0);
+		}
+		goto restart;
 	}
-	return srv->char_uuids;
+	return next;
 }
 
-blz_char* blz_get_char_from_uuid(blz_serv* srv, const char* uuid)
+/** completes all operations and object lookups with -ECANCELED */
+static void fini_cancel(blz* ctx)
 {
-	/* alloc char structure for use later */
-	struct blz_char* ch = calloc(1, sizeof(struct blz_char));
-	if (ch == NULL) {
-		LOG_ERR("blz_char: alloc failed");
-		return NULL;
+	for (blz_char* ch = ctx->chars; ch != NULL; ch = ch->next) {
+		while (ch->ops != NULL) {
+			op_cancel(ch->ops);
+		}
 	}
+	op_check_retries(ctx);
 
-	ch->ctx = srv->dev->ctx;
-	ch->dev = srv->dev;
-	strncpy(ch->uuid, uuid, UUID_STR_LEN);
-
-	/* this will try to find the uuid in char, fill required info */
-	bool b = find_char_by_uuid(ch);
-	if (!b) {
-		LOG_ERR("Couldn't find characteristic with UUID %s", uuid);
-		free(ch);
-		return NULL;
+restart:
+	for (blz_dev* dev = ctx->devices; dev != NULL; dev = dev->next) {
+		objects_cb_t cb = dev->objects_cb;
+		if (cb != NULL) {
+			dev->objects_slot = sd_bus_slot_unref(dev->objects_slot);
+			dev->objects_cb = NULL;
+			cb(dev, -ECANCELED, NULL, dev->objects_user);
+			goto restart;
+		}
 	}
-
-	LOG_INF("Found characteristic with UUID %s", uuid);
-	return ch;
 }
 
-bool blz_char_write(blz_char* ch, const uint8_t* data, size_t len)
+static bool op_start(blz_char* ch, enum op_kind kind, const uint8_t* data,
+					 size_t len, const char* type, blz_read_cb_t rcb,
+					 blz_write_cb_t wcb, void* user)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	sd_bus_message* call = NULL;
-	sd_bus_message* reply = NULL;
-	int r;
-
-	if (!(ch->flags & (BLZ_CHAR_WRITE | BLZ_CHAR_WRITE_WITHOUT_RESPONSE))) {
-		LOG_ERR("BLZ characteristic does not support write");
+	blz_dev* dev = ch->dev;
+	if (dev == NULL) {
+		CLOG_ERR(ch->ctx, "BLZ device of characteristic is disconnected");
 		return false;
 	}
 
-	r = sd_bus_message_new_method_call(
-		ch->ctx->bus, &call, "org.bluez", ch->path,
-		"org.bluez.GattCharacteristic1", "WriteValue");
-
-	if (r < 0) {
-		LOG_ERR("BLZ write failed to create message");
-		goto exit;
+	struct blz_op* op = mem_alloc(ch->ctx, BLZ_MEM_QUEUES,
+								  sizeof(struct blz_op) + len);
+	if (op == NULL) {
+		CLOG_ERR(ch->ctx, "BLZ op alloc failed");
+		return false;
 	}
 
-	r = sd_bus_message_append_array(call, 'y', data, len);
-	if (r < 0) {
-		LOG_ERR("BLZ write failed to create message");
-		goto exit;
+	op->ctx = ch->ctx;
+	op->ch = ch;
+	op->kind = kind;
+	op->type = type;
+	op->read_cb = rcb;
+	op->write_cb = wcb;
+	op->user = user;
+	op->len = len;
+	if (len > 0) {
+		memcpy(op->data, data, len);
 	}
 
-	r = sd_bus_message_open_container(call, 'a', "{sv}");
-	if (r < 0) {
-		LOG_ERR("BLZ write failed to create message");
-		goto exit;
+	op->next = ch->ops;
+	ch->ops = op;
+	if (dev->queue_last != NULL) {
+		dev->queue_last->dev_next = op;
+	} else {
+		dev->queue = op;
 	}
+	dev->queue_last = op;
 
-	r = sd_bus_message_close_container(call);
-	if (r < 0) {
-		LOG_ERR("BLZ write failed to create message");
-		goto exit;
-	}
+	dev_pump(dev);
+	return true;
+}
 
-	r = sd_bus_call(ch->ctx->bus, call, 0, &error, &reply);
-	if (r < 0) {
-		LOG_ERR("BLZ failed to write: %s", error.message);
-		goto exit;
+bool blz_char_read_async(blz_char* ch, blz_read_cb_t cb, void* user)
+{
+	if (!(ch->flags & BLZ_CHAR_READ)) {
+		CLOG_ERR(ch->ctx, "BLZ characteristic does not support read");
+		return false;
+	}
+	if (cb == NULL && !events_enabled(ch->ctx)) {
+		CLOG_ERR(ch->ctx, "BLZ read no callback");
+		return false;
 	}
 
-exit:
-	sd_bus_error_free(&error);
-	sd_bus_message_unref(call);
-	sd_bus_message_unref(reply);
-	return r >= 0;
+	return op_start(ch, OP_READ, NULL, 0, NULL, cb, NULL, user);
 }
 
-bool blz_char_write_cmd(blz_char* ch, const uint8_t* data, size_t len)
+bool char_write_async(blz_char* ch, const uint8_t* data, size_t len,
+					  const char* type, blz_write_cb_t cb, void* user)
 {
-	return blz_char_write(ch, data, len);
+	return op_start(ch, OP_WRITE, data, len, type, NULL, cb, user);
 }
 
-int blz_char_read(blz_char* ch, uint8_t* data, size_t len)
+bool blz_char_write_async(blz_char* ch, const uint8_t* data, size_t len,
+						  blz_write_cb_t cb, void* user)
 {
-	sd_bus_error error = SD_BUS_ERROR_NULL;
-	sd_bus_message* reply = NULL;
-	const void* ptr;
-	size_t rlen = -1;
-	int r;
-
-	if (!(ch->flags & BLZ_CHAR_READ)) {
-		LOG_ERR("BLZ characteristic does not support read");
+	if (!(ch->flags & BLZ_CHAR_WRITE)) {
+		CLOG_ERR(ch->ctx, "BLZ characteristic does not support write");
 		return false;
 	}
-
-	r = sd_bus_call_method(ch->ctx->bus, "org.bluez", ch->path,
-						   "org.bluez.GattCharacteristic1", "ReadValue", &error,
-						   &reply, "a{sv}", 0);
-
-	if (r < 0) {
-		LOG_ERR("BLZ failed to read: %s", error.message);
-		goto exit;
+	if (cb == NULL && !events_enabled(ch->ctx)) {
+		CLOG_ERR(ch->ctx, "BLZ write no callback");
+		return false;
 	}
 
-	r = sd_bus_message_read_array(reply, 'y', &ptr, &rlen);
-	if (r < 0) {
-		LOG_ERR("BLZ failed to read result: %s", error.message);
-		goto exit;
-	}
+	return char_write_async(ch, data, len, "request", cb, user);
+}
 
-	if (rlen > 0) {
-		memcpy(data, ptr, rlen < len ? rlen : len);
-	}
+void blz_set_max_inflight(blz_dev* dev, unsigned max)
+{
+	dev->max_inflight = max;
+	dev_pump(dev);
+}
 
-exit:
-	sd_bus_error_free(&error);
-	sd_bus_message_unref(reply);
-	return rlen;
+int blz_attr_read(blz_dev* dev, const struct blz_gatt_attr* attr,
+				  uint8_t* data, size_t len)
+{
+	if (attr->type == BLZ_GATT_CHAR) {
+		return read_value(dev->ctx, attr->path,
+						  "org.bluez.GattCharacteristic1", data, len);
+	} else if (attr->type == BLZ_GATT_DESC) {
+		return read_value(dev->ctx, attr->path, "org.bluez.GattDescriptor1",
+						  data, len);
+	}
+	CLOG_ERR(dev->ctx, "BLZ services have no value");
+	return -1;
 }
 
 static int blz_notify_cb(sd_bus_message* m, void* user, sd_bus_error* err)
@@ -744,15 +1639,25 @@ static int blz_notify_cb(sd_bus_message* m, void* user, sd_bus_error* err)
 	size_t len;
 	struct blz_char* ch = user;
 
-	if (ch == NULL || ch->notify_cb == NULL) {
+	if (ch == NULL || (ch->notify_cb == NULL && !events_enabled(ch->ctx))) {
 		LOG_ERR("BLZ signal no callback");
 		return -1;
 	}
 
-	r = msg_parse_notify(m, ch, &ptr, &len);
+	r = msg_parse_notify(ch->ctx, m, ch, &ptr, &len);
 
 	if (r > 0 && ptr != NULL) {
+		health_notify(ch);
+	}
+	if (r > 0 && ptr != NULL && ch->notify_cb != NULL) {
 		ch->notify_cb(ptr, len, ch, ch->notify_user);
+	} else if (r > 0 && ptr != NULL) {
+		struct blz_event* ev = event_push(ch->ctx, BLZ_EVENT_NOTIFY, 0,
+										  ch->notify_user);
+		if (ev != NULL) {
+			ev->ch = ch;
+			event_set_data(ev, ptr, len);
+		}
 	}
 
 	return 0;
@@ -765,19 +1670,24 @@ bool blz_char_notify_start(blz_char* ch, blz_notify_handler_t cb, void* user)
 	int r;
 
 	if (!(ch->flags & (BLZ_CHAR_NOTIFY | BLZ_CHAR_INDICATE))) {
-		LOG_ERR("BLZ characteristic does not support notify");
+		CLOG_ERR(ch->ctx, "BLZ characteristic does not support notify");
+		return false;
+	}
+	if (cb == NULL && !events_enabled(ch->ctx)) {
+		CLOG_ERR(ch->ctx, "BLZ notify no callback");
 		return false;
 	}
 
 	ch->notify_cb = cb;
 	ch->notify_user = user;
 
-	r = sd_bus_match_signal(ch->ctx->bus, &ch->notify_slot, "org.bluez",
-							ch->path, "org.freedesktop.DBus.Properties",
+	r = sd_bus_match_signal(ch->ctx->bus, &ch->notify_slot,
+							bluez_sender(ch->ctx), ch->path,
+							"org.freedesktop.DBus.Properties",
 							"PropertiesChanged", blz_notify_cb, ch);
 
 	if (r < 0) {
-		LOG_ERR("BLZ Failed to notify");
+		CLOG_ERR(ch->ctx, "BLZ Failed to notify");
 		goto exit;
 	}
 
@@ -786,13 +1696,13 @@ bool blz_char_notify_start(blz_char* ch, blz_notify_handler_t cb, void* user)
 						   &error, &reply, "");
 
 	if (r < 0) {
-		LOG_ERR("BLZ Failed to start notify: %s", error.message);
+		CLOG_ERR(ch->ctx, "BLZ Failed to start notify: %s", error.message);
 	}
 
 	/* wait until Notifying property changed to true */
 	r = blz_loop_timeout(ch->ctx, &ch->notifying, 5000);
 	if (r < 0) {
-		LOG_ERR("BLZ timeout waiting for Notifying");
+		CLOG_ERR(ch->ctx, "BLZ timeout waiting for Notifying");
 	}
 
 exit:
@@ -801,6 +1711,48 @@ exit:
 	return r >= 0;
 }
 
+bool blz_char_notify_start_async(blz_char* ch, blz_notify_handler_t cb,
+								 void* user, blz_write_cb_t done,
+								 void* done_user)
+{
+	int r;
+
+	if (!(ch->flags & (BLZ_CHAR_NOTIFY | BLZ_CHAR_INDICATE))) {
+		CLOG_ERR(ch->ctx, "BLZ characteristic does not support notify");
+		return false;
+	}
+
+	if (ch->notify_slot != NULL) {
+		CLOG_ERR(ch->ctx, "BLZ notify already started");
+		return false;
+	}
+	if ((cb == NULL || done == NULL) && !events_enabled(ch->ctx)) {
+		CLOG_ERR(ch->ctx, "BLZ notify no callback");
+		return false;
+	}
+
+	r = sd_bus_match_signal(ch->ctx->bus, &ch->notify_slot,
+							bluez_sender(ch->ctx), ch->path,
+							"org.freedesktop.DBus.Properties",
+							"PropertiesChanged", blz_notify_cb, ch);
+	if (r < 0) {
+		CLOG_ERR(ch->ctx, "BLZ Failed to notify");
+		return false;
+	}
+
+	ch->notify_cb = cb;
+	ch->notify_user = user;
+
+	/* BlueZ replies when the CCCD has been written */
+	if (!op_start(ch, OP_NOTIFY, NULL, 0, NULL, NULL, done, done_user)) {
+		ch->notify_slot = sd_bus_slot_unref(ch->notify_slot);
+		ch->notify_cb = NULL;
+		ch->notify_user = NULL;
+		return false;
+	}
+	return true;
+}
+
 bool blz_char_indicate_start(blz_char* ch, blz_notify_handler_t cb, void* user)
 {
 	return blz_char_notify_start(ch, cb, user);
@@ -821,7 +1773,7 @@ bool blz_char_notify_stop(blz_char* ch)
 						   &error, &reply, "");
 
 	if (r < 0) {
-		LOG_ERR("BLZ Failed to stop notify: %s", error.message);
+		CLOG_ERR(ch->ctx, "BLZ Failed to stop notify: %s", error.message);
 	}
 
 	ch->notify_slot = sd_bus_slot_unref(ch->notify_slot);
@@ -841,7 +1793,8 @@ int blz_char_write_fd_acquire(blz_char* ch)
 	int r;
 
 	if (!(ch->flags & BLZ_CHAR_WRITE_WITHOUT_RESPONSE)) {
-		LOG_ERR("BLZ characteristic does not support write-without-response");
+		CLOG_ERR(ch->ctx,
+				 "BLZ characteristic does not support write-without-response");
 		return -1;
 	}
 
@@ -850,23 +1803,75 @@ int blz_char_write_fd_acquire(blz_char* ch)
 						   &error, &reply, "a{sv}", 0);
 
 	if (r < 0) {
-		LOG_ERR("BLZ Failed acquire write: %s", error.message);
+		CLOG_ERR(ch->ctx, "BLZ Failed acquire write: %s", error.message);
 		goto exit;
 	}
 
 	r = sd_bus_message_read(reply, "h", &fd);
 	if (r < 0) {
-		LOG_ERR("BLZ Failed to get write fd");
+		CLOG_ERR(ch->ctx, "BLZ Failed to get write fd");
 	} else {
 		r = dup(fd);
 	}
 
+	/* remembered by inode, the fd belongs to the user who may close it and
+	 * get the same number for something else */
+	struct stat st;
+	if (r >= 0 && fstat(r, &st) == 0) {
+		ch->write_acquired = true;
+		ch->write_fd = r;
+		ch->write_ino = st.st_ino;
+	}
+
 exit:
 	sd_bus_error_free(&error);
 	sd_bus_message_unref(reply);
 	return r;
 }
 
+/** shutdown() of the acquired write socket, if the user still has it open,
+ * makes BlueZ release it without closing the fd of the user */
+static void char_write_fd_shutdown(blz_char* ch)
+{
+	struct stat st;
+
+	if (ch->write_acquired && fstat(ch->write_fd, &st) == 0
+		&& S_ISSOCK(st.st_mode) && st.st_ino == ch->write_ino) {
+		shutdown(ch->write_fd, SHUT_RDWR);
+	}
+	ch->write_acquired = false;
+}
+
+/** unlinks dev from the context before it is freed. Its services and
+ * characteristics belong to the user and stay, without device */
+static void dev_detach(blz_dev* dev)
+{
+	blz* ctx = dev->ctx;
+
+	for (blz_dev** p = &ctx->devices; *p != NULL; p = &(*p)->next) {
+		if (*p == dev) {
+			*p = dev->next;
+			break;
+		}
+	}
+	for (blz_serv* sv = ctx->servs; sv != NULL; sv = sv->next) {
+		if (sv->dev == dev) {
+			sv->dev = NULL;
+		}
+	}
+	for (blz_char* ch = ctx->chars; ch != NULL; ch = ch->next) {
+		if (ch->dev == dev) {
+			while (ch->ops != NULL) {
+				op_cancel(ch->ops);
+			}
+			ch->dev = NULL;
+		}
+	}
+
+	dev->connect_slot = sd_bus_slot_unref(dev->connect_slot);
+	dev->objects_slot = sd_bus_slot_unref(dev->objects_slot);
+}
+
 /** frees dev */
 void blz_disconnect(blz_dev* dev)
 {
@@ -874,9 +1879,7 @@ void blz_disconnect(blz_dev* dev)
 		return;
 	}
 
-	if (dev->connect_slot) {
-		dev->connect_slot = sd_bus_slot_unref(dev->connect_slot);
-	}
+	dev_detach(dev);
 
 	sd_bus_error error = SD_BUS_ERROR_NULL;
 	int r;
@@ -885,19 +1888,77 @@ void blz_disconnect(blz_dev* dev)
 						   "org.bluez.Device1", "Disconnect", &error, NULL, "");
 
 	if (r < 0) {
-		LOG_ERR("BLZ failed to disconnect: %s", error.message);
+		CLOG_ERR(dev->ctx, "BLZ failed to disconnect: %s", error.message);
 	}
 
 	sd_bus_error_free(&error);
+	dev_free(dev);
+}
 
-	/* free */
-	for (int i = 0; dev->service_uuids != NULL && dev->service_uuids[i] != NULL;
-		 i++) {
-		free(dev->service_uuids[i]);
+static int disconnect_reply_cb(sd_bus_message* reply, void* userdata,
+							   sd_bus_error* error)
+{
+	blz_dev* dev = userdata;
+	blz* ctx = dev->ctx;
+	blz_disconnect_cb_t cb = dev->disconnect_done;
+	void* user = dev->disconnect_done_user;
+	int r = 0;
+
+	const sd_bus_error* err = sd_bus_message_get_error(reply);
+	if (err != NULL) {
+		r = -sd_bus_message_get_errno(reply);
+		CLOG_ERR(ctx, "BLZ failed to disconnect: %s", err->message);
+	}
+
+	for (blz_dev** p = &ctx->disconnecting; *p != NULL; p = &(*p)->next) {
+		if (*p == dev) {
+			*p = dev->next;
+			break;
+		}
+	}
+	dev_free(dev);
+
+	if (cb != NULL) {
+		cb(r, user);
+	} else {
+		event_push(ctx, BLZ_EVENT_DISCONNECT, r, user);
+	}
+	return 0;
+}
+
+bool blz_disconnect_async(blz_dev* dev, blz_disconnect_cb_t cb, void* user)
+{
+	sd_bus_message* call = NULL;
+
+	if (!dev) {
+		return false;
+	}
+
+	blz* ctx = dev->ctx;
+	dev_detach(dev);
+
+	int r = sd_bus_message_new_method_call(ctx->bus, &call, "org.bluez",
+										   dev->path, "org.bluez.Device1",
+										   "Disconnect");
+	if (r >= 0) {
+		dev->call_slot = sd_bus_slot_unref(dev->call_slot);
+		r = sd_bus_call_async(ctx->bus, &dev->call_slot, call,
+							  disconnect_reply_cb, dev,
+							  DISCONNECT_TIMEOUT * 1000000ULL);
+	}
+	sd_bus_message_unref(call);
+
+	if (r < 0) {
+		CLOG_ERR(ctx, "BLZ failed to disconnect: %s", strerror(-r));
+		dev_free(dev);
+		return false;
 	}
-	free(dev->service_uuids);
 
-	free(dev);
+	dev->disconnect_done = cb;
+	dev->disconnect_done_user = user;
+	dev->next = ctx->disconnecting;
+	ctx->disconnecting = dev;
+	return true;
 }
 
 void blz_serv_free(blz_serv* sv)
@@ -905,23 +1966,61 @@ void blz_serv_free(blz_serv* sv)
 	if (!sv) {
 		return;
 	}
-	for (int i = 0; sv->char_uuids != NULL && sv->char_uuids[i] != NULL; i++) {
-		free(sv->char_uuids[i]);
+	for (blz_serv** p = &sv->ctx->servs; *p != NULL; p = &(*p)->next) {
+		if (*p == sv) {
+			*p = sv->next;
+			break;
+		}
 	}
-	free(sv->char_uuids);
-	free(sv);
+	/* UUID strings are interned in context */
+	mem_free(sv->ctx, BLZ_MEM_DEVICES, sv->char_uuids,
+			 (sv->chars_cnt + 1) * sizeof(char*));
+	mem_free(sv->ctx, BLZ_MEM_DEVICES, sv, sizeof(struct blz_serv));
 }
 
 void blz_char_free(blz_char* ch)
 {
-	free(ch);
+	if (!ch) {
+		return;
+	}
+	/* the signal match would call into freed memory */
+	if (ch->notify_slot != NULL) {
+		blz_char_notify_stop(ch);
+	}
+	/* cancel operations in progress, their places in flight are free for
+	 * other characteristics now */
+	if (ch->ops != NULL) {
+		while (ch->ops != NULL) {
+			op_cancel(ch->ops);
+		}
+		dev_pump(ch->dev);
+	}
+	for (struct blz_op* op = ch->ctx->retrying; op != NULL;
+		 op = op->retry_next) {
+		if (op->canceled && op->ch == ch) {
+			op->ch = NULL;
+		}
+	}
+	for (blz_char** p = &ch->ctx->chars; *p != NULL; p = &(*p)->next) {
+		if (*p == ch) {
+			*p = ch->next;
+			break;
+		}
+	}
+	events_forget(ch->ctx, ch);
+	mem_free(ch->ctx, BLZ_MEM_DEVICES, ch, sizeof(struct blz_char));
 }
 
 void blz_loop(blz* ctx, uint64_t timeout_us)
 {
+	uint64_t next = connect_check_timeouts(ctx);
+	next = MIN(next, op_check_retries(ctx));
+	next = MIN(next, adv_check_updates(ctx));
+
 	int r = sd_bus_process(ctx->bus, NULL);
 	if (r < 0) {
-		LOG_ERR("BLZ loop process error: %s", strerror(-r));
+		CLOG_ERR(ctx, "BLZ loop process error: %s", strerror(-r));
+		event_push(ctx, BLZ_EVENT_ERROR, r, NULL);
 		return;
 	}
 
@@ -930,9 +2029,9 @@ void blz_loop(blz* ctx, uint64_t timeout_us)
 		return;
 	}
 
-	r = sd_bus_wait(ctx->bus, timeout_us);
+	r = sd_bus_wait(ctx->bus, MIN(timeout_us, next));
 	if (r < 0 && -r != EINTR) {
-		LOG_ERR("BLZ loop wait error: %s", strerror(-r));
+		CLOG_ERR(ctx, "BLZ loop wait error: %s", strerror(-r));
 	}
 }
 
@@ -957,3 +2056,50 @@ int blz_get_fd(blz* ctx)
 {
 	return sd_bus_get_fd(ctx->bus);
 }
+
+int blz_get_events(blz* ctx)
+{
+	return sd_bus_get_events(ctx->bus);
+}
+
+uint64_t blz_get_timeout(blz* ctx)
+{
+	uint64_t t = UINT64_MAX;
+	if (sd_bus_get_timeout(ctx->bus, &t) < 0) {
+		t = UINT64_MAX;
+	}
+
+	for (blz_dev* dev = ctx->connecting; dev != NULL; dev = dev->connect_next) {
+		if (dev->wait_resolved) {
+			t = MIN(t, dev->deadline);
+		}
+	}
+	for (struct blz_op* op = ctx->retrying; op != NULL; op = op->retry_next) {
+		t = MIN(t, op->retry_at);
+	}
+	t = MIN(t, adv_next_update(ctx));
+	return t;
+}
+
+int blz_process(blz* ctx)
+{
+	int r;
+
+	connect_check_timeouts(ctx);
+	op_check_retries(ctx);
+	adv_check_updates(ctx);
+
+	do {
+		r = sd_bus_process(ctx->bus, NULL);
+	} while (r > 0);
+
+	if (r < 0) {
+		CLOG_ERR(ctx, "BLZ process error: %s", strerror(-r));
+	}
+	return r;
+}
+
+struct sd_bus* blz_get_bus(blz* ctx)
+{
+	return ctx->bus;
+}
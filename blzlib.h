@@ -18,6 +18,48 @@ extern "C" {
 
 enum blz_addr_type { BLZ_ADDR_UNKNOWN, BLZ_ADDR_PUBLIC, BLZ_ADDR_RANDOM };
 
+/* memory accounting categories */
+enum blz_mem_cat {
+	BLZ_MEM_OBJ_CACHE, /* cached D-Bus object tree, evictable */
+	BLZ_MEM_DEVICES,   /* device, service and characteristic structs */
+	BLZ_MEM_UUIDS,	   /* interned UUID table */
+	BLZ_MEM_QUEUES,	   /* operation and event queues */
+	BLZ_MEM_CAT_MAX
+};
+
+struct blz_mem_stats {
+	size_t used[BLZ_MEM_CAT_MAX];
+	size_t peak[BLZ_MEM_CAT_MAX];
+	size_t limit[BLZ_MEM_CAT_MAX]; /* 0 is unlimited */
+	size_t used_total;
+	size_t peak_total;
+	size_t limit_total;
+	size_t refused; /* number of refused allocations */
+	size_t evicted; /* bytes evicted from caches */
+};
+
+/* Characteristic Flags (Characteristic Properties bit field) */
+#define BLZ_CHAR_BROADCAST				0x01
+#define BLZ_CHAR_READ					0x02
+#define BLZ_CHAR_WRITE_WITHOUT_RESPONSE 0x04
+#define BLZ_CHAR_WRITE					0x08
+#define BLZ_CHAR_NOTIFY					0x10
+#define BLZ_CHAR_INDICATE				0x20
+#define BLZ_CHAR_SIGNED_WRITE			0x40
+#define BLZ_CHAR_EXTENDED				0x80
+
+enum blz_gatt_type { BLZ_GATT_SERVICE, BLZ_GATT_CHAR, BLZ_GATT_DESC };
+
+/* one GATT attribute, as passed by blz_dev_enumerate() */
+struct blz_gatt_attr {
+	enum blz_gatt_type type;
+	const char* path; /* D-Bus object path, only valid in the callback */
+	const char* uuid; /* interned */
+	uint32_t flags;	  /* BLZ_CHAR_* for characteristics, 0 otherwise */
+};
+
+struct sd_bus;
+
 typedef struct blz_context blz;
 typedef struct blz_dev blz_dev;
 typedef struct blz_char blz_char;
@@ -29,8 +71,43 @@ typedef void (*blz_scan_handler_t)(const uint8_t* mac, enum blz_addr_type atype,
 								   int8_t rssi, const uint8_t* data, size_t len,
 								   void* user);
 typedef void (*blz_disconn_handler_t)(void* user);
+typedef void (*blz_gatt_handler_t)(const struct blz_gatt_attr* attr,
+								   void* user);
+/* completion of asynchronous operations. err is 0 or a negative errno, dev
+ * is NULL on error. data is only valid during the callback */
+typedef void (*blz_connect_cb_t)(blz_dev* dev, int err, void* user);
+typedef void (*blz_read_cb_t)(blz_char* ch, int err, const uint8_t* data,
+							  size_t len, void* user);
+typedef void (*blz_write_cb_t)(blz_char* ch, int err, void* user);
+typedef void (*blz_disconnect_cb_t)(int err, void* user);
 
+/*
+ * Contexts are independent of each other and have no global state, so
+ * different contexts can be used from different threads at the same time.
+ * A context and the objects created from it must only be used by one thread
+ * at a time.
+ */
+
+/** init using the default system bus connection of the calling thread,
+ * which is shared with other contexts of the same thread */
 blz* blz_init(const char* dev);
+/** init with a new private system bus connection, only used by this context */
+blz* blz_init_private(const char* dev);
+/** init with a bus connection provided by the caller. The context takes its
+ * own reference, so the same connection can be shared by several contexts
+ * or the caller's own code */
+blz* blz_init_with_bus(struct sd_bus* bus, const char* dev);
+/** init with a new connection to the bus at address, e.g.
+ * "unix:path=/run/test-bus" for a private bus with a stand-in BlueZ */
+blz* blz_init_address(const char* address, const char* dev);
+/** init with a peer-to-peer connection to a stand-in BlueZ at address,
+ * without a bus daemon */
+blz* blz_init_peer(const char* address, const char* dev);
+/** disconnects all devices which are still connected and stops their
+ * notifications, with all calls in flight at the same time and waiting at
+ * most 2 seconds for the replies. Write fds of blz_char_write_fd_acquire()
+ * are shut down. Devices, services and characteristics which were not freed
+ * are freed, plans and plan runs must be freed before */
 void blz_fini(blz* ctx);
 
 bool blz_known_devices(blz* ctx, blz_scan_handler_t cb, void* user);
@@ -39,9 +116,253 @@ bool blz_scan_stop(blz* ctx);
 
 blz_dev* blz_connect(blz* ctx, const char* macstr, enum blz_addr_type atype);
 
+/*
+ * Asynchronous versions: they return immediately and the callback is called
+ * from blz_loop() (or sd_bus_process() when the bus is attached to another
+ * event loop) when the operation has finished. They return false if the
+ * operation could not be started, then the callback is not called.
+ *
+ * The timeout waiting for ServicesResolved after connecting is only checked
+ * in blz_loop(). Connects still in progress are canceled by blz_fini(),
+ * reads, writes and notify starts by blz_char_free(), blz_disconnect*() and
+ * blz_fini(). Their callbacks get -ECANCELED from the loop, with a NULL
+ * characteristic if it was freed.
+ *
+ * Reads, writes and notify starts are queued per device and sent in the
+ * order they were started, one at a time per characteristic, as BlueZ
+ * rejects concurrent ones with org.bluez.Error.InProgress. If that happens
+ * anyway, e.g. because of a blocking call, the operation is retried with
+ * backoff. Errors are passed to the callback, also when the operation could
+ * not be sent.
+ */
+bool blz_connect_async(blz* ctx, const char* macstr, enum blz_addr_type atype,
+					   blz_connect_cb_t cb, void* user);
+bool blz_char_read_async(blz_char* ch, blz_read_cb_t cb, void* user);
+/** write with response */
+bool blz_char_write_async(blz_char* ch, const uint8_t* data, size_t len,
+						  blz_write_cb_t cb, void* user);
+/** limit of operations in flight of the device, over all characteristics.
+ * 0 (default) is no limit */
+void blz_set_max_inflight(blz_dev* dev, unsigned max);
+/** cb gets the notifications like with blz_char_notify_start(), done is
+ * called when BlueZ has enabled them */
+bool blz_char_notify_start_async(blz_char* ch, blz_notify_handler_t cb,
+								 void* user, blz_write_cb_t done,
+								 void* done_user);
+
+/*
+ * Fan-out write: the same value to many characteristics, usually the same
+ * characteristic on many devices. All writes are started asynchronously,
+ * at most max_inflight at a time (0 is no limit), as write with response if
+ * the characteristic supports it, otherwise as write command. The result of
+ * chars[i] is stored in res[i], which must stay valid until the end. The
+ * characteristics must not be freed while the fan-out is in progress.
+ * Returns false if no write could be started, then res has the errors.
+ */
+struct blz_fanout_result {
+	int err;		   /* 0 or negative errno */
+	uint64_t start_us; /* since the start of the fan-out */
+	uint64_t end_us;
+};
+
+/** distribution of the completion times (end_us) of the successful writes */
+struct blz_fanout_stats {
+	size_t ok;
+	size_t failed;
+	uint64_t min_us;
+	uint64_t p50_us;
+	uint64_t p90_us;
+	uint64_t p99_us;
+	uint64_t max_us;
+	uint64_t lat_avg_us; /* average of end_us - start_us */
+};
+
+/** failed is the number of writes which failed */
+typedef void (*blz_fanout_cb_t)(size_t failed, void* user);
+
+bool blz_char_write_fanout_async(blz* ctx, blz_char* const* chars,
+								 size_t count, const uint8_t* data, size_t len,
+								 unsigned max_inflight,
+								 struct blz_fanout_result* res,
+								 blz_fanout_cb_t cb, void* user);
+/** runs blz_loop() until all writes have finished. Returns the number of
+ * failed writes or -1 if the fan-out could not be started */
+int blz_char_write_fanout(blz* ctx, blz_char* const* chars, size_t count,
+						  const uint8_t* data, size_t len,
+						  unsigned max_inflight, struct blz_fanout_result* res);
+void blz_fanout_stats(const struct blz_fanout_result* res, size_t count,
+					  struct blz_fanout_stats* st);
+
+/*
+ * Operation plans: a fixed list of reads, writes and notification starts
+ * which is built once and then executed on any number of devices, also
+ * concurrently. An execution connects, looks up all characteristics at once
+ * and then runs the steps pipelined: all reads and notification starts are
+ * sent at the same time, writes one after the other in the order they were
+ * added. A failed write cancels the writes after it (-ECANCELED).
+ *
+ * Steps return their index, which is used to get the result, or -1 on error.
+ * The plan must not be changed or freed while executions are in progress.
+ */
+typedef struct blz_plan blz_plan;
+typedef struct blz_plan_run blz_plan_run;
+
+/** per step result, times in usec since the execution was started */
+struct blz_plan_result {
+	int err;			 /* 0 or negative errno, -ENOENT if not found */
+	uint64_t start_us;	 /* 0 if never started */
+	uint64_t end_us;
+	const uint8_t* data; /* value of reads */
+	size_t len;
+};
+
+/** times of the phases of an execution in usec since its start */
+struct blz_plan_times {
+	uint64_t connected_us; /* connected and services resolved */
+	uint64_t resolved_us;  /* characteristics looked up */
+	uint64_t done_us;	   /* all steps finished */
+};
+
+/** err is 0 if every step was successful, otherwise the first error. The
+ * run belongs to the callback, which has to free it */
+typedef void (*blz_plan_cb_t)(blz_plan_run* run, int err, void* user);
+
+blz_plan* blz_plan_new(blz* ctx);
+void blz_plan_free(blz_plan* plan);
+int blz_plan_read(blz_plan* plan, const char* uuid_srv, const char* uuid_char);
+/** data is copied */
+int blz_plan_write(blz_plan* plan, const char* uuid_srv, const char* uuid_char,
+				   const uint8_t* data, size_t len);
+/** cb gets the notifications until the run is freed, only one notify step
+ * per characteristic */
+int blz_plan_notify(blz_plan* plan, const char* uuid_srv,
+					const char* uuid_char, blz_notify_handler_t cb, void* user);
+
+bool blz_plan_exec_async(blz_plan* plan, const char* macstr,
+						 enum blz_addr_type atype, blz_plan_cb_t cb,
+						 void* user);
+/** runs blz_loop() until the execution has finished. NULL if it could not be
+ * started, otherwise the run has to be freed, also when it failed */
+blz_plan_run* blz_plan_exec(blz_plan* plan, const char* macstr,
+							enum blz_addr_type atype);
+
+int blz_plan_run_err(blz_plan_run* run);
+const struct blz_plan_result* blz_plan_run_result(blz_plan_run* run,
+												  int step);
+const struct blz_plan_times* blz_plan_run_times(blz_plan_run* run);
+/** the connected device, NULL if the connect failed. Owned by the run */
+blz_dev* blz_plan_run_dev(blz_plan_run* run);
+/** characteristic of a step, NULL if not found. Owned by the run */
+blz_char* blz_plan_run_char(blz_plan_run* run, int step);
+/** disconnects and frees the run */
+void blz_plan_run_free(blz_plan_run* run);
+
+/*
+ * GATT server (peripheral role): services and characteristics are exported
+ * as an application and registered with BlueZ, which then offers them to
+ * connected clients. Reads are answered from the value of the
+ * characteristic, writes update it and are passed to the write handler.
+ * The method calls of BlueZ are dispatched by blz_loop() or blz_process().
+ *
+ * blz_server_notify() sends a value to a subscribed client. When a client
+ * subscribes, BlueZ acquires a socket for the notifications (AcquireNotify)
+ * and values are written to it instead of emitting one PropertiesChanged
+ * signal per value, which allows much higher rates. Likewise, if a write fd
+ * handler is set, BlueZ passes write commands through a socket
+ * (AcquireWrite) which the handler gets.
+ *
+ * Servers must be freed before blz_fini().
+ */
+typedef struct blz_server blz_server;
+typedef struct blz_server_char blz_server_char;
+
+/** value written by a client, with WriteValue. data is only valid during
+ * the callback */
+typedef void (*blz_server_write_cb_t)(blz_server_char* ch, const uint8_t* data,
+									  size_t len, void* user);
+/** a client acquired the write socket: every packet read from fd is one
+ * write of at most mtu bytes. The fd belongs to the handler, which closes it
+ * when reading returns 0 */
+typedef void (*blz_server_fd_cb_t)(blz_server_char* ch, int fd, uint16_t mtu,
+								   void* user);
+
+/** path of the application object, NULL for "/org/blzlib/server" */
+blz_server* blz_server_new(blz* ctx, const char* path);
+/** returns the index of the new primary service, or -1 */
+int blz_server_add_service(blz_server* srv, const char* uuid);
+/** flags are BLZ_CHAR_*, cb can be NULL */
+blz_server_char* blz_server_add_char(blz_server* srv, int serv,
+									 const char* uuid, uint32_t flags,
+									 blz_server_write_cb_t cb, void* user);
+void blz_server_char_set_fd_handler(blz_server_char* ch, blz_server_fd_cb_t cb,
+									void* user);
+/** value for reads, doesn't notify */
+bool blz_server_char_set_value(blz_server_char* ch, const uint8_t* data,
+							   size_t len);
+/** sets the value and sends it to the subscribed client. Returns 0,
+ * -ENOTCONN if no client is subscribed, -EAGAIN if the socket is full or
+ * another negative errno */
+int blz_server_notify(blz_server_char* ch, const uint8_t* data, size_t len);
+/** exports the objects and registers the application, running blz_loop()
+ * until BlueZ has read the objects and replied. Services and characteristics
+ * can't be added afterwards. On failure nothing stays exported and it can
+ * be tried again */
+bool blz_server_register(blz_server* srv);
+/** unregisters the application and frees the server, blz_fini() does this
+ * for the servers which are left */
+void blz_server_free(blz_server* srv);
+
+/*
+ * LE advertising (LEAdvertisingManager1). The payload can be changed while
+ * the advertisement is registered, BlueZ picks up the new data from a
+ * PropertiesChanged signal instead of a new registration. With an update
+ * interval, changes are batched and at most one signal per interval is
+ * sent, with the latest data, from blz_loop().
+ *
+ * Advertisements must be freed before blz_fini().
+ */
+typedef struct blz_adv blz_adv;
+
+struct blz_adv_stats {
+	uint64_t register_us; /* RegisterAdvertisement until the reply */
+	unsigned long updates; /* data changes */
+	unsigned long sent;	   /* PropertiesChanged signals sent */
+	double sent_hz;		   /* signals per second since registration */
+};
+
+/** path of the advertisement object, NULL for "/org/blzlib/advertisement".
+ * Connectable advertisements are of type "peripheral", others "broadcast" */
+blz_adv* blz_adv_new(blz* ctx, const char* path, bool connectable);
+bool blz_adv_set_name(blz_adv* adv, const char* name);
+bool blz_adv_add_service_uuid(blz_adv* adv, const char* uuid);
+/** replaces the data of the same company ID, up to 31 bytes */
+bool blz_adv_set_manufacturer_data(blz_adv* adv, uint16_t company,
+								   const uint8_t* data, size_t len);
+/** replaces the data of the same service UUID, up to 31 bytes */
+bool blz_adv_set_service_data(blz_adv* adv, const char* uuid,
+							  const uint8_t* data, size_t len);
+/** minimum time between updates, 0 (default) sends every change */
+void blz_adv_set_interval(blz_adv* adv, unsigned ms);
+/** registers the advertisement, running blz_loop() until BlueZ has read it
+ * and replied */
+bool blz_adv_register(blz_adv* adv);
+void blz_adv_get_stats(blz_adv* adv, struct blz_adv_stats* st);
+/** unregisters and frees the advertisement */
+void blz_adv_free(blz_adv* adv);
+
 void blz_set_disconnect_handler(blz_dev* dev, blz_disconn_handler_t cb,
 								void* user);
 
+/** UUID strings are interned per context: equal UUIDs (case insensitive)
+ * always return the same lowercase string pointer and a small integer ID,
+ * both stable until blz_fini(). All UUID lists returned by the library point
+ * into this table, so they can be compared by pointer */
+const char* blz_uuid_intern(blz* ctx, const char* uuid);
+/** returns ID of UUID (interning it if necessary) or -1 on error */
+int blz_uuid_id(blz* ctx, const char* uuid);
+/** returns UUID string for ID or NULL if ID is unknown */
+const char* blz_uuid_from_id(blz* ctx, int id);
+
 /** returns NULL terminated list of service UUID strings, don't free them */
 char** blz_list_service_uuids(blz_dev* dev);
 blz_serv* blz_get_serv_from_uuid(blz_dev* dev, const char* uuid_srv);
@@ -50,9 +371,26 @@ blz_serv* blz_get_serv_from_uuid(blz_dev* dev, const char* uuid_srv);
 char** blz_list_char_uuids(blz_serv* serv);
 blz_char* blz_get_char_from_uuid(blz_serv* serv, const char* uuid_char);
 
+/** calls cb for all services, characteristics and descriptors of the device
+ * from one object tree lookup. The order is that of BlueZ, sorting by path
+ * gives the tree order (service, its characteristics, their descriptors) */
+bool blz_dev_enumerate(blz_dev* dev, blz_gatt_handler_t cb, void* user);
+/** read the value of a characteristic or descriptor from
+ * blz_dev_enumerate(), returns length or -1 on error */
+int blz_attr_read(blz_dev* dev, const struct blz_gatt_attr* attr,
+				  uint8_t* data, size_t len);
+/** service or characteristic object for an attribute from
+ * blz_dev_enumerate(), without looking it up again. Can be called in the
+ * callback, NULL if the type doesn't match */
+blz_serv* blz_serv_from_attr(blz_dev* dev, const struct blz_gatt_attr* attr);
+blz_char* blz_char_from_attr(blz_dev* dev, const struct blz_gatt_attr* attr);
+
 bool blz_char_write(blz_char* ch, const uint8_t* data, size_t len);
+/** write without response (write command) through D-Bus */
 bool blz_char_write_cmd(blz_char* ch, const uint8_t* data, size_t len);
 int blz_char_read(blz_char* ch, uint8_t* data, size_t len);
+/** BLZ_CHAR_* flags of the characteristic */
+uint32_t blz_char_get_flags(blz_char* ch);
 bool blz_char_notify_start(blz_char* ch, blz_notify_handler_t cb, void* user);
 bool blz_char_indicate_start(blz_char* ch, blz_notify_handler_t cb, void* user);
 bool blz_char_notify_stop(blz_char* ch);
@@ -64,10 +402,157 @@ int blz_loop_timeout(blz* ctx, bool* check, uint32_t timeout_ms);
 
 /* this frees dev */
 void blz_disconnect(blz_dev* dev);
+/** frees dev right away and calls cb (can be NULL) with the result of
+ * Disconnect from the loop. Operations in progress on its characteristics
+ * are canceled (-ECANCELED), its services and characteristics stay valid
+ * until freed but can't be used for lookups and asynchronous operations
+ * anymore. Disconnecting many devices this way is much faster than one
+ * after the other. Returns false if the call could not be started */
+bool blz_disconnect_async(blz_dev* dev, blz_disconnect_cb_t cb, void* user);
 void blz_serv_free(blz_serv* sv);
+/** also stops notifications if they were started. Operations in progress
+ * complete with -ECANCELED and a NULL characteristic from the loop */
 void blz_char_free(blz_char* ch);
 
+/*
+ * Pull-based events, instead of callbacks from inside the loop: after
+ * blz_events_enable(), a NULL callback passed to blz_scan_start(),
+ * blz_char_notify_start(), blz_connect_async(), blz_char_read_async(),
+ * blz_char_write_async(), blz_char_notify_start_async() or
+ * blz_disconnect_async() queues its results as events in a ring which is
+ * allocated once, carrying the user pointer of the call. So do disconnects
+ * of devices without disconnect handler. blz_poll_events() then returns
+ * them in batches.
+ */
+enum blz_event_type {
+	BLZ_EVENT_SCAN,			  /* mac, rssi */
+	BLZ_EVENT_NOTIFY,		  /* ch, data */
+	BLZ_EVENT_NOTIFY_STARTED, /* ch, err */
+	BLZ_EVENT_CONNECT,		  /* dev, err. dev is NULL on error */
+	BLZ_EVENT_DISCONNECT,	  /* dev, err. dev is NULL after
+								 blz_disconnect_async(), which freed it */
+	BLZ_EVENT_READ,			  /* ch, err, data */
+	BLZ_EVENT_WRITE,		  /* ch, err */
+	BLZ_EVENT_ERROR,		  /* err. -ENOBUFS if len events were dropped as
+								 the ring was full */
+};
+
+#define BLZ_EVENTS_DEFAULT 256
+#define BLZ_EVENT_DATA_MAX 244 /* notification at an MTU of 247 */
+
+struct blz_event {
+	enum blz_event_type type;
+	int err;	  /* 0 or negative errno */
+	void* user;	  /* of the call which started it */
+	blz_dev* dev; /* NULL if freed since */
+	blz_char* ch; /* NULL if freed since */
+	uint8_t mac[6];
+	int16_t rssi; /* dBm */
+	size_t len;	  /* of the value, data has at most BLZ_EVENT_DATA_MAX bytes */
+	uint8_t data[BLZ_EVENT_DATA_MAX];
+};
+
+/** allocates the ring for size events (0 for BLZ_EVENTS_DEFAULT) */
+bool blz_events_enable(blz* ctx, size_t size);
+/** dispatches what is pending and waits up to timeout_us (UINT64_MAX is
+ * forever) if there is no event yet. Copies up to max events to out and
+ * returns their number, 0 on timeout or negative errno */
+int blz_poll_events(blz* ctx, struct blz_event* out, size_t max,
+					uint64_t timeout_us);
+
+/*
+ * Loop thread: runs the loop of the context in a thread of its own, e.g.
+ * pinned to isolated CPUs with real-time priority, so that the latency of
+ * BLE events doesn't depend on other load. Callbacks run in this thread.
+ * While it runs, other threads must call into the context only between
+ * blz_lock() and blz_unlock(), callbacks already hold the lock.
+ */
+struct blz_thread_conf {
+	const char* name; /* NULL for "blz-loop", at most 15 characters */
+	const int* cpus;  /* affinity, NULL for all CPUs */
+	size_t num_cpus;
+	int priority;	   /* SCHED_FIFO priority, 0 for SCHED_OTHER */
+	unsigned probe_ms; /* interval of wakeups measuring the latency when
+						  there is no other timeout, 0 is off */
+};
+
+/* how late the thread woke up after timeouts */
+struct blz_thread_stats {
+	int err; /* negative errno if the loop ended on an error, else 0 */
+	unsigned long wakeups;
+	uint64_t lat_avg_us;
+	uint64_t lat_p99_us; /* upper bound, power of two */
+	uint64_t lat_max_us;
+};
+
+/** conf can be NULL for defaults. Fails with a priority if the process
+ * may not use SCHED_FIFO (CAP_SYS_NICE or RLIMIT_RTPRIO) */
+bool blz_thread_start(blz* ctx, const struct blz_thread_conf* conf);
+/** also done by blz_fini(), must not be called with the lock held. Returns
+ * the error which ended the loop before, if any, otherwise 0 */
+int blz_thread_stop(blz* ctx);
+/** no-ops without loop thread */
+void blz_lock(blz* ctx);
+void blz_unlock(blz* ctx);
+void blz_thread_get_stats(blz* ctx, struct blz_thread_stats* st);
+
+/*
+ * Link health: a score per MAC address from 0 (bad) to 100 (good), kept
+ * from the first connect until blz_fini(). It combines the RSSI level and
+ * trend, the success rate of connects, recent unexpected disconnects,
+ * the error rate and latency of operations and gaps in notifications.
+ * Devices with a score below 40 get only one operation in flight at a
+ * time, fan-out writes start with the healthiest devices.
+ */
+struct blz_health {
+	int score;
+	int16_t rssi;		 /* dBm, smoothed, 0 if unknown */
+	int rssi_trend;		 /* dB, negative while the signal weakens */
+	float connect_success; /* moving average, 0-1 */
+	float disconnects;	   /* unexpected, each counts 1/(1 + hours ago) */
+	float error_rate;	   /* of operations, moving average, 0-1 */
+	float notify_gap_rate; /* notifications after a gap, 0-1 */
+	uint32_t lat_p50_us;   /* of the last 32 operations */
+	uint32_t lat_p90_us;
+	uint32_t lat_max_us;
+};
+
+/** dev is NULL if the device is not connected */
+typedef void (*blz_health_cb_t)(const uint8_t* mac, blz_dev* dev, int score,
+								void* user);
+
+/** false if the device was never connected */
+bool blz_get_health(blz* ctx, const uint8_t* mac, struct blz_health* h);
+bool blz_dev_get_health(blz_dev* dev, struct blz_health* h);
+/** cb is called when the score changed by at least min_change since it was
+ * last reported */
+void blz_set_health_handler(blz* ctx, int min_change, blz_health_cb_t cb,
+							void* user);
+
 int blz_get_fd(blz* ctx);
+/*
+ * Integration into other event loops: wait for blz_get_events() (POLLIN,
+ * POLLOUT) on blz_get_fd() or until blz_get_timeout(), then call
+ * blz_process() and repeat, as what to wait for changes with every call.
+ */
+int blz_get_events(blz* ctx);
+/** absolute time in usec of CLOCK_MONOTONIC when blz_process() needs to be
+ * called at the latest, UINT64_MAX if there is no timeout */
+uint64_t blz_get_timeout(blz* ctx);
+/** dispatches everything pending without blocking, also the timeouts of
+ * blz_connect_async(). Returns negative errno on error */
+int blz_process(blz* ctx);
+/** bus connection used by the context, e.g. to attach it to an event loop.
+ * No reference is taken */
+struct sd_bus* blz_get_bus(blz* ctx);
+
+/** bytes used by the context per category */
+void blz_get_mem_stats(blz* ctx, struct blz_mem_stats* st);
+/** limit memory of one category or in total (0 is unlimited). Caches are
+ * evicted to stay within the limits, if that is not enough new allocations
+ * (e.g. devices on connect) are refused */
+void blz_set_mem_limit(blz* ctx, enum blz_mem_cat cat, size_t bytes);
+void blz_set_mem_limit_total(blz* ctx, size_t bytes);
 
 #ifdef __cplusplus
 }
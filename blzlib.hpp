@@ -0,0 +1,905 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#ifndef BLZLIB_HPP
+#define BLZLIB_HPP
+
+/*
+ * Header only C++20 wrapper. The types own the C objects and free them when
+ * they go out of scope, they can be moved but not copied. Objects must be
+ * destroyed before the object they were created from (characteristic before
+ * service before device before context), declaring them in this order in one
+ * scope does this.
+ *
+ * Functions which can fail return an empty object (check with operator bool)
+ * or false like the C API, there are no exceptions.
+ *
+ * Callbacks are template trampolines: the callable is passed by reference
+ * and must stay alive while it is registered, or a member function is given
+ * as template argument with the object pointer, so there is neither
+ * std::function nor an allocation.
+ *
+ * The async_ functions return awaitables for coroutines. co_await starts the
+ * operation and suspends. When the reply arrives the coroutine is queued and
+ * context::loop() resumes it after blz_loop() has returned, so it runs on the
+ * thread driving the loop and can also use the blocking functions, which
+ * can't be called from within sd_bus_process(). Programs with their own
+ * event loop call run_ready() after sd_bus_process(). task is a coroutine
+ * type for starting them without waiting for the result.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "blzlib.h"
+
+namespace blzpp {
+
+namespace detail {
+
+template <auto Fn> struct deleter {
+	template <class T> void operator()(T* p) const { Fn(p); }
+};
+
+template <class T, auto Fn> using handle = std::unique_ptr<T, deleter<Fn>>;
+
+inline const uint8_t* u8(std::span<const std::byte> s)
+{
+	return reinterpret_cast<const uint8_t*>(s.data());
+}
+
+inline std::span<const std::byte> bytes(const uint8_t* data, size_t len)
+{
+	return {reinterpret_cast<const std::byte*>(data), data ? len : 0};
+}
+
+/** iterator over a NULL terminated list of C strings, e.g. UUID lists */
+class strv_iterator
+{
+public:
+	using iterator_concept = std::forward_iterator_tag;
+	using value_type = std::string_view;
+	using difference_type = std::ptrdiff_t;
+
+	strv_iterator() = default;
+	explicit strv_iterator(char* const* p) : p_(p) {}
+
+	std::string_view operator*() const { return *p_; }
+	strv_iterator& operator++()
+	{
+		++p_;
+		return *this;
+	}
+	strv_iterator operator++(int)
+	{
+		auto it = *this;
+		++p_;
+		return it;
+	}
+	bool operator==(const strv_iterator&) const = default;
+	bool operator==(std::default_sentinel_t) const
+	{
+		return p_ == nullptr || *p_ == nullptr;
+	}
+
+	char* const* get() const { return p_; }
+
+private:
+	char* const* p_ = nullptr;
+};
+
+/** coroutine waiting to be resumed by run_ready(), the node is part of its
+ * awaiter so queueing doesn't allocate */
+struct ready_node {
+	ready_node* next = nullptr;
+	std::coroutine_handle<> h;
+};
+
+struct ready_list {
+	ready_node* head = nullptr;
+	ready_node** tail = &head;
+};
+
+/* per thread, as the loop of a context is only driven by one thread */
+inline thread_local ready_list ready;
+
+inline void post(ready_node& n)
+{
+	n.next = nullptr;
+	*ready.tail = &n;
+	ready.tail = &n.next;
+}
+
+} // namespace detail
+
+/** resumes the coroutines whose operations have finished, returns false if
+ * there were none */
+inline bool run_ready()
+{
+	bool ran = false;
+	while (detail::ready.head != nullptr) {
+		/* unlink first, the node is gone when the coroutine continues */
+		detail::ready_node* n = detail::ready.head;
+		detail::ready.head = n->next;
+		if (detail::ready.head == nullptr) {
+			detail::ready.tail = &detail::ready.head;
+		}
+		n->h.resume();
+		ran = true;
+	}
+	return ran;
+}
+
+/** range of UUIDs. The list is copied, as the C list is replaced by the
+ * next blz_list_*_uuids() call, the strings are interned by the context so
+ * they stay valid */
+class uuid_view : public std::ranges::view_interface<uuid_view>
+{
+public:
+	uuid_view() = default;
+	explicit uuid_view(char** list)
+	{
+		for (; list != nullptr && *list != nullptr; list++) {
+			list_.push_back(*list);
+		}
+		list_.push_back(nullptr);
+	}
+
+	detail::strv_iterator begin() const
+	{
+		return detail::strv_iterator(list_.empty() ? nullptr : list_.data());
+	}
+	std::default_sentinel_t end() const { return {}; }
+
+private:
+	std::vector<char*> list_;
+};
+
+/** coroutine which starts immediately and is not awaited. It frees itself
+ * when it returns, exceptions terminate */
+struct task {
+	struct promise_type {
+		task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+/** result of co_await characteristic::async_read() */
+struct read_result {
+	int err = -EIO;	/* 0 or negative errno */
+	size_t len = 0; /* length of the value, can be larger than data */
+	std::array<std::byte, 512> data;
+
+	explicit operator bool() const { return err == 0; }
+	std::span<const std::byte> value() const
+	{
+		return {data.data(), std::min(len, data.size())};
+	}
+};
+
+class read_awaiter
+{
+public:
+	explicit read_awaiter(blz_char* ch) : ch_(ch) {}
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		node_.h = h;
+		return blz_char_read_async(ch_, &done, this);
+	}
+	read_result await_resume() const { return res_; }
+
+private:
+	static void done(blz_char*, int err, const uint8_t* data, size_t len,
+					 void* user)
+	{
+		auto* a = static_cast<read_awaiter*>(user);
+		a->res_.err = err;
+		a->res_.len = len;
+		if (len > 0) {
+			std::memcpy(a->res_.data.data(), data,
+						std::min(len, a->res_.data.size()));
+		}
+		detail::post(a->node_);
+	}
+
+	blz_char* ch_;
+	detail::ready_node node_;
+	read_result res_;
+};
+
+class write_awaiter
+{
+public:
+	write_awaiter(blz_char* ch, std::span<const std::byte> data)
+		: ch_(ch), data_(data)
+	{
+	}
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		node_.h = h;
+		return blz_char_write_async(ch_, detail::u8(data_), data_.size(),
+									&done, this);
+	}
+	/** true if the write was confirmed */
+	bool await_resume() const { return err_ == 0; }
+
+private:
+	static void done(blz_char*, int err, void* user)
+	{
+		auto* a = static_cast<write_awaiter*>(user);
+		a->err_ = err;
+		detail::post(a->node_);
+	}
+
+	blz_char* ch_;
+	std::span<const std::byte> data_;
+	detail::ready_node node_;
+	int err_ = -EIO;
+};
+
+class notify_start_awaiter
+{
+public:
+	notify_start_awaiter(blz_char* ch, blz_notify_handler_t cb, void* user)
+		: ch_(ch), cb_(cb), user_(user)
+	{
+	}
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		node_.h = h;
+		return blz_char_notify_start_async(ch_, cb_, user_, &done, this);
+	}
+	/** true if BlueZ has enabled notifications */
+	bool await_resume() const { return err_ == 0; }
+
+private:
+	static void done(blz_char*, int err, void* user)
+	{
+		auto* a = static_cast<notify_start_awaiter*>(user);
+		a->err_ = err;
+		detail::post(a->node_);
+	}
+
+	blz_char* ch_;
+	blz_notify_handler_t cb_;
+	void* user_;
+	detail::ready_node node_;
+	int err_ = -EIO;
+};
+
+/** notifications of a characteristic for a coroutine: they are copied into
+ * a ring of N slots of Size bytes and co_await next() returns the oldest, or
+ * std::nullopt when the stream is closed. The returned data is valid until
+ * the next call of next(). Notifications arriving when all slots are full
+ * are dropped and counted. co_await start() or the first next() starts
+ * them without blocking, next() returns std::nullopt if they could not be
+ * started.
+ *
+ *     auto s = ch.notifications();
+ *     while (auto pkt = co_await s.next()) { ... }
+ *
+ * The stream must not outlive the characteristic and can't be moved, as the
+ * C callback points to it. */
+template <size_t N = 16, size_t Size = 512> class notification_stream
+{
+public:
+	class next_awaiter
+	{
+	public:
+		explicit next_awaiter(notification_stream& s) : s_(s) {}
+
+		bool await_ready() const noexcept
+		{
+			return s_.closed_ || (s_.started_ && s_.count_ > 0);
+		}
+		bool await_suspend(std::coroutine_handle<> h) { return s_.wait(h); }
+		std::optional<std::span<const std::byte>> await_resume()
+		{
+			if (s_.count_ == 0) {
+				return std::nullopt;
+			}
+			s_.popped_ = true;
+			return std::span<const std::byte>(s_.slots_[s_.head_].data(),
+											  s_.len_[s_.head_]);
+		}
+
+	private:
+		notification_stream& s_;
+	};
+
+	class start_awaiter
+	{
+	public:
+		explicit start_awaiter(notification_stream& s) : s_(s) {}
+
+		bool await_ready() const noexcept { return s_.started_ || s_.closed_; }
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			s_.start_waiter_ = true;
+			return s_.wait(h);
+		}
+		/** true if BlueZ has enabled notifications */
+		bool await_resume() const { return !s_.closed_; }
+
+	private:
+		notification_stream& s_;
+	};
+
+	/** also for indications, they are started the same way */
+	explicit notification_stream(blz_char* ch) : ch_(ch) {}
+
+	~notification_stream()
+	{
+		if (started_ && !closed_) {
+			blz_char_notify_stop(ch_);
+		}
+	}
+
+	notification_stream(const notification_stream&) = delete;
+	notification_stream& operator=(const notification_stream&) = delete;
+
+	/** false after closing or if notifications could not be started */
+	explicit operator bool() const { return !closed_; }
+
+	start_awaiter start() { return start_awaiter(*this); }
+
+	next_awaiter next()
+	{
+		if (popped_) {
+			head_ = (head_ + 1) % N;
+			count_--;
+			popped_ = false;
+		}
+		return next_awaiter(*this);
+	}
+
+	/** stops notifications, a waiting next() returns std::nullopt after
+	 * the slots still filled */
+	void close()
+	{
+		if (closed_) {
+			return;
+		}
+		if (started_) {
+			blz_char_notify_stop(ch_);
+		}
+		closed_ = true;
+		resume();
+	}
+
+	size_t dropped() const { return dropped_; }
+
+private:
+	/** starts notifications on the first call, false if that failed */
+	bool wait(std::coroutine_handle<> h)
+	{
+		waiter_.h = h;
+		waiting_ = true;
+		if (!started_) {
+			started_ = starting_ = true;
+			if (!blz_char_notify_start_async(ch_, &notify_fn, this,
+											 &started_fn, this)) {
+				starting_ = waiting_ = start_waiter_ = false;
+				closed_ = true;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static void notify_fn(const uint8_t* data, size_t len, blz_char*,
+						  void* user)
+	{
+		auto* s = static_cast<notification_stream*>(user);
+		if (s->count_ == N) {
+			s->dropped_++;
+			return;
+		}
+		size_t i = (s->head_ + s->count_) % N;
+		s->len_[i] = std::min(len, Size);
+		if (len > 0) {
+			std::memcpy(s->slots_[i].data(), data, s->len_[i]);
+		}
+		s->count_++;
+		s->resume();
+	}
+
+	static void started_fn(blz_char*, int err, void* user)
+	{
+		auto* s = static_cast<notification_stream*>(user);
+		s->starting_ = false;
+		if (err < 0) {
+			/* the C layer has dropped notify_fn */
+			s->closed_ = true;
+		}
+		if (s->start_waiter_ || s->count_ > 0 || s->closed_) {
+			s->start_waiter_ = false;
+			s->resume();
+		}
+	}
+
+	/** not while starting, the waiter gets the reply first so that the
+	 * stream can't go away before started_fn() */
+	void resume()
+	{
+		if (waiting_ && !starting_) {
+			waiting_ = false;
+			detail::post(waiter_);
+		}
+	}
+
+	blz_char* ch_;
+	detail::ready_node waiter_;
+	size_t head_ = 0;
+	size_t count_ = 0;
+	size_t dropped_ = 0;
+	bool waiting_ = false;
+	bool popped_ = false;
+	bool started_ = false;
+	bool starting_ = false;
+	bool start_waiter_ = false;
+	bool closed_ = false;
+	std::array<size_t, N> len_;
+	std::array<std::array<std::byte, Size>, N> slots_;
+};
+
+class characteristic
+{
+public:
+	characteristic() = default;
+	explicit characteristic(blz_char* ch) : h_(ch) {}
+
+	blz_char* get() const { return h_.get(); }
+	blz_char* release() { return h_.release(); }
+	explicit operator bool() const { return h_ != nullptr; }
+
+	bool write(std::span<const std::byte> data)
+	{
+		return blz_char_write(get(), detail::u8(data), data.size());
+	}
+
+	bool write_cmd(std::span<const std::byte> data)
+	{
+		return blz_char_write_cmd(get(), detail::u8(data), data.size());
+	}
+
+	/** BLZ_CHAR_* */
+	uint32_t flags() const { return blz_char_get_flags(get()); }
+
+	/** returns the length of the value, which can be larger than buf, or
+	 * -1 on error */
+	int read(std::span<std::byte> buf)
+	{
+		/* blz_char_read() returns 0 for that */
+		if (!(flags() & BLZ_CHAR_READ)) {
+			return -1;
+		}
+		return blz_char_read(get(), reinterpret_cast<uint8_t*>(buf.data()),
+							 buf.size());
+	}
+
+	/** f(std::span<const std::byte>) is called for each notification.
+	 * Blocks until they are enabled, see async_notify_start() */
+	template <class F> bool notify_start(F& f)
+	{
+		return blz_char_notify_start(get(), &notify_fn<F>, &f);
+	}
+
+	/** (obj->*Fn)(std::span<const std::byte>) for each notification */
+	template <auto Fn, class T> bool notify_start(T* obj)
+	{
+		return blz_char_notify_start(get(), &notify_mem<Fn, T>, obj);
+	}
+
+	/** like notify_start(), co_await returns true when BlueZ has enabled
+	 * notifications (or indications) */
+	template <class F> notify_start_awaiter async_notify_start(F& f)
+	{
+		return notify_start_awaiter(get(), &notify_fn<F>, &f);
+	}
+
+	template <auto Fn, class T>
+	notify_start_awaiter async_notify_start(T* obj)
+	{
+		return notify_start_awaiter(get(), &notify_mem<Fn, T>, obj);
+	}
+
+	template <class F> bool indicate_start(F& f)
+	{
+		return blz_char_indicate_start(get(), &notify_fn<F>, &f);
+	}
+
+	template <auto Fn, class T> bool indicate_start(T* obj)
+	{
+		return blz_char_indicate_start(get(), &notify_mem<Fn, T>, obj);
+	}
+
+	bool notify_stop() { return blz_char_notify_stop(get()); }
+
+	/** returns fd or -1 on error, the caller needs to close it */
+	int write_fd_acquire() { return blz_char_write_fd_acquire(get()); }
+
+	/** co_await returns read_result */
+	read_awaiter async_read() { return read_awaiter(get()); }
+
+	/** write with response, co_await returns true on success */
+	write_awaiter async_write(std::span<const std::byte> data)
+	{
+		return write_awaiter(get(), data);
+	}
+
+	template <size_t N = 16, size_t Size = 512>
+	notification_stream<N, Size> notifications()
+	{
+		return notification_stream<N, Size>(get());
+	}
+
+private:
+	template <class F>
+	static void notify_fn(const uint8_t* data, size_t len, blz_char*,
+						  void* user)
+	{
+		(*static_cast<F*>(user))(detail::bytes(data, len));
+	}
+
+	template <auto Fn, class T>
+	static void notify_mem(const uint8_t* data, size_t len, blz_char*,
+						   void* user)
+	{
+		(static_cast<T*>(user)->*Fn)(detail::bytes(data, len));
+	}
+
+	detail::handle<blz_char, blz_char_free> h_;
+};
+
+/** range of the characteristics of a service, the UUIDs are listed when the
+ * view is created and each is looked up when the iterator is dereferenced */
+class characteristic_view
+	: public std::ranges::view_interface<characteristic_view>
+{
+public:
+	class iterator
+	{
+	public:
+		using iterator_concept = std::input_iterator_tag;
+		using value_type = characteristic;
+		using difference_type = std::ptrdiff_t;
+
+		iterator() = default;
+		iterator(blz_serv* srv, char* const* p) : srv_(srv), it_(p) {}
+
+		characteristic operator*() const
+		{
+			return characteristic(blz_get_char_from_uuid(srv_, *it_.get()));
+		}
+		iterator& operator++()
+		{
+			++it_;
+			return *this;
+		}
+		void operator++(int) { ++it_; }
+		bool operator==(std::default_sentinel_t s) const { return it_ == s; }
+
+	private:
+		blz_serv* srv_ = nullptr;
+		detail::strv_iterator it_;
+	};
+
+	characteristic_view() = default;
+	explicit characteristic_view(blz_serv* srv)
+		: srv_(srv), uuids_(srv ? blz_list_char_uuids(srv) : nullptr)
+	{
+	}
+
+	iterator begin() const { return iterator(srv_, uuids_.begin().get()); }
+	std::default_sentinel_t end() const { return {}; }
+
+private:
+	blz_serv* srv_ = nullptr;
+	uuid_view uuids_;
+};
+
+class service
+{
+public:
+	service() = default;
+	explicit service(blz_serv* srv) : h_(srv) {}
+
+	blz_serv* get() const { return h_.get(); }
+	blz_serv* release() { return h_.release(); }
+	explicit operator bool() const { return h_ != nullptr; }
+
+	characteristic char_from_uuid(const char* uuid) const
+	{
+		return characteristic(blz_get_char_from_uuid(get(), uuid));
+	}
+
+	uuid_view char_uuids() const
+	{
+		return uuid_view(blz_list_char_uuids(get()));
+	}
+
+	characteristic_view characteristics() const
+	{
+		return characteristic_view(get());
+	}
+
+private:
+	detail::handle<blz_serv, blz_serv_free> h_;
+};
+
+/** range of the services of a device, the UUIDs are listed when the view
+ * is created and each is looked up when the iterator is dereferenced */
+class service_view : public std::ranges::view_interface<service_view>
+{
+public:
+	class iterator
+	{
+	public:
+		using iterator_concept = std::input_iterator_tag;
+		using value_type = service;
+		using difference_type = std::ptrdiff_t;
+
+		iterator() = default;
+		iterator(blz_dev* dev, char* const* p) : dev_(dev), it_(p) {}
+
+		service operator*() const
+		{
+			return service(blz_get_serv_from_uuid(dev_, *it_.get()));
+		}
+		iterator& operator++()
+		{
+			++it_;
+			return *this;
+		}
+		void operator++(int) { ++it_; }
+		bool operator==(std::default_sentinel_t s) const { return it_ == s; }
+
+	private:
+		blz_dev* dev_ = nullptr;
+		detail::strv_iterator it_;
+	};
+
+	service_view() = default;
+	explicit service_view(blz_dev* dev)
+		: dev_(dev), uuids_(dev ? blz_list_service_uuids(dev) : nullptr)
+	{
+	}
+
+	iterator begin() const { return iterator(dev_, uuids_.begin().get()); }
+	std::default_sentinel_t end() const { return {}; }
+
+private:
+	blz_dev* dev_ = nullptr;
+	uuid_view uuids_;
+};
+
+class device
+{
+public:
+	device() = default;
+	explicit device(blz_dev* dev) : h_(dev) {}
+
+	blz_dev* get() const { return h_.get(); }
+	blz_dev* release() { return h_.release(); }
+	explicit operator bool() const { return h_ != nullptr; }
+
+	service serv_from_uuid(const char* uuid) const
+	{
+		return service(blz_get_serv_from_uuid(get(), uuid));
+	}
+
+	uuid_view service_uuids() const
+	{
+		return uuid_view(blz_list_service_uuids(get()));
+	}
+
+	service_view services() const { return service_view(get()); }
+
+	/** f(const blz_gatt_attr&) for every service, characteristic and
+	 * descriptor, see blz_dev_enumerate() */
+	template <class F> bool enumerate(F&& f) const
+	{
+		using T = std::remove_reference_t<F>;
+		return blz_dev_enumerate(get(), &gatt_fn<T>,
+								 const_cast<void*>(static_cast<const void*>(
+									 std::addressof(f))));
+	}
+
+	/** f() is called when the device disconnects */
+	template <class F> void on_disconnect(F& f)
+	{
+		blz_set_disconnect_handler(get(), &disconn_fn<F>, &f);
+	}
+
+	template <auto Fn, class T> void on_disconnect(T* obj)
+	{
+		blz_set_disconnect_handler(get(), &disconn_mem<Fn, T>, obj);
+	}
+
+	/** disconnects, same as destroying the object */
+	void disconnect() { h_.reset(); }
+
+private:
+	template <class T>
+	static void gatt_fn(const struct blz_gatt_attr* attr, void* user)
+	{
+		(*static_cast<T*>(user))(*attr);
+	}
+
+	template <class F> static void disconn_fn(void* user)
+	{
+		(*static_cast<F*>(user))();
+	}
+
+	template <auto Fn, class T> static void disconn_mem(void* user)
+	{
+		(static_cast<T*>(user)->*Fn)();
+	}
+
+	detail::handle<blz_dev, blz_disconnect> h_;
+};
+
+/** co_await returns the connected device, empty on error */
+class connect_awaiter
+{
+public:
+	connect_awaiter(blz* ctx, const char* mac, enum blz_addr_type atype)
+		: ctx_(ctx), mac_(mac), atype_(atype)
+	{
+	}
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		node_.h = h;
+		return blz_connect_async(ctx_, mac_, atype_, &done, this);
+	}
+	device await_resume() { return device(dev_); }
+
+private:
+	static void done(blz_dev* dev, int, void* user)
+	{
+		auto* a = static_cast<connect_awaiter*>(user);
+		a->dev_ = dev;
+		detail::post(a->node_);
+	}
+
+	blz* ctx_;
+	const char* mac_;
+	enum blz_addr_type atype_;
+	detail::ready_node node_;
+	blz_dev* dev_ = nullptr;
+};
+
+class context
+{
+public:
+	context() = default;
+	explicit context(blz* ctx) : h_(ctx) {}
+
+	/** see blz_init() */
+	static context init(const char* adapter = "hci0")
+	{
+		return context(blz_init(adapter));
+	}
+
+	static context init_private(const char* adapter = "hci0")
+	{
+		return context(blz_init_private(adapter));
+	}
+
+	static context init_address(const char* address,
+								const char* adapter = "hci0")
+	{
+		return context(blz_init_address(address, adapter));
+	}
+
+	blz* get() const { return h_.get(); }
+	blz* release() { return h_.release(); }
+	explicit operator bool() const { return h_ != nullptr; }
+
+	device connect(const char* mac,
+				   enum blz_addr_type atype = BLZ_ADDR_UNKNOWN) const
+	{
+		return device(blz_connect(get(), mac, atype));
+	}
+
+	connect_awaiter async_connect(const char* mac,
+								  enum blz_addr_type atype = BLZ_ADDR_UNKNOWN)
+		const
+	{
+		return connect_awaiter(get(), mac, atype);
+	}
+
+	/** f(std::span<const uint8_t, 6> mac, blz_addr_type, int8_t rssi,
+	 *   std::span<const std::byte> data) */
+	template <class F> bool known_devices(F&& f) const
+	{
+		using T = std::remove_reference_t<F>;
+		return blz_known_devices(get(), &scan_fn<T>,
+								 const_cast<void*>(static_cast<const void*>(
+									 std::addressof(f))));
+	}
+
+	/** f as for known_devices(), it must stay alive until scan_stop() */
+	template <class F> bool scan_start(F& f) const
+	{
+		return blz_scan_start(get(), &scan_fn<F>, &f);
+	}
+
+	template <auto Fn, class T> bool scan_start(T* obj) const
+	{
+		return blz_scan_start(get(), &scan_mem<Fn, T>, obj);
+	}
+
+	bool scan_stop() const { return blz_scan_stop(get()); }
+
+	/** blz_loop() and then resumes the coroutines it has completed */
+	void loop(uint64_t timeout_us) const
+	{
+		blz_loop(get(), timeout_us);
+		run_ready();
+	}
+
+	/** returns false on timeout. Doesn't resume coroutines, as it may be
+	 * called from one */
+	bool loop_until(bool& check, uint32_t timeout_ms) const
+	{
+		return blz_loop_timeout(get(), &check, timeout_ms) == 0;
+	}
+
+	int fd() const { return blz_get_fd(get()); }
+
+private:
+	template <class T>
+	static void scan_fn(const uint8_t* mac, enum blz_addr_type atype,
+						int8_t rssi, const uint8_t* data, size_t len,
+						void* user)
+	{
+		(*static_cast<T*>(user))(std::span<const uint8_t, 6>(mac, 6), atype,
+								 rssi, detail::bytes(data, len));
+	}
+
+	template <auto Fn, class T>
+	static void scan_mem(const uint8_t* mac, enum blz_addr_type atype,
+						 int8_t rssi, const uint8_t* data, size_t len,
+						 void* user)
+	{
+		(static_cast<T*>(user)->*Fn)(std::span<const uint8_t, 6>(mac, 6),
+									 atype, rssi, detail::bytes(data, len));
+	}
+
+	detail::handle<blz, blz_fini> h_;
+};
+
+} // namespace blzpp
+
+#endif
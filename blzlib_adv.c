@@ -0,0 +1,465 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/*
+ * An advertisement is a LEAdvertisement1 object which BlueZ reads when it
+ * is registered. BlueZ also follows PropertiesChanged of the data
+ * properties and updates the advertising data in the controller, so a new
+ * payload doesn't need a new registration, which takes much longer.
+ *
+ * Changes are batched: the first one after a quiet interval is sent right
+ * away, later ones within the interval only mark what changed and one
+ * signal with the latest values is sent when it has passed, from
+ * blz_loop() like the retries of operations.
+ */
+
+#define ADV_PATH	 "/org/blzlib/advertisement"
+#define ADV_DATA_MAX 4	/* entries of manufacturer and service data */
+#define ADV_LEN_MAX	 31 /* legacy advertising PDU */
+
+enum adv_prop {
+	ADV_MANUF = 0x01,
+	ADV_SERV_DATA = 0x02,
+	ADV_UUIDS = 0x04,
+	ADV_NAME = 0x08,
+};
+
+struct adv_data {
+	const char* uuid; /* interned, service data */
+	uint16_t company; /* manufacturer data */
+	size_t len;
+	uint8_t data[ADV_LEN_MAX];
+};
+
+struct blz_adv {
+	blz* ctx;
+	struct blz_adv* next; /* ctx->advs */
+	char path[DBUS_PATH_MAX_LEN];
+	sd_bus_slot* slot;
+	bool connectable;
+	bool registered;
+	char name[NAME_STR_LEN];
+	const char* uuids[ADV_DATA_MAX]; /* interned */
+	size_t num_uuids;
+	struct adv_data manuf[ADV_DATA_MAX];
+	size_t num_manuf;
+	struct adv_data serv_data[ADV_DATA_MAX];
+	size_t num_serv_data;
+	unsigned dirty; /* enum adv_prop */
+	uint64_t interval_us;
+	uint64_t update_at; /* 0 if no update is due */
+	uint64_t last_update;
+	uint64_t registered_at;
+	struct blz_adv_stats stats;
+};
+
+static int adv_get_type(sd_bus* bus, const char* path, const char* intf,
+						const char* prop, sd_bus_message* reply, void* user,
+						sd_bus_error* err)
+{
+	blz_adv* adv = user;
+	return sd_bus_message_append(reply, "s",
+								 adv->connectable ? "peripheral" : "broadcast");
+}
+
+static int adv_get_name(sd_bus* bus, const char* path, const char* intf,
+						const char* prop, sd_bus_message* reply, void* user,
+						sd_bus_error* err)
+{
+	blz_adv* adv = user;
+	return sd_bus_message_append(reply, "s", adv->name);
+}
+
+static int adv_get_uuids(sd_bus* bus, const char* path, const char* intf,
+						 const char* prop, sd_bus_message* reply, void* user,
+						 sd_bus_error* err)
+{
+	blz_adv* adv = user;
+
+	int r = sd_bus_message_open_container(reply, 'a', "s");
+	for (size_t i = 0; r >= 0 && i < adv->num_uuids; i++) {
+		r = sd_bus_message_append(reply, "s", adv->uuids[i]);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(reply);
+	}
+	return r;
+}
+
+/** a{qv} of manufacturer data or a{sv} of service data, v is ay */
+static int adv_get_data(sd_bus* bus, const char* path, const char* intf,
+						const char* prop, sd_bus_message* reply, void* user,
+						sd_bus_error* err)
+{
+	blz_adv* adv = user;
+	bool manuf = strcmp(prop, "ManufacturerData") == 0;
+	struct adv_data* d = manuf ? adv->manuf : adv->serv_data;
+	size_t num = manuf ? adv->num_manuf : adv->num_serv_data;
+
+	int r = sd_bus_message_open_container(reply, 'a', manuf ? "{qv}" : "{sv}");
+	for (size_t i = 0; r >= 0 && i < num; i++) {
+		r = sd_bus_message_open_container(reply, 'e', manuf ? "qv" : "sv");
+		if (r >= 0 && manuf) {
+			r = sd_bus_message_append(reply, "q", d[i].company);
+		} else if (r >= 0) {
+			r = sd_bus_message_append(reply, "s", d[i].uuid);
+		}
+		if (r >= 0) {
+			r = sd_bus_message_open_container(reply, 'v', "ay");
+		}
+		if (r >= 0) {
+			r = sd_bus_message_append_array(reply, 'y', d[i].data, d[i].len);
+		}
+		if (r >= 0) {
+			r = sd_bus_message_close_container(reply);
+		}
+		if (r >= 0) {
+			r = sd_bus_message_close_container(reply);
+		}
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(reply);
+	}
+	return r;
+}
+
+static int adv_release(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	blz_adv* adv = user;
+
+	/* removed by BlueZ, e.g. when the adapter was powered off */
+	CLOG_INF(adv->ctx, "BLZ advertisement released");
+	adv->registered = false;
+	adv->update_at = 0;
+	return sd_bus_reply_method_return(m, "");
+}
+
+/* clang-format off */
+static const sd_bus_vtable adv_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("Type", "s", adv_get_type, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("LocalName", "s", adv_get_name, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("ServiceUUIDs", "as", adv_get_uuids, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("ManufacturerData", "a{qv}", adv_get_data, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("ServiceData", "a{sv}", adv_get_data, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_METHOD("Release", "", "", adv_release, 0),
+	SD_BUS_VTABLE_END
+};
+/* clang-format on */
+
+/** one PropertiesChanged with everything that changed since the last one */
+static void adv_send_update(blz_adv* adv, uint64_t now)
+{
+	char* names[5];
+	size_t n = 0;
+
+	if (adv->dirty & ADV_MANUF) {
+		names[n++] = "ManufacturerData";
+	}
+	if (adv->dirty & ADV_SERV_DATA) {
+		names[n++] = "ServiceData";
+	}
+	if (adv->dirty & ADV_UUIDS) {
+		names[n++] = "ServiceUUIDs";
+	}
+	if (adv->dirty & ADV_NAME) {
+		names[n++] = "LocalName";
+	}
+	names[n] = NULL;
+
+	adv->dirty = 0;
+	adv->update_at = 0;
+	adv->last_update = now;
+	if (n == 0) {
+		return;
+	}
+
+	int r = sd_bus_emit_properties_changed_strv(
+		adv->ctx->bus, adv->path, "org.bluez.LEAdvertisement1", names);
+	if (r < 0) {
+		CLOG_ERR(adv->ctx, "BLZ advertisement update failed: %s",
+				 strerror(-r));
+		return;
+	}
+	adv->stats.sent++;
+}
+
+static void adv_changed(blz_adv* adv, unsigned what)
+{
+	adv->dirty |= what;
+	adv->stats.updates++;
+
+	/* before registration BlueZ reads everything anyway */
+	if (!adv->registered || adv->update_at != 0) {
+		return;
+	}
+
+	uint64_t now = now_usec();
+	if (adv->last_update + adv->interval_us <= now) {
+		adv_send_update(adv, now);
+	} else {
+		adv->update_at = adv->last_update + adv->interval_us;
+	}
+}
+
+uint64_t adv_check_updates(blz* ctx)
+{
+	uint64_t now = now_usec();
+	uint64_t next = UINT64_MAX;
+
+	for (blz_adv* adv = ctx->advs; adv != NULL; adv = adv->next) {
+		if (adv->update_at == 0) {
+			continue;
+		}
+		if (adv->update_at <= now) {
+			adv_send_update(adv, now);
+		} else {
+			next = MIN(next, adv->update_at - now);
+		}
+	}
+	return next;
+}
+
+uint64_t adv_next_update(blz* ctx)
+{
+	uint64_t t = UINT64_MAX;
+
+	for (blz_adv* adv = ctx->advs; adv != NULL; adv = adv->next) {
+		if (adv->update_at != 0) {
+			t = MIN(t, adv->update_at);
+		}
+	}
+	return t;
+}
+
+blz_adv* blz_adv_new(blz* ctx, const char* path, bool connectable)
+{
+	if (path == NULL) {
+		path = ADV_PATH;
+	}
+	if (strlen(path) >= DBUS_PATH_MAX_LEN) {
+		CLOG_ERR(ctx, "BLZ advertisement invalid path '%s'", path);
+		return NULL;
+	}
+
+	blz_adv* adv = mem_alloc(ctx, BLZ_MEM_DEVICES, sizeof(struct blz_adv));
+	if (adv == NULL) {
+		CLOG_ERR(ctx, "BLZ advertisement alloc failed");
+		return NULL;
+	}
+
+	int r = sd_bus_add_object_vtable(ctx->bus, &adv->slot, path,
+									 "org.bluez.LEAdvertisement1", adv_vtable,
+									 adv);
+	if (r < 0) {
+		CLOG_ERR(ctx, "BLZ advertisement failed to export: %s", strerror(-r));
+		mem_free(ctx, BLZ_MEM_DEVICES, adv, sizeof(struct blz_adv));
+		return NULL;
+	}
+
+	adv->ctx = ctx;
+	adv->connectable = connectable;
+	strcpy(adv->path, path);
+	adv->next = ctx->advs;
+	ctx->advs = adv;
+	return adv;
+}
+
+bool blz_adv_set_name(blz_adv* adv, const char* name)
+{
+	if (strlen(name) >= NAME_STR_LEN) {
+		CLOG_ERR(adv->ctx, "BLZ advertisement name too long");
+		return false;
+	}
+	strcpy(adv->name, name);
+	adv_changed(adv, ADV_NAME);
+	return true;
+}
+
+bool blz_adv_add_service_uuid(blz_adv* adv, const char* uuid)
+{
+	const char* u = uuid_intern(adv->ctx, uuid);
+
+	if (u == NULL || adv->num_uuids == ADV_DATA_MAX) {
+		CLOG_ERR(adv->ctx, "BLZ advertisement can't add UUID '%s'", uuid);
+		return false;
+	}
+	adv->uuids[adv->num_uuids++] = u;
+	adv_changed(adv, ADV_UUIDS);
+	return true;
+}
+
+/** replaces the entry with the same key or adds one */
+static bool adv_data_set(blz_adv* adv, struct adv_data* d, size_t* num,
+						 const char* uuid, uint16_t company,
+						 const uint8_t* data, size_t len)
+{
+	size_t i;
+
+	if (len > ADV_LEN_MAX) {
+		CLOG_ERR(adv->ctx, "BLZ advertisement data too long");
+		return false;
+	}
+	for (i = 0; i < *num; i++) {
+		if (d[i].uuid == uuid && d[i].company == company) {
+			break;
+		}
+	}
+	if (i == ADV_DATA_MAX) {
+		CLOG_ERR(adv->ctx, "BLZ advertisement has too much data");
+		return false;
+	}
+	if (i == *num) {
+		(*num)++;
+	}
+
+	d[i].uuid = uuid;
+	d[i].company = company;
+	d[i].len = len;
+	memcpy(d[i].data, data, len);
+	return true;
+}
+
+bool blz_adv_set_manufacturer_data(blz_adv* adv, uint16_t company,
+								   const uint8_t* data, size_t len)
+{
+	if (!adv_data_set(adv, adv->manuf, &adv->num_manuf, NULL, company, data,
+					  len)) {
+		return false;
+	}
+	adv_changed(adv, ADV_MANUF);
+	return true;
+}
+
+bool blz_adv_set_service_data(blz_adv* adv, const char* uuid,
+							  const uint8_t* data, size_t len)
+{
+	const char* u = uuid_intern(adv->ctx, uuid);
+
+	if (u == NULL
+		|| !adv_data_set(adv, adv->serv_data, &adv->num_serv_data, u, 0, data,
+						 len)) {
+		return false;
+	}
+	adv_changed(adv, ADV_SERV_DATA);
+	return true;
+}
+
+void blz_adv_set_interval(blz_adv* adv, unsigned ms)
+{
+	adv->interval_us = ms * 1000ULL;
+	if (adv->update_at != 0) {
+		adv->update_at = adv->last_update + adv->interval_us;
+	}
+}
+
+struct adv_wait {
+	blz_adv* adv;
+	bool done;
+	int err;
+};
+
+static int adv_register_cb(sd_bus_message* reply, void* userdata,
+						   sd_bus_error* error)
+{
+	struct adv_wait* w = userdata;
+	const sd_bus_error* err = sd_bus_message_get_error(reply);
+
+	if (err != NULL) {
+		w->err = -sd_bus_message_get_errno(reply);
+		CLOG_ERR(w->adv->ctx, "BLZ failed to register advertisement: %s",
+				 err->message);
+	}
+	w->done = true;
+	return 0;
+}
+
+bool blz_adv_register(blz_adv* adv)
+{
+	struct adv_wait w = {.adv = adv};
+	sd_bus_slot* slot = NULL;
+
+	if (adv->registered) {
+		return true;
+	}
+
+	uint64_t start = now_usec();
+	int r = sd_bus_call_method_async(adv->ctx->bus, &slot, "org.bluez",
+									 adv->ctx->path,
+									 "org.bluez.LEAdvertisingManager1",
+									 "RegisterAdvertisement", adv_register_cb,
+									 &w, "oa{sv}", adv->path, 0);
+	if (r < 0) {
+		CLOG_ERR(adv->ctx, "BLZ failed to register advertisement: %s",
+				 strerror(-r));
+		return false;
+	}
+
+	/* BlueZ reads the properties before it replies */
+	while (!w.done) {
+		blz_loop(adv->ctx, UINT64_MAX);
+	}
+	sd_bus_slot_unref(slot);
+	if (w.err < 0) {
+		return false;
+	}
+
+	adv->registered = true;
+	adv->registered_at = adv->last_update = now_usec();
+	adv->stats.register_us = adv->registered_at - start;
+	adv->dirty = 0;
+	return true;
+}
+
+void blz_adv_get_stats(blz_adv* adv, struct blz_adv_stats* st)
+{
+	*st = adv->stats;
+	if (adv->registered) {
+		uint64_t t = now_usec() - adv->registered_at;
+		st->sent_hz = t > 0 ? st->sent * 1e6 / t : 0;
+	}
+}
+
+void blz_adv_free(blz_adv* adv)
+{
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+
+	if (adv == NULL) {
+		return;
+	}
+
+	if (adv->registered) {
+		int r = sd_bus_call_method(adv->ctx->bus, "org.bluez", adv->ctx->path,
+								   "org.bluez.LEAdvertisingManager1",
+								   "UnregisterAdvertisement", &error, NULL,
+								   "o", adv->path);
+		if (r < 0) {
+			CLOG_DBG(adv->ctx, "BLZ failed to unregister advertisement: %s",
+					 error.message);
+		}
+		sd_bus_error_free(&error);
+	}
+
+	for (blz_adv** p = &adv->ctx->advs; *p != NULL; p = &(*p)->next) {
+		if (*p == adv) {
+			*p = adv->next;
+			break;
+		}
+	}
+	sd_bus_slot_unref(adv->slot);
+	mem_free(adv->ctx, BLZ_MEM_DEVICES, adv, sizeof(struct blz_adv));
+}
@@ -0,0 +1,314 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#ifndef BLZLIB_ASIO_HPP
+#define BLZLIB_ASIO_HPP
+
+/*
+ * Runs a blzlib context on an Asio io_context instead of blz_loop(). The bus
+ * fd is watched with a posix::stream_descriptor and the timeouts of sd-bus
+ * and blz_connect_async() with one steady_timer, so the context is
+ * processed by the threads running the io_context. As a context must only be
+ * used by one thread at a time, use it from one thread or a strand.
+ *
+ *     asio::io_context io;
+ *     auto ctx = blzpp::context::init();
+ *     blzpp::asio_driver drv(io, ctx);
+ *     drv.async_connect(mac, [](std::error_code ec, blzpp::device dev) {});
+ *     io.run();
+ *
+ * Connect, read and write take a completion token, so they work with
+ * callbacks, asio::use_awaitable and asio::use_future. Completion handlers
+ * are posted, they don't run within sd_bus_process() and can use the
+ * blocking functions as well. Notification callbacks and coroutines of
+ * blzlib.hpp are run by the driver too.
+ *
+ * Standalone Asio is used, define BLZPP_BOOST_ASIO before including this for
+ * Boost.Asio.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#include <poll.h>
+#include <time.h>
+
+#ifdef BLZPP_BOOST_ASIO
+#include <boost/asio.hpp>
+#else
+#include <asio.hpp>
+#endif
+
+#include "blzlib.hpp"
+
+namespace blzpp {
+
+#ifdef BLZPP_BOOST_ASIO
+namespace asio = boost::asio;
+using asio_error_code = boost::system::error_code;
+#else
+using asio_error_code = asio::error_code;
+#endif
+
+class asio_driver
+{
+public:
+	using executor_type = asio::io_context::executor_type;
+
+	/** ctx must outlive the driver */
+	asio_driver(asio::io_context& io, const context& ctx)
+		: s_(std::make_shared<state>(io, ctx.get()))
+	{
+		s_->arm(s_);
+	}
+
+	/** stops watching the bus, the fd stays open as it belongs to the
+	 * context. Operations in progress keep the io_context running until
+	 * they complete, at the latest with operation_aborted from blz_fini() */
+	~asio_driver() { s_->close(); }
+
+	asio_driver(const asio_driver&) = delete;
+	asio_driver& operator=(const asio_driver&) = delete;
+
+	executor_type get_executor() { return s_->io.get_executor(); }
+
+	/** call after using the context outside of the completion handlers,
+	 * e.g. with the blocking functions from another handler, so that
+	 * messages which were read or queued by them are processed */
+	void rearm() { s_->arm(s_); }
+
+	/** completes with (error_code, device) */
+	template <class Token>
+	auto async_connect(const char* mac, Token&& token,
+					   enum blz_addr_type atype = BLZ_ADDR_UNKNOWN)
+	{
+		return asio::async_initiate<Token, void(asio_error_code, device)>(
+			[this, mac, atype](auto handler) {
+				using op = connect_op<decltype(handler)>;
+				auto* o = new op(std::move(handler), s_);
+				if (!blz_connect_async(s_->ctx, mac, atype, &op::done, o)) {
+					op::done(nullptr, -EINVAL, o);
+				}
+				s_->arm(s_);
+			},
+			token);
+	}
+
+	/** reads into buf, completes with (error_code, size_t length) where
+	 * length is what was copied into buf */
+	template <class Token>
+	auto async_read(characteristic& ch, asio::mutable_buffer buf,
+					Token&& token)
+	{
+		return asio::async_initiate<Token, void(asio_error_code, size_t)>(
+			[this, &ch, buf](auto handler) {
+				using op = read_op<decltype(handler)>;
+				auto* o = new op(std::move(handler), s_, buf);
+				if (!blz_char_read_async(ch.get(), &op::done, o)) {
+					op::done(ch.get(), -EINVAL, nullptr, 0, o);
+				}
+				s_->arm(s_);
+			},
+			token);
+	}
+
+	/** write with response, completes with (error_code) */
+	template <class Token>
+	auto async_write(characteristic& ch, asio::const_buffer buf,
+					 Token&& token)
+	{
+		return asio::async_initiate<Token, void(asio_error_code)>(
+			[this, &ch, buf](auto handler) {
+				using op = write_op<decltype(handler)>;
+				auto* o = new op(std::move(handler), s_);
+				auto p = static_cast<const uint8_t*>(buf.data());
+				if (!blz_char_write_async(ch.get(), p, buf.size(), &op::done,
+										  o)) {
+					op::done(ch.get(), -EINVAL, o);
+				}
+				s_->arm(s_);
+			},
+			token);
+	}
+
+	/** the socket of blz_char_write_fd_acquire() for write without
+	 * response with async_write_some(), one packet per write. Closed by
+	 * the descriptor */
+	asio::posix::stream_descriptor acquire_write(characteristic& ch)
+	{
+		asio::posix::stream_descriptor sd(s_->io);
+		int fd = ch.write_fd_acquire();
+		if (fd >= 0) {
+			sd.assign(fd);
+		}
+		return sd;
+	}
+
+private:
+	struct state {
+		asio::io_context& io;
+		blz* ctx;
+		asio::posix::stream_descriptor sd;
+		asio::steady_timer timer;
+		bool reading = false;
+		bool writing = false;
+		bool closed = false;
+
+		state(asio::io_context& io, blz* ctx)
+			: io(io), ctx(ctx), sd(io, blz_get_fd(ctx)), timer(io)
+		{
+		}
+
+		void close()
+		{
+			closed = true;
+			timer.cancel();
+			sd.cancel();
+			/* the fd belongs to sd-bus */
+			sd.release();
+		}
+
+		void process()
+		{
+			blz_process(ctx);
+			run_ready();
+		}
+
+		/** waits for what sd-bus needs next, handlers keep the state */
+		void arm(const std::shared_ptr<state>& self)
+		{
+			if (closed) {
+				return;
+			}
+
+			int ev = blz_get_events(ctx);
+			if ((ev & POLLIN) && !reading) {
+				reading = true;
+				sd.async_wait(asio::posix::stream_descriptor::wait_read,
+							  [self](const asio_error_code& ec) {
+								  self->reading = false;
+								  self->ready(self, ec);
+							  });
+			}
+			if ((ev & POLLOUT) && !writing) {
+				writing = true;
+				sd.async_wait(asio::posix::stream_descriptor::wait_write,
+							  [self](const asio_error_code& ec) {
+								  self->writing = false;
+								  self->ready(self, ec);
+							  });
+			}
+
+			/* CLOCK_MONOTONIC, the same as steady_clock on Linux */
+			uint64_t t = blz_get_timeout(ctx);
+			if (t == UINT64_MAX) {
+				timer.cancel();
+				return;
+			}
+			timer.expires_at(asio::steady_timer::time_point(
+				std::chrono::microseconds(t)));
+			timer.async_wait([self](const asio_error_code& ec) {
+				/* aborted when expires_at() is called again */
+				if (ec != asio::error::operation_aborted) {
+					self->ready(self, ec);
+				}
+			});
+		}
+
+		void ready(const std::shared_ptr<state>& self,
+				   const asio_error_code& ec)
+		{
+			if (closed || ec == asio::error::operation_aborted) {
+				return;
+			}
+			process();
+			arm(self);
+		}
+	};
+
+	/* completion of the C callbacks: the handler is posted to its
+	 * executor, afterwards the bus is waited for again as the handler may
+	 * have queued messages or read some with a blocking call */
+	template <class Handler> struct op_base {
+		Handler handler;
+		std::shared_ptr<state> s;
+		asio::executor_work_guard<executor_type> work;
+
+		op_base(Handler&& h, const std::shared_ptr<state>& st)
+			: handler(std::move(h)), s(st), work(st->io.get_executor())
+		{
+		}
+
+		template <class Op, class... Args>
+		static void complete(Op* o, Args&&... args)
+		{
+			auto ex = asio::get_associated_executor(o->handler,
+													o->work.get_executor());
+			asio::post(ex, [h = std::move(o->handler), s = o->s,
+							... args = std::forward<Args>(args)]() mutable {
+				std::move(h)(std::move(args)...);
+				s->arm(s);
+			});
+			delete o;
+		}
+	};
+
+	static asio_error_code errc(int err)
+	{
+		return asio_error_code(-err, asio::error::get_system_category());
+	}
+
+	template <class Handler> struct connect_op : op_base<Handler> {
+		using op_base<Handler>::op_base;
+
+		static void done(blz_dev* dev, int err, void* user)
+		{
+			auto* o = static_cast<connect_op*>(user);
+			op_base<Handler>::complete(o, errc(dev ? 0 : err ? err : -EIO),
+									   device(dev));
+		}
+	};
+
+	template <class Handler> struct read_op : op_base<Handler> {
+		asio::mutable_buffer buf;
+
+		read_op(Handler&& h, const std::shared_ptr<state>& st,
+				asio::mutable_buffer b)
+			: op_base<Handler>(std::move(h), st), buf(b)
+		{
+		}
+
+		static void done(blz_char*, int err, const uint8_t* data, size_t len,
+						 void* user)
+		{
+			auto* o = static_cast<read_op*>(user);
+			size_t n = len < o->buf.size() ? len : o->buf.size();
+			if (err == 0 && n > 0) {
+				std::memcpy(o->buf.data(), data, n);
+			}
+			op_base<Handler>::complete(o, errc(err), err == 0 ? n : 0);
+		}
+	};
+
+	template <class Handler> struct write_op : op_base<Handler> {
+		using op_base<Handler>::op_base;
+
+		static void done(blz_char*, int err, void* user)
+		{
+			op_base<Handler>::complete(static_cast<write_op*>(user),
+									   errc(err));
+		}
+	};
+
+	std::shared_ptr<state> s_;
+};
+
+} // namespace blzpp
+
+#endif
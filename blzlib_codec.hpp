@@ -0,0 +1,455 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#ifndef BLZLIB_CODEC_HPP
+#define BLZLIB_CODEC_HPP
+
+/*
+ * Characteristic payload codecs from a compile time schema. A schema lists
+ * the members of a struct and their wire format in order:
+ *
+ *     struct hrm {
+ *         uint8_t flags;
+ *         uint16_t bpm;
+ *         uint16_t energy;
+ *         uint8_t rr_count;
+ *         std::array<uint16_t, 9> rr;
+ *     };
+ *
+ *     using hrm_codec = blzpp::codec::schema<
+ *         field<&hrm::flags, u8>,
+ *         field<&hrm::bpm, choose<&hrm::flags, 0x01, u16le, u8>>,
+ *         when<&hrm::flags, 0x08, field<&hrm::energy, u16le>>,
+ *         repeat<&hrm::rr, &hrm::rr_count, u16le, when_set<&hrm::flags, 0x10>>>;
+ *
+ *     hrm v;
+ *     if (hrm_codec::decode(data, v)) ...
+ *
+ * decode() and encode() are folds over the items, so the compiler emits
+ * straight-line code for the schema: there is no table or loop interpreting
+ * it at runtime (except for repeat<>), and nothing is allocated, so they
+ * can be used directly in notification callbacks. decode() returns false if
+ * the payload is too short, encode() returns the length written or 0 if the
+ * buffer is too small.
+ *
+ * Formats (the type of a value on the wire):
+ *   u8 u16le u16be u24le u32le u32be u64le s8 s16le s16be s32le...
+ *       unsigned and signed integers of 1 to 8 bytes in either byte order
+ *   sfloat, float32   IEEE 11073-20601 16 bit SFLOAT and 32 bit FLOAT, as
+ *                     used by the health profiles (to float and double)
+ *
+ * Items (what the schema consists of):
+ *   field<&S::m, Format>           one value
+ *   bits<Format, sub<&S::m, Shift, Width>...>
+ *                                  packed bitfields of one integer
+ *   when<&S::flags, Mask, Items...>
+ *                                  Items only present if flags & Mask
+ *   choose<&S::flags, Mask, FormatSet, FormatClear>
+ *                                  a format selected by a flag
+ *   repeat<&S::array, &S::count, Format[, Cond]>
+ *                                  the rest of the payload as values, up to
+ *                                  the size of the array
+ *
+ * Flags must be decoded before the items depending on them.
+ */
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <type_traits>
+
+namespace blzpp::codec {
+
+namespace detail {
+
+template <class M> struct member_traits;
+
+template <class S, class T> struct member_traits<T S::*> {
+	using owner = S;
+	using type = T;
+};
+
+template <auto M> using owner_t = typename member_traits<decltype(M)>::owner;
+
+/** m * 10^e for the exponent range of IEEE 11073 SFLOAT and FLOAT. Negative
+ * exponents divide, as 10^-e is exact in a double up to 10^22 and the result
+ * is rounded once */
+constexpr std::array<double, 129> make_pow10()
+{
+	std::array<double, 129> t{};
+	double p = 1;
+	for (int i = 0; i <= 128; i++) {
+		t[i] = p;
+		p *= 10;
+	}
+	return t;
+}
+
+inline constexpr std::array<double, 129> pow10 = make_pow10();
+
+inline double scale10(double m, int e)
+{
+	return e >= 0 ? m * pow10[e] : m / pow10[-e];
+}
+
+} // namespace detail
+
+/* --- formats --- */
+
+enum class endian { little, big };
+
+template <class T, size_t N, endian E> struct integer {
+	static_assert(N >= 1 && N <= sizeof(T));
+	using value_type = T;
+	static constexpr size_t size = N;
+
+	static T get(const uint8_t* p)
+	{
+		using U = std::make_unsigned_t<T>;
+		U v = 0;
+		for (size_t i = 0; i < N; i++) {
+			size_t b = E == endian::little ? i : N - 1 - i;
+			v |= U(p[b]) << (8 * i);
+		}
+		/* sign extend values narrower than T, e.g. s24 */
+		if constexpr (std::is_signed_v<T> && N < sizeof(T)) {
+			U m = U(1) << (8 * N - 1);
+			v = (v ^ m) - m;
+		}
+		return T(v);
+	}
+
+	static void put(uint8_t* p, T v)
+	{
+		using U = std::make_unsigned_t<T>;
+		for (size_t i = 0; i < N; i++) {
+			size_t b = E == endian::little ? i : N - 1 - i;
+			p[b] = uint8_t(U(v) >> (8 * i));
+		}
+	}
+};
+
+using u8 = integer<uint8_t, 1, endian::little>;
+using s8 = integer<int8_t, 1, endian::little>;
+using u16le = integer<uint16_t, 2, endian::little>;
+using u16be = integer<uint16_t, 2, endian::big>;
+using s16le = integer<int16_t, 2, endian::little>;
+using s16be = integer<int16_t, 2, endian::big>;
+using u24le = integer<uint32_t, 3, endian::little>;
+using u24be = integer<uint32_t, 3, endian::big>;
+using s24le = integer<int32_t, 3, endian::little>;
+using u32le = integer<uint32_t, 4, endian::little>;
+using u32be = integer<uint32_t, 4, endian::big>;
+using s32le = integer<int32_t, 4, endian::little>;
+using s32be = integer<int32_t, 4, endian::big>;
+using u48le = integer<uint64_t, 6, endian::little>;
+using u64le = integer<uint64_t, 8, endian::little>;
+using s64le = integer<int64_t, 8, endian::little>;
+
+/** IEEE 11073 16 bit SFLOAT: 4 bit exponent, 12 bit mantissa (base 10).
+ * NaN, NRes and reserved decode to NaN, +/-INFINITY to infinity */
+struct sfloat {
+	using value_type = float;
+	static constexpr size_t size = 2;
+
+	static float get(const uint8_t* p)
+	{
+		uint16_t raw = p[0] | p[1] << 8;
+		/* special values have exponent 0 */
+		if (raw >= 0x07fe && raw <= 0x0802) {
+			if (raw == 0x07fe) {
+				return std::numeric_limits<float>::infinity();
+			} else if (raw == 0x0802) {
+				return -std::numeric_limits<float>::infinity();
+			}
+			return std::numeric_limits<float>::quiet_NaN();
+		}
+		int m = ((raw & 0x0fff) ^ 0x800) - 0x800;
+		int e = int8_t(raw >> 8) >> 4;
+		return float(detail::scale10(m, e));
+	}
+
+	static void put(uint8_t* p, float v)
+	{
+		uint16_t raw = 0x07ff;
+		if (std::isinf(v)) {
+			raw = v > 0 ? 0x07fe : 0x0802;
+		} else if (!std::isnan(v)) {
+			/* smallest exponent whose mantissa fits keeps most digits.
+			 * Mantissas of special values are reserved at exponent 0 */
+			for (int e = -8; e <= 7; e++) {
+				double m = std::nearbyint(detail::scale10(v, -e));
+				if (m >= -2048 && m <= 2047
+					&& (e != 0 || (m > -2046 && m < 2046))) {
+					raw = (e & 0xf) << 12 | (int(m) & 0x0fff);
+					break;
+				}
+			}
+		}
+		p[0] = raw;
+		p[1] = raw >> 8;
+	}
+};
+
+/** IEEE 11073 32 bit FLOAT: 8 bit exponent, 24 bit mantissa (base 10) */
+struct float32 {
+	using value_type = double;
+	static constexpr size_t size = 4;
+
+	static double get(const uint8_t* p)
+	{
+		int32_t m = p[0] | p[1] << 8 | p[2] << 16;
+		if (p[3] == 0 && m >= 0x7ffffe && m <= 0x800002) {
+			if (m == 0x7ffffe) {
+				return std::numeric_limits<double>::infinity();
+			} else if (m == 0x800002) {
+				return -std::numeric_limits<double>::infinity();
+			}
+			return std::numeric_limits<double>::quiet_NaN();
+		}
+		m = (m ^ 0x800000) - 0x800000;
+		return detail::scale10(m, int8_t(p[3]));
+	}
+
+	static void put(uint8_t* p, double v)
+	{
+		uint32_t raw = 0x007fffff;
+		if (std::isinf(v)) {
+			raw = v > 0 ? 0x007ffffe : 0x00800002;
+		} else if (v == 0) {
+			raw = 0;
+		} else if (!std::isnan(v)) {
+			/* start near the exponent which leaves 7 digits */
+			int e0 = int(std::floor(std::log10(std::fabs(v)))) - 7;
+			for (int e = e0 < -128 ? -128 : e0; e <= 127; e++) {
+				double m = std::nearbyint(detail::scale10(v, -e));
+				if (m >= -0x800000 && m <= 0x7fffff
+					&& (e != 0 || (m > -0x7ffffe && m < 0x7ffffe))) {
+					raw = uint32_t(e & 0xff) << 24
+						  | (uint32_t(int32_t(m)) & 0xffffff);
+					break;
+				}
+			}
+		}
+		p[0] = raw;
+		p[1] = raw >> 8;
+		p[2] = raw >> 16;
+		p[3] = raw >> 24;
+	}
+};
+
+/* --- items --- */
+
+template <auto M, class F> struct field {
+	using owner = detail::owner_t<M>;
+	static constexpr size_t max_size = F::size;
+
+	static bool decode(const uint8_t* p, size_t len, size_t& off, owner& s)
+	{
+		if (len - off < F::size) {
+			return false;
+		}
+		s.*M = F::get(p + off);
+		off += F::size;
+		return true;
+	}
+
+	static bool encode(const owner& s, uint8_t* p, size_t cap, size_t& off)
+	{
+		if (cap - off < F::size) {
+			return false;
+		}
+		F::put(p + off, s.*M);
+		off += F::size;
+		return true;
+	}
+};
+
+/** Width bits at Shift of the integer of bits<> */
+template <auto M, unsigned Shift, unsigned Width> struct sub {
+	using owner = detail::owner_t<M>;
+	static constexpr uint64_t mask = (Width < 64 ? (1ULL << Width) : 0) - 1;
+
+	static void get(uint64_t v, owner& s)
+	{
+		s.*M = static_cast<typename detail::member_traits<decltype(M)>::type>(
+			(v >> Shift) & mask);
+	}
+
+	static uint64_t put(const owner& s)
+	{
+		return (uint64_t(s.*M) & mask) << Shift;
+	}
+};
+
+template <class F, class... Subs> struct bits {
+	using owner = std::common_type_t<typename Subs::owner...>;
+	static constexpr size_t max_size = F::size;
+
+	static bool decode(const uint8_t* p, size_t len, size_t& off, owner& s)
+	{
+		if (len - off < F::size) {
+			return false;
+		}
+		uint64_t v = F::get(p + off);
+		(Subs::get(v, s), ...);
+		off += F::size;
+		return true;
+	}
+
+	static bool encode(const owner& s, uint8_t* p, size_t cap, size_t& off)
+	{
+		if (cap - off < F::size) {
+			return false;
+		}
+		F::put(p + off, typename F::value_type((Subs::put(s) | ... | 0)));
+		off += F::size;
+		return true;
+	}
+};
+
+template <auto Flags, uint64_t Mask, class... Items> struct when {
+	using owner = detail::owner_t<Flags>;
+	static constexpr size_t max_size = (Items::max_size + ... + 0);
+
+	static bool decode(const uint8_t* p, size_t len, size_t& off, owner& s)
+	{
+		if (!(uint64_t(s.*Flags) & Mask)) {
+			return true;
+		}
+		return (Items::decode(p, len, off, s) && ...);
+	}
+
+	static bool encode(const owner& s, uint8_t* p, size_t cap, size_t& off)
+	{
+		if (!(uint64_t(s.*Flags) & Mask)) {
+			return true;
+		}
+		return (Items::encode(s, p, cap, off) && ...);
+	}
+};
+
+/** format FSet if flags & Mask, otherwise FClear. For field<> */
+template <auto Flags, uint64_t Mask, class FSet, class FClear> struct choose {
+	using owner = detail::owner_t<Flags>;
+	using value_type = std::common_type_t<typename FSet::value_type,
+										  typename FClear::value_type>;
+	static constexpr size_t size = FSet::size > FClear::size ? FSet::size
+															  : FClear::size;
+};
+
+template <auto M, auto Flags, uint64_t Mask, class FSet, class FClear>
+struct field<M, choose<Flags, Mask, FSet, FClear>> {
+	using owner = detail::owner_t<M>;
+	static constexpr size_t max_size = choose<Flags, Mask, FSet, FClear>::size;
+
+	static bool decode(const uint8_t* p, size_t len, size_t& off, owner& s)
+	{
+		if (uint64_t(s.*Flags) & Mask) {
+			return field<M, FSet>::decode(p, len, off, s);
+		}
+		return field<M, FClear>::decode(p, len, off, s);
+	}
+
+	static bool encode(const owner& s, uint8_t* p, size_t cap, size_t& off)
+	{
+		if (uint64_t(s.*Flags) & Mask) {
+			return field<M, FSet>::encode(s, p, cap, off);
+		}
+		return field<M, FClear>::encode(s, p, cap, off);
+	}
+};
+
+/** condition for repeat<> */
+template <auto Flags, uint64_t Mask> struct when_set {
+	template <class S> static bool test(const S& s)
+	{
+		return uint64_t(s.*Flags) & Mask;
+	}
+};
+
+struct always {
+	template <class S> static bool test(const S&) { return true; }
+};
+
+/** remaining bytes as values of F into the std::array member A, their
+ * number into C. Values which don't fit into A are ignored */
+template <auto A, auto C, class F, class Cond = always> struct repeat {
+	using owner = detail::owner_t<A>;
+	using array_type = typename detail::member_traits<decltype(A)>::type;
+	static constexpr size_t capacity = std::tuple_size_v<array_type>;
+	static constexpr size_t max_size = capacity * F::size;
+
+	static bool decode(const uint8_t* p, size_t len, size_t& off, owner& s)
+	{
+		size_t n = 0;
+		if (Cond::test(s)) {
+			for (; n < capacity && len - off >= F::size; n++) {
+				(s.*A)[n] = F::get(p + off);
+				off += F::size;
+			}
+			/* rest of the payload is consumed */
+			off = len;
+		}
+		s.*C = n;
+		return true;
+	}
+
+	static bool encode(const owner& s, uint8_t* p, size_t cap, size_t& off)
+	{
+		if (!Cond::test(s)) {
+			return true;
+		}
+		size_t n = s.*C < capacity ? s.*C : capacity;
+		if (cap - off < n * F::size) {
+			return false;
+		}
+		for (size_t i = 0; i < n; i++) {
+			F::put(p + off, (s.*A)[i]);
+			off += F::size;
+		}
+		return true;
+	}
+};
+
+/* --- schema --- */
+
+template <class... Items> struct schema {
+	using value_type = std::common_type_t<typename Items::owner...>;
+	/** largest encoded size, for encode buffers */
+	static constexpr size_t max_size = (Items::max_size + ... + 0);
+
+	static bool decode(std::span<const std::byte> in, value_type& out)
+	{
+		auto p = reinterpret_cast<const uint8_t*>(in.data());
+		size_t off = 0;
+		return (Items::decode(p, in.size(), off, out) && ...);
+	}
+
+	static bool decode(const uint8_t* data, size_t len, value_type& out)
+	{
+		size_t off = 0;
+		return (Items::decode(data, len, off, out) && ...);
+	}
+
+	static size_t encode(const value_type& in, std::span<std::byte> out)
+	{
+		auto p = reinterpret_cast<uint8_t*>(out.data());
+		size_t off = 0;
+		if (!(Items::encode(in, p, out.size(), off) && ...)) {
+			return 0;
+		}
+		return off;
+	}
+};
+
+} // namespace blzpp::codec
+
+#endif
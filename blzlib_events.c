@@ -0,0 +1,160 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/*
+ * The ring is allocated once by blz_events_enable(). Events are pushed from
+ * the places which would otherwise call a callback, inside sd_bus_process(),
+ * and copied out by blz_poll_events(). If it is full, new events are dropped
+ * and counted, which is reported with an error event at the next poll.
+ */
+
+bool blz_events_enable(blz* ctx, size_t size)
+{
+	struct event_ring* ring = &ctx->events;
+
+	if (ring->ev != NULL) {
+		CLOG_ERR(ctx, "BLZ event ring already enabled");
+		return false;
+	}
+	if (size == 0) {
+		size = BLZ_EVENTS_DEFAULT;
+	}
+
+	ring->ev = mem_alloc(ctx, BLZ_MEM_QUEUES, size * sizeof(struct blz_event));
+	if (ring->ev == NULL) {
+		CLOG_ERR(ctx, "BLZ event ring alloc failed");
+		return false;
+	}
+	ring->size = size;
+	ring->head = ring->count = 0;
+	ring->dropped = 0;
+	return true;
+}
+
+void events_free(blz* ctx)
+{
+	struct event_ring* ring = &ctx->events;
+
+	if (ring->ev != NULL) {
+		mem_free(ctx, BLZ_MEM_QUEUES, ring->ev,
+				 ring->size * sizeof(struct blz_event));
+		memset(ring, 0, sizeof(*ring));
+	}
+}
+
+struct blz_event* event_push(blz* ctx, enum blz_event_type type, int err,
+							 void* user)
+{
+	struct event_ring* ring = &ctx->events;
+
+	if (ring->ev == NULL) {
+		return NULL;
+	}
+	if (ring->count == ring->size) {
+		ring->dropped++;
+		return NULL;
+	}
+
+	struct blz_event* ev = &ring->ev[(ring->head + ring->count) % ring->size];
+	ring->count++;
+
+	/* only the header, data is copied by event_set_data() */
+	memset(ev, 0, offsetof(struct blz_event, data));
+	ev->type = type;
+	ev->err = err;
+	ev->user = user;
+	return ev;
+}
+
+void event_set_data(struct blz_event* ev, const void* data, size_t len)
+{
+	ev->len = len;
+	if (data != NULL) {
+		memcpy(ev->data, data, MIN(len, BLZ_EVENT_DATA_MAX));
+	}
+}
+
+void events_forget(blz* ctx, const void* obj)
+{
+	struct event_ring* ring = &ctx->events;
+
+	for (size_t i = 0; i < ring->count; i++) {
+		struct blz_event* ev = &ring->ev[(ring->head + i) % ring->size];
+		if ((const void*)ev->dev == obj) {
+			ev->dev = NULL;
+		}
+		if ((const void*)ev->ch == obj) {
+			ev->ch = NULL;
+		}
+	}
+}
+
+/** copies out up to max events, the first one reports dropped events */
+static size_t events_pop(blz* ctx, struct blz_event* out, size_t max)
+{
+	struct event_ring* ring = &ctx->events;
+	size_t n = 0;
+
+	if (ring->dropped > 0 && max > 0) {
+		CLOG_WARN(ctx, "BLZ event ring full, %lu events dropped",
+				  ring->dropped);
+		memset(&out[n], 0, offsetof(struct blz_event, data));
+		out[n].type = BLZ_EVENT_ERROR;
+		out[n].err = -ENOBUFS;
+		out[n].len = ring->dropped;
+		ring->dropped = 0;
+		n++;
+	}
+
+	while (n < max && ring->count > 0) {
+		struct blz_event* ev = &ring->ev[ring->head];
+		memcpy(&out[n], ev,
+			   offsetof(struct blz_event, data)
+				   + MIN(ev->len, BLZ_EVENT_DATA_MAX));
+		ring->head = (ring->head + 1) % ring->size;
+		ring->count--;
+		n++;
+	}
+	return n;
+}
+
+int blz_poll_events(blz* ctx, struct blz_event* out, size_t max,
+					uint64_t timeout_us)
+{
+	struct event_ring* ring = &ctx->events;
+
+	if (ring->ev == NULL) {
+		CLOG_ERR(ctx, "BLZ event ring not enabled");
+		return -EINVAL;
+	}
+
+	uint64_t now = now_usec();
+	uint64_t deadline = timeout_us == UINT64_MAX ? UINT64_MAX
+												 : now + timeout_us;
+
+	/* everything which is already there goes into this batch */
+	int r = blz_process(ctx);
+	while (r >= 0 && ring->count == 0 && ring->dropped == 0 && now < deadline) {
+		blz_loop(ctx, deadline - now);
+		r = blz_process(ctx);
+		now = now_usec();
+	}
+	if (r < 0) {
+		return r;
+	}
+	return events_pop(ctx, out, max);
+}
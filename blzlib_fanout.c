@@ -0,0 +1,270 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/*
+ * The payload is copied once into the fan-out, every write is a separate
+ * D-Bus call to the path of its characteristic. A slot per characteristic
+ * points back to the fan-out, so the write callback knows which result it
+ * completes. The fan-out finishes when the last write has completed.
+ *
+ * Writes start in the order of the health of the devices, so with a limit
+ * in flight a bad link doesn't delay the healthy ones.
+ */
+
+struct fanout;
+
+struct fanout_slot {
+	struct fanout* f;
+	size_t idx;
+	int score; /* of the device, for the order */
+};
+
+struct fanout {
+	blz* ctx;
+	blz_char* const* chars;
+	size_t count;
+	struct blz_fanout_result* res;
+	unsigned max_inflight;
+	size_t next;
+	size_t inflight;
+	size_t failed;
+	blz_fanout_cb_t cb;
+	void* user;
+	uint64_t start;
+	size_t size;
+	struct fanout_slot* slots;
+	struct fanout_slot** order;
+	uint8_t* data;
+	size_t len;
+};
+
+static uint64_t fanout_elapsed(struct fanout* f)
+{
+	return MAX(now_usec() - f->start, 1);
+}
+
+static void fanout_write_cb(blz_char* ch, int err, void* user);
+
+/** starts writes up to the limit, returns true when all have finished */
+static bool fanout_fill(struct fanout* f)
+{
+	while (f->next < f->count
+		   && (f->max_inflight == 0 || f->inflight < f->max_inflight)) {
+		size_t i = f->order[f->next++]->idx;
+		blz_char* ch = f->chars[i];
+		struct blz_fanout_result* r = &f->res[i];
+		const char* type = NULL;
+
+		r->start_us = fanout_elapsed(f);
+		if (ch == NULL || ch->ctx != f->ctx) {
+			r->err = -EINVAL;
+		} else if (ch->flags & BLZ_CHAR_WRITE) {
+			type = "request";
+		} else if (ch->flags & BLZ_CHAR_WRITE_WITHOUT_RESPONSE) {
+			type = "command";
+		} else {
+			CLOG_ERR(f->ctx, "BLZ characteristic does not support write");
+			r->err = -EOPNOTSUPP;
+		}
+
+		if (type != NULL
+			&& char_write_async(ch, f->data, f->len, type, fanout_write_cb,
+								&f->slots[i])) {
+			f->inflight++;
+			continue;
+		}
+
+		if (r->err == 0) {
+			r->err = -EIO;
+		}
+		r->end_us = r->start_us;
+		f->failed++;
+	}
+	return f->next == f->count && f->inflight == 0;
+}
+
+/** healthiest first, otherwise in the order given */
+static int cmp_slot(const void* a, const void* b)
+{
+	const struct fanout_slot* x = *(const struct fanout_slot* const*)a;
+	const struct fanout_slot* y = *(const struct fanout_slot* const*)b;
+
+	if (x->score != y->score) {
+		return y->score - x->score;
+	}
+	return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+static void fanout_free(struct fanout* f)
+{
+	mem_free(f->ctx, BLZ_MEM_QUEUES, f, f->size);
+}
+
+static void fanout_finish(struct fanout* f)
+{
+	blz_fanout_cb_t cb = f->cb;
+	void* user = f->user;
+	size_t failed = f->failed;
+
+	fanout_free(f);
+	cb(failed, user);
+}
+
+static void fanout_write_cb(blz_char* ch, int err, void* user)
+{
+	struct fanout_slot* s = user;
+	struct fanout* f = s->f;
+	struct blz_fanout_result* r = &f->res[s->idx];
+
+	r->err = err;
+	r->end_us = fanout_elapsed(f);
+	if (err < 0) {
+		f->failed++;
+	}
+	f->inflight--;
+
+	if (fanout_fill(f)) {
+		fanout_finish(f);
+	}
+}
+
+bool blz_char_write_fanout_async(blz* ctx, blz_char* const* chars,
+								 size_t count, const uint8_t* data, size_t len,
+								 unsigned max_inflight,
+								 struct blz_fanout_result* res,
+								 blz_fanout_cb_t cb, void* user)
+{
+	size_t size = sizeof(struct fanout)
+				  + count
+						* (sizeof(struct fanout_slot)
+						   + sizeof(struct fanout_slot*))
+				  + len;
+
+	struct fanout* f = mem_alloc(ctx, BLZ_MEM_QUEUES, size);
+	if (f == NULL) {
+		CLOG_ERR(ctx, "BLZ fan-out alloc failed");
+		return false;
+	}
+
+	f->ctx = ctx;
+	f->chars = chars;
+	f->count = count;
+	f->res = res;
+	f->max_inflight = max_inflight;
+	f->cb = cb;
+	f->user = user;
+	f->size = size;
+	f->slots = (struct fanout_slot*)(f + 1);
+	f->order = (struct fanout_slot**)(f->slots + count);
+	f->data = (uint8_t*)(f->order + count);
+	f->len = len;
+	if (len > 0) {
+		memcpy(f->data, data, len);
+	}
+	memset(res, 0, count * sizeof(struct blz_fanout_result));
+	for (size_t i = 0; i < count; i++) {
+		blz_char* ch = chars[i];
+		f->slots[i].f = f;
+		f->slots[i].idx = i;
+		f->slots[i].score = 100;
+		if (ch != NULL && ch->dev != NULL && ch->dev->health != NULL) {
+			f->slots[i].score = health_score(ch->dev->health);
+		}
+		f->order[i] = &f->slots[i];
+	}
+	qsort(f->order, count, sizeof(struct fanout_slot*), cmp_slot);
+
+	f->start = now_usec();
+	if (fanout_fill(f)) {
+		/* no write could be started, res has the errors */
+		CLOG_ERR(ctx, "BLZ fan-out failed to start any write");
+		fanout_free(f);
+		return false;
+	}
+	return true;
+}
+
+struct fanout_wait {
+	bool done;
+	size_t failed;
+};
+
+static void fanout_wait_cb(size_t failed, void* user)
+{
+	struct fanout_wait* w = user;
+	w->failed = failed;
+	w->done = true;
+}
+
+int blz_char_write_fanout(blz* ctx, blz_char* const* chars, size_t count,
+						  const uint8_t* data, size_t len,
+						  unsigned max_inflight, struct blz_fanout_result* res)
+{
+	struct fanout_wait w = {0};
+
+	if (!blz_char_write_fanout_async(ctx, chars, count, data, len,
+									 max_inflight, res, fanout_wait_cb, &w)) {
+		return -1;
+	}
+
+	/* every write is a call with a timeout */
+	while (!w.done) {
+		blz_loop(ctx, UINT64_MAX);
+	}
+	return w.failed;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+void blz_fanout_stats(const struct blz_fanout_result* res, size_t count,
+					  struct blz_fanout_stats* st)
+{
+	uint64_t* t = malloc(MAX(count, 1) * sizeof(uint64_t));
+	uint64_t lat = 0;
+
+	memset(st, 0, sizeof(*st));
+	for (size_t i = 0; i < count; i++) {
+		if (res[i].err < 0) {
+			st->failed++;
+			continue;
+		}
+		lat += res[i].end_us - res[i].start_us;
+		if (t != NULL) {
+			t[st->ok] = res[i].end_us;
+		}
+		st->ok++;
+	}
+
+	if (st->ok == 0 || t == NULL) {
+		free(t);
+		return;
+	}
+
+	qsort(t, st->ok, sizeof(uint64_t), cmp_u64);
+	st->min_us = t[0];
+	st->p50_us = t[st->ok / 2];
+	st->p90_us = t[MIN(st->ok * 90 / 100, st->ok - 1)];
+	st->p99_us = t[MIN(st->ok * 99 / 100, st->ok - 1)];
+	st->max_us = t[st->ok - 1];
+	st->lat_avg_us = lat / st->ok;
+	free(t);
+}
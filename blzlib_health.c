@@ -0,0 +1,260 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/*
+ * Health is kept per MAC address, from the first connect until blz_fini(),
+ * so it spans connections. Every input is smoothed on its own (moving
+ * averages, a decaying disconnect count, the last operation latencies) and
+ * mapped to 0..1, the score is their weighted sum. Inputs which were never
+ * seen count as good.
+ */
+
+#define EWMA(avg, val, alpha) ((avg) += (alpha) * ((val) - (avg)))
+
+#define DISC_TAU_US	  (3600 * 1000000ULL) /* disconnect count decay */
+#define GAP_FACTOR	  3	  /* notification gap: interval over average */
+#define GAP_SAMPLES	  4	  /* notifications before gaps are detected */
+#define RSSI_GOOD	  -60 /* dBm, full score above */
+#define RSSI_BAD	  -95 /* dBm, zero score below */
+#define LAT_GOOD_US	  100000
+#define LAT_BAD_US	  2000000
+
+static float clamp01(float x)
+{
+	return x < 0 ? 0 : x > 1 ? 1 : x;
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+/** disconnect count decayed to now */
+static float health_disconnects(struct dev_health* h, uint64_t now)
+{
+	if (h->disc_at == 0 || now <= h->disc_at) {
+		return h->disc;
+	}
+	/* 1/(1+t) instead of exp(-t), close enough for a score */
+	return h->disc / (1 + (float)(now - h->disc_at) / DISC_TAU_US);
+}
+
+static int health_calc(struct dev_health* h)
+{
+	float rssi = 1;
+	if (h->rssi_samples > 0) {
+		rssi = clamp01((h->rssi_slow - RSSI_BAD) / (RSSI_GOOD - RSSI_BAD));
+		/* falling by 10 dB halves it */
+		rssi *= 1 - clamp01((h->rssi_slow - h->rssi_fast) / 20);
+	}
+	float disc = 1 / (1 + health_disconnects(h, now_usec()) / 2);
+	float lat = 1 - clamp01((float)((int64_t)h->lat_p90 - LAT_GOOD_US)
+							/ (LAT_BAD_US - LAT_GOOD_US));
+
+	float score = 0.15f * rssi + 0.25f * h->connect_ok + 0.15f * disc
+				  + 0.20f * (1 - h->err_rate) + 0.10f * (1 - h->gap_rate)
+				  + 0.15f * lat;
+	return (int)(score * 100 + 0.5f);
+}
+
+int health_score(struct dev_health* h)
+{
+	/* the disconnect count decays without new input */
+	h->score = health_calc(h);
+	return h->score;
+}
+
+/** recalculates the score and tells the handler about large changes */
+static void health_update(struct dev_health* h, blz_dev* dev)
+{
+	blz* ctx = h->ctx;
+
+	h->score = health_calc(h);
+	if (ctx->health_cb == NULL
+		|| abs(h->score - h->reported) < ctx->health_min_change) {
+		return;
+	}
+	h->reported = h->score;
+
+	uint8_t mac[6];
+	blz_key_to_mac(h->key, mac);
+	ctx->health_cb(mac, dev, h->score, ctx->health_user);
+}
+
+struct dev_health* health_get(blz* ctx, const uint8_t* mac, bool create)
+{
+	blz_mac_key key = blz_mac_to_key(mac);
+
+	for (struct dev_health* h = ctx->health; h != NULL; h = h->next) {
+		if (h->key == key) {
+			return h;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	struct dev_health* h = mem_alloc(ctx, BLZ_MEM_DEVICES,
+									 sizeof(struct dev_health));
+	if (h == NULL) {
+		CLOG_ERR(ctx, "BLZ health alloc failed");
+		return NULL;
+	}
+	h->ctx = ctx;
+	h->key = key;
+	h->connect_ok = 1;
+	h->score = h->reported = health_calc(h);
+	h->next = ctx->health;
+	ctx->health = h;
+	return h;
+}
+
+void health_free_all(blz* ctx)
+{
+	while (ctx->health != NULL) {
+		struct dev_health* h = ctx->health;
+		ctx->health = h->next;
+		mem_free(ctx, BLZ_MEM_DEVICES, h, sizeof(struct dev_health));
+	}
+}
+
+void health_connect(struct dev_health* h, blz_dev* dev, int err)
+{
+	if (h == NULL) {
+		return;
+	}
+	EWMA(h->connect_ok, err < 0 ? 0.0f : 1.0f, 0.3f);
+	health_update(h, dev);
+}
+
+void health_disconnect(struct dev_health* h, blz_dev* dev)
+{
+	if (h == NULL) {
+		return;
+	}
+	uint64_t now = now_usec();
+	h->disc = health_disconnects(h, now) + 1;
+	h->disc_at = now;
+	health_update(h, dev);
+}
+
+void health_rssi(struct dev_health* h, blz_dev* dev, int16_t rssi)
+{
+	if (h == NULL || rssi == 0) {
+		return;
+	}
+	if (h->rssi_samples++ == 0) {
+		h->rssi_fast = h->rssi_slow = rssi;
+	}
+	EWMA(h->rssi_fast, rssi, 0.3f);
+	EWMA(h->rssi_slow, rssi, 0.05f);
+	health_update(h, dev);
+}
+
+void health_op(struct dev_health* h, blz_dev* dev, int err, uint64_t lat_us)
+{
+	uint32_t sorted[HEALTH_LAT_SAMPLES];
+
+	if (h == NULL) {
+		return;
+	}
+	EWMA(h->err_rate, err < 0 ? 1.0f : 0.0f, 0.1f);
+
+	if (err == 0) {
+		h->lat[h->lat_idx++ % HEALTH_LAT_SAMPLES] = MIN(lat_us, UINT32_MAX);
+		size_t n = MIN(h->lat_idx, HEALTH_LAT_SAMPLES);
+		memcpy(sorted, h->lat, n * sizeof(uint32_t));
+		qsort(sorted, n, sizeof(uint32_t), cmp_u32);
+		h->lat_p50 = sorted[n / 2];
+		h->lat_p90 = sorted[MIN(n * 90 / 100, n - 1)];
+		h->lat_max = sorted[n - 1];
+	}
+	health_update(h, dev);
+}
+
+void health_notify(blz_char* ch)
+{
+	struct dev_health* h = ch->dev != NULL ? ch->dev->health : NULL;
+	uint64_t now = now_usec();
+	bool gap = false;
+
+	if (ch->notify_last != 0) {
+		uint64_t interval = now - ch->notify_last;
+		gap = ch->notify_count >= GAP_SAMPLES
+			  && interval > GAP_FACTOR * ch->notify_avg_us;
+		if (ch->notify_count++ == 0) {
+			ch->notify_avg_us = interval;
+		} else if (!gap) {
+			ch->notify_avg_us += ((int64_t)interval - (int64_t)ch->notify_avg_us)
+								 / 8;
+		}
+	}
+	ch->notify_last = now;
+
+	if (h != NULL && ch->notify_count > GAP_SAMPLES) {
+		EWMA(h->gap_rate, gap ? 1.0f : 0.0f, 0.05f);
+		health_update(h, ch->dev);
+	}
+}
+
+static void health_fill(struct dev_health* h, struct blz_health* out)
+{
+	memset(out, 0, sizeof(*out));
+	out->score = health_score(h);
+	if (h->rssi_samples > 0) {
+		out->rssi = (int16_t)h->rssi_slow;
+		out->rssi_trend = (int)(h->rssi_fast - h->rssi_slow);
+	}
+	out->connect_success = h->connect_ok;
+	out->disconnects = health_disconnects(h, now_usec());
+	out->error_rate = h->err_rate;
+	out->notify_gap_rate = h->gap_rate;
+	out->lat_p50_us = h->lat_p50;
+	out->lat_p90_us = h->lat_p90;
+	out->lat_max_us = h->lat_max;
+}
+
+bool blz_get_health(blz* ctx, const uint8_t* mac, struct blz_health* out)
+{
+	struct dev_health* h = health_get(ctx, mac, false);
+	if (h == NULL) {
+		return false;
+	}
+	health_fill(h, out);
+	return true;
+}
+
+bool blz_dev_get_health(blz_dev* dev, struct blz_health* out)
+{
+	if (dev->health == NULL) {
+		return false;
+	}
+	health_fill(dev->health, out);
+	return true;
+}
+
+void blz_set_health_handler(blz* ctx, int min_change, blz_health_cb_t cb,
+							void* user)
+{
+	ctx->health_cb = cb;
+	ctx->health_user = user;
+	ctx->health_min_change = MAX(min_change, 1);
+	for (struct dev_health* h = ctx->health; h != NULL; h = h->next) {
+		h->reported = h->score;
+	}
+}
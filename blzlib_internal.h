@@ -8,23 +8,117 @@
 #ifndef BLZLIB_INTERNAL_H
 #define BLZLIB_INTERNAL_H
 
+#include <sys/types.h>
+
+#include "blzlib_log.h"
+
 #define DBUS_PATH_MAX_LEN	255
 #define UUID_STR_LEN		37
 #define MAC_STR_LEN			18
 #define NAME_STR_LEN		20
 #define CONNECT_TIMEOUT		60 /* sec */
 #define SERV_RESOLV_TIMEOUT 60 /* sec */
+#define OP_RETRY_START		5  /* ms, doubled with every retry */
+#define OP_RETRY_MAX		8  /* retries after org.bluez.Error.InProgress */
+#define DISCONNECT_TIMEOUT	5  /* sec */
+#define FINI_TIMEOUT		2  /* sec, for all calls of blz_fini() */
 
 /* this return value is used to indicate that we found what was searched */
 #define RETURN_FOUND 1000
 
 /* clang-format off */
+struct uuid_chunk;
+
+/* GetManagedObjects reply of dev_objects_async(), NULL on error */
+typedef void (*objects_cb_t)(struct blz_dev* dev, int err,
+							 sd_bus_message* reply, void* user);
+
+/* per context table of interned UUID strings, see blzlib_uuid.c */
+struct uuid_table {
+	char**			   strs;		/* ID -> string */
+	size_t			   count;
+	size_t			   cap;
+	uint32_t*		   hash;		/* ID + 1, 0 is empty */
+	size_t			   hash_size;
+	struct uuid_chunk* chunks;
+};
+
+/* per context memory accounting, see blzlib_mem.c */
+struct blz_mem {
+	size_t used[BLZ_MEM_CAT_MAX];
+	size_t peak[BLZ_MEM_CAT_MAX];
+	size_t limit[BLZ_MEM_CAT_MAX];
+	size_t used_total;
+	size_t peak_total;
+	size_t limit_total;
+	size_t refused;
+	size_t evicted;
+	size_t (*evict[BLZ_MEM_CAT_MAX])(struct blz_context* ctx, size_t need);
+};
+
+#define HEALTH_LAT_SAMPLES 32
+#define HEALTH_POOR		   40 /* score below which one operation at a time */
+
+/* link health of a MAC address, see blzlib_health.c */
+struct dev_health {
+	struct blz_context* ctx;
+	struct dev_health*	next;		/* ctx->health */
+	uint64_t			key;		/* blz_mac_to_key() */
+	int					score;
+	int					reported;	/* last score passed to the handler */
+	float				connect_ok;	/* moving averages of 0 or 1 */
+	float				err_rate;
+	float				gap_rate;
+	float				disc;		/* disconnects, decaying */
+	uint64_t			disc_at;
+	float				rssi_fast;
+	float				rssi_slow;
+	unsigned			rssi_samples;
+	uint32_t			lat[HEALTH_LAT_SAMPLES]; /* usec, ring */
+	size_t				lat_idx;
+	uint32_t			lat_p50;
+	uint32_t			lat_p90;
+	uint32_t			lat_max;
+};
+
+/* blz_events_enable() */
+struct event_ring {
+	struct blz_event* ev;
+	size_t size;
+	size_t head;			/* oldest */
+	size_t count;
+	unsigned long dropped;	/* since the last blz_poll_events() */
+};
+
 struct blz_context {
 	sd_bus*			   bus;
 	char			   path[DBUS_PATH_MAX_LEN];
 	blz_scan_handler_t scan_cb;
 	sd_bus_slot*	   scan_slot;
 	void*              scan_user;
+	struct uuid_table  uuids;
+	struct blz_mem	   mem;
+	sd_bus_message*	   obj_cache;		/* GetManagedObjects reply */
+	size_t			   obj_cache_size;
+	sd_bus_slot*	   obj_slot;
+	blz_log_handler_t  log_cb;
+	void*			   log_user;
+	struct blz_dev*	   connecting;		/* blz_connect_async() in progress */
+	struct blz_op*	   retrying;		/* operations waiting for a retry */
+	/* live objects, for blz_fini() */
+	struct blz_dev*	   devices;			/* connected */
+	struct blz_dev*	   disconnecting;	/* blz_disconnect_async() */
+	struct blz_serv*   servs;
+	struct blz_char*   chars;
+	struct blz_adv*	   advs;			/* advertisements */
+	struct blz_server* servers;			/* GATT servers */
+	struct event_ring  events;
+	struct loop_thread* thread;		/* blz_thread_start() */
+	struct dev_health* health;
+	blz_health_cb_t	   health_cb;
+	void*			   health_user;
+	int				   health_min_change;
+	bool			   peer;			/* no bus daemon, see bluez_sender() */
 };
 
 struct blz_dev {
@@ -33,48 +127,113 @@ struct blz_dev {
 	uint8_t				  mac[6];
 	char				  name[NAME_STR_LEN];
 	sd_bus_slot*		  connect_slot;
-	bool				  connect_async_done;
-	int					  connect_async_result;
+	/* blz_connect_async() in progress */
+	blz_connect_cb_t	  connect_cb;
+	void*				  connect_user;
+	sd_bus_slot*		  call_slot;
+	enum blz_addr_type	  atype;
+	bool				  tried_other;	/* other address type */
+	bool				  wait_resolved;
+	uint64_t			  deadline;		/* usec CLOCK_MONOTONIC */
+	struct blz_dev*		  connect_next;	/* ctx->connecting list */
+	struct blz_dev*		  next;			/* ctx->devices or disconnecting */
 	bool				  connected;
 	bool				  services_resolved;
 	int16_t				  rssi;
-	char**				  service_uuids;
+	char**				  service_uuids; /* interned */
 	blz_disconn_handler_t disconnect_cb;
 	void*                 disconn_user;
+	/* dev_objects_async() in progress */
+	sd_bus_slot*		  objects_slot;
+	objects_cb_t		  objects_cb;
+	void*				  objects_user;
+	/* operations not sent yet, in submission order */
+	struct blz_op*		  queue;
+	struct blz_op*		  queue_last;
+	unsigned			  inflight;
+	unsigned			  max_inflight;	/* 0 is no limit */
+	/* blz_disconnect_async() in progress */
+	blz_disconnect_cb_t	  disconnect_done;
+	void*				  disconnect_done_user;
+	struct dev_health*	  health;
 };
 
 struct blz_serv {
 	struct blz_context* ctx;
-	struct blz_dev*		dev;
+	struct blz_dev*		dev;		/* NULL after disconnect */
+	struct blz_serv*	next;		/* ctx->servs */
 	char				path[DBUS_PATH_MAX_LEN];
-	char				uuid[UUID_STR_LEN];
-	char**				char_uuids;
+	const char*			uuid;		/* interned */
+	char**				char_uuids; /* interned */
 	size_t				chars_idx;
+	size_t				chars_cnt;	/* allocated for char_uuids */
 };
 
-/* Characteristic Flags (Characteristic Properties bit field) */
-#define BLZ_CHAR_BROADCAST				0x01
-#define BLZ_CHAR_READ					0x02
-#define BLZ_CHAR_WRITE_WITHOUT_RESPONSE 0x04
-#define BLZ_CHAR_WRITE					0x08
-#define BLZ_CHAR_NOTIFY					0x10
-#define BLZ_CHAR_INDICATE				0x20
-#define BLZ_CHAR_SIGNED_WRITE			0x40
-#define BLZ_CHAR_EXTENDED				0x80
+enum op_kind { OP_READ, OP_WRITE, OP_NOTIFY };
+
+/* asynchronous read, write or notify start, queued or in progress */
+struct blz_op {
+	struct blz_op*	 next;		 /* all of the characteristic */
+	struct blz_op*	 dev_next;	 /* queue of the device */
+	struct blz_op*	 retry_next; /* ctx->retrying */
+	struct blz_context* ctx;
+	struct blz_char* ch;		 /* NULL if freed while canceled */
+	bool			 canceled;	 /* only in ctx->retrying, see op_cancel() */
+	sd_bus_slot*	 slot;
+	enum op_kind	 kind;
+	const char*		 type;		 /* of writes */
+	blz_read_cb_t	 read_cb;
+	blz_write_cb_t	 write_cb;
+	void*			 user;
+	unsigned		 retries;
+	uint64_t		 retry_at;	 /* usec CLOCK_MONOTONIC */
+	int				 err;		 /* failed to send */
+	uint64_t		 sent_at;	 /* usec CLOCK_MONOTONIC */
+	size_t			 len;
+	uint8_t			 data[];	 /* value of writes */
+};
 
 struct blz_char {
 	struct blz_context*	 ctx;
-	struct blz_dev*		 dev;
+	struct blz_dev*		 dev;		/* NULL after disconnect */
+	struct blz_char*	 next;		/* ctx->chars */
 	char				 path[DBUS_PATH_MAX_LEN];
-	char				 uuid[UUID_STR_LEN];
+	const char*			 uuid;		/* interned */
 	uint32_t			 flags;
 	blz_notify_handler_t notify_cb;
 	sd_bus_slot*		 notify_slot;
 	bool				 notifying;
 	void*                notify_user;
+	struct blz_op*		 ops;
+	struct blz_op*		 busy;		/* in flight or waiting for retry */
+	/* of blz_char_write_fd_acquire(), to shut it down in blz_fini() */
+	bool				 write_acquired;
+	int					 write_fd;
+	ino_t				 write_ino;
+	/* notification intervals, for the health of the device */
+	uint64_t			 notify_last;
+	uint64_t			 notify_avg_us;
+	unsigned			 notify_count;
 };
 /* clang-format on */
 
+/* log via the context log handler, falls back to the global one. ctx can
+ * be NULL */
+void __attribute__((format(printf, 3, 4)))
+ctx_log_out(const struct blz_context* ctx, enum loglevel ll, const char* fmt,
+			...);
+
+#define CLOG_CRIT(ctx, ...) ctx_log_out(ctx, LL_CRIT, __VA_ARGS__)
+#define CLOG_ERR(ctx, ...)	ctx_log_out(ctx, LL_ERR, __VA_ARGS__)
+#define CLOG_WARN(ctx, ...) ctx_log_out(ctx, LL_WARN, __VA_ARGS__)
+#define CLOG_NOTI(ctx, ...) ctx_log_out(ctx, LL_NOTICE, __VA_ARGS__)
+#define CLOG_INF(ctx, ...)	ctx_log_out(ctx, LL_INFO, __VA_ARGS__)
+#define CLOG_DBG(ctx, ...)                                                     \
+	do {                                                                       \
+		if (DEBUG)                                                             \
+			ctx_log_out(ctx, LL_DEBUG, __VA_ARGS__);                           \
+	} while (0)
+
 /* actions that can be done on message parsing for objects and interfaces */
 enum msg_act {
 	MSG_CHAR_FIND,
@@ -82,20 +241,94 @@ enum msg_act {
 	MSG_DEVICE_SCAN,
 	MSG_CHAR_COUNT,
 	MSG_CHARS_ALL,
-	MSG_SERV_FIND
+	MSG_SERV_FIND,
+	MSG_GATT_ALL
+};
+
+/* user of MSG_GATT_ALL */
+struct gatt_enum {
+	blz_gatt_handler_t cb;
+	void*			   user;
 };
 
-int msg_parse_objects(sd_bus_message* m, const char* match_path,
+int msg_parse_objects(blz* ctx, sd_bus_message* m, const char* match_path,
 					  enum msg_act act, void* user);
-int msg_parse_object(sd_bus_message* m, const char* match_path,
+int msg_parse_object(blz* ctx, sd_bus_message* m, const char* match_path,
 					 enum msg_act act, void* user);
-int msg_parse_interface(sd_bus_message* m, enum msg_act act, const char* opath,
-						void* user);
-int msg_parse_notify(sd_bus_message* m, blz_char* ch, const void** ptr,
-					 size_t* len);
-int msg_append_property(sd_bus_message* m, const char* name, char type,
-						const void* value);
-int msg_read_variant(sd_bus_message* m, char* type, void* dest);
-int msg_read_variant_strv(sd_bus_message* m, char*** dest);
+int msg_parse_interface(blz* ctx, sd_bus_message* m, enum msg_act act,
+						const char* opath, void* user);
+int msg_parse_notify(blz* ctx, sd_bus_message* m, blz_char* ch,
+					 const void** ptr, size_t* len);
+int msg_append_property(blz* ctx, sd_bus_message* m, const char* name,
+						char type, const void* value);
+int msg_read_variant(blz* ctx, sd_bus_message* m, char* type, void* dest);
+int msg_read_variant_strv(blz* ctx, sd_bus_message* m, char*** dest);
+ssize_t msg_size(blz* ctx, sd_bus_message* m);
+
+/** usec of CLOCK_MONOTONIC */
+uint64_t now_usec(void);
+
+bool mem_reserve(blz* ctx, enum blz_mem_cat cat, size_t size);
+void mem_release(blz* ctx, enum blz_mem_cat cat, size_t size);
+void* mem_alloc(blz* ctx, enum blz_mem_cat cat, size_t size);
+void mem_free(blz* ctx, enum blz_mem_cat cat, void* ptr, size_t size);
+void mem_set_evict(blz* ctx, enum blz_mem_cat cat,
+				   size_t (*evict)(blz* ctx, size_t need));
+
+/** WriteValue without blocking, type is "request" or "command", without
+ * checking the flags of the characteristic */
+bool char_write_async(blz_char* ch, const uint8_t* data, size_t len,
+					  const char* type, blz_write_cb_t cb, void* user);
+
+/** GetManagedObjects without blocking, cb is called from the loop, or right
+ * away if the object tree is cached. Returns false if the call could not be
+ * started */
+bool dev_objects_async(blz_dev* dev, objects_cb_t cb, void* user);
+
+/** sends batched advertisement updates which are due, returns usec until
+ * the next one or UINT64_MAX */
+uint64_t adv_check_updates(blz* ctx);
+/** absolute time of the next advertisement update or UINT64_MAX */
+uint64_t adv_next_update(blz* ctx);
+
+/** next slot of the event ring, with type, err and user set, or NULL if the
+ * ring is not enabled or full */
+struct blz_event* event_push(blz* ctx, enum blz_event_type type, int err,
+							 void* user);
+void event_set_data(struct blz_event* ev, const void* data, size_t len);
+/** clears references to a device or characteristic which is freed */
+void events_forget(blz* ctx, const void* obj);
+void events_free(blz* ctx);
+
+static inline bool events_enabled(blz* ctx)
+{
+	return ctx->events.ev != NULL;
+}
+
+/** sender for signal matches, on a peer-to-peer connection signals carry
+ * none */
+static inline const char* bluez_sender(blz* ctx)
+{
+	return ctx->peer ? NULL : "org.bluez";
+}
+
+/** health of mac, NULL if unknown and not create or on alloc failure. The
+ * update functions accept NULL */
+struct dev_health* health_get(blz* ctx, const uint8_t* mac, bool create);
+void health_connect(struct dev_health* h, blz_dev* dev, int err);
+void health_disconnect(struct dev_health* h, blz_dev* dev);
+void health_rssi(struct dev_health* h, blz_dev* dev, int16_t rssi);
+void health_op(struct dev_health* h, blz_dev* dev, int err, uint64_t lat_us);
+void health_notify(blz_char* ch);
+void health_free_all(blz* ctx);
+/** recalculates the score of h as of now, without calling the handler */
+int health_score(struct dev_health* h);
+
+char* uuid_intern(blz* ctx, const char* uuid);
+/** frees strv and returns its UUIDs interned in a list which is accounted in
+ * BLZ_MEM_DEVICES, NULL if that can't be allocated */
+char** uuid_intern_strv(blz* ctx, char** strv);
+void uuid_strv_free(blz* ctx, char** uuids);
+void uuid_table_free(blz* ctx, struct uuid_table* tbl);
 
 #endif
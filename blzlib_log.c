@@ -7,25 +7,50 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <systemd/sd-bus.h>
 
+#include "blzlib.h"
+#include "blzlib_internal.h"
 #include "blzlib_log.h"
 
 static void (*log_handler)(enum loglevel ll, const char* fmt, va_list ap);
 
-void __attribute__((format(printf, 2, 3)))
-blz_log_out(enum loglevel level, const char* format, ...)
+static void log_vout(enum loglevel level, const char* format, va_list args)
 {
-	va_list args;
-
-	va_start(args, format);
 	if (log_handler != NULL) {
 		log_handler(level, format, args);
-		va_end(args);
 		return;
 	}
 
+	/* lock, so lines of different threads don't mix */
+	flockfile(stdout);
 	vprintf(format, args);
 	printf("\n");
+	funlockfile(stdout);
+}
+
+void __attribute__((format(printf, 2, 3)))
+blz_log_out(enum loglevel level, const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	log_vout(level, format, args);
+	va_end(args);
+}
+
+void __attribute__((format(printf, 3, 4)))
+ctx_log_out(const struct blz_context* ctx, enum loglevel level,
+			const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	if (ctx != NULL && ctx->log_cb != NULL) {
+		ctx->log_cb(level, format, args, ctx->log_user);
+	} else {
+		log_vout(level, format, args);
+	}
 	va_end(args);
 }
 
@@ -34,3 +59,10 @@ void blz_set_log_handler(void (*cb)(enum loglevel ll, const char* fmt,
 {
 	log_handler = cb;
 }
+
+void blz_set_ctx_log_handler(struct blz_context* ctx, blz_log_handler_t cb,
+							 void* user)
+{
+	ctx->log_cb = cb;
+	ctx->log_user = user;
+}
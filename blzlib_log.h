@@ -13,12 +13,23 @@
 /* these conincide with syslog levels for convenience */
 enum loglevel { LL_CRIT = 2, LL_ERR, LL_WARN, LL_NOTICE, LL_INFO, LL_DEBUG };
 
+struct blz_context;
+
+typedef void (*blz_log_handler_t)(enum loglevel ll, const char* fmt,
+								  va_list ap, void* user);
+
 void __attribute__((format(printf, 2, 3)))
 blz_log_out(enum loglevel ll, const char* fmt, ...);
 
+/** global log handler, used when a context has no own log handler. Set it
+ * before starting threads, it is not synchronized */
 void blz_set_log_handler(void (*cb)(enum loglevel ll, const char* fmt,
 									va_list ap));
 
+/** log handler for all messages of one context */
+void blz_set_ctx_log_handler(struct blz_context* ctx, blz_log_handler_t cb,
+							 void* user);
+
 #ifndef DEBUG
 #define DEBUG 0
 #endif
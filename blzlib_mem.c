@@ -0,0 +1,153 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/*
+ * Memory used by a context is accounted per category. When a category or
+ * the total would go over its limit, evictable categories (caches) are
+ * asked to free memory first, if that is not enough the allocation is
+ * refused and the caller has to fail gracefully.
+ */
+
+static bool mem_over(struct blz_mem* mem, enum blz_mem_cat cat, size_t size)
+{
+	return (mem->limit[cat] && mem->used[cat] + size > mem->limit[cat])
+		   || (mem->limit_total && mem->used_total + size > mem->limit_total);
+}
+
+static void mem_evict(blz* ctx, enum blz_mem_cat cat, size_t size)
+{
+	struct blz_mem* mem = &ctx->mem;
+
+	/* first the category itself if it is evictable, then all others (only
+	 * helps for the total limit) */
+	if (mem->evict[cat] != NULL) {
+		mem->evicted += mem->evict[cat](ctx, size);
+	}
+
+	for (int i = 0; i < BLZ_MEM_CAT_MAX && mem_over(mem, cat, size); i++) {
+		if (i != (int)cat && mem->evict[i] != NULL) {
+			mem->evicted += mem->evict[i](ctx, size);
+		}
+	}
+}
+
+bool mem_reserve(blz* ctx, enum blz_mem_cat cat, size_t size)
+{
+	struct blz_mem* mem = &ctx->mem;
+
+	if (mem_over(mem, cat, size)) {
+		mem_evict(ctx, cat, size);
+		if (mem_over(mem, cat, size)) {
+			mem->refused++;
+			CLOG_NOTI(ctx, "BLZ memory limit reached (%s %zu bytes)",
+					 blz_mem_cat_str(cat), size);
+			return false;
+		}
+	}
+
+	mem->used[cat] += size;
+	mem->used_total += size;
+	if (mem->used[cat] > mem->peak[cat]) {
+		mem->peak[cat] = mem->used[cat];
+	}
+	if (mem->used_total > mem->peak_total) {
+		mem->peak_total = mem->used_total;
+	}
+	return true;
+}
+
+void mem_release(blz* ctx, enum blz_mem_cat cat, size_t size)
+{
+	struct blz_mem* mem = &ctx->mem;
+
+	if (size > mem->used[cat]) {
+		CLOG_ERR(ctx, "BLZ memory accounting underflow (%s)",
+				 blz_mem_cat_str(cat));
+		size = mem->used[cat];
+	}
+	mem->used[cat] -= size;
+	mem->used_total -= size;
+}
+
+void* mem_alloc(blz* ctx, enum blz_mem_cat cat, size_t size)
+{
+	if (!mem_reserve(ctx, cat, size)) {
+		return NULL;
+	}
+
+	void* ptr = calloc(1, size);
+	if (ptr == NULL) {
+		mem_release(ctx, cat, size);
+	}
+	return ptr;
+}
+
+void mem_free(blz* ctx, enum blz_mem_cat cat, void* ptr, size_t size)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	mem_release(ctx, cat, size);
+	free(ptr);
+}
+
+void mem_set_evict(blz* ctx, enum blz_mem_cat cat,
+				   size_t (*evict)(blz* ctx, size_t need))
+{
+	ctx->mem.evict[cat] = evict;
+}
+
+void blz_get_mem_stats(blz* ctx, struct blz_mem_stats* st)
+{
+	struct blz_mem* mem = &ctx->mem;
+
+	memcpy(st->used, mem->used, sizeof(st->used));
+	memcpy(st->peak, mem->peak, sizeof(st->peak));
+	memcpy(st->limit, mem->limit, sizeof(st->limit));
+	st->used_total = mem->used_total;
+	st->peak_total = mem->peak_total;
+	st->limit_total = mem->limit_total;
+	st->refused = mem->refused;
+	st->evicted = mem->evicted;
+}
+
+void blz_set_mem_limit(blz* ctx, enum blz_mem_cat cat, size_t bytes)
+{
+	if (cat >= BLZ_MEM_CAT_MAX) {
+		return;
+	}
+
+	ctx->mem.limit[cat] = bytes;
+
+	/* shrink evictable categories right away */
+	if (bytes && ctx->mem.used[cat] > bytes && ctx->mem.evict[cat] != NULL) {
+		ctx->mem.evicted += ctx->mem.evict[cat](ctx,
+												ctx->mem.used[cat] - bytes);
+	}
+}
+
+void blz_set_mem_limit_total(blz* ctx, size_t bytes)
+{
+	ctx->mem.limit_total = bytes;
+
+	for (int i = 0; bytes && ctx->mem.used_total > bytes && i < BLZ_MEM_CAT_MAX;
+		 i++) {
+		if (ctx->mem.evict[i] != NULL) {
+			ctx->mem.evicted += ctx->mem.evict[i](ctx, ctx->mem.used_total
+															- bytes);
+		}
+	}
+}
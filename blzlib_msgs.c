@@ -15,17 +15,17 @@
 #include "blzlib_log.h"
 #include "blzlib_util.h"
 
-static int msg_parse_characteristic1(sd_bus_message* m, const char* opath,
-									 blz_char* ch)
+static int msg_parse_characteristic1(blz* ctx, sd_bus_message* m,
+									 const char* opath, blz_char* ch)
 {
 	const char* str;
-	const char* uuid;
-	char** flags;
+	const char* uuid = NULL;
+	char** flags = NULL;
 
 	/* enter array of dict entries */
 	int r = sd_bus_message_enter_container(m, 'a', "{sv}");
 	if (r < 0) {
-		LOG_ERR("BLZ error parse char 1");
+		CLOG_ERR(ctx, "BLZ error parse char 1");
 		return r;
 	}
 
@@ -34,26 +34,26 @@ static int msg_parse_characteristic1(sd_bus_message* m, const char* opath,
 		/* property name */
 		r = sd_bus_message_read_basic(m, 's', &str);
 		if (r < 0) {
-			LOG_ERR("BLZ error parse char 2");
+			CLOG_ERR(ctx, "BLZ error parse char 2");
 			return r;
 		}
 
-		// LOG_INF("Name %s", str);
+		// CLOG_INF(ctx, "Name %s", str);
 
 		if (strcmp(str, "UUID") == 0) {
-			r = msg_read_variant(m, "s", &uuid);
+			r = msg_read_variant(ctx, m, "s", &uuid);
 			if (r < 0) {
 				return r;
 			}
 		} else if (strcmp(str, "Flags") == 0) {
-			r = msg_read_variant_strv(m, &flags);
+			r = msg_read_variant_strv(ctx, m, &flags);
 			if (r < 0) {
 				return r;
 			}
 		} else {
 			r = sd_bus_message_skip(m, "v");
 			if (r < 0) {
-				LOG_ERR("BLZ error parse char 9");
+				CLOG_ERR(ctx, "BLZ error parse char 9");
 				return r;
 			}
 		}
@@ -61,32 +61,35 @@ static int msg_parse_characteristic1(sd_bus_message* m, const char* opath,
 		/* exit dict */
 		r = sd_bus_message_exit_container(m);
 		if (r < 0) {
-			LOG_ERR("BLZ error parse char 10");
+			CLOG_ERR(ctx, "BLZ error parse char 10");
 			return r;
 		}
 	}
 
 	if (r < 0) {
-		LOG_ERR("BLZ error parse char 11");
+		CLOG_ERR(ctx, "BLZ error parse char 11");
 		return r;
 	}
 
 	/* exit array */
 	r = sd_bus_message_exit_container(m);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse char 12");
+		CLOG_ERR(ctx, "BLZ error parse char 12");
 		return r;
 	}
 
-	// LOG_INF("UUID %s", uuid);
+	// CLOG_INF(ctx, "UUID %s", uuid);
+
+	/* interned UUIDs can be compared by pointer */
+	if (uuid != NULL) {
+		uuid = uuid_intern(ctx, uuid);
+	}
 
 	/* if UUID matched or if UUID was empty (match all) */
-	if (ch->uuid[0] == '\0' || strcasecmp(uuid, ch->uuid) == 0) {
+	if (uuid != NULL && (ch->uuid == NULL || uuid == ch->uuid)) {
 		/* save object path and UUID */
 		strncpy(ch->path, opath, DBUS_PATH_MAX_LEN);
-		if (ch->uuid[0] == '\0') {
-			strncpy(ch->uuid, uuid, UUID_STR_LEN);
-		}
+		ch->uuid = uuid;
 
 		/* convert flags */
 		for (int i = 0; flags != NULL && flags[i] != NULL; i++) {
@@ -119,16 +122,16 @@ static int msg_parse_characteristic1(sd_bus_message* m, const char* opath,
 	return r;
 }
 
-static int msg_parse_service1(sd_bus_message* m, const char* opath,
+static int msg_parse_service1(blz* ctx, sd_bus_message* m, const char* opath,
 							  blz_serv* srv)
 {
 	const char* str;
-	const char* uuid;
+	const char* uuid = NULL;
 
 	/* enter array of dict entries */
 	int r = sd_bus_message_enter_container(m, 'a', "{sv}");
 	if (r < 0) {
-		LOG_ERR("BLZ error parse serv 1");
+		CLOG_ERR(ctx, "BLZ error parse serv 1");
 		return r;
 	}
 
@@ -137,22 +140,22 @@ static int msg_parse_service1(sd_bus_message* m, const char* opath,
 		/* property name */
 		r = sd_bus_message_read_basic(m, 's', &str);
 		if (r < 0) {
-			LOG_ERR("BLZ error parse serv 2");
+			CLOG_ERR(ctx, "BLZ error parse serv 2");
 			return r;
 		}
 
-		// LOG_INF("serv Name %s", str);
+		// CLOG_INF(ctx, "serv Name %s", str);
 
 		if (strcmp(str, "UUID") == 0) {
-			r = msg_read_variant(m, "s", &uuid);
+			r = msg_read_variant(ctx, m, "s", &uuid);
 			if (r < 0) {
-				LOG_ERR("BLZ error parse serv 3");
+				CLOG_ERR(ctx, "BLZ error parse serv 3");
 				return r;
 			}
 		} else {
 			r = sd_bus_message_skip(m, "v");
 			if (r < 0) {
-				LOG_ERR("BLZ error parse serv 4");
+				CLOG_ERR(ctx, "BLZ error parse serv 4");
 				return r;
 			}
 		}
@@ -160,47 +163,50 @@ static int msg_parse_service1(sd_bus_message* m, const char* opath,
 		/* exit dict */
 		r = sd_bus_message_exit_container(m);
 		if (r < 0) {
-			LOG_ERR("BLZ error parse serv 5");
+			CLOG_ERR(ctx, "BLZ error parse serv 5");
 			return r;
 		}
 	}
 
 	if (r < 0) {
-		LOG_ERR("BLZ error parse serv 6");
+		CLOG_ERR(ctx, "BLZ error parse serv 6");
 		return r;
 	}
 
 	/* exit array */
 	r = sd_bus_message_exit_container(m);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse serv 7");
+		CLOG_ERR(ctx, "BLZ error parse serv 7");
 		return r;
 	}
 
-	// LOG_INF("Serv UUID %s path %s", uuid, opath);
+	// CLOG_INF(ctx, "Serv UUID %s path %s", uuid, opath);
+
+	/* interned UUIDs can be compared by pointer */
+	if (uuid != NULL) {
+		uuid = uuid_intern(ctx, uuid);
+	}
 
 	/* if UUID matched or if UUID was empty (match all) */
-	if (srv->uuid[0] == '\0' || strcasecmp(uuid, srv->uuid) == 0) {
+	if (uuid != NULL && (srv->uuid == NULL || uuid == srv->uuid)) {
 		/* save object path and UUID */
 		strncpy(srv->path, opath, DBUS_PATH_MAX_LEN);
-		if (srv->uuid[0] == '\0') {
-			strncpy(srv->uuid, uuid, UUID_STR_LEN);
-		}
-
+		srv->uuid = uuid;
 		return RETURN_FOUND;
 	}
 
 	return r;
 }
 
-static int msg_parse_device1(sd_bus_message* m, const char* opath, blz_dev* dev)
+static int msg_parse_device1(blz* ctx, sd_bus_message* m, const char* opath,
+							 blz_dev* dev)
 {
 	const char* str;
 
 	/* enter array of dict entries */
 	int r = sd_bus_message_enter_container(m, 'a', "{sv}");
 	if (r < 0) {
-		LOG_ERR("BLZ error parse dev 1");
+		CLOG_ERR(ctx, "BLZ error parse dev 1");
 		return r;
 	}
 
@@ -209,33 +215,36 @@ static int msg_parse_device1(sd_bus_message* m, const char* opath, blz_dev* dev)
 		/* property name */
 		r = sd_bus_message_read_basic(m, 's', &str);
 		if (r < 0) {
-			LOG_ERR("BLZ error parse dev 2");
+			CLOG_ERR(ctx, "BLZ error parse dev 2");
 			return r;
 		}
 
-		// LOG_INF("Name %s", str);
+		// CLOG_INF(ctx, "Name %s", str);
 
 		if (strcmp(str, "Name") == 0) {
-			r = msg_read_variant(m, "s", &str);
+			r = msg_read_variant(ctx, m, "s", &str);
 			if (r < 0) {
 				return r;
 			}
 			strncpy(dev->name, str, NAME_STR_LEN);
 		} else if (strcmp(str, "Address") == 0) {
-			r = msg_read_variant(m, "s", &str);
+			r = msg_read_variant(ctx, m, "s", &str);
 			if (r < 0) {
 				return r;
 			}
 			blz_string_to_mac(str, dev->mac);
 		} else if (strcmp(str, "UUIDs") == 0) {
-			r = msg_read_variant_strv(m, &dev->service_uuids);
+			char** uuids = NULL;
+			r = msg_read_variant_strv(ctx, m, &uuids);
 			if (r < 0) {
 				return r;
 			}
+			uuid_strv_free(ctx, dev->service_uuids);
+			dev->service_uuids = uuid_intern_strv(ctx, uuids);
 		} else if (strcmp(str, "ServicesResolved") == 0) {
 			/* note: bool in sd-dbus is expected to be int type */
 			int b;
-			r = msg_read_variant(m, "b", &b);
+			r = msg_read_variant(ctx, m, "b", &b);
 			if (r < 0) {
 				return r;
 			}
@@ -243,23 +252,34 @@ static int msg_parse_device1(sd_bus_message* m, const char* opath, blz_dev* dev)
 		} else if (strcmp(str, "Connected") == 0) {
 			/* note: bool in sd-dbus is expected to be int type */
 			int b;
-			r = msg_read_variant(m, "b", &b);
+			r = msg_read_variant(ctx, m, "b", &b);
 			if (r < 0) {
 				return r;
 			}
+			bool was_connected = dev->connected;
 			dev->connected = b;
+			if (!b && was_connected) {
+				health_disconnect(dev->health, dev);
+			}
 			if (dev->disconnect_cb && !b) {
 				dev->disconnect_cb(dev->disconn_user);
+			} else if (!b && was_connected) {
+				struct blz_event* ev = event_push(ctx, BLZ_EVENT_DISCONNECT, 0,
+												  dev->disconn_user);
+				if (ev != NULL) {
+					ev->dev = dev;
+				}
 			}
 		} else if (strcmp(str, "RSSI") == 0) {
-			r = msg_read_variant(m, "n", &dev->rssi);
+			r = msg_read_variant(ctx, m, "n", &dev->rssi);
 			if (r < 0) {
 				return r;
 			}
+			health_rssi(dev->health, dev, dev->rssi);
 		} else {
 			r = sd_bus_message_skip(m, "v");
 			if (r < 0) {
-				LOG_ERR("BLZ error parse dev 15");
+				CLOG_ERR(ctx, "BLZ error parse dev 15");
 				return r;
 			}
 		}
@@ -267,47 +287,47 @@ static int msg_parse_device1(sd_bus_message* m, const char* opath, blz_dev* dev)
 		/* exit dict */
 		r = sd_bus_message_exit_container(m);
 		if (r < 0) {
-			LOG_ERR("BLZ error parse dev 16");
+			CLOG_ERR(ctx, "BLZ error parse dev 16");
 			return r;
 		}
 	}
 
 	if (r < 0) {
-		LOG_ERR("BLZ error parse dev 17");
+		CLOG_ERR(ctx, "BLZ error parse dev 17");
 		return r;
 	}
 
 	/* exit array */
 	r = sd_bus_message_exit_container(m);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse dev 18");
+		CLOG_ERR(ctx, "BLZ error parse dev 18");
 		return r;
 	}
 
 	return r;
 }
 
-int msg_parse_interface(sd_bus_message* m, enum msg_act act, const char* opath,
-						void* user)
+int msg_parse_interface(blz* ctx, sd_bus_message* m, enum msg_act act,
+						const char* opath, void* user)
 {
 	const char* intf;
 
 	/* interface name */
 	int r = sd_bus_message_read_basic(m, 's', &intf);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse 1intf 1");
+		CLOG_ERR(ctx, "BLZ error parse 1intf 1");
 		return r;
 	}
 
 	if (act == MSG_SERV_FIND && strcmp(intf, "org.bluez.GattService1") == 0) {
 		/* find service by UUID, returns RETURN_FOUND if found, user
 		 * points to a blz_serv where the UUID to look for is filled */
-		r = msg_parse_service1(m, opath, user);
+		r = msg_parse_service1(ctx, m, opath, user);
 	} else if (act == MSG_CHAR_FIND
 			   && strcmp(intf, "org.bluez.GattCharacteristic1") == 0) {
 		/* find char by UUID, returns RETURN_FOUND if found, user
 		 * points to a blz_char where the UUID to look for is filled */
-		r = msg_parse_characteristic1(m, opath, user);
+		r = msg_parse_characteristic1(ctx, m, opath, user);
 	} else if (act == MSG_CHAR_COUNT
 			   && strcmp(intf, "org.bluez.GattCharacteristic1") == 0) {
 		/* just count the times the GattCharacteristic1 interface was
@@ -316,71 +336,116 @@ int msg_parse_interface(sd_bus_message* m, enum msg_act act, const char* opath,
 		(*cnt)++;
 		r = sd_bus_message_skip(m, "a{sv}");
 		if (r < 0) {
-			LOG_ERR("BLZ error parse 1intf 2");
+			CLOG_ERR(ctx, "BLZ error parse 1intf 2");
 		}
 	} else if (act == MSG_CHARS_ALL
 			   && strcmp(intf, "org.bluez.GattCharacteristic1") == 0) {
 		/* get UUIDs from all characteristics. user points to the service
 		 * where enough space for them has already been allocated */
 		blz_serv* srv = user;
-		blz_char ch = {0}; // temporary char
-		r = msg_parse_characteristic1(m, opath, &ch);
+		blz_char ch = {.ctx = ctx}; // temporary char
+		r = msg_parse_characteristic1(ctx, m, opath, &ch);
 		if (r < 0) {
 			return r;
 		}
-		/* copy UUID */
-		srv->char_uuids[srv->chars_idx] = strdup(ch.uuid);
-		srv->chars_idx++;
+		/* interned UUID, no copy */
+		if (ch.uuid != NULL) {
+			srv->char_uuids[srv->chars_idx] = (char*)ch.uuid;
+			srv->chars_idx++;
+		}
+		return 0; // override RETURN_FOUND this would stop the loop
+	} else if (act == MSG_GATT_ALL
+			   && strncmp(intf, "org.bluez.Gatt", 14) == 0) {
+		/* every GATT attribute, user points to a struct gatt_enum */
+		struct gatt_enum* ge = user;
+		struct blz_gatt_attr attr = {.path = opath};
+		if (strcmp(intf, "org.bluez.GattCharacteristic1") == 0) {
+			blz_char ch = {.ctx = ctx}; // temporary char
+			r = msg_parse_characteristic1(ctx, m, opath, &ch);
+			attr.type = BLZ_GATT_CHAR;
+			attr.uuid = ch.uuid;
+			attr.flags = ch.flags;
+		} else if (strcmp(intf, "org.bluez.GattService1") == 0
+				   || strcmp(intf, "org.bluez.GattDescriptor1") == 0) {
+			/* only the UUID is used of services and descriptors */
+			blz_serv srv = {.ctx = ctx}; // temporary service
+			r = msg_parse_service1(ctx, m, opath, &srv);
+			attr.type = intf[14] == 'S' ? BLZ_GATT_SERVICE : BLZ_GATT_DESC;
+			attr.uuid = srv.uuid;
+		} else {
+			/* e.g. GattManager1 */
+			r = sd_bus_message_skip(m, "a{sv}");
+		}
+		if (r < 0) {
+			CLOG_ERR(ctx, "BLZ error parse 1intf 4");
+			return r;
+		}
+		if (attr.uuid != NULL) {
+			ge->cb(&attr, ge->user);
+		}
 		return 0; // override RETURN_FOUND this would stop the loop
 	} else if (act == MSG_DEVICE && strcmp(intf, "org.bluez.Device1") == 0) {
 		/* parse device properties, user points to device */
-		r = msg_parse_device1(m, opath, user);
+		r = msg_parse_device1(ctx, m, opath, user);
 	} else if (act == MSG_DEVICE_SCAN
 			   && strcmp(intf, "org.bluez.Device1") == 0) {
-		/* used in scan callback. user points to a blz* where the scan_cb
-		 * can be found. create a temporary device, parse all info into
-		 * it and then call callback */
-		blz_dev dev = {0};
-		r = msg_parse_device1(m, opath, &dev);
+		/* used in scan callback, the scan_cb is found in the context.
+		 * create a temporary device, parse all info into it and then call
+		 * callback */
+		blz_dev dev = {.ctx = ctx};
+		r = msg_parse_device1(ctx, m, opath, &dev);
 		if (r < 0) {
+			uuid_strv_free(ctx, dev.service_uuids);
 			return r;
 		}
 
 		/* callback */
-		blz* ctx = user;
-		if (ctx != NULL && ctx->scan_cb != NULL) {
-			ctx->scan_cb(dev.mac, BLZ_ADDR_UNKNOWN, dev.rssi, NULL, 0, ctx->scan_user);
+		if (ctx->scan_cb != NULL) {
+			ctx->scan_cb(dev.mac, BLZ_ADDR_UNKNOWN, dev.rssi, NULL, 0,
+						 ctx->scan_user);
+		} else {
+			struct blz_event* ev = event_push(ctx, BLZ_EVENT_SCAN, 0,
+											  ctx->scan_user);
+			if (ev != NULL) {
+				memcpy(ev->mac, dev.mac, sizeof(ev->mac));
+				ev->rssi = dev.rssi;
+			}
 		}
 
-		/* free uuids of temporary device */
-		for (int i = 0;
-			 dev.service_uuids != NULL && dev.service_uuids[i] != NULL; i++) {
-			free(dev.service_uuids[i]);
+		/* only of devices which were connected before, with the device
+		 * while it is connected */
+		struct dev_health* h = health_get(ctx, dev.mac, false);
+		blz_dev* d = h != NULL ? ctx->devices : NULL;
+		while (d != NULL && d->health != h) {
+			d = d->next;
 		}
-		free(dev.service_uuids);
+		health_rssi(h, d, dev.rssi);
+
+		/* UUIDs of temporary device are interned, only free the list */
+		uuid_strv_free(ctx, dev.service_uuids);
 	} else {
 		/* unknown interface or action */
 		r = sd_bus_message_skip(m, "a{sv}");
 		if (r < 0) {
-			LOG_ERR("BLZ error parse 1intf 3");
+			CLOG_ERR(ctx, "BLZ error parse 1intf 3");
 		}
 	}
 	return r;
 }
 
-static int msg_parse_interfaces(sd_bus_message* m, enum msg_act act,
+static int msg_parse_interfaces(blz* ctx, sd_bus_message* m, enum msg_act act,
 								const char* opath, void* user)
 {
 	/* enter array of interface names with array of properties */
 	int r = sd_bus_message_enter_container(m, 'a', "{sa{sv}}");
 	if (r < 0) {
-		LOG_ERR("BLZ error parse intf 1");
+		CLOG_ERR(ctx, "BLZ error parse intf 1");
 		return r;
 	}
 
 	/* enter next dict entry */
 	while ((r = sd_bus_message_enter_container(m, 'e', "sa{sv}")) > 0) {
-		r = msg_parse_interface(m, act, opath, user);
+		r = msg_parse_interface(ctx, m, act, opath, user);
 		if (r < 0 || r == RETURN_FOUND) {
 			return r;
 		}
@@ -388,26 +453,26 @@ static int msg_parse_interfaces(sd_bus_message* m, enum msg_act act,
 		/* exit dict */
 		r = sd_bus_message_exit_container(m);
 		if (r < 0) {
-			LOG_ERR("BLZ error parse intf 2");
+			CLOG_ERR(ctx, "BLZ error parse intf 2");
 			return r;
 		}
 	}
 
 	if (r < 0) {
-		LOG_ERR("BLZ error parse intf 3");
+		CLOG_ERR(ctx, "BLZ error parse intf 3");
 		return r;
 	}
 
 	/* exit array */
 	r = sd_bus_message_exit_container(m);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse intf 4");
+		CLOG_ERR(ctx, "BLZ error parse intf 4");
 		return r;
 	}
 	return r;
 }
 
-int msg_parse_object(sd_bus_message* m, const char* match_path,
+int msg_parse_object(blz* ctx, sd_bus_message* m, const char* match_path,
 					 enum msg_act act, void* user)
 {
 	const char* opath;
@@ -415,38 +480,38 @@ int msg_parse_object(sd_bus_message* m, const char* match_path,
 	/* object path */
 	int r = sd_bus_message_read_basic(m, 'o', &opath);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse 1obj 1");
+		CLOG_ERR(ctx, "BLZ error parse 1obj 1");
 		return r;
 	}
 
 	/* check if it is below our own device path */
 	if (strncmp(opath, match_path, strlen(match_path)) == 0) {
 		/* parse array of interfaces */
-		r = msg_parse_interfaces(m, act, opath, user);
+		r = msg_parse_interfaces(ctx, m, act, opath, user);
 	} else {
 		/* ignore */
 		r = sd_bus_message_skip(m, "a{sa{sv}}");
 		if (r < 0) {
-			LOG_ERR("BLZ error parse 1obj 2");
+			CLOG_ERR(ctx, "BLZ error parse 1obj 2");
 		}
 	}
 
 	return r;
 }
 
-int msg_parse_objects(sd_bus_message* m, const char* match_path,
+int msg_parse_objects(blz* ctx, sd_bus_message* m, const char* match_path,
 					  enum msg_act act, void* user)
 {
 	/* enter array of objects */
 	int r = sd_bus_message_enter_container(m, 'a', "{oa{sa{sv}}}");
 	if (r < 0) {
-		LOG_ERR("BLZ error parse obj 1");
+		CLOG_ERR(ctx, "BLZ error parse obj 1");
 		return r;
 	}
 
 	/* enter next dict/object */
 	while ((r = sd_bus_message_enter_container(m, 'e', "oa{sa{sv}}")) > 0) {
-		r = msg_parse_object(m, match_path, act, user);
+		r = msg_parse_object(ctx, m, match_path, act, user);
 		if (r < 0 || r == RETURN_FOUND) {
 			return r;
 		}
@@ -454,26 +519,26 @@ int msg_parse_objects(sd_bus_message* m, const char* match_path,
 		/* exit dict */
 		r = sd_bus_message_exit_container(m);
 		if (r < 0) {
-			LOG_ERR("BLZ error parse obj 2");
+			CLOG_ERR(ctx, "BLZ error parse obj 2");
 			return r;
 		}
 	}
 
 	if (r < 0) {
-		LOG_ERR("BLZ error parse obj 3");
+		CLOG_ERR(ctx, "BLZ error parse obj 3");
 		return r;
 	}
 
 	/* exit array */
 	r = sd_bus_message_exit_container(m);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse obj 4");
+		CLOG_ERR(ctx, "BLZ error parse obj 4");
 	}
 	return r;
 }
 
-int msg_parse_notify(sd_bus_message* m, blz_char* ch, const void** ptr,
-					 size_t* len)
+int msg_parse_notify(blz* ctx, sd_bus_message* m, blz_char* ch,
+					 const void** ptr, size_t* len)
 {
 	int r;
 	char* str;
@@ -481,34 +546,34 @@ int msg_parse_notify(sd_bus_message* m, blz_char* ch, const void** ptr,
 	/* interface name */
 	r = sd_bus_message_read_basic(m, 's', &str);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse notify 1");
+		CLOG_ERR(ctx, "BLZ error parse notify 1");
 		return -2;
 	}
 
 	/* ignore all other interfaces */
 	if (strcmp(str, "org.bluez.GattCharacteristic1") != 0) {
-		LOG_INF("BLZ notify interface %s ignored", str);
+		CLOG_INF(ctx, "BLZ notify interface %s ignored", str);
 		return 0;
 	}
 
 	/* enter array of dict entries */
 	r = sd_bus_message_enter_container(m, 'a', "{sv}");
 	if (r < 0) {
-		LOG_ERR("BLZ error parse notify 2");
+		CLOG_ERR(ctx, "BLZ error parse notify 2");
 		return -2;
 	}
 
 	/* enter first element */
 	r = sd_bus_message_enter_container(m, 'e', "sv");
 	if (r < 0) {
-		LOG_ERR("BLZ error parse notify 3");
+		CLOG_ERR(ctx, "BLZ error parse notify 3");
 		return -2;
 	}
 
 	/* property name */
 	r = sd_bus_message_read_basic(m, 's', &str);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse notify 4");
+		CLOG_ERR(ctx, "BLZ error parse notify 4");
 		return -2;
 	}
 
@@ -516,7 +581,7 @@ int msg_parse_notify(sd_bus_message* m, blz_char* ch, const void** ptr,
 	if (strcmp(str, "Notifying") == 0) {
 		/* note: bool in sd-dbus is expected to be int type */
 		int b;
-		r = msg_read_variant(m, "b", &b);
+		r = msg_read_variant(ctx, m, "b", &b);
 		if (r < 0) {
 			return -2;
 		}
@@ -525,18 +590,18 @@ int msg_parse_notify(sd_bus_message* m, blz_char* ch, const void** ptr,
 		/* enter variant */
 		r = sd_bus_message_enter_container(m, 'v', "ay");
 		if (r < 0) {
-			LOG_ERR("BLZ error parse notify 7");
+			CLOG_ERR(ctx, "BLZ error parse notify 7");
 			return -2;
 		}
 
 		/* get byte array */
 		r = sd_bus_message_read_array(m, 'y', ptr, len);
 		if (r < 0) {
-			LOG_ERR("BLZ error parse notify 8");
+			CLOG_ERR(ctx, "BLZ error parse notify 8");
 			return -2;
 		}
 	} else {
-		LOG_INF("BLZ notify property %s ignored", str);
+		CLOG_INF(ctx, "BLZ notify property %s ignored", str);
 		return 0;
 	}
 
@@ -544,46 +609,46 @@ int msg_parse_notify(sd_bus_message* m, blz_char* ch, const void** ptr,
 	return r;
 }
 
-int msg_append_property(sd_bus_message* m, const char* name, char type,
-						const void* value)
+int msg_append_property(blz* ctx, sd_bus_message* m, const char* name,
+						char type, const void* value)
 {
 	/* open dict */
 	int r = sd_bus_message_open_container(m, 'e', "sv");
 	if (r < 0) {
-		LOG_ERR("BLZ failed to create property");
+		CLOG_ERR(ctx, "BLZ failed to create property");
 		return r;
 	}
 
 	r = sd_bus_message_append_basic(m, 's', name);
 	if (r < 0) {
-		LOG_ERR("BLZ failed to create property");
+		CLOG_ERR(ctx, "BLZ failed to create property");
 		return r;
 	}
 
 	/* open variant */
 	r = sd_bus_message_open_container(m, 'v', "s");
 	if (r < 0) {
-		LOG_ERR("BLZ failed to create property");
+		CLOG_ERR(ctx, "BLZ failed to create property");
 		return r;
 	}
 
 	r = sd_bus_message_append_basic(m, type, value);
 	if (r < 0) {
-		LOG_ERR("BLZ failed to create property");
+		CLOG_ERR(ctx, "BLZ failed to create property");
 		return r;
 	}
 
 	/* close variant */
 	r = sd_bus_message_close_container(m);
 	if (r < 0) {
-		LOG_ERR("BLZ failed to create property");
+		CLOG_ERR(ctx, "BLZ failed to create property");
 		return r;
 	}
 
 	/* close dict */
 	r = sd_bus_message_close_container(m);
 	if (r < 0) {
-		LOG_ERR("BLZ failed to create property");
+		CLOG_ERR(ctx, "BLZ failed to create property");
 		return r;
 	}
 
@@ -591,23 +656,23 @@ int msg_append_property(sd_bus_message* m, const char* name, char type,
 }
 
 /** type can only be basic type, but as string */
-int msg_read_variant(sd_bus_message* m, char* type, void* dest)
+int msg_read_variant(blz* ctx, sd_bus_message* m, char* type, void* dest)
 {
 	int r = sd_bus_message_enter_container(m, 'v', type);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse variant 1");
+		CLOG_ERR(ctx, "BLZ error parse variant 1");
 		return r;
 	}
 
 	r = sd_bus_message_read_basic(m, type[0], dest);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse variant 2");
+		CLOG_ERR(ctx, "BLZ error parse variant 2");
 		return r;
 	}
 
 	r = sd_bus_message_exit_container(m);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse variant 3");
+		CLOG_ERR(ctx, "BLZ error parse variant 3");
 		return r;
 	}
 
@@ -615,25 +680,88 @@ int msg_read_variant(sd_bus_message* m, char* type, void* dest)
 }
 
 /** type can only be basic type, but as string */
-int msg_read_variant_strv(sd_bus_message* m, char*** dest)
+int msg_read_variant_strv(blz* ctx, sd_bus_message* m, char*** dest)
 {
 	int r = sd_bus_message_enter_container(m, 'v', "as");
 	if (r < 0) {
-		LOG_ERR("BLZ error parse strv variant 1");
+		CLOG_ERR(ctx, "BLZ error parse strv variant 1");
 		return r;
 	}
 
 	r = sd_bus_message_read_strv(m, dest);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse strv variant 2");
+		CLOG_ERR(ctx, "BLZ error parse strv variant 2");
 		return r;
 	}
 
 	r = sd_bus_message_exit_container(m);
 	if (r < 0) {
-		LOG_ERR("BLZ error parse strv variant 3");
+		CLOG_ERR(ctx, "BLZ error parse strv variant 3");
 		return r;
 	}
 
 	return r;
 }
+
+static ssize_t msg_size_container(sd_bus_message* m)
+{
+	char type;
+	const char* contents;
+	ssize_t size = 0;
+	int r;
+
+	while ((r = sd_bus_message_peek_type(m, &type, &contents)) > 0) {
+		if (type == 'a' && contents[1] == '\0'
+			&& strchr("ybnqiuxtd", *contents)) {
+			/* arrays of fixed size types in one go */
+			const void* ptr;
+			size_t len;
+			r = sd_bus_message_read_array(m, *contents, &ptr, &len);
+			if (r < 0) {
+				return r;
+			}
+			size += 4 + len;
+		} else if (type == 'a' || type == 'v' || type == 'r' || type == 'e') {
+			r = sd_bus_message_enter_container(m, type, contents);
+			if (r < 0) {
+				return r;
+			}
+			ssize_t s = msg_size_container(m);
+			if (s < 0) {
+				return s;
+			}
+			r = sd_bus_message_exit_container(m);
+			if (r < 0) {
+				return r;
+			}
+			size += 8 + s;
+		} else {
+			union {
+				const char* str;
+				uint64_t u64;
+			} v;
+			r = sd_bus_message_read_basic(m, type, &v);
+			if (r < 0) {
+				return r;
+			}
+			if (type == 's' || type == 'o' || type == 'g') {
+				size += 5 + strlen(v.str);
+			} else {
+				size += 8;
+			}
+		}
+	}
+
+	return r < 0 ? r : size;
+}
+
+/** approximate memory used by message body, rewinds message */
+ssize_t msg_size(blz* ctx, sd_bus_message* m)
+{
+	ssize_t size = msg_size_container(m);
+	if (size < 0) {
+		CLOG_ERR(ctx, "BLZ error estimating message size");
+	}
+	sd_bus_message_rewind(m, true);
+	return size;
+}
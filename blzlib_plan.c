@@ -0,0 +1,610 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/*
+ * A plan is a list of steps on characteristics, which are identified by
+ * service and characteristic UUID. Services and characteristics are
+ * deduplicated when the plan is built, so an execution looks up each of them
+ * once from a single GetManagedObjects, no matter how many steps use it.
+ *
+ * An execution (run) is one allocation holding the results of all steps and
+ * the characteristic objects. It counts the steps in progress and finishes
+ * when none are left. While steps are being started the count is held one
+ * higher, so that steps failing right away can't finish it early.
+ */
+
+enum plan_step_type { STEP_READ, STEP_WRITE, STEP_NOTIFY };
+
+struct plan_char {
+	const char* uuid; /* interned */
+	size_t serv;	  /* index into servs */
+};
+
+struct plan_step {
+	enum plan_step_type type;
+	size_t ch; /* index into chars */
+	uint8_t* data;
+	size_t len;
+	blz_notify_handler_t notify_cb;
+	void* notify_user;
+};
+
+struct blz_plan {
+	blz* ctx;
+	const char** servs; /* interned UUIDs */
+	size_t serv_count;
+	size_t serv_cap;
+	struct plan_char* chars;
+	size_t char_count;
+	size_t char_cap;
+	struct plan_step* steps;
+	size_t step_count;
+	size_t step_cap;
+};
+
+struct plan_res {
+	struct blz_plan_result r;
+	struct blz_plan_run* run;
+};
+
+struct blz_plan_run {
+	blz_plan* plan;
+	blz* ctx;
+	blz_dev* dev;
+	blz_plan_cb_t cb;
+	void* user;
+	uint64_t start;
+	struct blz_plan_times times;
+	int err;
+	size_t pending;
+	size_t next_write; /* first step which may be a write not started */
+	bool write_failed;
+	bool chars_pass; /* second pass over the object tree */
+	size_t size;
+	struct plan_res* res;		   /* per step */
+	blz_char** chars;			   /* per plan char */
+	char (*spath)[DBUS_PATH_MAX_LEN]; /* per plan service */
+};
+
+/** returns arr grown to hold one more element, or NULL */
+static void* plan_grow(blz* ctx, void* arr, size_t count, size_t* cap,
+					   size_t size)
+{
+	if (count < *cap) {
+		return arr;
+	}
+
+	size_t ncap = *cap ? *cap * 2 : 8;
+	void* n = mem_alloc(ctx, BLZ_MEM_QUEUES, ncap * size);
+	if (n == NULL) {
+		CLOG_ERR(ctx, "BLZ plan alloc failed");
+		return NULL;
+	}
+	if (count > 0) {
+		memcpy(n, arr, count * size);
+	}
+	mem_free(ctx, BLZ_MEM_QUEUES, arr, *cap * size);
+	*cap = ncap;
+	return n;
+}
+
+blz_plan* blz_plan_new(blz* ctx)
+{
+	blz_plan* plan = mem_alloc(ctx, BLZ_MEM_QUEUES, sizeof(struct blz_plan));
+	if (plan == NULL) {
+		CLOG_ERR(ctx, "BLZ plan alloc failed");
+		return NULL;
+	}
+	plan->ctx = ctx;
+	return plan;
+}
+
+void blz_plan_free(blz_plan* plan)
+{
+	if (!plan) {
+		return;
+	}
+
+	blz* ctx = plan->ctx;
+	for (size_t i = 0; i < plan->step_count; i++) {
+		mem_free(ctx, BLZ_MEM_QUEUES, plan->steps[i].data,
+				 plan->steps[i].len);
+	}
+	mem_free(ctx, BLZ_MEM_QUEUES, plan->steps,
+			 plan->step_cap * sizeof(struct plan_step));
+	mem_free(ctx, BLZ_MEM_QUEUES, plan->chars,
+			 plan->char_cap * sizeof(struct plan_char));
+	mem_free(ctx, BLZ_MEM_QUEUES, plan->servs,
+			 plan->serv_cap * sizeof(const char*));
+	mem_free(ctx, BLZ_MEM_QUEUES, plan, sizeof(struct blz_plan));
+}
+
+/** index of the characteristic, added if it is new, or -1 */
+static int plan_char(blz_plan* plan, const char* uuid_srv,
+					 const char* uuid_char)
+{
+	const char* su = uuid_intern(plan->ctx, uuid_srv);
+	const char* cu = uuid_intern(plan->ctx, uuid_char);
+	if (su == NULL || cu == NULL) {
+		return -1;
+	}
+
+	/* interned, so they can be compared by pointer */
+	size_t s = 0;
+	while (s < plan->serv_count && plan->servs[s] != su) {
+		s++;
+	}
+	if (s == plan->serv_count) {
+		const char** n = plan_grow(plan->ctx, plan->servs, plan->serv_count,
+								   &plan->serv_cap, sizeof(const char*));
+		if (n == NULL) {
+			return -1;
+		}
+		plan->servs = n;
+		plan->servs[plan->serv_count++] = su;
+	}
+
+	for (size_t i = 0; i < plan->char_count; i++) {
+		if (plan->chars[i].uuid == cu && plan->chars[i].serv == s) {
+			return i;
+		}
+	}
+
+	struct plan_char* n = plan_grow(plan->ctx, plan->chars, plan->char_count,
+									&plan->char_cap, sizeof(struct plan_char));
+	if (n == NULL) {
+		return -1;
+	}
+	plan->chars = n;
+	plan->chars[plan->char_count].uuid = cu;
+	plan->chars[plan->char_count].serv = s;
+	return plan->char_count++;
+}
+
+static struct plan_step* plan_step_add(blz_plan* plan, enum plan_step_type t,
+									   const char* uuid_srv,
+									   const char* uuid_char)
+{
+	int ch = plan_char(plan, uuid_srv, uuid_char);
+	if (ch < 0) {
+		return NULL;
+	}
+
+	struct plan_step* n = plan_grow(plan->ctx, plan->steps, plan->step_count,
+									&plan->step_cap, sizeof(struct plan_step));
+	if (n == NULL) {
+		return NULL;
+	}
+	plan->steps = n;
+
+	struct plan_step* st = &plan->steps[plan->step_count];
+	memset(st, 0, sizeof(*st));
+	st->type = t;
+	st->ch = ch;
+	return st;
+}
+
+int blz_plan_read(blz_plan* plan, const char* uuid_srv, const char* uuid_char)
+{
+	if (plan_step_add(plan, STEP_READ, uuid_srv, uuid_char) == NULL) {
+		return -1;
+	}
+	return plan->step_count++;
+}
+
+int blz_plan_write(blz_plan* plan, const char* uuid_srv, const char* uuid_char,
+				   const uint8_t* data, size_t len)
+{
+	struct plan_step* st = plan_step_add(plan, STEP_WRITE, uuid_srv,
+										 uuid_char);
+	if (st == NULL) {
+		return -1;
+	}
+
+	if (len > 0) {
+		st->data = mem_alloc(plan->ctx, BLZ_MEM_QUEUES, len);
+		if (st->data == NULL) {
+			CLOG_ERR(plan->ctx, "BLZ plan alloc failed");
+			return -1;
+		}
+		memcpy(st->data, data, len);
+		st->len = len;
+	}
+	return plan->step_count++;
+}
+
+int blz_plan_notify(blz_plan* plan, const char* uuid_srv,
+					const char* uuid_char, blz_notify_handler_t cb, void* user)
+{
+	struct plan_step* st = plan_step_add(plan, STEP_NOTIFY, uuid_srv,
+										 uuid_char);
+	if (st == NULL) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < plan->step_count; i++) {
+		if (plan->steps[i].type == STEP_NOTIFY && plan->steps[i].ch == st->ch) {
+			CLOG_ERR(plan->ctx, "BLZ plan already notifies %s", uuid_char);
+			return -1;
+		}
+	}
+
+	st->notify_cb = cb;
+	st->notify_user = user;
+	return plan->step_count++;
+}
+
+static uint64_t run_elapsed(blz_plan_run* run)
+{
+	/* never 0, that means not started */
+	return MAX(now_usec() - run->start, 1);
+}
+
+/** the last step has finished, the callback may free the run */
+static void run_put(blz_plan_run* run)
+{
+	if (--run->pending > 0) {
+		return;
+	}
+
+	/* steps not started because the connect or lookup failed */
+	for (size_t i = 0; i < run->plan->step_count; i++) {
+		if (run->res[i].r.start_us == 0) {
+			run->res[i].r.err = run->err;
+		}
+	}
+	run->times.done_us = run_elapsed(run);
+	run->cb(run, run->err, run->user);
+}
+
+static void step_begin(struct plan_res* pr)
+{
+	pr->run->pending++;
+	pr->r.start_us = run_elapsed(pr->run);
+}
+
+static void step_done(struct plan_res* pr, int err)
+{
+	blz_plan_run* run = pr->run;
+
+	pr->r.err = err;
+	pr->r.end_us = run_elapsed(run);
+	if (err < 0 && run->err == 0) {
+		run->err = err;
+	}
+}
+
+static void step_read_cb(blz_char* ch, int err, const uint8_t* data, size_t len,
+						 void* user)
+{
+	struct plan_res* pr = user;
+	blz_plan_run* run = pr->run;
+
+	if (err == 0 && len > 0) {
+		uint8_t* d = mem_alloc(run->ctx, BLZ_MEM_QUEUES, len);
+		if (d != NULL) {
+			memcpy(d, data, len);
+			pr->r.data = d;
+			pr->r.len = len;
+		} else {
+			CLOG_ERR(run->ctx, "BLZ plan alloc failed");
+			err = -ENOMEM;
+		}
+	}
+	step_done(pr, err);
+	run_put(run);
+}
+
+static void step_notify_cb(blz_char* ch, int err, void* user)
+{
+	struct plan_res* pr = user;
+	step_done(pr, err);
+	run_put(pr->run);
+}
+
+static void run_writes(blz_plan_run* run);
+
+static void step_write_cb(blz_char* ch, int err, void* user)
+{
+	struct plan_res* pr = user;
+	blz_plan_run* run = pr->run;
+
+	step_done(pr, err);
+	if (err < 0) {
+		run->write_failed = true;
+	}
+	/* this step is still counted, so the run can't finish in between */
+	run_writes(run);
+	run_put(run);
+}
+
+/** starts the next write, or cancels all remaining after a failed one */
+static void run_writes(blz_plan_run* run)
+{
+	blz_plan* plan = run->plan;
+
+	while (run->next_write < plan->step_count) {
+		size_t i = run->next_write++;
+		struct plan_step* st = &plan->steps[i];
+		struct plan_res* pr = &run->res[i];
+		blz_char* ch = run->chars[st->ch];
+
+		if (st->type != STEP_WRITE) {
+			continue;
+		}
+
+		/* like the fan-out, write commands where requests aren't supported */
+		const char* type = NULL;
+		if (ch != NULL && (ch->flags & BLZ_CHAR_WRITE)) {
+			type = "request";
+		} else if (ch != NULL && (ch->flags & BLZ_CHAR_WRITE_WITHOUT_RESPONSE)) {
+			type = "command";
+		}
+
+		step_begin(pr);
+		if (run->write_failed) {
+			step_done(pr, -ECANCELED);
+		} else if (ch == NULL) {
+			step_done(pr, -ENOENT);
+			run->write_failed = true;
+		} else if (type == NULL) {
+			CLOG_ERR(run->ctx, "BLZ characteristic does not support write");
+			step_done(pr, -EOPNOTSUPP);
+			run->write_failed = true;
+		} else if (!char_write_async(ch, st->data, st->len, type, step_write_cb,
+									 pr)) {
+			step_done(pr, -EIO);
+			run->write_failed = true;
+		} else {
+			return;
+		}
+		run_put(run);
+	}
+}
+
+/** sends all reads and notify starts at once and the first write */
+static void run_steps(blz_plan_run* run)
+{
+	blz_plan* plan = run->plan;
+
+	for (size_t i = 0; i < plan->step_count; i++) {
+		struct plan_step* st = &plan->steps[i];
+		struct plan_res* pr = &run->res[i];
+		blz_char* ch = run->chars[st->ch];
+		bool ok;
+
+		if (st->type == STEP_WRITE) {
+			continue;
+		}
+
+		step_begin(pr);
+		if (ch == NULL) {
+			step_done(pr, -ENOENT);
+			run_put(run);
+			continue;
+		}
+
+		if (st->type == STEP_READ) {
+			ok = blz_char_read_async(ch, step_read_cb, pr);
+		} else {
+			ok = blz_char_notify_start_async(ch, st->notify_cb, st->notify_user,
+											 step_notify_cb, pr);
+		}
+		if (!ok) {
+			step_done(pr, -EOPNOTSUPP);
+			run_put(run);
+		}
+	}
+
+	run_writes(run);
+}
+
+/* blz_dev_enumerate() callback, in the first pass for services and in the
+ * second for characteristics as BlueZ doesn't guarantee that services come
+ * before their characteristics */
+static void run_attr_cb(const struct blz_gatt_attr* attr, void* user)
+{
+	blz_plan_run* run = user;
+	blz_plan* plan = run->plan;
+
+	if (!run->chars_pass && attr->type == BLZ_GATT_SERVICE) {
+		for (size_t i = 0; i < plan->serv_count; i++) {
+			if (plan->servs[i] == attr->uuid && run->spath[i][0] == '\0'
+				&& strlen(attr->path) < DBUS_PATH_MAX_LEN) {
+				strcpy(run->spath[i], attr->path);
+			}
+		}
+		return;
+	}
+
+	if (!run->chars_pass || attr->type != BLZ_GATT_CHAR) {
+		return;
+	}
+
+	const char* slash = strrchr(attr->path, '/');
+	size_t plen = slash ? slash - attr->path : 0;
+	for (size_t i = 0; i < plan->char_count; i++) {
+		const char* sp = run->spath[plan->chars[i].serv];
+		if (run->chars[i] != NULL || plan->chars[i].uuid != attr->uuid
+			|| strlen(sp) != plen || strncmp(sp, attr->path, plen) != 0) {
+			continue;
+		}
+		run->chars[i] = blz_char_from_attr(run->dev, attr);
+	}
+}
+
+static void run_objects_cb(blz_dev* dev, int err, sd_bus_message* reply,
+						   void* user)
+{
+	blz_plan_run* run = user;
+	struct gatt_enum ge = {.cb = run_attr_cb, .user = run};
+
+	run->pending = 1;
+	if (reply != NULL) {
+		for (int pass = 0; pass < 2 && err >= 0; pass++) {
+			run->chars_pass = pass;
+			err = sd_bus_message_rewind(reply, true);
+			if (err >= 0) {
+				err = msg_parse_objects(run->ctx, reply, dev->path,
+										MSG_GATT_ALL, &ge);
+			}
+		}
+	}
+
+	if (err < 0) {
+		run->err = err;
+		run_put(run);
+		return;
+	}
+
+	run->times.resolved_us = run_elapsed(run);
+	run_steps(run);
+	run_put(run);
+}
+
+static void run_connect_cb(blz_dev* dev, int err, void* user)
+{
+	blz_plan_run* run = user;
+
+	run->dev = dev;
+	if (dev == NULL) {
+		run->err = err;
+		run->pending = 1;
+		run_put(run);
+		return;
+	}
+
+	run->times.connected_us = run_elapsed(run);
+	if (!dev_objects_async(dev, run_objects_cb, run)) {
+		run->err = -EIO;
+		run->pending = 1;
+		run_put(run);
+	}
+}
+
+bool blz_plan_exec_async(blz_plan* plan, const char* macstr,
+						 enum blz_addr_type atype, blz_plan_cb_t cb,
+						 void* user)
+{
+	blz* ctx = plan->ctx;
+	size_t rsize = plan->step_count * sizeof(struct plan_res);
+	size_t csize = plan->char_count * sizeof(blz_char*);
+	size_t size = sizeof(struct blz_plan_run) + rsize + csize
+				  + plan->serv_count * DBUS_PATH_MAX_LEN;
+
+	blz_plan_run* run = mem_alloc(ctx, BLZ_MEM_QUEUES, size);
+	if (run == NULL) {
+		CLOG_ERR(ctx, "BLZ plan run alloc failed");
+		return false;
+	}
+
+	run->plan = plan;
+	run->ctx = ctx;
+	run->cb = cb;
+	run->user = user;
+	run->size = size;
+	run->res = (struct plan_res*)(run + 1);
+	run->chars = (blz_char**)((char*)run->res + rsize);
+	run->spath = (void*)((char*)run->chars + csize);
+	for (size_t i = 0; i < plan->step_count; i++) {
+		run->res[i].run = run;
+	}
+
+	run->start = now_usec();
+	if (!blz_connect_async(ctx, macstr, atype, run_connect_cb, run)) {
+		mem_free(ctx, BLZ_MEM_QUEUES, run, size);
+		return false;
+	}
+	return true;
+}
+
+struct plan_wait {
+	bool done;
+	blz_plan_run* run;
+};
+
+static void plan_wait_cb(blz_plan_run* run, int err, void* user)
+{
+	struct plan_wait* w = user;
+	w->run = run;
+	w->done = true;
+}
+
+blz_plan_run* blz_plan_exec(blz_plan* plan, const char* macstr,
+							enum blz_addr_type atype)
+{
+	struct plan_wait w = {0};
+
+	if (!blz_plan_exec_async(plan, macstr, atype, plan_wait_cb, &w)) {
+		return NULL;
+	}
+
+	/* every step is a call with a timeout */
+	while (!w.done) {
+		blz_loop(plan->ctx, UINT64_MAX);
+	}
+	return w.run;
+}
+
+int blz_plan_run_err(blz_plan_run* run)
+{
+	return run->err;
+}
+
+const struct blz_plan_result* blz_plan_run_result(blz_plan_run* run, int step)
+{
+	if (step < 0 || (size_t)step >= run->plan->step_count) {
+		return NULL;
+	}
+	return &run->res[step].r;
+}
+
+const struct blz_plan_times* blz_plan_run_times(blz_plan_run* run)
+{
+	return &run->times;
+}
+
+blz_dev* blz_plan_run_dev(blz_plan_run* run)
+{
+	return run->dev;
+}
+
+blz_char* blz_plan_run_char(blz_plan_run* run, int step)
+{
+	if (step < 0 || (size_t)step >= run->plan->step_count) {
+		return NULL;
+	}
+	return run->chars[run->plan->steps[step].ch];
+}
+
+void blz_plan_run_free(blz_plan_run* run)
+{
+	if (!run) {
+		return;
+	}
+
+	blz_plan* plan = run->plan;
+	for (size_t i = 0; i < plan->step_count; i++) {
+		mem_free(run->ctx, BLZ_MEM_QUEUES, (void*)run->res[i].r.data,
+				 run->res[i].r.len);
+	}
+	for (size_t i = 0; i < plan->char_count; i++) {
+		blz_char_free(run->chars[i]);
+	}
+	blz_disconnect(run->dev);
+	mem_free(run->ctx, BLZ_MEM_QUEUES, run, run->size);
+}
@@ -0,0 +1,306 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#ifndef BLZLIB_PROFILE_HPP
+#define BLZLIB_PROFILE_HPP
+
+/*
+ * Compile time UUIDs and GATT profiles for blzlib.hpp.
+ *
+ * "6e400002-b5a3-f393-e0a9-e50e24dcca9e"_uuid and "2a29"_uuid (16 bit SIG
+ * UUID) are parsed by the compiler, a malformed UUID doesn't compile. A
+ * profile declares the services and characteristics a device must have,
+ * with the flags each characteristic needs:
+ *
+ *     using namespace blzpp::literals;
+ *     using nus = blzpp::profile<blzpp::gatt_service<
+ *         "6e400001-b5a3-f393-e0a9-e50e24dcca9e"_uuid,
+ *         blzpp::gatt_char<"6e400002-b5a3-f393-e0a9-e50e24dcca9e"_uuid,
+ *                          BLZ_CHAR_WRITE>,
+ *         blzpp::gatt_char<"6e400003-b5a3-f393-e0a9-e50e24dcca9e"_uuid,
+ *                          BLZ_CHAR_NOTIFY>>>;
+ *
+ *     auto p = nus::resolve(dev);
+ *     p.get<"6e400002-b5a3-f393-e0a9-e50e24dcca9e"_uuid>().write(...);
+ *
+ * resolve() finds all members from one object tree lookup
+ * (blz_dev_enumerate()) and fails unless every one was found with its
+ * flags. get<>() of a UUID which is not part of the profile doesn't compile.
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "blzlib.hpp"
+#include "blzlib_util.h"
+
+namespace blzpp {
+
+/** 128 bit UUID, in the byte order of blz_string_to_uuid() (little endian)
+ * and as lowercase string like the UUIDs interned by blzlib */
+struct uuid {
+	std::array<uint8_t, 16> bytes{};
+	std::array<char, BLZ_UUID_STR_LEN> str{};
+
+	constexpr const char* c_str() const { return str.data(); }
+	constexpr bool operator==(const uuid&) const = default;
+};
+
+namespace detail {
+
+/* not constexpr: reaching it in a consteval function is a compile error */
+inline void malformed_uuid_literal() {}
+
+consteval int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	malformed_uuid_literal();
+	return -1;
+}
+
+consteval uuid parse_uuid(const char* s, size_t len)
+{
+	constexpr char base[] = "00000000-0000-1000-8000-00805f9b34fb";
+	uuid u;
+
+	/* 16 bit UUIDs are inserted into the base UUID */
+	if (len == 4) {
+		for (size_t i = 0; i < 36; i++) {
+			u.str[i] = i >= 4 && i < 8 ? s[i - 4] : base[i];
+		}
+	} else if (len == 36) {
+		for (size_t i = 0; i < 36; i++) {
+			u.str[i] = s[i];
+		}
+	} else {
+		malformed_uuid_literal();
+	}
+
+	int b = 15;
+	for (size_t i = 0; i < 36; i += 2) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (u.str[i] != '-') {
+				malformed_uuid_literal();
+			}
+			i--;
+			continue;
+		}
+		int hi = hex_digit(u.str[i]);
+		int lo = hex_digit(u.str[i + 1]);
+		u.bytes[b--] = hi << 4 | lo;
+		u.str[i] = "0123456789abcdef"[hi];
+		u.str[i + 1] = "0123456789abcdef"[lo];
+	}
+	return u;
+}
+
+} // namespace detail
+
+namespace literals {
+
+consteval uuid operator""_uuid(const char* s, size_t len)
+{
+	return detail::parse_uuid(s, len);
+}
+
+} // namespace literals
+
+/** characteristic of a profile, Flags are BLZ_CHAR_* it must have */
+template <uuid U, uint32_t Flags = 0> struct gatt_char {
+	static constexpr uuid id = U;
+	static constexpr uint32_t flags = Flags;
+};
+
+template <uuid U, class... Chars> struct gatt_service {
+	static constexpr uuid id = U;
+	static constexpr size_t char_count = sizeof...(Chars);
+	static constexpr std::array<uuid, sizeof...(Chars)> char_ids = {
+		Chars::id...};
+	static constexpr std::array<uint32_t, sizeof...(Chars)> char_flags = {
+		Chars::flags...};
+};
+
+template <class... Servs> class profile
+{
+public:
+	static constexpr size_t serv_count = sizeof...(Servs);
+	static constexpr size_t char_count = (Servs::char_count + ... + 0);
+
+	profile() = default;
+
+	/** looks up all services and characteristics of the profile in dev,
+	 * which must outlive the result. Empty (operator bool) if one is
+	 * missing or lacks a flag */
+	static profile resolve(const device& dev)
+	{
+		struct resolver r;
+		r.dev = dev.get();
+		if (!dev.enumerate(r)) {
+			return profile();
+		}
+
+		for (size_t i = 0; i < char_count; i++) {
+			if (!r.p.chars_[i] || !r.parent_ok(i)) {
+				/* not found in the right service */
+				return profile();
+			}
+		}
+		for (size_t i = 0; i < serv_count; i++) {
+			if (!r.p.servs_[i]) {
+				return profile();
+			}
+		}
+		r.p.ok_ = true;
+		return std::move(r.p);
+	}
+
+	explicit operator bool() const { return ok_; }
+
+	template <uuid U> characteristic& get()
+	{
+		constexpr size_t i = char_index(U);
+		static_assert(i < char_count, "characteristic is not in profile");
+		return chars_[i];
+	}
+
+	template <uuid U> service& serv()
+	{
+		constexpr size_t i = serv_index(U);
+		static_assert(i < serv_count, "service is not in profile");
+		return servs_[i];
+	}
+
+private:
+	struct entry {
+		uuid id;
+		uint32_t flags = 0;
+		size_t serv = 0;
+	};
+
+	static constexpr std::array<uuid, serv_count> serv_ids = {Servs::id...};
+
+	static constexpr std::array<entry, char_count> make_chars()
+	{
+		std::array<entry, char_count> a{};
+		size_t k = 0;
+		size_t s = 0;
+		auto add = [&]<class S>() {
+			for (size_t j = 0; j < S::char_count; j++) {
+				a[k++] = {S::char_ids[j], S::char_flags[j], s};
+			}
+			s++;
+		};
+		(add.template operator()<Servs>(), ...);
+		return a;
+	}
+
+	static constexpr std::array<entry, char_count> chars = make_chars();
+
+	static constexpr size_t char_index(const uuid& u)
+	{
+		for (size_t i = 0; i < char_count; i++) {
+			if (chars[i].id == u) {
+				return i;
+			}
+		}
+		return char_count;
+	}
+
+	static constexpr size_t serv_index(const uuid& u)
+	{
+		for (size_t i = 0; i < serv_count; i++) {
+			if (serv_ids[i] == u) {
+				return i;
+			}
+		}
+		return serv_count;
+	}
+
+	static constexpr bool unique_servs()
+	{
+		for (size_t i = 0; i < serv_count; i++) {
+			if (serv_index(serv_ids[i]) != i) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static_assert(unique_servs(), "service declared twice in profile");
+
+	/* blz_dev_enumerate() callback. BlueZ doesn't guarantee that services
+	 * come before their characteristics, so the parent path of each match
+	 * is kept and checked against the service at the end */
+	struct resolver {
+		static constexpr size_t path_len = 128;
+
+		blz_dev* dev = nullptr;
+		profile p;
+		std::array<std::array<char, path_len>, serv_count> spath{};
+		std::array<std::array<char, path_len>, char_count> cpath{};
+
+		bool parent_ok(size_t i) const
+		{
+			return p.servs_[chars[i].serv]
+				   && std::strcmp(cpath[i].data(),
+								  spath[chars[i].serv].data())
+						  == 0;
+		}
+
+		void operator()(const blz_gatt_attr& a)
+		{
+			size_t len = std::strlen(a.path);
+			if (len >= path_len) {
+				return;
+			}
+
+			if (a.type == BLZ_GATT_SERVICE) {
+				for (size_t i = 0; i < serv_count; i++) {
+					if (!p.servs_[i]
+						&& std::strcmp(a.uuid, serv_ids[i].c_str()) == 0) {
+						p.servs_[i] = service(blz_serv_from_attr(dev, &a));
+						std::memcpy(spath[i].data(), a.path, len + 1);
+					}
+				}
+				return;
+			}
+
+			if (a.type != BLZ_GATT_CHAR) {
+				return;
+			}
+
+			const char* slash = std::strrchr(a.path, '/');
+			size_t plen = slash ? slash - a.path : 0;
+			for (size_t i = 0; i < char_count; i++) {
+				if (std::strcmp(a.uuid, chars[i].id.c_str()) != 0
+					|| (a.flags & chars[i].flags) != chars[i].flags
+					|| (p.chars_[i] && parent_ok(i))) {
+					continue;
+				}
+				p.chars_[i] = characteristic(blz_char_from_attr(dev, &a));
+				std::memcpy(cpath[i].data(), a.path, plen);
+				cpath[i][plen] = '\0';
+			}
+		}
+	};
+
+	std::array<service, serv_count> servs_;
+	std::array<characteristic, char_count> chars_;
+	bool ok_ = false;
+};
+
+} // namespace blzpp
+
+#endif
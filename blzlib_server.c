@@ -0,0 +1,699 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <systemd/sd-bus.h>
+#include <unistd.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/*
+ * The application is an object tree below the server path, with an object
+ * manager at the path itself where BlueZ calls GetManagedObjects while
+ * RegisterApplication is in progress. So registering must not block in
+ * sd_bus_call(), it runs blz_loop() until the reply arrives.
+ *
+ *     /org/blzlib/server				ObjectManager
+ *     /org/blzlib/server/service0		GattService1
+ *     /org/blzlib/server/service0/char0	GattCharacteristic1
+ *
+ * The socket of AcquireNotify is a SOCK_SEQPACKET pair, one packet is one
+ * notification. Its end is closed by BlueZ when the client unsubscribes,
+ * which is noticed by the next blz_server_notify().
+ */
+
+#define SERVER_PATH		 "/org/blzlib/server"
+#define SERVER_VALUE_MAX 512
+#define SERVER_MTU_MIN	 23
+
+struct server_serv {
+	struct server_serv* next;
+	char path[DBUS_PATH_MAX_LEN];
+	const char* uuid; /* interned */
+	sd_bus_slot* slot;
+};
+
+struct blz_server_char {
+	struct blz_server* srv;
+	struct blz_server_char* next;
+	struct server_serv* serv;
+	char path[DBUS_PATH_MAX_LEN];
+	const char* uuid; /* interned */
+	uint32_t flags;
+	blz_server_write_cb_t write_cb;
+	void* write_user;
+	blz_server_fd_cb_t fd_cb;
+	void* fd_user;
+	sd_bus_slot* slot;
+	bool notifying; /* StartNotify */
+	int notify_fd;	/* AcquireNotify, -1 if not acquired */
+	size_t len;
+	uint8_t value[SERVER_VALUE_MAX];
+};
+
+struct blz_server {
+	blz* ctx;
+	struct blz_server* next; /* ctx->servers */
+	char path[DBUS_PATH_MAX_LEN];
+	sd_bus_slot* om_slot;
+	struct server_serv* servs;
+	struct server_serv* servs_last;
+	int num_servs;
+	struct blz_server_char* chars;
+	struct blz_server_char* chars_last;
+	bool registered;
+};
+
+static const struct {
+	uint32_t flag;
+	const char* name;
+} char_flag_names[] = {
+	{BLZ_CHAR_BROADCAST, "broadcast"},
+	{BLZ_CHAR_READ, "read"},
+	{BLZ_CHAR_WRITE_WITHOUT_RESPONSE, "write-without-response"},
+	{BLZ_CHAR_WRITE, "write"},
+	{BLZ_CHAR_NOTIFY, "notify"},
+	{BLZ_CHAR_INDICATE, "indicate"},
+	{BLZ_CHAR_SIGNED_WRITE, "authenticated-signed-writes"},
+	{BLZ_CHAR_EXTENDED, "extended-properties"},
+};
+
+/** reads the uint16 option "key" of an a{sv} dictionary, others are
+ * skipped. val stays as it is if the key is missing */
+static int read_option_u16(sd_bus_message* m, const char* key, uint16_t* val)
+{
+	const char* k;
+
+	int r = sd_bus_message_enter_container(m, 'a', "{sv}");
+	while (r >= 0
+		   && (r = sd_bus_message_enter_container(m, 'e', "sv")) > 0) {
+		r = sd_bus_message_read(m, "s", &k);
+		if (r >= 0 && strcmp(k, key) == 0) {
+			r = sd_bus_message_read(m, "v", "q", val);
+		} else if (r >= 0) {
+			r = sd_bus_message_skip(m, "v");
+		}
+		if (r >= 0) {
+			r = sd_bus_message_exit_container(m);
+		}
+	}
+	if (r >= 0) {
+		r = sd_bus_message_exit_container(m);
+	}
+	return r;
+}
+
+/* --- GattService1 --- */
+
+static int serv_get_uuid(sd_bus* bus, const char* path, const char* intf,
+						 const char* prop, sd_bus_message* reply, void* user,
+						 sd_bus_error* err)
+{
+	struct server_serv* sv = user;
+	return sd_bus_message_append(reply, "s", sv->uuid);
+}
+
+static int serv_get_primary(sd_bus* bus, const char* path, const char* intf,
+							const char* prop, sd_bus_message* reply,
+							void* user, sd_bus_error* err)
+{
+	return sd_bus_message_append(reply, "b", 1);
+}
+
+/* clang-format off */
+static const sd_bus_vtable serv_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("UUID", "s", serv_get_uuid, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Primary", "b", serv_get_primary, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_VTABLE_END
+};
+/* clang-format on */
+
+/* --- GattCharacteristic1 --- */
+
+static void char_notify_release(blz_server_char* ch)
+{
+	if (ch->notify_fd < 0) {
+		return;
+	}
+	close(ch->notify_fd);
+	ch->notify_fd = -1;
+	sd_bus_emit_properties_changed(ch->srv->ctx->bus, ch->path,
+								   "org.bluez.GattCharacteristic1",
+								   "NotifyAcquired", NULL);
+}
+
+static int char_get_prop(sd_bus* bus, const char* path, const char* intf,
+						 const char* prop, sd_bus_message* reply, void* user,
+						 sd_bus_error* err)
+{
+	blz_server_char* ch = user;
+	int r;
+
+	if (strcmp(prop, "UUID") == 0) {
+		return sd_bus_message_append(reply, "s", ch->uuid);
+	} else if (strcmp(prop, "Service") == 0) {
+		return sd_bus_message_append(reply, "o", ch->serv->path);
+	} else if (strcmp(prop, "Value") == 0) {
+		return sd_bus_message_append_array(reply, 'y', ch->value, ch->len);
+	} else if (strcmp(prop, "Notifying") == 0) {
+		return sd_bus_message_append(reply, "b", ch->notifying);
+	} else if (strcmp(prop, "NotifyAcquired") == 0) {
+		return sd_bus_message_append(reply, "b", ch->notify_fd >= 0);
+	} else if (strcmp(prop, "WriteAcquired") == 0) {
+		/* the sockets belong to the fd handler, more can be acquired */
+		return sd_bus_message_append(reply, "b", 0);
+	}
+
+	/* Flags */
+	r = sd_bus_message_open_container(reply, 'a', "s");
+	for (size_t i = 0; r >= 0 && i < ARRAY_SIZE(char_flag_names); i++) {
+		if (ch->flags & char_flag_names[i].flag) {
+			r = sd_bus_message_append(reply, "s", char_flag_names[i].name);
+		}
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(reply);
+	}
+	return r;
+}
+
+static int char_read_value(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	blz_server_char* ch = user;
+	sd_bus_message* reply = NULL;
+	uint16_t offset = 0;
+
+	if (!(ch->flags & BLZ_CHAR_READ)) {
+		return sd_bus_reply_method_errorf(m, "org.bluez.Error.NotPermitted",
+										  "Read not permitted");
+	}
+
+	int r = read_option_u16(m, "offset", &offset);
+	if (r < 0) {
+		return r;
+	}
+	if (offset > ch->len) {
+		return sd_bus_reply_method_errorf(m, "org.bluez.Error.InvalidOffset",
+										  "Invalid offset");
+	}
+
+	r = sd_bus_message_new_method_return(m, &reply);
+	if (r >= 0) {
+		r = sd_bus_message_append_array(reply, 'y', ch->value + offset,
+										ch->len - offset);
+	}
+	if (r >= 0) {
+		r = sd_bus_send(NULL, reply, NULL);
+	}
+	sd_bus_message_unref(reply);
+	return r;
+}
+
+static int char_write_value(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	blz_server_char* ch = user;
+	const void* data;
+	size_t len;
+	uint16_t offset = 0;
+
+	if (!(ch->flags & (BLZ_CHAR_WRITE | BLZ_CHAR_WRITE_WITHOUT_RESPONSE))) {
+		return sd_bus_reply_method_errorf(m, "org.bluez.Error.NotPermitted",
+										  "Write not permitted");
+	}
+
+	int r = sd_bus_message_read_array(m, 'y', &data, &len);
+	if (r >= 0) {
+		r = read_option_u16(m, "offset", &offset);
+	}
+	if (r < 0) {
+		return r;
+	}
+	if (offset + len > SERVER_VALUE_MAX) {
+		return sd_bus_reply_method_errorf(
+			m, "org.bluez.Error.InvalidValueLength", "Invalid value length");
+	}
+
+	memcpy(ch->value + offset, data, len);
+	ch->len = offset + len;
+	if (ch->write_cb != NULL) {
+		ch->write_cb(ch, data, len, ch->write_user);
+	}
+	return sd_bus_reply_method_return(m, "");
+}
+
+static int char_start_notify(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	blz_server_char* ch = user;
+
+	if (!(ch->flags & (BLZ_CHAR_NOTIFY | BLZ_CHAR_INDICATE))) {
+		return sd_bus_reply_method_errorf(m, "org.bluez.Error.NotSupported",
+										  "Notify not supported");
+	}
+	if (!ch->notifying) {
+		ch->notifying = true;
+		sd_bus_emit_properties_changed(ch->srv->ctx->bus, ch->path,
+									   "org.bluez.GattCharacteristic1",
+									   "Notifying", NULL);
+	}
+	return sd_bus_reply_method_return(m, "");
+}
+
+static int char_stop_notify(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	blz_server_char* ch = user;
+
+	if (ch->notifying) {
+		ch->notifying = false;
+		sd_bus_emit_properties_changed(ch->srv->ctx->bus, ch->path,
+									   "org.bluez.GattCharacteristic1",
+									   "Notifying", NULL);
+	}
+	return sd_bus_reply_method_return(m, "");
+}
+
+/** socket pair for AcquireNotify / AcquireWrite, the other end goes into
+ * the reply and our end is returned, or negative errno */
+static int char_acquire(sd_bus_message* m, blz_server_char* ch,
+						uint16_t* mtu)
+{
+	int sv[2];
+
+	int r = read_option_u16(m, "mtu", mtu);
+	if (r < 0) {
+		return r;
+	}
+	*mtu = MAX(*mtu, SERVER_MTU_MIN);
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+				   sv)
+		< 0) {
+		r = -errno;
+		CLOG_ERR(ch->srv->ctx, "BLZ server failed to create socket: %s",
+				 strerror(errno));
+		return r;
+	}
+
+	/* the fd is duplicated into the message */
+	r = sd_bus_reply_method_return(m, "hq", sv[1], *mtu);
+	close(sv[1]);
+	if (r < 0) {
+		close(sv[0]);
+		return r;
+	}
+	return sv[0];
+}
+
+static int char_acquire_notify(sd_bus_message* m, void* user,
+							   sd_bus_error* err)
+{
+	blz_server_char* ch = user;
+	uint16_t mtu = 0;
+
+	if (!(ch->flags & (BLZ_CHAR_NOTIFY | BLZ_CHAR_INDICATE))) {
+		return sd_bus_reply_method_errorf(m, "org.bluez.Error.NotSupported",
+										  "Notify not supported");
+	}
+	if (ch->notify_fd >= 0) {
+		return sd_bus_reply_method_errorf(m, "org.bluez.Error.NotPermitted",
+										  "Notify already acquired");
+	}
+
+	int fd = char_acquire(m, ch, &mtu);
+	if (fd < 0) {
+		return fd;
+	}
+	ch->notify_fd = fd;
+	sd_bus_emit_properties_changed(ch->srv->ctx->bus, ch->path,
+								   "org.bluez.GattCharacteristic1",
+								   "NotifyAcquired", NULL);
+	return 1;
+}
+
+static int char_acquire_write(sd_bus_message* m, void* user,
+							  sd_bus_error* err)
+{
+	blz_server_char* ch = user;
+	uint16_t mtu = 0;
+
+	int fd = char_acquire(m, ch, &mtu);
+	if (fd < 0) {
+		return fd;
+	}
+	ch->fd_cb(ch, fd, mtu, ch->fd_user);
+	return 1;
+}
+
+/* clang-format off */
+#define CHAR_VTABLE_COMMON \
+	SD_BUS_PROPERTY("UUID", "s", char_get_prop, 0, SD_BUS_VTABLE_PROPERTY_CONST), \
+	SD_BUS_PROPERTY("Service", "o", char_get_prop, 0, SD_BUS_VTABLE_PROPERTY_CONST), \
+	SD_BUS_PROPERTY("Flags", "as", char_get_prop, 0, SD_BUS_VTABLE_PROPERTY_CONST), \
+	SD_BUS_PROPERTY("Value", "ay", char_get_prop, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE), \
+	SD_BUS_PROPERTY("Notifying", "b", char_get_prop, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE), \
+	SD_BUS_PROPERTY("NotifyAcquired", "b", char_get_prop, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE), \
+	SD_BUS_METHOD("ReadValue", "a{sv}", "ay", char_read_value, 0), \
+	SD_BUS_METHOD("WriteValue", "aya{sv}", "", char_write_value, 0), \
+	SD_BUS_METHOD("StartNotify", "", "", char_start_notify, 0), \
+	SD_BUS_METHOD("StopNotify", "", "", char_stop_notify, 0), \
+	SD_BUS_METHOD("AcquireNotify", "a{sv}", "hq", char_acquire_notify, 0)
+
+static const sd_bus_vtable char_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	CHAR_VTABLE_COMMON,
+	SD_BUS_VTABLE_END
+};
+
+/* BlueZ only uses AcquireWrite if the WriteAcquired property exists */
+static const sd_bus_vtable char_vtable_write_fd[] = {
+	SD_BUS_VTABLE_START(0),
+	CHAR_VTABLE_COMMON,
+	SD_BUS_PROPERTY("WriteAcquired", "b", char_get_prop, 0, 0),
+	SD_BUS_METHOD("AcquireWrite", "a{sv}", "hq", char_acquire_write, 0),
+	SD_BUS_VTABLE_END
+};
+/* clang-format on */
+
+/* --- API --- */
+
+blz_server* blz_server_new(blz* ctx, const char* path)
+{
+	if (path == NULL) {
+		path = SERVER_PATH;
+	}
+	/* room for the service and characteristic parts */
+	if (strlen(path) >= DBUS_PATH_MAX_LEN - 32) {
+		CLOG_ERR(ctx, "BLZ server invalid path '%s'", path);
+		return NULL;
+	}
+
+	blz_server* srv = mem_alloc(ctx, BLZ_MEM_DEVICES,
+								sizeof(struct blz_server));
+	if (srv == NULL) {
+		CLOG_ERR(ctx, "BLZ server alloc failed");
+		return NULL;
+	}
+	srv->ctx = ctx;
+	strcpy(srv->path, path);
+	srv->next = ctx->servers;
+	ctx->servers = srv;
+	return srv;
+}
+
+int blz_server_add_service(blz_server* srv, const char* uuid)
+{
+	if (srv->registered) {
+		CLOG_ERR(srv->ctx, "BLZ server already registered");
+		return -1;
+	}
+
+	struct server_serv* sv = mem_alloc(srv->ctx, BLZ_MEM_DEVICES,
+									   sizeof(struct server_serv));
+	if (sv == NULL) {
+		CLOG_ERR(srv->ctx, "BLZ server alloc failed");
+		return -1;
+	}
+
+	sv->uuid = uuid_intern(srv->ctx, uuid);
+	if (sv->uuid == NULL) {
+		CLOG_ERR(srv->ctx, "BLZ server invalid UUID '%s'", uuid);
+		mem_free(srv->ctx, BLZ_MEM_DEVICES, sv, sizeof(struct server_serv));
+		return -1;
+	}
+	int r = snprintf(sv->path, DBUS_PATH_MAX_LEN, "%s/service%d", srv->path,
+					 srv->num_servs);
+	if (r < 0 || r >= DBUS_PATH_MAX_LEN) {
+		CLOG_ERR(srv->ctx, "BLZ server service path too long");
+		mem_free(srv->ctx, BLZ_MEM_DEVICES, sv, sizeof(struct server_serv));
+		return -1;
+	}
+
+	if (srv->servs_last != NULL) {
+		srv->servs_last->next = sv;
+	} else {
+		srv->servs = sv;
+	}
+	srv->servs_last = sv;
+	return srv->num_servs++;
+}
+
+blz_server_char* blz_server_add_char(blz_server* srv, int serv,
+									 const char* uuid, uint32_t flags,
+									 blz_server_write_cb_t cb, void* user)
+{
+	struct server_serv* sv = srv->servs;
+	int idx = 0;
+
+	if (srv->registered) {
+		CLOG_ERR(srv->ctx, "BLZ server already registered");
+		return NULL;
+	}
+	for (int i = 0; sv != NULL && i < serv; i++) {
+		sv = sv->next;
+	}
+	if (sv == NULL || serv < 0) {
+		CLOG_ERR(srv->ctx, "BLZ server has no service %d", serv);
+		return NULL;
+	}
+
+	blz_server_char* ch = mem_alloc(srv->ctx, BLZ_MEM_DEVICES,
+									sizeof(struct blz_server_char));
+	if (ch == NULL) {
+		CLOG_ERR(srv->ctx, "BLZ server alloc failed");
+		return NULL;
+	}
+
+	ch->uuid = uuid_intern(srv->ctx, uuid);
+	if (ch->uuid == NULL) {
+		CLOG_ERR(srv->ctx, "BLZ server invalid UUID '%s'", uuid);
+		mem_free(srv->ctx, BLZ_MEM_DEVICES, ch, sizeof(struct blz_server_char));
+		return NULL;
+	}
+
+	/* characteristics are numbered per service */
+	for (blz_server_char* c = srv->chars; c != NULL; c = c->next) {
+		if (c->serv == sv) {
+			idx++;
+		}
+	}
+	int r = snprintf(ch->path, DBUS_PATH_MAX_LEN, "%s/char%d", sv->path, idx);
+	if (r < 0 || r >= DBUS_PATH_MAX_LEN) {
+		CLOG_ERR(srv->ctx, "BLZ server characteristic path too long");
+		mem_free(srv->ctx, BLZ_MEM_DEVICES, ch, sizeof(struct blz_server_char));
+		return NULL;
+	}
+	ch->srv = srv;
+	ch->serv = sv;
+	ch->flags = flags;
+	ch->write_cb = cb;
+	ch->write_user = user;
+	ch->notify_fd = -1;
+
+	if (srv->chars_last != NULL) {
+		srv->chars_last->next = ch;
+	} else {
+		srv->chars = ch;
+	}
+	srv->chars_last = ch;
+	return ch;
+}
+
+void blz_server_char_set_fd_handler(blz_server_char* ch, blz_server_fd_cb_t cb,
+									void* user)
+{
+	if (ch->srv->registered) {
+		CLOG_ERR(ch->srv->ctx, "BLZ server already registered");
+		return;
+	}
+	ch->fd_cb = cb;
+	ch->fd_user = user;
+}
+
+bool blz_server_char_set_value(blz_server_char* ch, const uint8_t* data,
+							   size_t len)
+{
+	if (len > SERVER_VALUE_MAX) {
+		CLOG_ERR(ch->srv->ctx, "BLZ server value too long");
+		return false;
+	}
+	memcpy(ch->value, data, len);
+	ch->len = len;
+	return true;
+}
+
+int blz_server_notify(blz_server_char* ch, const uint8_t* data, size_t len)
+{
+	if (!blz_server_char_set_value(ch, data, len)) {
+		return -EINVAL;
+	}
+
+	if (ch->notify_fd >= 0) {
+		if (send(ch->notify_fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) {
+			return 0;
+		}
+		if (errno == EAGAIN) {
+			return -EAGAIN;
+		}
+		/* the client has unsubscribed */
+		CLOG_DBG(ch->srv->ctx, "BLZ server notify socket closed: %s",
+				 strerror(errno));
+		char_notify_release(ch);
+		return -ENOTCONN;
+	}
+
+	if (!ch->notifying) {
+		return -ENOTCONN;
+	}
+	int r = sd_bus_emit_properties_changed(ch->srv->ctx->bus, ch->path,
+										   "org.bluez.GattCharacteristic1",
+										   "Value", NULL);
+	return MIN(r, 0);
+}
+
+static int server_export(blz_server* srv)
+{
+	sd_bus* bus = srv->ctx->bus;
+
+	int r = sd_bus_add_object_manager(bus, &srv->om_slot, srv->path);
+	for (struct server_serv* sv = srv->servs; r >= 0 && sv != NULL;
+		 sv = sv->next) {
+		r = sd_bus_add_object_vtable(bus, &sv->slot, sv->path,
+									 "org.bluez.GattService1", serv_vtable, sv);
+	}
+	for (blz_server_char* ch = srv->chars; r >= 0 && ch != NULL;
+		 ch = ch->next) {
+		r = sd_bus_add_object_vtable(
+			bus, &ch->slot, ch->path, "org.bluez.GattCharacteristic1",
+			ch->fd_cb != NULL ? char_vtable_write_fd : char_vtable, ch);
+	}
+	return r;
+}
+
+/** removes what server_export() added, also after it failed halfway */
+static void server_unexport(blz_server* srv)
+{
+	for (struct server_serv* sv = srv->servs; sv != NULL; sv = sv->next) {
+		sv->slot = sd_bus_slot_unref(sv->slot);
+	}
+	for (blz_server_char* ch = srv->chars; ch != NULL; ch = ch->next) {
+		ch->slot = sd_bus_slot_unref(ch->slot);
+	}
+	srv->om_slot = sd_bus_slot_unref(srv->om_slot);
+}
+
+struct register_wait {
+	blz* ctx;
+	bool done;
+	int err;
+};
+
+static int register_reply_cb(sd_bus_message* reply, void* userdata,
+							 sd_bus_error* error)
+{
+	struct register_wait* w = userdata;
+	const sd_bus_error* err = sd_bus_message_get_error(reply);
+
+	if (err != NULL) {
+		w->err = -sd_bus_message_get_errno(reply);
+		CLOG_ERR(w->ctx, "BLZ server failed to register: %s", err->message);
+	}
+	w->done = true;
+	return 0;
+}
+
+bool blz_server_register(blz_server* srv)
+{
+	struct register_wait w = {.ctx = srv->ctx};
+	sd_bus_slot* slot = NULL;
+
+	if (srv->registered) {
+		CLOG_ERR(srv->ctx, "BLZ server already registered");
+		return false;
+	}
+
+	int r = server_export(srv);
+	if (r < 0) {
+		CLOG_ERR(srv->ctx, "BLZ server failed to export objects: %s",
+				 strerror(-r));
+		server_unexport(srv);
+		return false;
+	}
+
+	r = sd_bus_call_method_async(srv->ctx->bus, &slot, "org.bluez",
+								 srv->ctx->path, "org.bluez.GattManager1",
+								 "RegisterApplication", register_reply_cb, &w,
+								 "oa{sv}", srv->path, 0);
+	if (r < 0) {
+		CLOG_ERR(srv->ctx, "BLZ server failed to register: %s", strerror(-r));
+		server_unexport(srv);
+		return false;
+	}
+
+	/* BlueZ reads the objects before it replies, the call has a timeout */
+	while (!w.done) {
+		blz_loop(srv->ctx, UINT64_MAX);
+	}
+	sd_bus_slot_unref(slot);
+	if (w.err < 0) {
+		/* can be registered again, e.g. after fixing a conflict */
+		server_unexport(srv);
+		return false;
+	}
+	srv->registered = true;
+	return true;
+}
+
+void blz_server_free(blz_server* srv)
+{
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+
+	if (srv == NULL) {
+		return;
+	}
+
+	if (srv->registered) {
+		int r = sd_bus_call_method(srv->ctx->bus, "org.bluez", srv->ctx->path,
+								   "org.bluez.GattManager1",
+								   "UnregisterApplication", &error, NULL, "o",
+								   srv->path);
+		if (r < 0) {
+			CLOG_DBG(srv->ctx, "BLZ server failed to unregister: %s",
+					 error.message);
+		}
+		sd_bus_error_free(&error);
+	}
+
+	while (srv->chars != NULL) {
+		blz_server_char* ch = srv->chars;
+		srv->chars = ch->next;
+		if (ch->notify_fd >= 0) {
+			close(ch->notify_fd);
+		}
+		sd_bus_slot_unref(ch->slot);
+		mem_free(srv->ctx, BLZ_MEM_DEVICES, ch, sizeof(struct blz_server_char));
+	}
+	while (srv->servs != NULL) {
+		struct server_serv* sv = srv->servs;
+		srv->servs = sv->next;
+		sd_bus_slot_unref(sv->slot);
+		mem_free(srv->ctx, BLZ_MEM_DEVICES, sv, sizeof(struct server_serv));
+	}
+	sd_bus_slot_unref(srv->om_slot);
+	for (blz_server** p = &srv->ctx->servers; *p != NULL; p = &(*p)->next) {
+		if (*p == srv) {
+			*p = srv->next;
+			break;
+		}
+	}
+	mem_free(srv->ctx, BLZ_MEM_DEVICES, srv, sizeof(struct blz_server));
+}
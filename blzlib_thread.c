@@ -0,0 +1,282 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+/*
+ * The loop thread holds the lock while it dispatches and releases it while
+ * it waits in poll(), with what to wait for taken from blz_get_events() and
+ * blz_get_timeout() like any other event loop. blz_unlock() wakes it through
+ * an eventfd, as a call from another thread may have changed both.
+ *
+ * The scheduling latency is how late the thread wakes up after a poll()
+ * timeout. That can't be measured for wakeups by the bus, so probes add
+ * timeouts at a fixed interval if the library has none.
+ */
+
+#define LAT_BUCKETS 32 /* log2 of usec */
+
+struct loop_thread {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int wake_fd;
+	bool stop;
+	int err; /* what ended the loop, 0 while it runs */
+	uint64_t probe_us;
+	unsigned long wakeups;
+	uint64_t lat_sum;
+	uint64_t lat_max;
+	unsigned long hist[LAT_BUCKETS];
+};
+
+static void thread_measure(struct loop_thread* t, uint64_t lat)
+{
+	int b = 0;
+
+	while (b < LAT_BUCKETS - 1 && (1ULL << b) <= lat) {
+		b++;
+	}
+	t->hist[b]++;
+	t->wakeups++;
+	t->lat_sum += lat;
+	t->lat_max = MAX(t->lat_max, lat);
+}
+
+static void* thread_run(void* arg)
+{
+	blz* ctx = arg;
+	struct loop_thread* t = ctx->thread;
+	uint64_t buf;
+
+	pthread_mutex_lock(&t->lock);
+	while (!t->stop) {
+		int r = blz_process(ctx);
+		if (r < 0) {
+			CLOG_ERR(ctx, "BLZ loop thread process error: %s", strerror(-r));
+			t->err = r;
+			break;
+		}
+
+		uint64_t now = now_usec();
+		uint64_t wake_at = blz_get_timeout(ctx);
+		if (t->probe_us > 0) {
+			wake_at = MIN(wake_at, now + t->probe_us);
+		}
+		struct pollfd pfd[2] = {
+			{.fd = blz_get_fd(ctx), .events = blz_get_events(ctx)},
+			{.fd = t->wake_fd, .events = POLLIN},
+		};
+		pthread_mutex_unlock(&t->lock);
+
+		struct timespec ts;
+		struct timespec* tsp = NULL;
+		if (wake_at != UINT64_MAX) {
+			uint64_t rel = wake_at > now ? wake_at - now : 0;
+			ts.tv_sec = rel / 1000000;
+			ts.tv_nsec = rel % 1000000 * 1000;
+			tsp = &ts;
+		}
+		r = ppoll(pfd, 2, tsp, NULL);
+		int err = errno;
+		now = now_usec();
+
+		pthread_mutex_lock(&t->lock);
+		if (r == 0) {
+			thread_measure(t, now > wake_at ? now - wake_at : 0);
+		} else if (r < 0 && err != EINTR) {
+			CLOG_ERR(ctx, "BLZ loop thread poll error: %s", strerror(err));
+			t->err = -err;
+			break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			(void)!read(t->wake_fd, &buf, sizeof(buf));
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+/** pthread attributes of the configuration, false if invalid */
+static bool thread_attr(blz* ctx, const struct blz_thread_conf* conf,
+						pthread_attr_t* attr)
+{
+	pthread_attr_init(attr);
+
+	if (conf->num_cpus > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (size_t i = 0; i < conf->num_cpus; i++) {
+			if (conf->cpus[i] < 0 || conf->cpus[i] >= CPU_SETSIZE) {
+				CLOG_ERR(ctx, "BLZ loop thread invalid CPU %d", conf->cpus[i]);
+				return false;
+			}
+			CPU_SET(conf->cpus[i], &set);
+		}
+		int r = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+		if (r != 0) {
+			CLOG_ERR(ctx, "BLZ loop thread failed to set affinity: %s",
+					 strerror(r));
+			return false;
+		}
+	}
+
+	if (conf->priority > 0) {
+		struct sched_param sp = {.sched_priority = conf->priority};
+		pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+		if (pthread_attr_setschedparam(attr, &sp) != 0) {
+			CLOG_ERR(ctx, "BLZ loop thread invalid priority %d",
+					 conf->priority);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool blz_thread_start(blz* ctx, const struct blz_thread_conf* conf)
+{
+	static const struct blz_thread_conf defaults = {0};
+	pthread_mutexattr_t mattr;
+	pthread_attr_t attr;
+
+	if (ctx->thread != NULL) {
+		CLOG_ERR(ctx, "BLZ loop thread already running");
+		return false;
+	}
+	if (conf == NULL) {
+		conf = &defaults;
+	}
+	const char* name = conf->name != NULL ? conf->name : "blz-loop";
+	if (strlen(name) > 15) {
+		CLOG_ERR(ctx, "BLZ loop thread name '%s' too long", name);
+		return false;
+	}
+
+	struct loop_thread* t = calloc(1, sizeof(struct loop_thread));
+	if (t == NULL) {
+		CLOG_ERR(ctx, "BLZ loop thread alloc failed");
+		return false;
+	}
+	t->probe_us = conf->probe_ms * 1000ULL;
+	t->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (t->wake_fd < 0) {
+		CLOG_ERR(ctx, "BLZ loop thread eventfd failed: %s", strerror(errno));
+		free(t);
+		return false;
+	}
+
+	/* callbacks run with the lock held and may call blz_lock() again */
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&t->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	ctx->thread = t;
+	int r = thread_attr(ctx, conf, &attr) ? 0 : EINVAL;
+	if (r == 0) {
+		r = pthread_create(&t->thread, &attr, thread_run, ctx);
+		if (r != 0) {
+			/* EPERM without CAP_SYS_NICE or RLIMIT_RTPRIO */
+			CLOG_ERR(ctx, "BLZ loop thread failed to start: %s",
+					 strerror(r));
+		}
+	}
+	pthread_attr_destroy(&attr);
+	if (r != 0) {
+		ctx->thread = NULL;
+		pthread_mutex_destroy(&t->lock);
+		close(t->wake_fd);
+		free(t);
+		return false;
+	}
+
+	r = pthread_setname_np(t->thread, name);
+	if (r != 0) {
+		/* it runs anyway, only harder to find */
+		CLOG_WARN(ctx, "BLZ loop thread failed to set name: %s", strerror(r));
+	}
+	return true;
+}
+
+int blz_thread_stop(blz* ctx)
+{
+	struct loop_thread* t = ctx->thread;
+
+	if (t == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&t->lock);
+	t->stop = true;
+	pthread_mutex_unlock(&t->lock);
+	eventfd_write(t->wake_fd, 1);
+	pthread_join(t->thread, NULL);
+
+	int err = t->err;
+	ctx->thread = NULL;
+	pthread_mutex_destroy(&t->lock);
+	close(t->wake_fd);
+	free(t);
+	return err;
+}
+
+void blz_lock(blz* ctx)
+{
+	if (ctx->thread != NULL) {
+		pthread_mutex_lock(&ctx->thread->lock);
+	}
+}
+
+void blz_unlock(blz* ctx)
+{
+	if (ctx->thread != NULL) {
+		pthread_mutex_unlock(&ctx->thread->lock);
+		eventfd_write(ctx->thread->wake_fd, 1);
+	}
+}
+
+void blz_thread_get_stats(blz* ctx, struct blz_thread_stats* st)
+{
+	struct loop_thread* t = ctx->thread;
+	unsigned long n = 0;
+
+	memset(st, 0, sizeof(*st));
+	if (t == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&t->lock);
+	st->err = t->err;
+	st->wakeups = t->wakeups;
+	st->lat_max_us = t->lat_max;
+	if (t->wakeups > 0) {
+		st->lat_avg_us = t->lat_sum / t->wakeups;
+	}
+	/* upper bound of the bucket */
+	for (int b = 0; b < LAT_BUCKETS && t->wakeups > 0; b++) {
+		n += t->hist[b];
+		if (n * 100 >= t->wakeups * 99) {
+			st->lat_p99_us = MIN(1ULL << b, t->lat_max);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+}
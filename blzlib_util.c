@@ -13,86 +13,169 @@
 #include "blzlib_log.h"
 #include "blzlib_util.h"
 
+/* hex digit values, 0x100 marks invalid characters so errors can be
+ * accumulated with OR and checked once at the end */
+static const uint16_t hex_val[256] = {
+	[0 ... '0' - 1] = 0x100,
+	['0'] = 0,	['1'] = 1,	['2'] = 2,	['3'] = 3,	['4'] = 4,
+	['5'] = 5,	['6'] = 6,	['7'] = 7,	['8'] = 8,	['9'] = 9,
+	['9' + 1 ... 'A' - 1] = 0x100,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14,
+	['F'] = 15,
+	['F' + 1 ... 'a' - 1] = 0x100,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14,
+	['f'] = 15,
+	['f' + 1 ... 255] = 0x100,
+};
+
+static const char hex_chr[16] = "0123456789abcdef";
+
+/* byte position in the string of the 16 UUID bytes, reversed (little
+ * endian), and dash positions */
+static const uint8_t uuid_pos[16]
+	= {34, 32, 30, 28, 26, 24, 21, 19, 16, 14, 11, 9, 6, 4, 2, 0};
+
+static inline uint16_t hex_byte(const char* s)
+{
+	return hex_val[(uint8_t)s[0]] << 4 | hex_val[(uint8_t)s[1]];
+}
+
+static inline void byte_hex(char* s, uint8_t b)
+{
+	s[0] = hex_chr[b >> 4];
+	s[1] = hex_chr[b & 0xf];
+}
+
 bool blz_string_to_mac(const char* str, uint8_t mac[6])
 {
-	if (str == NULL || mac == NULL)
+	if (str == NULL || mac == NULL || strnlen(str, 17) != 17) {
 		return false;
+	}
 
-	int n = sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx", mac + 5, mac + 4,
-				   mac + 3, mac + 2, mac + 1, mac);
-	return (n == 6);
+	uint16_t v[6];
+	uint16_t bad = 0;
+	for (int i = 0; i < 6; i++) {
+		v[i] = hex_byte(str + i * 3);
+		bad |= v[i];
+	}
+	uint8_t sep = (str[2] ^ ':') | (str[5] ^ ':') | (str[8] ^ ':')
+				  | (str[11] ^ ':') | (str[14] ^ ':');
+
+	if ((bad & 0xff00) | sep) {
+		return false;
+	}
+
+	/* only write on success */
+	for (int i = 0; i < 6; i++) {
+		mac[5 - i] = v[i];
+	}
+	return true;
 }
 
 uint8_t* blz_string_to_mac_s(const char* str)
 {
-	static uint8_t mac[6];
+	static __thread uint8_t mac[6];
 	blz_string_to_mac(str, mac);
 	return mac;
 }
 
-const char* blz_mac_to_string_s(const uint8_t mac[6])
+char* blz_mac_to_string(const uint8_t mac[6], char buf[BLZ_MAC_STR_LEN])
 {
-	static char buf[18];
-	sprintf(buf, MAC_FMT, MAC_PARR(mac));
+	for (int i = 0; i < 6; i++) {
+		byte_hex(buf + i * 3, mac[5 - i]);
+		buf[i * 3 + 2] = ':';
+	}
+	buf[17] = '\0';
 	return buf;
 }
 
+const char* blz_mac_to_string_s(const uint8_t mac[6])
+{
+	static __thread char buf[BLZ_MAC_STR_LEN];
+	return blz_mac_to_string(mac, buf);
+}
+
+bool blz_string_to_mac_key(const char* str, blz_mac_key* key)
+{
+	uint8_t mac[6];
+	if (!blz_string_to_mac(str, mac)) {
+		return false;
+	}
+	*key = blz_mac_to_key(mac);
+	return true;
+}
+
+char* blz_mac_key_to_string(blz_mac_key key, char buf[BLZ_MAC_STR_LEN])
+{
+	uint8_t mac[6];
+	blz_key_to_mac(key, mac);
+	return blz_mac_to_string(mac, buf);
+}
+
 bool blz_string_to_uuid(const char* str, uint8_t uuid[16])
 {
-	int n = sscanf(str,
-				   "%2hhx%2hhx%2hhx%2hhx-%2hhx%2hhx-%2hhx%2hhx-%2hhx%2hhx-%"
-				   "2hhx%2hhx%2hhx%2hhx%2hhx%2hhx",
-				   uuid + 15, uuid + 14, uuid + 13, uuid + 12, uuid + 11,
-				   uuid + 10, uuid + 9, uuid + 8, uuid + 7, uuid + 6, uuid + 5,
-				   uuid + 4, uuid + 3, uuid + 2, uuid + 1, uuid);
-	return (n == 16);
+	if (str == NULL || uuid == NULL || strnlen(str, 36) != 36) {
+		return false;
+	}
+
+	uint16_t v[16];
+	uint16_t bad = 0;
+	for (int i = 0; i < 16; i++) {
+		v[i] = hex_byte(str + uuid_pos[i]);
+		bad |= v[i];
+	}
+
+	uint8_t sep = (str[8] ^ '-') | (str[13] ^ '-') | (str[18] ^ '-')
+				  | (str[23] ^ '-');
+
+	if ((bad & 0xff00) | sep) {
+		return false;
+	}
+
+	/* only write on success */
+	for (int i = 0; i < 16; i++) {
+		uuid[i] = v[i];
+	}
+	return true;
 }
 
 uint8_t* blz_string_to_uuid_s(const char* str)
 {
-	static uint8_t uuid[16];
+	static __thread uint8_t uuid[16];
 	blz_string_to_uuid(str, uuid);
 	return uuid;
 }
 
-char* blz_uuid_to_string_s(const uint8_t* uuid)
+char* blz_uuid_to_string(const uint8_t uuid[16], char buf[BLZ_UUID_STR_LEN])
 {
-	static char buf[37];
-	int r = sprintf(
-		buf,
-		"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
-		uuid[15], uuid[14], uuid[13], uuid[12], uuid[11], uuid[10], uuid[9],
-		uuid[8], uuid[7], uuid[6], uuid[5], uuid[4], uuid[3], uuid[2], uuid[1],
-		uuid[0]);
-	if (r <= 0) {
-		return NULL;
+	for (int i = 0; i < 16; i++) {
+		byte_hex(buf + uuid_pos[i], uuid[i]);
 	}
+	buf[8] = buf[13] = buf[18] = buf[23] = '-';
+	buf[36] = '\0';
 	return buf;
 }
 
+char* blz_uuid_to_string_s(const uint8_t* uuid)
+{
+	static __thread char buf[BLZ_UUID_STR_LEN];
+	return blz_uuid_to_string(uuid, buf);
+}
+
 char* blz_uuid_to_string_a(const uint8_t* uuid)
 {
-	char* str;
-	int r = asprintf(
-		&str,
-		"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
-		uuid[15], uuid[14], uuid[13], uuid[12], uuid[11], uuid[10], uuid[9],
-		uuid[8], uuid[7], uuid[6], uuid[5], uuid[4], uuid[3], uuid[2], uuid[1],
-		uuid[0]);
-	if (r <= 0) {
+	char* str = malloc(BLZ_UUID_STR_LEN);
+	if (str == NULL) {
 		return NULL;
 	}
-	return str;
+	return blz_uuid_to_string(uuid, str);
 }
 
 char* blz_uuid16_to_string_a(uint16_t uuid)
 {
-	char* str;
-	int r = asprintf(&str, "0000%04x-0000-1000-8000-00805f9b34fb", uuid);
-	if (r <= 0) {
-		return NULL;
-	}
-	return str;
+	uint8_t u[16];
+	blz_uuid16_to_uuid(u, uuid);
+	return blz_uuid_to_string_a(u);
 }
 
 void blz_uuid16_to_uuid(uint8_t dst[16], uint16_t uuid16)
@@ -115,6 +198,23 @@ const char* blz_addr_type_str(enum blz_addr_type atype)
 	return "-invalid-";
 }
 
+const char* blz_mem_cat_str(enum blz_mem_cat cat)
+{
+	switch (cat) {
+	case BLZ_MEM_OBJ_CACHE:
+		return "object-cache";
+	case BLZ_MEM_DEVICES:
+		return "devices";
+	case BLZ_MEM_UUIDS:
+		return "uuids";
+	case BLZ_MEM_QUEUES:
+		return "queues";
+	case BLZ_MEM_CAT_MAX:
+		break;
+	}
+	return "-invalid-";
+}
+
 void hex_dump(const char* txt, const uint8_t* data, size_t len)
 {
 	printf("%s", txt);
@@ -51,19 +51,67 @@ extern "C" {
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
 #endif
 
+/* string buffer sizes including terminating zero */
+#define BLZ_MAC_STR_LEN	 18
+#define BLZ_UUID_STR_LEN 37
+
+/* MAC address packed into 64 bit, for use as key in hashes or sorting. Byte
+ * order is the same as in the uint8_t[6] (little endian) */
+typedef uint64_t blz_mac_key;
+
+static inline blz_mac_key blz_mac_to_key(const uint8_t mac[6])
+{
+	return (uint64_t)mac[0] | (uint64_t)mac[1] << 8 | (uint64_t)mac[2] << 16
+		   | (uint64_t)mac[3] << 24 | (uint64_t)mac[4] << 32
+		   | (uint64_t)mac[5] << 40;
+}
+
+static inline void blz_key_to_mac(blz_mac_key key, uint8_t mac[6])
+{
+	for (int i = 0; i < 6; i++) {
+		mac[i] = key >> (i * 8);
+	}
+}
+
 #define STD_BASE_UUID                                                          \
 	"\xfb\x34\x9b\x5f\x80\x00\x00\x80\x00\x10\x00\x00\x00\x00\x00\x00"
 
-/* big endian human readable with ':' to little endian */
+/* 16 bit SIG UUIDs with the base UUID. BLZ_UUID16_STR(2a29) is the string
+ * "00002a29-0000-1000-8000-00805f9b34fb" (x are 4 hex digits without 0x),
+ * BLZ_UUID16_INIT(0x2a29) the little endian uint8_t[16] initializer as
+ * written by blz_uuid16_to_uuid() */
+#define BLZ_UUID16_STR(x) "0000" #x "-0000-1000-8000-00805f9b34fb"
+
+#define BLZ_UUID16_INIT(x)                                                     \
+	{                                                                          \
+		0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00,      \
+			0x00, (x) & 0xff, ((x) >> 8) & 0xff, 0x00, 0x00                    \
+	}
+
+/*
+ * Conversion functions without suffix write to a caller supplied buffer. _s
+ * variants return a static thread local buffer which is overwritten by the
+ * next call in the same thread, _a variants allocate and need to be freed.
+ */
+
+/* big endian human readable with ':' to little endian. mac is only written
+ * on success */
 bool blz_string_to_mac(const char* str, uint8_t mac[6]);
 uint8_t* blz_string_to_mac_s(const char* str);
+bool blz_string_to_mac_key(const char* str, blz_mac_key* key);
+
+/* little endian MAC to human readable string, returns buf */
+char* blz_mac_to_string(const uint8_t mac[6], char buf[BLZ_MAC_STR_LEN]);
 const char* blz_mac_to_string_s(const uint8_t mac[6]);
+char* blz_mac_key_to_string(blz_mac_key key, char buf[BLZ_MAC_STR_LEN]);
 
-/* big endian human readable UUID with dashes to little endian*/
+/* big endian human readable UUID with dashes to little endian. uuid is only
+ * written on success */
 bool blz_string_to_uuid(const char* str, uint8_t uuid[16]);
 uint8_t* blz_string_to_uuid_s(const char* str);
 
-/* little endian UUID128 to human readable string ALLOCATE */
+/* little endian UUID128 to human readable string, returns buf */
+char* blz_uuid_to_string(const uint8_t uuid[16], char buf[BLZ_UUID_STR_LEN]);
 char* blz_uuid_to_string_s(const uint8_t* uuid);
 char* blz_uuid_to_string_a(const uint8_t* uuid);
 
@@ -73,6 +121,7 @@ char* blz_uuid16_to_string_a(uint16_t uuid16);
 void blz_uuid16_to_uuid(uint8_t dst[16], uint16_t uuid16);
 
 const char* blz_addr_type_str(enum blz_addr_type atype);
+const char* blz_mem_cat_str(enum blz_mem_cat cat);
 
 void hex_dump(const char* txt, const uint8_t* data, size_t len);
 
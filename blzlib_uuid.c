@@ -0,0 +1,225 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_internal.h"
+#include "blzlib_log.h"
+
+/*
+ * UUID strings are interned per context: every distinct UUID is stored once
+ * (lowercase) in fixed chunks which are never moved, so the pointers handed
+ * out stay valid until the context is freed and equal UUIDs can be compared
+ * by pointer. IDs are the index in insertion order and are stable as well.
+ */
+
+#define UUID_CHUNK_ENTRIES 64
+#define UUID_HASH_MIN	   128
+
+struct uuid_chunk {
+	struct uuid_chunk* prev;
+	char			   str[UUID_CHUNK_ENTRIES][UUID_STR_LEN];
+};
+
+static uint32_t uuid_hash(const char* str)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	while (*str) {
+		h ^= (uint8_t)*str++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* returns slot in hash table: either the one containing str or empty */
+static size_t uuid_slot(struct uuid_table* tbl, const char* str, uint32_t h)
+{
+	size_t mask = tbl->hash_size - 1;
+	size_t i = h & mask;
+
+	while (tbl->hash[i] != 0
+		   && strcmp(tbl->strs[tbl->hash[i] - 1], str) != 0) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static bool uuid_table_grow(blz* ctx, struct uuid_table* tbl)
+{
+	/* id array */
+	if (tbl->count == tbl->cap) {
+		size_t cap = tbl->cap ? tbl->cap * 2 : UUID_CHUNK_ENTRIES;
+		size_t grow = (cap - tbl->cap) * sizeof(char*);
+		if (!mem_reserve(ctx, BLZ_MEM_UUIDS, grow)) {
+			return false;
+		}
+		char** strs = realloc(tbl->strs, cap * sizeof(char*));
+		if (strs == NULL) {
+			mem_release(ctx, BLZ_MEM_UUIDS, grow);
+			return false;
+		}
+		tbl->strs = strs;
+		tbl->cap = cap;
+	}
+
+	/* string storage and hash table, both allocated before either is used
+	 * so that a failure leaves the table as it was */
+	struct uuid_chunk* c = NULL;
+	if (tbl->count % UUID_CHUNK_ENTRIES == 0) {
+		c = mem_alloc(ctx, BLZ_MEM_UUIDS, sizeof(struct uuid_chunk));
+		if (c == NULL) {
+			return false;
+		}
+	}
+
+	/* keep hash table at most half full */
+	uint32_t* hash = NULL;
+	size_t size = tbl->hash_size ? tbl->hash_size * 2 : UUID_HASH_MIN;
+	if ((tbl->count + 1) * 2 > tbl->hash_size) {
+		hash = mem_alloc(ctx, BLZ_MEM_UUIDS, size * sizeof(uint32_t));
+		if (hash == NULL) {
+			mem_free(ctx, BLZ_MEM_UUIDS, c, sizeof(struct uuid_chunk));
+			return false;
+		}
+	}
+
+	if (c != NULL) {
+		c->prev = tbl->chunks;
+		tbl->chunks = c;
+	}
+
+	if (hash != NULL) {
+		uint32_t* old = tbl->hash;
+		size_t old_size = tbl->hash_size;
+
+		tbl->hash = hash;
+		tbl->hash_size = size;
+
+		for (size_t i = 0; i < old_size; i++) {
+			if (old[i] != 0) {
+				const char* s = tbl->strs[old[i] - 1];
+				tbl->hash[uuid_slot(tbl, s, uuid_hash(s))] = old[i];
+			}
+		}
+		mem_free(ctx, BLZ_MEM_UUIDS, old, old_size * sizeof(uint32_t));
+	}
+	return true;
+}
+
+static int uuid_table_add(blz* ctx, struct uuid_table* tbl, const char* uuid)
+{
+	char str[UUID_STR_LEN];
+	size_t len = strnlen(uuid, UUID_STR_LEN);
+
+	if (len == 0 || len >= UUID_STR_LEN) {
+		CLOG_ERR(ctx, "BLZ invalid UUID '%.*s'", (int)len, uuid);
+		return -1;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		str[i] = tolower((unsigned char)uuid[i]);
+	}
+	str[len] = '\0';
+
+	uint32_t h = uuid_hash(str);
+	if (tbl->hash_size > 0) {
+		size_t i = uuid_slot(tbl, str, h);
+		if (tbl->hash[i] != 0) {
+			return tbl->hash[i] - 1;
+		}
+	}
+
+	if (!uuid_table_grow(ctx, tbl)) {
+		CLOG_ERR(ctx, "BLZ UUID table alloc failed");
+		return -1;
+	}
+
+	int id = tbl->count++;
+	char* dst = tbl->chunks->str[id % UUID_CHUNK_ENTRIES];
+	memcpy(dst, str, len + 1);
+	tbl->strs[id] = dst;
+	tbl->hash[uuid_slot(tbl, str, h)] = id + 1;
+	return id;
+}
+
+void uuid_table_free(blz* ctx, struct uuid_table* tbl)
+{
+	struct uuid_chunk* c = tbl->chunks;
+	while (c != NULL) {
+		struct uuid_chunk* prev = c->prev;
+		mem_free(ctx, BLZ_MEM_UUIDS, c, sizeof(struct uuid_chunk));
+		c = prev;
+	}
+	mem_free(ctx, BLZ_MEM_UUIDS, tbl->strs, tbl->cap * sizeof(char*));
+	mem_free(ctx, BLZ_MEM_UUIDS, tbl->hash, tbl->hash_size * sizeof(uint32_t));
+	memset(tbl, 0, sizeof(*tbl));
+}
+
+char* uuid_intern(blz* ctx, const char* uuid)
+{
+	int id = uuid_table_add(ctx, &ctx->uuids, uuid);
+	return id < 0 ? NULL : ctx->uuids.strs[id];
+}
+
+char** uuid_intern_strv(blz* ctx, char** strv)
+{
+	size_t j = 0;
+
+	if (strv == NULL) {
+		return NULL;
+	}
+
+	/* replace allocated strings in place, drop the ones which failed */
+	for (size_t i = 0; strv[i] != NULL; i++) {
+		char* s = uuid_intern(ctx, strv[i]);
+		free(strv[i]);
+		if (s != NULL) {
+			strv[j++] = s;
+		}
+	}
+
+	/* accounted copy of the list, see uuid_strv_free() */
+	char** uuids = mem_alloc(ctx, BLZ_MEM_DEVICES, (j + 1) * sizeof(char*));
+	if (uuids != NULL) {
+		memcpy(uuids, strv, j * sizeof(char*));
+	}
+	free(strv);
+	return uuids;
+}
+
+void uuid_strv_free(blz* ctx, char** uuids)
+{
+	size_t n = 0;
+
+	while (uuids != NULL && uuids[n] != NULL) {
+		n++;
+	}
+	mem_free(ctx, BLZ_MEM_DEVICES, uuids, (n + 1) * sizeof(char*));
+}
+
+const char* blz_uuid_intern(blz* ctx, const char* uuid)
+{
+	return uuid_intern(ctx, uuid);
+}
+
+int blz_uuid_id(blz* ctx, const char* uuid)
+{
+	return uuid_table_add(ctx, &ctx->uuids, uuid);
+}
+
+const char* blz_uuid_from_id(blz* ctx, int id)
+{
+	if (id < 0 || (size_t)id >= ctx->uuids.count) {
+		return NULL;
+	}
+	return ctx->uuids.strs[id];
+}
@@ -0,0 +1,119 @@
+/*
+ * Boost.Asio with blzlib_asio.hpp: one coroutine per device given on the
+ * command line, all running on the io_context of the main thread. Each
+ * connects, writes numbered lines and reads the characteristic back.
+ * Failures, also operations canceled by a disconnect, arrive as exceptions.
+ */
+
+#define BLZPP_BOOST_ASIO
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+
+#include <unistd.h>
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include "blzlib_asio.hpp"
+
+namespace asio = boost::asio;
+
+static const char* serv_uuid = "6e400001-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* char_uuid = "6e400002-b5a3-f393-e0a9-e50e24dcca9e";
+static int count = 10;
+
+static asio::awaitable<void> session(blzpp::asio_driver& drv, const char* mac,
+									 int& active)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	int i = 0;
+
+	try {
+		auto dev = co_await drv.async_connect(mac, asio::use_awaitable);
+		auto srv = dev.serv_from_uuid(serv_uuid);
+		auto ch = srv ? srv.char_from_uuid(char_uuid)
+					  : blzpp::characteristic();
+		if (!ch) {
+			std::fprintf(stderr, "%s: characteristic not found\n", mac);
+		}
+
+		for (; ch && i < count; i++) {
+			char buf[32];
+			int len = std::snprintf(buf, sizeof(buf), "%s %d", mac, i);
+			co_await drv.async_write(ch, asio::buffer(buf, len),
+									 asio::use_awaitable);
+		}
+
+		std::array<char, 64> rx;
+		size_t n = ch ? co_await drv.async_read(ch, asio::buffer(rx),
+												 asio::use_awaitable)
+					  : 0;
+		std::printf("%s: %d written, read '%.*s'\n", mac, i, (int)n,
+					rx.data());
+	} catch (const boost::system::system_error& e) {
+		std::fprintf(stderr, "%s: failed after %d: %s\n", mac, i, e.what());
+	}
+
+	auto ms = std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - t0);
+	std::printf("%s: %.1f ms\n", mac, ms.count());
+
+	/* the driver waits for the bus as long as it exists */
+	if (--active == 0) {
+		drv.get_executor().context().stop();
+	}
+}
+
+static void usage(void)
+{
+	std::fprintf(stderr,
+				 "Usage: blz-asio-sessions [options] MAC...\n"
+				 "  -a address  bus address, default is the system bus\n"
+				 "  -s UUID     service\n"
+				 "  -w UUID     characteristic to write and read\n"
+				 "  -c count    lines per device (10)\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* address = nullptr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:s:w:c:h")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 's': serv_uuid = optarg; break;
+		case 'w': char_uuid = optarg; break;
+		case 'c': count = std::atoi(optarg); break;
+		default: usage(); return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	/* before the context, blz_fini() completes what is still in progress */
+	asio::io_context io;
+
+	auto ctx = address ? blzpp::context::init_address(address)
+					   : blzpp::context::init();
+	if (!ctx) {
+		return EXIT_FAILURE;
+	}
+	blzpp::asio_driver drv(io, ctx);
+
+	int active = argc - optind;
+	for (int i = optind; i < argc; i++) {
+		asio::co_spawn(io, session(drv, argv[i], active), asio::detached);
+	}
+	io.run();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+/*
+ * Coroutines with blzlib.hpp: one session per device given on the command
+ * line, all running at the same time on one thread. Each connects, writes a
+ * numbered line and waits for the device to notify it back, like the Nordic
+ * UART Service of a device which echoes what it receives.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <span>
+
+#include <unistd.h>
+
+#include "blzlib.hpp"
+
+static const char* serv_uuid = "6e400001-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* write_uuid = "6e400002-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* notify_uuid = "6e400003-b5a3-f393-e0a9-e50e24dcca9e";
+static int count = 10;
+
+static blzpp::task session(const blzpp::context& ctx, const char* mac,
+						   int& active)
+{
+	auto dev = co_await ctx.async_connect(mac);
+	auto srv = dev ? dev.serv_from_uuid(serv_uuid) : blzpp::service();
+	auto wch = srv ? srv.char_from_uuid(write_uuid) : blzpp::characteristic();
+	auto nch = srv ? srv.char_from_uuid(notify_uuid) : blzpp::characteristic();
+	if (!wch || !nch) {
+		std::fprintf(stderr, "%s: connect failed\n", mac);
+		active--;
+		co_return;
+	}
+
+	auto rx = nch.notifications();
+	co_await rx.start();
+	int i = 0;
+	for (; rx && i < count; i++) {
+		char buf[32];
+		int len = std::snprintf(buf, sizeof(buf), "%s %d", mac, i);
+		if (!co_await wch.async_write(std::as_bytes(std::span(buf, len)))) {
+			break;
+		}
+		auto pkt = co_await rx.next();
+		if (!pkt) {
+			break;
+		}
+		std::printf("RX: '%.*s'\n", (int)pkt->size(),
+					(const char*)pkt->data());
+	}
+
+	if (i == count) {
+		std::printf("%s: %d echoed, %zu dropped\n", mac, i, rx.dropped());
+	} else {
+		std::fprintf(stderr, "%s: failed after %d\n", mac, i);
+	}
+	active--;
+}
+
+static void usage(void)
+{
+	std::fprintf(stderr,
+				 "Usage: blz-coro-sessions [options] MAC...\n"
+				 "  -a address  bus address, default is the system bus\n"
+				 "  -s UUID     service\n"
+				 "  -w UUID     characteristic to write\n"
+				 "  -n UUID     characteristic which notifies the echo\n"
+				 "  -c count    lines per device (10)\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* address = nullptr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:s:w:n:c:h")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 's': serv_uuid = optarg; break;
+		case 'w': write_uuid = optarg; break;
+		case 'n': notify_uuid = optarg; break;
+		case 'c': count = std::atoi(optarg); break;
+		default: usage(); return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	auto ctx = address ? blzpp::context::init_address(address)
+					   : blzpp::context::init();
+	if (!ctx) {
+		return EXIT_FAILURE;
+	}
+
+	/* each session runs until its first co_await and continues from the
+	 * loop when the reply or notification arrives */
+	int active = argc - optind;
+	for (int i = optind; i < argc; i++) {
+		session(ctx, argv[i], active);
+	}
+
+	while (active > 0) {
+		ctx.loop(UINT64_MAX);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+/*
+ * Pull-based events: scans, connects to the devices given on the command
+ * line, starts notifications, reads and writes, all with NULL callbacks,
+ * and handles the results from one blz_poll_events() loop. Prints how many
+ * events of each type arrived. The default UUIDs are the ones of
+ * blz-mock-bluez, run it with a notification rate (-n) to see those.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define MAX_DEVS 32
+#define BATCH	 64
+
+static const char* serv_uuid = "6e400100-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* rw_uuid = "6e400101-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* notify_uuid = "6e400102-b5a3-f393-e0a9-e50e24dcca9e";
+static int duration_ms = 2000;
+
+static const char* event_names[] = {
+	"scan", "notify", "notify started", "connect",
+	"disconnect", "read", "write", "error",
+};
+
+struct session {
+	const char* mac;
+	blz_dev* dev;
+	blz_serv* srv;
+	blz_char* rw;
+	blz_char* notify;
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/** starts everything on a connected device, results arrive as events */
+static void session_start(struct session* s, blz_dev* dev)
+{
+	s->dev = dev;
+	/* no handler, only for the user pointer of the disconnect event */
+	blz_set_disconnect_handler(dev, NULL, s);
+	s->srv = blz_get_serv_from_uuid(dev, serv_uuid);
+	s->rw = s->srv ? blz_get_char_from_uuid(s->srv, rw_uuid) : NULL;
+	s->notify = s->srv ? blz_get_char_from_uuid(s->srv, notify_uuid) : NULL;
+	if (s->rw == NULL || s->notify == NULL) {
+		LOG_ERR("%s: characteristics not found", s->mac);
+		return;
+	}
+
+	blz_char_notify_start_async(s->notify, NULL, s, NULL, s);
+	blz_char_read_async(s->rw, NULL, s);
+	blz_char_write_async(s->rw, (const uint8_t*)"hello", 5, NULL, s);
+}
+
+static void session_stop(struct session* s)
+{
+	blz_char_free(s->notify);
+	blz_char_free(s->rw);
+	blz_serv_free(s->srv);
+	if (s->dev != NULL) {
+		blz_disconnect_async(s->dev, NULL, s);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"Usage: blz-events [options] MAC...\n"
+			"  -a address  bus address, default is the system bus\n"
+			"  -s UUID     service\n"
+			"  -r UUID     characteristic to read and write\n"
+			"  -n UUID     characteristic which notifies\n"
+			"  -t ms       time to run (2000)\n");
+}
+
+int main(int argc, char** argv)
+{
+	struct session sessions[MAX_DEVS] = {0};
+	struct blz_event ev[BATCH];
+	unsigned long counts[BLZ_EVENT_ERROR + 1] = {0};
+	const char* address = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:s:r:n:t:h")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 's': serv_uuid = optarg; break;
+		case 'r': rw_uuid = optarg; break;
+		case 'n': notify_uuid = optarg; break;
+		case 't': duration_ms = atoi(optarg); break;
+		default: usage(); return EXIT_FAILURE;
+		}
+	}
+
+	int count = argc - optind;
+	if (count <= 0 || count > MAX_DEVS) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	blz* ctx = address ? blz_init_address(address, "hci0") : blz_init("hci0");
+	if (ctx == NULL || !blz_events_enable(ctx, 0)) {
+		blz_fini(ctx);
+		return EXIT_FAILURE;
+	}
+
+	blz_scan_start(ctx, NULL, NULL);
+	for (int i = 0; i < count; i++) {
+		sessions[i].mac = argv[optind + i];
+		blz_connect_async(ctx, sessions[i].mac, BLZ_ADDR_UNKNOWN, NULL,
+						  &sessions[i]);
+	}
+
+	uint64_t end = now_us() + duration_ms * 1000ULL;
+	for (uint64_t now = now_us(); now < end; now = now_us()) {
+		int n = blz_poll_events(ctx, ev, BATCH, end - now);
+		if (n < 0) {
+			LOG_ERR("poll failed: %s", strerror(-n));
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct blz_event* e = &ev[i];
+			struct session* s = e->user;
+			counts[e->type]++;
+
+			switch (e->type) {
+			case BLZ_EVENT_CONNECT:
+				if (e->dev != NULL) {
+					session_start(s, e->dev);
+				} else {
+					LOG_ERR("%s: connect failed: %s", s->mac,
+							strerror(-e->err));
+				}
+				break;
+			case BLZ_EVENT_READ:
+				LOG_INF("%s: read %s '%.*s'", s->mac,
+						e->err == 0 ? "ok" : strerror(-e->err), (int)e->len,
+						(const char*)e->data);
+				break;
+			case BLZ_EVENT_WRITE:
+			case BLZ_EVENT_NOTIFY_STARTED:
+				if (e->err < 0) {
+					LOG_ERR("%s: %s failed: %s", s->mac, event_names[e->type],
+							strerror(-e->err));
+				}
+				break;
+			case BLZ_EVENT_DISCONNECT:
+				/* by the device, the session keeps its objects */
+				LOG_INF("%s: disconnected", s->mac);
+				break;
+			case BLZ_EVENT_ERROR:
+				LOG_ERR("events lost: %s", strerror(-e->err));
+				break;
+			default: break;
+			}
+		}
+	}
+
+	blz_scan_stop(ctx);
+	for (int i = 0; i < count; i++) {
+		session_stop(&sessions[i]);
+	}
+
+	for (int i = 0; i <= BLZ_EVENT_ERROR; i++) {
+		LOG_INF("%-14s %lu", event_names[i], counts[i]);
+	}
+
+	/* waits for the replies of Disconnect */
+	blz_fini(ctx);
+	return EXIT_SUCCESS;
+}
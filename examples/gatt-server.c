@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define UUID_SERVICE "0000fe00-b5a3-f393-e0a9-e50e24dcca9e"
+#define UUID_COUNTER "0000fe01-b5a3-f393-e0a9-e50e24dcca9e"
+#define UUID_COMMAND "0000fe02-b5a3-f393-e0a9-e50e24dcca9e"
+
+static volatile sig_atomic_t running = 1;
+static int write_fd = -1;
+static unsigned long writes;
+
+static void signal_handler(int sig)
+{
+	running = 0;
+}
+
+static void command_handler(blz_server_char* ch, const uint8_t* data,
+							size_t len, void* user)
+{
+	writes++;
+	LOG_INF("Command: '%.*s'", (int)len, data);
+}
+
+static void command_fd_handler(blz_server_char* ch, int fd, uint16_t mtu,
+							   void* user)
+{
+	LOG_INF("Command socket acquired, MTU %d", mtu);
+	if (write_fd >= 0) {
+		close(write_fd);
+	}
+	write_fd = fd;
+}
+
+/* write commands from the acquired socket, one packet each */
+static void command_fd_read(void)
+{
+	uint8_t buf[512];
+	ssize_t len;
+
+	while (write_fd >= 0
+		   && (len = recv(write_fd, buf, sizeof(buf), MSG_DONTWAIT)) != 0) {
+		if (len < 0) {
+			if (errno == EAGAIN) {
+				return;
+			}
+			break;
+		}
+		command_handler(NULL, buf, len, NULL);
+	}
+	/* closed by BlueZ */
+	if (write_fd >= 0) {
+		close(write_fd);
+		write_fd = -1;
+	}
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char** argv)
+{
+	const char* address = NULL;
+	int rate = 100;
+	int secs = 0;
+	unsigned long sent = 0;
+	unsigned long full = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:r:t:h")) != -1) {
+		switch (c) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'r':
+			rate = atoi(optarg) > 0 ? atoi(optarg) : 1;
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "blz-gatt-server [-a bus-address] [-r hz] "
+							"[-t secs]\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	blz* blz = address ? blz_init_address(address, "hci0") : blz_init("hci0");
+	if (!blz) {
+		return EXIT_FAILURE;
+	}
+
+	/* a counter which is notified at a fixed rate and a command
+	 * characteristic, which also accepts write commands through a socket */
+	blz_server* srv = blz_server_new(blz, NULL);
+	if (!srv) {
+		goto exit;
+	}
+	int serv = blz_server_add_service(srv, UUID_SERVICE);
+	blz_server_char* counter = blz_server_add_char(
+		srv, serv, UUID_COUNTER, BLZ_CHAR_READ | BLZ_CHAR_NOTIFY, NULL, NULL);
+	blz_server_char* command = blz_server_add_char(
+		srv, serv, UUID_COMMAND, BLZ_CHAR_WRITE | BLZ_CHAR_WRITE_WITHOUT_RESPONSE,
+		command_handler, NULL);
+	if (!counter || !command) {
+		goto exit;
+	}
+	blz_server_char_set_fd_handler(command, command_fd_handler, NULL);
+
+	if (!blz_server_register(srv)) {
+		goto exit;
+	}
+	LOG_INF("GATT server registered, notifying at %d Hz", rate);
+
+	uint64_t period = 1000000 / rate;
+	uint64_t start = now_usec();
+	uint64_t next = start;
+	uint32_t count = 0;
+
+	while (running && (secs == 0 || now_usec() - start < secs * 1000000ULL)) {
+		uint64_t now = now_usec();
+		if (now >= next) {
+			int r = blz_server_notify(counter, (uint8_t*)&count, sizeof(count));
+			if (r == 0) {
+				sent++;
+			} else if (r == -EAGAIN) {
+				full++;
+			}
+			count++;
+			next += period;
+			continue;
+		}
+		command_fd_read();
+		blz_loop(blz, MIN(next - now, 10000));
+	}
+
+	LOG_INF("Sent %lu notifications, %lu with full socket, received %lu "
+			"writes",
+			sent, full, writes);
+
+exit:
+	if (write_fd >= 0) {
+		close(write_fd);
+	}
+	blz_server_free(srv);
+	blz_fini(blz);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/*
+ * The Nordic UART example with the C++ wrapper blzlib.hpp: lists the GATT
+ * database, sends each line read from stdin and prints what the device
+ * notifies until stdin is closed.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <span>
+#include <string>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "blzlib_profile.hpp"
+
+using namespace blzpp::literals;
+
+constexpr auto UUID_SERVICE = "6e400001-b5a3-f393-e0a9-e50e24dcca9e"_uuid;
+constexpr auto UUID_WRITE = "6e400002-b5a3-f393-e0a9-e50e24dcca9e"_uuid;
+constexpr auto UUID_READ = "6e400003-b5a3-f393-e0a9-e50e24dcca9e"_uuid;
+
+using nus_profile = blzpp::profile<
+	blzpp::gatt_service<UUID_SERVICE,
+						blzpp::gatt_char<UUID_WRITE, BLZ_CHAR_WRITE>,
+						blzpp::gatt_char<UUID_READ, BLZ_CHAR_NOTIFY>>>;
+
+struct uart {
+	void on_rx(std::span<const std::byte> data)
+	{
+		std::printf("RX: '%.*s'\n", (int)data.size(), (const char*)data.data());
+	}
+};
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		std::fprintf(stderr, "Pass MAC address of device to connect to\n");
+		return EXIT_FAILURE;
+	}
+
+	/* declaration order is destruction order in reverse: the profile's
+	 * characteristics are freed before its service, device and context */
+	auto ctx = blzpp::context::init();
+	auto dev = ctx ? ctx.connect(argv[1]) : blzpp::device();
+	if (!dev) {
+		return EXIT_FAILURE;
+	}
+
+	/* services and characteristics are only looked up while iterating */
+	for (auto s : dev.services()) {
+		for (auto uuid : s.char_uuids()) {
+			std::printf("%.*s\n", (int)uuid.size(), uuid.data());
+		}
+	}
+
+	/* all members are found in one lookup, with the required flags */
+	auto nus = nus_profile::resolve(dev);
+	if (!nus) {
+		std::fprintf(stderr, "Nordic UART characteristics not found\n");
+		return EXIT_FAILURE;
+	}
+	auto& wch = nus.get<UUID_WRITE>();
+	auto& rch = nus.get<UUID_READ>();
+
+	uart u;
+	if (!rch.notify_start<&uart::on_rx>(&u)) {
+		return EXIT_FAILURE;
+	}
+
+	struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN, .revents = 0};
+	char line[256];
+	for (;;) {
+		/* handle notifications for up to 50 ms, then check stdin */
+		ctx.loop(50000);
+		if (poll(&pfd, 1, 0) < 0) {
+			break;
+		}
+		if (pfd.revents) {
+			ssize_t len = read(STDIN_FILENO, line, sizeof(line));
+			if (len <= 0) {
+				break;
+			}
+			wch.write(std::as_bytes(std::span(line, len)));
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -144,8 +144,8 @@ int main(int argc, char** argv)
 	int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
 	fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
 
-	/* get default dbus system connection */
-	sd_bus_default_system(&sdbus);
+	/* get dbus connection used by blzlib */
+	sdbus = sd_bus_ref(blz_get_bus(blz));
 
 	/* Use SD Event loop */
 	sd_event_default(&event);
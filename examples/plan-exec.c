@@ -0,0 +1,135 @@
+/*
+ * Operation plan: reads a characteristic, starts notifications of another
+ * one and writes a value, on all devices given on the command line at the
+ * same time. Prints the result of each step and the
+ * times of the phases of each execution. The default UUIDs are the ones of
+ * blz-mock-bluez.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+static const char* serv_uuid = "6e400100-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* rw_uuid = "6e400101-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* notify_uuid = "6e400102-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* value = "config";
+
+static const char* step_names[] = {"read", "notify", "write"};
+
+/* of all executions, the notify step belongs to the plan */
+static unsigned long notifications;
+
+struct exec {
+	const char* mac;
+	int* active;
+};
+
+static void notify_cb(const uint8_t* data, size_t len, blz_char* ch,
+					  void* user)
+{
+	notifications++;
+}
+
+static void plan_cb(blz_plan_run* run, int err, void* user)
+{
+	struct exec* e = user;
+	const struct blz_plan_times* t = blz_plan_run_times(run);
+
+	LOG_INF("%s: %s, connected %.1f ms, resolved %.1f ms, done %.1f ms",
+			e->mac, err == 0 ? "ok" : strerror(-err), t->connected_us / 1000.0,
+			t->resolved_us / 1000.0, t->done_us / 1000.0);
+
+	for (int i = 0; i < 3; i++) {
+		const struct blz_plan_result* r = blz_plan_run_result(run, i);
+		LOG_INF("  %-6s %-24s %6.1f - %6.1f ms %.*s", step_names[i],
+				r->err == 0 ? "ok" : strerror(-r->err), r->start_us / 1000.0,
+				r->end_us / 1000.0, (int)r->len, (const char*)r->data);
+	}
+
+	/* disconnects, the plan keeps running for the others */
+	blz_plan_run_free(run);
+	(*e->active)--;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"Usage: blz-plan-exec [options] MAC...\n"
+			"  -a address  bus address, default is the system bus\n"
+			"  -s UUID     service\n"
+			"  -r UUID     characteristic to read and write\n"
+			"  -n UUID     characteristic which notifies\n"
+			"  -v value    string to write (config)\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* address = NULL;
+	int ret = EXIT_FAILURE;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:s:r:n:v:h")) != -1) {
+		switch (opt) {
+		case 'a': address = optarg; break;
+		case 's': serv_uuid = optarg; break;
+		case 'r': rw_uuid = optarg; break;
+		case 'n': notify_uuid = optarg; break;
+		case 'v': value = optarg; break;
+		default: usage(); return EXIT_FAILURE;
+		}
+	}
+
+	int count = argc - optind;
+	if (count <= 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	blz* ctx = address ? blz_init_address(address, "hci0") : blz_init("hci0");
+	if (ctx == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	struct exec* execs = calloc(count, sizeof(struct exec));
+	blz_plan* plan = blz_plan_new(ctx);
+	if (execs == NULL || plan == NULL) {
+		goto exit;
+	}
+
+	/* the index of a step is its place in step_names */
+	if (blz_plan_read(plan, serv_uuid, rw_uuid) < 0
+		|| blz_plan_notify(plan, serv_uuid, notify_uuid, notify_cb, NULL) < 0
+		|| blz_plan_write(plan, serv_uuid, rw_uuid, (const uint8_t*)value,
+						  strlen(value))
+			   < 0) {
+		goto exit;
+	}
+
+	int active = 0;
+	for (int i = 0; i < count; i++) {
+		execs[i].mac = argv[optind + i];
+		execs[i].active = &active;
+		if (blz_plan_exec_async(plan, execs[i].mac, BLZ_ADDR_UNKNOWN, plan_cb,
+								&execs[i])) {
+			active++;
+		}
+	}
+
+	while (active > 0) {
+		blz_loop(ctx, UINT64_MAX);
+	}
+	LOG_INF("%lu notifications", notifications);
+	ret = EXIT_SUCCESS;
+
+exit:
+	blz_plan_free(plan);
+	free(execs);
+	blz_fini(ctx);
+	return ret;
+}
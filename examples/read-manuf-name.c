@@ -30,7 +30,7 @@ int main(int argc, char** argv)
 		goto exit;
 	}
 
-	srv = blz_get_serv_from_uuid(dev, "0000180a-0000-1000-8000-00805f9b34fb");
+	srv = blz_get_serv_from_uuid(dev, BLZ_UUID16_STR(180a));
 	if (!srv) {
 		goto exit;
 	}
@@ -42,7 +42,7 @@ int main(int argc, char** argv)
 	}
 
 	/* Find characteristic for manufacturer name */
-	rch = blz_get_char_from_uuid(srv, "00002a29-0000-1000-8000-00805f9b34fb");
+	rch = blz_get_char_from_uuid(srv, BLZ_UUID16_STR(2a29));
 	if (!rch) {
 		goto exit;
 	}
@@ -12,6 +12,14 @@ static bool terminate = false;
 static uint8_t scanned_macs[6][MAX_SCAN];
 static int scan_idx = 0;
 
+static void gatt_cb(const struct blz_gatt_attr* attr, void* user)
+{
+	static const char* indent[] = {"\t", "\t\t", "\t\t\t"};
+	static const char* type[] = {"Service", "Characteristic", "Descriptor"};
+
+	LOG_INF("%s%s %s", indent[attr->type], type[attr->type], attr->uuid);
+}
+
 static void discover(blz* blz, const char* mac)
 {
 	LOG_INF("Connecting to %s...", mac);
@@ -20,20 +28,9 @@ static void discover(blz* blz, const char* mac)
 		return;
 	}
 
-	char** uuids = blz_list_service_uuids(dev);
-
-	for (int i = 0; uuids != NULL && uuids[i] != NULL; i++) {
-		LOG_INF("\tService %s", uuids[i]);
-		blz_serv* srv = blz_get_serv_from_uuid(dev, uuids[i]);
-		if (srv) {
-			char** chuuids = blz_list_char_uuids(srv);
-			for (int i = 0; chuuids != NULL && chuuids[i] != NULL; i++) {
-				LOG_INF("\t\tCharacteristic %s", chuuids[i]);
-			}
-
-			blz_serv_free(srv);
-		}
-	}
+	/* all services, characteristics and descriptors in one go. They come
+	 * in the order of BlueZ, see tools/crawl.c for sorting them */
+	blz_dev_enumerate(dev, gatt_cb, NULL);
 
 	blz_disconnect(dev);
 }
@@ -97,8 +94,9 @@ int main(int argc, char** argv)
 		blz_scan_stop(blz);
 
 		/* connect to device to discover services and characteristics */
+		char macstr[BLZ_MAC_STR_LEN];
 		for (int i = 0; i < MAX_SCAN && MAC_NOT_EMPTY(scanned_macs[i]); i++) {
-			discover(blz, blz_mac_to_string_s(scanned_macs[i]));
+			discover(blz, blz_mac_to_string(scanned_macs[i], macstr));
 		}
 	}
 
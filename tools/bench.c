@@ -0,0 +1,503 @@
+/*
+ * Throughput and latency of one device: write with response, write command
+ * through D-Bus and through an acquired fd, read, notification rate and
+ * payload throughput and the round trip time from a write until the
+ * device notifies the same data back. The defaults are the Nordic UART
+ * Service, the RTT test needs a device (or blz-mock-bluez -e) which echoes
+ * what is written to RX on TX. Results are written as JSON, a short
+ * summary goes to stderr.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <systemd/sd-bus.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define PAYLOAD_MAX 512
+#define RTT_MAGIC	0x52545442 /* "BTTR" */
+
+enum test {
+	TEST_WRITE = 1 << 0,
+	TEST_CMD = 1 << 1,
+	TEST_FD = 1 << 2,
+	TEST_READ = 1 << 3,
+	TEST_NOTIFY = 1 << 4,
+	TEST_RTT = 1 << 5,
+};
+
+static const char* test_names[] = {"write", "cmd", "fd", "read", "notify",
+								   "rtt"};
+
+static const char* address;
+static const char* adapter = "hci0";
+static const char* mac;
+static const char* serv_uuid = "6e400001-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* write_uuid = "6e400002-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* notify_uuid = "6e400003-b5a3-f393-e0a9-e50e24dcca9e";
+static const char* read_uuid;
+static const char* label = "";
+static const char* out_file;
+static int tests = TEST_WRITE | TEST_CMD | TEST_FD | TEST_READ | TEST_NOTIFY
+				   | TEST_RTT;
+static int iterations = 1000;
+static int duration_ms = 5000;
+static int payload = 20;
+static int rtt_timeout_ms = 1000;
+static bool quiet = true;
+
+/** result of one timed operation loop */
+struct op_result {
+	const char* name;
+	bool run;
+	int count;
+	int errors;
+	size_t bytes;
+	uint64_t time_us;
+	uint32_t* lat_us;
+	int samples;
+};
+
+struct notify_state {
+	unsigned long count;
+	size_t bytes;
+	/* RTT: sequence number we wait for and whether it arrived */
+	uint32_t rtt_seq;
+	bool rtt_done;
+	uint64_t rtt_rx;
+};
+
+static struct notify_state ns;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void log_handler(enum loglevel ll, const char* fmt, va_list ap,
+						void* user)
+{
+	if (!quiet || ll <= LL_WARN) {
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+}
+
+static void notify_cb(const uint8_t* data, size_t len, blz_char* ch,
+					  void* user)
+{
+	uint32_t magic, seq;
+
+	ns.count++;
+	ns.bytes += len;
+
+	if (len < 8) {
+		return;
+	}
+	memcpy(&magic, data, 4);
+	memcpy(&seq, data + 4, 4);
+	if (magic == RTT_MAGIC && seq == ns.rtt_seq) {
+		ns.rtt_rx = now_us();
+		ns.rtt_done = true;
+	}
+}
+
+static bool op_init(struct op_result* op, const char* name, int n)
+{
+	op->name = name;
+	op->run = true;
+	op->lat_us = calloc(n, sizeof(uint32_t));
+	return op->lat_us != NULL;
+}
+
+static void op_add(struct op_result* op, uint64_t t0, size_t len, bool ok)
+{
+	uint64_t t = now_us() - t0;
+	op->time_us += t;
+	if (ok) {
+		op->lat_us[op->samples++] = MIN(t, UINT32_MAX);
+		op->count++;
+		op->bytes += len;
+	} else {
+		op->errors++;
+	}
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double pct(const struct op_result* op, double q)
+{
+	if (op->samples == 0) {
+		return 0;
+	}
+	size_t i = MIN((size_t)(q * op->samples), (size_t)op->samples - 1);
+	return op->lat_us[i] / 1000.0;
+}
+
+static double op_rate(const struct op_result* op)
+{
+	return op->time_us ? op->count * 1e6 / op->time_us : 0;
+}
+
+static void op_json(FILE* f, struct op_result* op, const char* sep)
+{
+	qsort(op->lat_us, op->samples, sizeof(uint32_t), cmp_u32);
+	fprintf(f,
+			"%s\n    \"%s\": {\"count\": %d, \"errors\": %d, "
+			"\"ops_per_s\": %.1f, \"bytes_per_s\": %.1f, \"p50_ms\": %.3f, "
+			"\"p90_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, "
+			"\"max_ms\": %.3f}",
+			sep, op->name, op->count, op->errors, op_rate(op),
+			op->time_us ? op->bytes * 1e6 / op->time_us : 0, pct(op, 0.5),
+			pct(op, 0.9), pct(op, 0.99), pct(op, 0.999), pct(op, 1));
+	fprintf(stderr, "%-7s %6d ok %5d err %10.1f ops/s %8.3f / %8.3f ms\n",
+			op->name, op->count, op->errors, op_rate(op), pct(op, 0.5),
+			pct(op, 0.99));
+}
+
+static void fill(uint8_t* buf, int i)
+{
+	memset(buf, 0, payload);
+	memcpy(buf, &i, MIN(payload, (int)sizeof(i)));
+}
+
+static void bench_write(struct op_result* op, blz_char* ch, bool cmd)
+{
+	uint8_t buf[PAYLOAD_MAX];
+
+	for (int i = 0; i < iterations; i++) {
+		fill(buf, i);
+		uint64_t t = now_us();
+		bool ok = cmd ? blz_char_write_cmd(ch, buf, payload)
+					  : blz_char_write(ch, buf, payload);
+		op_add(op, t, payload, ok);
+	}
+}
+
+/** write the whole buffer to the (non blocking) fd, waits while it is full */
+static bool fd_write(int fd, const uint8_t* buf, size_t len)
+{
+	struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+
+	while (write(fd, buf, len) < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			return false;
+		}
+		if (poll(&pfd, 1, 1000) <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* the fd is a socket to BlueZ, this measures how fast BlueZ takes the data
+ * off it, which is bounded by the connection interval */
+static void bench_fd(struct op_result* op, int fd)
+{
+	uint8_t buf[PAYLOAD_MAX];
+
+	for (int i = 0; i < iterations; i++) {
+		fill(buf, i);
+		uint64_t t = now_us();
+		op_add(op, t, payload, fd_write(fd, buf, payload));
+	}
+}
+
+static void bench_read(struct op_result* op, blz_char* ch)
+{
+	uint8_t buf[PAYLOAD_MAX];
+
+	for (int i = 0; i < iterations; i++) {
+		uint64_t t = now_us();
+		int len = blz_char_read(ch, buf, sizeof(buf));
+		op_add(op, t, MAX(len, 0), len >= 0);
+	}
+}
+
+/** count what the device sends on its own for the test duration, there are
+ * no per operation latencies */
+static void bench_notify(blz* ctx, struct op_result* op)
+{
+	/* dispatch echoes of the write tests which are still queued */
+	while (sd_bus_process(blz_get_bus(ctx), NULL) > 0) {
+		;
+	}
+
+	uint64_t end = now_us() + duration_ms * 1000ULL;
+	uint64_t t = now_us();
+	unsigned long count = ns.count;
+	size_t bytes = ns.bytes;
+
+	for (uint64_t now = t; now < end; now = now_us()) {
+		blz_loop(ctx, end - now);
+	}
+
+	op->time_us = now_us() - t;
+	op->count = ns.count - count;
+	op->bytes = ns.bytes - bytes;
+}
+
+static void bench_rtt(blz* ctx, struct op_result* op, blz_char* wch, int fd)
+{
+	uint8_t buf[PAYLOAD_MAX] = {0};
+	uint32_t magic = RTT_MAGIC;
+	int len = MAX(payload, 8);
+
+	memcpy(buf, &magic, 4);
+	for (int i = 0; i < iterations; i++) {
+		ns.rtt_seq = i;
+		ns.rtt_done = false;
+		memcpy(buf + 4, &ns.rtt_seq, 4);
+
+		/* a write with response returns only after the reply, the
+		 * notification may have arrived before but is dispatched later and
+		 * counts with its own receive time */
+		uint64_t t = now_us();
+		bool ok = fd >= 0 ? fd_write(fd, buf, len)
+						  : blz_char_write(wch, buf, len);
+		if (ok) {
+			ok = blz_loop_timeout(ctx, &ns.rtt_done, rtt_timeout_ms) >= 0;
+		}
+		if (ok) {
+			op->lat_us[op->samples++] = MIN(ns.rtt_rx - t, UINT32_MAX);
+			op->count++;
+			op->time_us += ns.rtt_rx - t;
+			op->bytes += len;
+		} else {
+			op->errors++;
+		}
+	}
+}
+
+static int parse_tests(char* list)
+{
+	int ret = 0;
+
+	for (char* tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		size_t i;
+		for (i = 0; i < ARRAY_SIZE(test_names); i++) {
+			if (strcmp(tok, test_names[i]) == 0) {
+				ret |= 1 << i;
+				break;
+			}
+		}
+		if (i == ARRAY_SIZE(test_names)) {
+			LOG_ERR("unknown test %s", tok);
+			return 0;
+		}
+	}
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"blz-bench -m MAC [options]\n"
+			"  -a addr   bus address (system bus), e.g. of blz-mock-bluez\n"
+			"  -i name   adapter (hci0)\n"
+			"  -s UUID   service (Nordic UART)\n"
+			"  -w UUID   characteristic to write (NUS RX)\n"
+			"  -n UUID   characteristic which notifies (NUS TX)\n"
+			"  -r UUID   characteristic to read (none)\n"
+			"  -t list   tests, comma separated: "
+			"write,cmd,fd,read,notify,rtt (all)\n"
+			"  -N num    iterations of write, cmd, fd, read and rtt (1000)\n"
+			"  -d ms     duration of the notify test (5000)\n"
+			"  -p bytes  payload size (20)\n"
+			"  -T ms     RTT timeout (1000)\n"
+			"  -L label  label for the results\n"
+			"  -o file   write JSON there instead of stdout\n"
+			"  -v        show library log\n");
+}
+
+int main(int argc, char** argv)
+{
+	struct op_result ops[ARRAY_SIZE(test_names)] = {0};
+	blz* ctx = NULL;
+	blz_dev* dev = NULL;
+	blz_serv* srv = NULL;
+	blz_char* wch = NULL;
+	blz_char* nch = NULL;
+	blz_char* rch = NULL;
+	int wfd = -1;
+	int ret = EXIT_FAILURE;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:i:m:s:w:n:r:t:N:d:p:T:L:o:vh")) != -1) {
+		switch (c) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'i':
+			adapter = optarg;
+			break;
+		case 'm':
+			mac = optarg;
+			break;
+		case 's':
+			serv_uuid = optarg;
+			break;
+		case 'w':
+			write_uuid = optarg;
+			break;
+		case 'n':
+			notify_uuid = optarg;
+			break;
+		case 'r':
+			read_uuid = optarg;
+			break;
+		case 't':
+			tests = parse_tests(optarg);
+			break;
+		case 'N':
+			iterations = MAX(atoi(optarg), 1);
+			break;
+		case 'd':
+			duration_ms = MAX(atoi(optarg), 1);
+			break;
+		case 'p':
+			payload = MIN(MAX(atoi(optarg), 1), PAYLOAD_MAX);
+			break;
+		case 'T':
+			rtt_timeout_ms = MAX(atoi(optarg), 1);
+			break;
+		case 'L':
+			label = optarg;
+			break;
+		case 'o':
+			out_file = optarg;
+			break;
+		case 'v':
+			quiet = false;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (mac == NULL || tests == 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(test_names); i++) {
+		if (!op_init(&ops[i], test_names[i], iterations)) {
+			return EXIT_FAILURE;
+		}
+		ops[i].run = false;
+	}
+
+	ctx = address ? blz_init_address(address, adapter) : blz_init(adapter);
+	if (ctx == NULL) {
+		goto exit;
+	}
+	blz_set_ctx_log_handler(ctx, log_handler, NULL);
+
+	dev = blz_connect(ctx, mac, BLZ_ADDR_UNKNOWN);
+	srv = dev ? blz_get_serv_from_uuid(dev, serv_uuid) : NULL;
+	if (srv == NULL) {
+		goto exit;
+	}
+
+	wch = blz_get_char_from_uuid(srv, write_uuid);
+	if (tests & (TEST_NOTIFY | TEST_RTT)) {
+		nch = blz_get_char_from_uuid(srv, notify_uuid);
+		if (nch == NULL || !blz_char_notify_start(nch, notify_cb, NULL)) {
+			goto exit;
+		}
+	}
+	if ((tests & TEST_READ) && read_uuid != NULL) {
+		rch = blz_get_char_from_uuid(srv, read_uuid);
+		if (rch == NULL) {
+			goto exit;
+		}
+	}
+	if (wch == NULL && (tests & (TEST_WRITE | TEST_CMD | TEST_FD | TEST_RTT))) {
+		goto exit;
+	}
+
+	if (tests & TEST_WRITE) {
+		ops[0].run = true;
+		bench_write(&ops[0], wch, false);
+	}
+	if (tests & TEST_CMD) {
+		ops[1].run = true;
+		bench_write(&ops[1], wch, true);
+	}
+	if (tests & (TEST_FD | TEST_RTT)) {
+		wfd = blz_char_write_fd_acquire(wch);
+	}
+	if ((tests & TEST_FD) && wfd >= 0) {
+		ops[2].run = true;
+		bench_fd(&ops[2], wfd);
+	}
+	if (rch != NULL) {
+		ops[3].run = true;
+		bench_read(&ops[3], rch);
+	}
+	if (tests & TEST_NOTIFY) {
+		ops[4].run = true;
+		bench_notify(ctx, &ops[4]);
+	}
+	if (tests & TEST_RTT) {
+		ops[5].run = true;
+		bench_rtt(ctx, &ops[5], wch, wfd);
+	}
+
+	FILE* f = out_file ? fopen(out_file, "w") : stdout;
+	if (f == NULL) {
+		LOG_ERR("can't open %s", out_file);
+		goto exit;
+	}
+	fprintf(f,
+			"{\n  \"label\": \"%s\",\n  \"device\": \"%s\",\n  \"payload\": %d,"
+			"\n  \"rtt_write\": \"%s\",\n  \"tests\": {",
+			label, mac, payload, wfd >= 0 ? "fd" : "request");
+	const char* sep = "";
+	for (size_t i = 0; i < ARRAY_SIZE(ops); i++) {
+		if (ops[i].run) {
+			op_json(f, &ops[i], sep);
+			sep = ",";
+		}
+	}
+	fprintf(f, "\n  }\n}\n");
+	if (f != stdout) {
+		fclose(f);
+	}
+	ret = EXIT_SUCCESS;
+
+exit:
+	if (wfd >= 0) {
+		close(wfd);
+	}
+	if (nch != NULL) {
+		blz_char_notify_stop(nch);
+	}
+	blz_char_free(rch);
+	blz_char_free(nch);
+	blz_char_free(wch);
+	blz_serv_free(srv);
+	blz_disconnect(dev);
+	blz_fini(ctx);
+	for (size_t i = 0; i < ARRAY_SIZE(ops); i++) {
+		free(ops[i].lat_us);
+	}
+	return ret;
+}
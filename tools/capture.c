@@ -0,0 +1,1007 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Record D-Bus traffic between BlueZ and its clients to a compact binary
+ * file and replay it, acting as the BlueZ side, to benchmark against real
+ * sessions without hardware.
+ *
+ * "record" becomes a bus monitor and writes method calls, replies, errors
+ * and signals to or from org.bluez (or only the ones of one client
+ * connection, e.g. a blzlib context) with relative timestamps.
+ *
+ * "play" claims org.bluez and goes through the recording in order: signals
+ * are sent after their recorded delay (or at once with -f) and when the
+ * next record is a call by the client it waits for the client to make it
+ * and replies with the recorded reply. Calls which are not next in the
+ * recording get the reply of a recorded call of the same method on the
+ * same object, so polling clients keep working.
+ *
+ * File format, host byte order: magic "BLZCAP1\n", then records of a
+ * struct rec_hdr followed by path, interface, member, error name and
+ * signature as NUL terminated strings, followed by the body. The body is
+ * encoded by walking the signature: fixed size integers, strings as
+ * uint32 length and bytes, arrays as uint32 element count and elements,
+ * variants as signature string and value. Unix fds are not recorded and
+ * replayed as /dev/null.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define CAP_MAGIC	  "BLZCAP1\n"
+#define CAP_MAGIC_LEN 8
+#define SIG_MAX		  256
+#define FAST_BATCH	  256
+#define QUEUE_MAX	  1024
+
+struct rec_hdr {
+	uint32_t len;	   /* whole record */
+	uint32_t delta_us; /* since previous record */
+	uint32_t cookie;
+	uint32_t reply_cookie;
+	uint8_t type; /* SD_BUS_MESSAGE_* */
+	uint8_t from_bluez;
+	uint8_t pad[2];
+};
+
+struct buf {
+	uint8_t* data;
+	size_t len;
+	size_t cap;
+};
+
+static volatile sig_atomic_t stop;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* --- body encoding --- */
+
+static bool buf_put(struct buf* b, const void* p, size_t n)
+{
+	if (b->len + n > b->cap) {
+		size_t cap = MAX(b->cap * 2, b->len + n + 256);
+		uint8_t* d = realloc(b->data, cap);
+		if (d == NULL) {
+			return false;
+		}
+		b->data = d;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+	return true;
+}
+
+static bool buf_put_str(struct buf* b, const char* s)
+{
+	uint32_t len = s ? strlen(s) : 0;
+	return buf_put(b, &len, 4) && buf_put(b, s, len);
+}
+
+static size_t basic_size(char type)
+{
+	switch (type) {
+	case 'y':
+		return 1;
+	case 'n':
+	case 'q':
+		return 2;
+	case 'b':
+	case 'i':
+	case 'u':
+	case 'h':
+		return 4;
+	case 'x':
+	case 't':
+	case 'd':
+		return 8;
+	default:
+		return 0; /* strings */
+	}
+}
+
+static int ser_value(sd_bus_message* m, struct buf* b, char type,
+					 const char* contents);
+
+/** encode all values up to the end of the current container, returns the
+ * number of values */
+static int ser_level(sd_bus_message* m, struct buf* b)
+{
+	char type;
+	const char* contents;
+	int r, n = 0;
+
+	while ((r = sd_bus_message_peek_type(m, &type, &contents)) > 0) {
+		r = ser_value(m, b, type, contents);
+		if (r < 0) {
+			return r;
+		}
+		n++;
+	}
+	return r < 0 ? r : n;
+}
+
+static int ser_value(sd_bus_message* m, struct buf* b, char type,
+					 const char* contents)
+{
+	int r;
+
+	if (type == 'a' || type == 'v' || type == 'r' || type == 'e') {
+		size_t pos = b->len;
+		uint32_t cnt = 0;
+
+		if (type == 'a' && !buf_put(b, &cnt, 4)) {
+			return -ENOMEM;
+		} else if (type == 'v' && !buf_put_str(b, contents)) {
+			return -ENOMEM;
+		}
+		r = sd_bus_message_enter_container(m, type, contents);
+		if (r >= 0) {
+			r = ser_level(m, b);
+		}
+		if (r >= 0 && type == 'a') {
+			cnt = r;
+			memcpy(b->data + pos, &cnt, 4);
+		}
+		if (r >= 0) {
+			r = sd_bus_message_exit_container(m);
+		}
+		return r;
+	}
+
+	union {
+		uint8_t y;
+		int b;
+		int16_t n;
+		uint16_t q;
+		int32_t i;
+		uint32_t u;
+		int64_t x;
+		uint64_t t;
+		double d;
+		const char* s;
+	} v;
+
+	r = sd_bus_message_read_basic(m, type, &v);
+	if (r < 0) {
+		return r;
+	}
+
+	if (type == 'h') {
+		v.i = -1;
+	}
+	size_t size = basic_size(type);
+	if (size > 0) {
+		return buf_put(b, &v, size) ? 0 : -ENOMEM;
+	}
+	return buf_put_str(b, v.s) ? 0 : -ENOMEM;
+}
+
+/* --- body decoding --- */
+
+/** length of the first complete type in signature s */
+static size_t sig_len(const char* s)
+{
+	if (*s == 'a') {
+		return 1 + sig_len(s + 1);
+	}
+	if (*s == '(' || *s == '{') {
+		char open = *s;
+		char close = open == '(' ? ')' : '}';
+		int depth = 0;
+		size_t i = 0;
+		do {
+			if (s[i] == open) {
+				depth++;
+			} else if (s[i] == close) {
+				depth--;
+			} else if (s[i] == '\0') {
+				return i;
+			}
+			i++;
+		} while (depth > 0);
+		return i;
+	}
+	return *s ? 1 : 0;
+}
+
+struct reader {
+	const uint8_t* p;
+	const uint8_t* end;
+};
+
+static bool rd(struct reader* rd, void* dst, size_t n)
+{
+	if ((size_t)(rd->end - rd->p) < n) {
+		return false;
+	}
+	memcpy(dst, rd->p, n);
+	rd->p += n;
+	return true;
+}
+
+/** read string into buf (NUL terminated) */
+static bool rd_str(struct reader* r, char* buf, size_t size)
+{
+	uint32_t len;
+	if (!rd(r, &len, 4) || len >= size) {
+		return false;
+	}
+	if (!rd(r, buf, len)) {
+		return false;
+	}
+	buf[len] = '\0';
+	return true;
+}
+
+static int deser_sig(sd_bus_message* m, const char* sig, size_t len,
+					 struct reader* r);
+
+/** append one value of the complete type sig[0..len) */
+static int deser_type(sd_bus_message* m, const char* sig, size_t len,
+					  struct reader* r)
+{
+	char inner[SIG_MAX];
+	int ret;
+
+	if (len >= SIG_MAX) {
+		return -EINVAL;
+	}
+
+	switch (sig[0]) {
+	case 'a': {
+		uint32_t cnt;
+		if (!rd(r, &cnt, 4)) {
+			return -EBADMSG;
+		}
+		memcpy(inner, sig + 1, len - 1);
+		inner[len - 1] = '\0';
+		ret = sd_bus_message_open_container(m, 'a', inner);
+		for (uint32_t i = 0; ret >= 0 && i < cnt; i++) {
+			ret = deser_type(m, inner, len - 1, r);
+		}
+		return ret < 0 ? ret : sd_bus_message_close_container(m);
+	}
+	case 'v':
+		if (!rd_str(r, inner, sizeof(inner))) {
+			return -EBADMSG;
+		}
+		ret = sd_bus_message_open_container(m, 'v', inner);
+		if (ret >= 0) {
+			ret = deser_type(m, inner, strlen(inner), r);
+		}
+		return ret < 0 ? ret : sd_bus_message_close_container(m);
+	case '(':
+	case '{':
+		memcpy(inner, sig + 1, len - 2);
+		inner[len - 2] = '\0';
+		ret = sd_bus_message_open_container(m, sig[0] == '(' ? 'r' : 'e',
+											inner);
+		if (ret >= 0) {
+			ret = deser_sig(m, inner, len - 2, r);
+		}
+		return ret < 0 ? ret : sd_bus_message_close_container(m);
+	}
+
+	union {
+		uint8_t buf[8];
+		int b;
+		int fd;
+	} v;
+	size_t size = basic_size(sig[0]);
+
+	if (size == 0) {
+		uint32_t slen;
+		if (!rd(r, &slen, 4) || (size_t)(r->end - r->p) < slen) {
+			return -EBADMSG;
+		}
+		/* strings are not NUL terminated in the file */
+		char* s = strndup((const char*)r->p, slen);
+		if (s == NULL) {
+			return -ENOMEM;
+		}
+		r->p += slen;
+		ret = sd_bus_message_append_basic(m, sig[0], s);
+		free(s);
+		return ret;
+	}
+
+	if (!rd(r, &v, size)) {
+		return -EBADMSG;
+	}
+	if (sig[0] == 'h') {
+		/* the message keeps a duplicate */
+		v.fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+		ret = sd_bus_message_append_basic(m, 'h', &v.fd);
+		close(v.fd);
+		return ret;
+	}
+	return sd_bus_message_append_basic(m, sig[0], &v);
+}
+
+static int deser_sig(sd_bus_message* m, const char* sig, size_t len,
+					 struct reader* r)
+{
+	int ret = 0;
+	size_t i = 0;
+
+	while (ret >= 0 && i < len) {
+		size_t l = sig_len(sig + i);
+		if (l == 0) {
+			return -EINVAL;
+		}
+		ret = deser_type(m, sig + i, l, r);
+		i += l;
+	}
+	return ret;
+}
+
+/* --- record --- */
+
+static bool rec_write(FILE* f, sd_bus_message* m, bool from_bluez,
+					  uint32_t delta, struct buf* body)
+{
+	struct rec_hdr h = {0};
+	uint64_t cookie = 0, reply_cookie = 0;
+	const char* strs[5];
+	uint8_t type;
+	const sd_bus_error* err = sd_bus_message_get_error(m);
+
+	sd_bus_message_get_type(m, &type);
+	sd_bus_message_get_cookie(m, &cookie);
+	sd_bus_message_get_reply_cookie(m, &reply_cookie);
+
+	strs[0] = sd_bus_message_get_path(m);
+	strs[1] = sd_bus_message_get_interface(m);
+	strs[2] = sd_bus_message_get_member(m);
+	strs[3] = err ? err->name : NULL;
+	strs[4] = sd_bus_message_get_signature(m, true);
+
+	body->len = 0;
+	if (sd_bus_message_rewind(m, true) < 0 || ser_level(m, body) < 0) {
+		LOG_WARN("failed to encode message");
+		return true;
+	}
+
+	h.len = sizeof(h) + body->len;
+	for (int i = 0; i < 5; i++) {
+		h.len += (strs[i] ? strlen(strs[i]) : 0) + 1;
+	}
+	h.delta_us = delta;
+	h.cookie = cookie;
+	h.reply_cookie = reply_cookie;
+	h.type = type;
+	h.from_bluez = from_bluez;
+
+	if (fwrite(&h, sizeof(h), 1, f) != 1) {
+		return false;
+	}
+	for (int i = 0; i < 5; i++) {
+		const char* s = strs[i] ? strs[i] : "";
+		if (fwrite(s, strlen(s) + 1, 1, f) != 1) {
+			return false;
+		}
+	}
+	return body->len == 0 || fwrite(body->data, body->len, 1, f) == 1;
+}
+
+static int add_rule(sd_bus_message* m, const char* fmt, const char* name)
+{
+	char rule[256];
+	snprintf(rule, sizeof(rule), fmt, name);
+	return sd_bus_message_append_basic(m, 's', rule);
+}
+
+static int cmd_record(const char* address, const char* client,
+					  const char* file)
+{
+	sd_bus* bus = NULL;
+	sd_bus_message* call = NULL;
+	sd_bus_message* reply = NULL;
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	struct buf body = {0};
+	const char* owner;
+	char bluez[256];
+	unsigned long count = 0;
+
+	if (address == NULL) {
+		address = "unix:path=/run/dbus/system_bus_socket";
+	}
+
+	/* look up the current owner of org.bluez to know the direction */
+	int r = sd_bus_new(&bus);
+	if (r >= 0) {
+		r = sd_bus_set_address(bus, address);
+	}
+	if (r >= 0) {
+		sd_bus_set_bus_client(bus, 1);
+		r = sd_bus_start(bus);
+	}
+	if (r >= 0) {
+		r = sd_bus_call_method(bus, "org.freedesktop.DBus",
+							   "/org/freedesktop/DBus", "org.freedesktop.DBus",
+							   "GetNameOwner", &error, &reply, "s",
+							   "org.bluez");
+	}
+	if (r >= 0) {
+		r = sd_bus_message_read_basic(reply, 's', &owner);
+	}
+	if (r < 0) {
+		LOG_ERR("org.bluez not found: %s",
+				error.message ? error.message : strerror(-r));
+		return EXIT_FAILURE;
+	}
+	strncpy(bluez, owner, sizeof(bluez) - 1);
+	bluez[sizeof(bluez) - 1] = '\0';
+	reply = sd_bus_message_unref(reply);
+	bus = sd_bus_flush_close_unref(bus);
+
+	/* monitor connection */
+	r = sd_bus_new(&bus);
+	if (r >= 0) {
+		r = sd_bus_set_address(bus, address);
+	}
+	if (r >= 0) {
+		sd_bus_set_bus_client(bus, 1);
+		sd_bus_set_monitor(bus, 1);
+		r = sd_bus_start(bus);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_new_method_call(
+			bus, &call, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+			"org.freedesktop.DBus.Monitoring", "BecomeMonitor");
+	}
+	if (r >= 0) {
+		r = sd_bus_message_open_container(call, 'a', "s");
+	}
+	if (client != NULL) {
+		/* one client connection and the broadcast signals of BlueZ */
+		if (r >= 0) {
+			r = add_rule(call, "sender='%s'", client);
+		}
+		if (r >= 0) {
+			r = add_rule(call, "destination='%s'", client);
+		}
+		if (r >= 0) {
+			r = add_rule(call, "type='signal',sender='%s'", bluez);
+		}
+	} else {
+		if (r >= 0) {
+			r = add_rule(call, "sender='%s'", bluez);
+		}
+		if (r >= 0) {
+			r = add_rule(call, "destination='%s'", bluez);
+		}
+		if (r >= 0) {
+			r = add_rule(call, "destination='%s'", "org.bluez");
+		}
+	}
+	if (r >= 0) {
+		r = sd_bus_message_close_container(call);
+	}
+	if (r >= 0) {
+		r = sd_bus_message_append(call, "u", 0);
+	}
+	if (r >= 0) {
+		r = sd_bus_call(bus, call, 0, &error, NULL);
+	}
+	sd_bus_message_unref(call);
+	if (r < 0) {
+		LOG_ERR("BecomeMonitor failed: %s",
+				error.message ? error.message : strerror(-r));
+		sd_bus_error_free(&error);
+		return EXIT_FAILURE;
+	}
+
+	FILE* f = fopen(file, "w");
+	if (f == NULL || fwrite(CAP_MAGIC, CAP_MAGIC_LEN, 1, f) != 1) {
+		LOG_ERR("can't write %s", file);
+		return EXIT_FAILURE;
+	}
+
+	LOG_INF("recording, stop with Ctrl-C");
+
+	uint64_t last = now_usec();
+	while (!stop) {
+		sd_bus_message* m = NULL;
+		r = sd_bus_process(bus, &m);
+		if (r < 0) {
+			LOG_ERR("bus error: %s", strerror(-r));
+			break;
+		}
+		if (m == NULL) {
+			if (r == 0) {
+				sd_bus_wait(bus, 100000);
+			}
+			continue;
+		}
+
+		const char* sender = sd_bus_message_get_sender(m);
+		const char* dest = sd_bus_message_get_destination(m);
+		bool from_bluez = sender && strcmp(sender, bluez) == 0;
+		bool to_bluez = dest
+						&& (strcmp(dest, bluez) == 0
+							|| strcmp(dest, "org.bluez") == 0);
+
+		if (from_bluez || to_bluez) {
+			uint64_t now = now_usec();
+			if (!rec_write(f, m, from_bluez, MIN(now - last, UINT32_MAX),
+						   &body)) {
+				LOG_ERR("write failed");
+				sd_bus_message_unref(m);
+				break;
+			}
+			last = now;
+			count++;
+		}
+		sd_bus_message_unref(m);
+	}
+
+	LOG_INF("recorded %lu messages", count);
+	fclose(f);
+	free(body.data);
+	sd_bus_flush_close_unref(bus);
+	return EXIT_SUCCESS;
+}
+
+/* --- play --- */
+
+struct rec {
+	struct rec_hdr h;
+	const char* path;
+	const char* intf;
+	const char* member;
+	const char* error;
+	const char* sig;
+	const uint8_t* body;
+	size_t body_len;
+	bool used;
+};
+
+static struct {
+	uint8_t* data;
+	struct rec* recs;
+	size_t count;
+	size_t cursor;
+	bool waiting;
+	bool delay_done;
+	bool fast;
+	int wait_ms;
+	sd_bus* bus;
+	sd_event* event;
+	sd_event_source* timer;
+	uint64_t start;
+	unsigned long signals;
+	unsigned long replies;
+	unsigned long skipped;
+	unsigned long unmatched;
+} play;
+
+static bool load(const char* file)
+{
+	FILE* f = fopen(file, "r");
+	if (f == NULL) {
+		LOG_ERR("can't open %s", file);
+		return false;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	play.data = malloc(size);
+	if (play.data == NULL || fread(play.data, size, 1, f) != 1
+		|| size < CAP_MAGIC_LEN
+		|| memcmp(play.data, CAP_MAGIC, CAP_MAGIC_LEN) != 0) {
+		LOG_ERR("%s is not a capture file", file);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+
+	/* two passes: count, then index */
+	for (int pass = 0; pass < 2; pass++) {
+		size_t off = CAP_MAGIC_LEN;
+		size_t n = 0;
+		while (off + sizeof(struct rec_hdr) <= (size_t)size) {
+			struct rec_hdr h;
+			memcpy(&h, play.data + off, sizeof(h));
+			if (h.len < sizeof(h) || off + h.len > (size_t)size) {
+				LOG_ERR("truncated record %zu", n);
+				return false;
+			}
+			if (pass == 1) {
+				struct rec* r = &play.recs[n];
+				const char* s = (const char*)play.data + off + sizeof(h);
+				const char* end = (const char*)play.data + off + h.len;
+				const char** strs[] = {&r->path, &r->intf, &r->member,
+									   &r->error, &r->sig};
+				r->h = h;
+				for (size_t i = 0; i < ARRAY_SIZE(strs); i++) {
+					size_t l = strnlen(s, end - s);
+					if (s + l >= end) {
+						LOG_ERR("bad record %zu", n);
+						return false;
+					}
+					*strs[i] = s;
+					s += l + 1;
+				}
+				r->body = (const uint8_t*)s;
+				r->body_len = end - s;
+			}
+			off += h.len;
+			n++;
+		}
+		if (pass == 0) {
+			play.recs = calloc(n, sizeof(struct rec));
+			if (play.recs == NULL) {
+				return false;
+			}
+		}
+		play.count = n;
+	}
+	return true;
+}
+
+static int build_body(sd_bus_message* m, struct rec* r)
+{
+	struct reader rd = {r->body, r->body + r->body_len};
+	return deser_sig(m, r->sig, strlen(r->sig), &rd);
+}
+
+static bool rec_is(struct rec* r, uint8_t type, bool from_bluez)
+{
+	return r->h.type == type && r->h.from_bluez == from_bluez;
+}
+
+static bool rec_matches(struct rec* r, sd_bus_message* m)
+{
+	const char* intf = sd_bus_message_get_interface(m);
+	return rec_is(r, SD_BUS_MESSAGE_METHOD_CALL, false)
+		   && strcmp(r->path, sd_bus_message_get_path(m)) == 0
+		   && strcmp(r->member, sd_bus_message_get_member(m)) == 0
+		   && (intf == NULL || strcmp(r->intf, intf) == 0);
+}
+
+static void send_signal(struct rec* r)
+{
+	sd_bus_message* m = NULL;
+
+	int ret = sd_bus_message_new_signal(play.bus, &m, r->path, r->intf,
+										r->member);
+	if (ret >= 0) {
+		ret = build_body(m, r);
+	}
+	if (ret >= 0) {
+		ret = sd_bus_send(play.bus, m, NULL);
+	}
+	if (ret < 0) {
+		LOG_WARN("failed to send signal %s: %s", r->member, strerror(-ret));
+	} else {
+		play.signals++;
+	}
+	sd_bus_message_unref(m);
+}
+
+static void send_reply(sd_bus_message* call, struct rec* c)
+{
+	sd_bus_message* m = NULL;
+	struct rec* reply = NULL;
+	int ret;
+
+	/* the reply follows the call in the recording */
+	for (size_t i = c - play.recs + 1; i < play.count; i++) {
+		struct rec* r = &play.recs[i];
+		if (r->h.from_bluez && r->h.reply_cookie == c->h.cookie
+			&& (r->h.type == SD_BUS_MESSAGE_METHOD_RETURN
+				|| r->h.type == SD_BUS_MESSAGE_METHOD_ERROR)) {
+			reply = r;
+			break;
+		}
+	}
+
+	if (reply == NULL) {
+		ret = sd_bus_message_new_method_errorf(
+			call, &m, "org.freedesktop.DBus.Error.NoReply",
+			"No reply in recording");
+	} else if (reply->h.type == SD_BUS_MESSAGE_METHOD_ERROR) {
+		char msg[256] = "";
+		struct reader rd = {reply->body, reply->body + reply->body_len};
+		if (reply->sig[0] == 's') {
+			rd_str(&rd, msg, sizeof(msg));
+		}
+		ret = sd_bus_message_new_method_errorf(call, &m, reply->error, "%s",
+											   msg);
+		reply->used = true;
+	} else {
+		ret = sd_bus_message_new_method_return(call, &m);
+		if (ret >= 0) {
+			ret = build_body(m, reply);
+		}
+		reply->used = true;
+	}
+
+	if (ret >= 0) {
+		ret = sd_bus_send(play.bus, m, NULL);
+	}
+	if (ret < 0) {
+		LOG_WARN("failed to reply %s: %s", c->member, strerror(-ret));
+	} else {
+		play.replies++;
+	}
+	sd_bus_message_unref(m);
+}
+
+static void step(void);
+
+static int timer_cb(sd_event_source* s, uint64_t usec, void* user)
+{
+	if (play.waiting) {
+		/* client did not make the expected call */
+		play.waiting = false;
+		play.skipped++;
+		play.cursor++;
+	}
+	step();
+	return 0;
+}
+
+static void timer_set(uint64_t delay_us)
+{
+	sd_event_source_set_time(play.timer, now_usec() + delay_us);
+	sd_event_source_set_enabled(play.timer, SD_EVENT_ONESHOT);
+}
+
+/** advance through the recording as far as possible */
+static void step(void)
+{
+	int batch = 0;
+
+	while (play.cursor < play.count) {
+		struct rec* r = &play.recs[play.cursor];
+
+		if (r->used) {
+			play.cursor++;
+		} else if (rec_is(r, SD_BUS_MESSAGE_SIGNAL, true)) {
+			if (!play.fast && !play.delay_done && r->h.delta_us > 0) {
+				play.delay_done = true;
+				timer_set(r->h.delta_us);
+				return;
+			}
+			if (play.fast && ++batch > FAST_BATCH) {
+				/* let the bus write and read in between */
+				uint64_t queued = 0;
+				sd_bus_get_n_queued_write(play.bus, &queued);
+				timer_set(queued > QUEUE_MAX ? 1000 : 0);
+				return;
+			}
+			send_signal(r);
+			play.delay_done = false;
+			play.cursor++;
+		} else if (rec_is(r, SD_BUS_MESSAGE_METHOD_CALL, false)) {
+			play.waiting = true;
+			timer_set(play.wait_ms * 1000ULL);
+			return;
+		} else {
+			/* replies are sent with the calls */
+			play.cursor++;
+		}
+	}
+
+	sd_event_exit(play.event, 0);
+}
+
+static int call_filter(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	uint8_t type;
+	struct rec* c = NULL;
+
+	if (sd_bus_message_get_type(m, &type) < 0
+		|| type != SD_BUS_MESSAGE_METHOD_CALL
+		|| sd_bus_message_get_destination(m) == NULL
+		|| strncmp(sd_bus_message_get_destination(m), "org.freedesktop.", 16)
+			   == 0) {
+		return 0;
+	}
+
+	/* expected call, next one of the same method or any earlier one */
+	for (size_t i = play.cursor; i < play.count && c == NULL; i++) {
+		if (!play.recs[i].used && rec_matches(&play.recs[i], m)) {
+			c = &play.recs[i];
+		}
+	}
+	for (size_t i = 0; i < play.cursor && c == NULL; i++) {
+		if (rec_matches(&play.recs[i], m)) {
+			c = &play.recs[i];
+		}
+	}
+
+	if (c == NULL) {
+		play.unmatched++;
+		sd_bus_reply_method_errorf(m, "org.freedesktop.DBus.Error.UnknownMethod",
+								   "%s not in recording",
+								   sd_bus_message_get_member(m));
+		return 1;
+	}
+
+	send_reply(m, c);
+
+	size_t idx = c - play.recs;
+	if (idx >= play.cursor) {
+		c->used = true;
+	}
+	if (play.waiting && idx == play.cursor) {
+		play.waiting = false;
+		play.cursor++;
+		step();
+	}
+	return 1;
+}
+
+static int signal_cb(sd_event_source* s, const struct signalfd_siginfo* si,
+					 void* user)
+{
+	sd_event_exit(play.event, 0);
+	return 0;
+}
+
+static int cmd_play(const char* address, const char* file)
+{
+	if (!load(file)) {
+		return EXIT_FAILURE;
+	}
+
+	int r = sd_event_new(&play.event);
+	if (r >= 0) {
+		r = sd_bus_new(&play.bus);
+	}
+	if (r >= 0) {
+		r = sd_bus_set_address(play.bus, address);
+	}
+	if (r >= 0) {
+		sd_bus_set_bus_client(play.bus, 1);
+		sd_bus_negotiate_fds(play.bus, 1);
+		r = sd_bus_start(play.bus);
+	}
+	if (r >= 0) {
+		r = sd_bus_add_filter(play.bus, NULL, call_filter, NULL);
+	}
+	if (r >= 0) {
+		r = sd_bus_request_name(play.bus, "org.bluez", 0);
+	}
+	if (r >= 0) {
+		r = sd_bus_attach_event(play.bus, play.event,
+								SD_EVENT_PRIORITY_NORMAL);
+	}
+	if (r >= 0) {
+		r = sd_event_add_time(play.event, &play.timer, CLOCK_MONOTONIC, 0, 1,
+							  timer_cb, NULL);
+	}
+	if (r < 0) {
+		LOG_ERR("failed to set up bus: %s", strerror(-r));
+		return EXIT_FAILURE;
+	}
+
+	sigset_t ss;
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGINT);
+	sigaddset(&ss, SIGTERM);
+	sigprocmask(SIG_BLOCK, &ss, NULL);
+	sd_event_add_signal(play.event, NULL, SIGINT, signal_cb, NULL);
+	sd_event_add_signal(play.event, NULL, SIGTERM, signal_cb, NULL);
+
+	LOG_INF("playing %zu messages", play.count);
+
+	play.start = now_usec();
+	step();
+	r = sd_event_loop(play.event);
+	sd_bus_flush(play.bus);
+
+	double secs = (now_usec() - play.start) / 1e6;
+	LOG_INF("%.2f s: %lu signals (%.0f/s), %lu replies, %lu expected calls "
+			"missing, %lu unknown calls",
+			secs, play.signals, play.signals / secs, play.replies,
+			play.skipped, play.unmatched);
+
+	sd_event_source_unref(play.timer);
+	sd_bus_flush_close_unref(play.bus);
+	sd_event_unref(play.event);
+	free(play.recs);
+	free(play.data);
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void stop_handler(int sig)
+{
+	stop = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"blz-capture record [-a bus-address] [-n client] -o file\n"
+			"  record traffic to and from org.bluez (system bus by default),\n"
+			"  or only of one client connection (unique name, e.g. :1.42)\n"
+			"blz-capture play -a bus-address [-f] [-w ms] -i file\n"
+			"  act as org.bluez and replay, -f as fast as possible instead of\n"
+			"  recorded timing, -w time to wait for expected calls (1000)\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* address = NULL;
+	const char* client = NULL;
+	const char* file = NULL;
+	int c;
+
+	if (argc < 2) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	const char* cmd = argv[1];
+	play.wait_ms = 1000;
+	optind = 2;
+
+	while ((c = getopt(argc, argv, "a:n:o:i:fw:h")) != -1) {
+		switch (c) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'n':
+			client = optarg;
+			break;
+		case 'o':
+		case 'i':
+			file = optarg;
+			break;
+		case 'f':
+			play.fast = true;
+			break;
+		case 'w':
+			play.wait_ms = atoi(optarg);
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (file == NULL) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp(cmd, "record") == 0) {
+		signal(SIGINT, stop_handler);
+		signal(SIGTERM, stop_handler);
+		return cmd_record(address, client, file);
+	} else if (strcmp(cmd, "play") == 0 && address != NULL) {
+		return cmd_play(address, file);
+	}
+
+	usage();
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,477 @@
+/*
+ * Inventory of the GATT databases of many devices. Devices are taken from
+ * the command line, a file or a scan and crawled by a number of worker
+ * threads, each with its own context and connection, so that at most that
+ * many connects are outstanding at a time. Each device is enumerated with
+ * one lookup of the object tree (blz_dev_enumerate()), optionally reading
+ * descriptors and characteristic values, and written as one line of JSON
+ * (NDJSON) with the time spent in each step.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blzlib.h"
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define MAX_WORKERS 32
+#define VALUE_MAX	512
+
+struct attr {
+	struct blz_gatt_attr a;
+	char* path;
+	int len; /* of value, -1 if not read or failed */
+	uint8_t* value;
+};
+
+struct device {
+	char mac[BLZ_MAC_STR_LEN];
+	struct attr* attrs;
+	size_t count;
+	size_t cap;
+	bool oom;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int ok;
+	int failed;
+};
+
+static const char* address;
+static const char* adapter = "hci0";
+static bool read_descs;
+static bool read_chars;
+static bool quiet = true;
+static FILE* out;
+
+static char (*macs)[BLZ_MAC_STR_LEN];
+static size_t num_macs;
+static size_t cap_macs;
+static size_t next_mac;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t start_us;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static double ms_since(uint64_t t)
+{
+	return (now_us() - t) / 1000.0;
+}
+
+static void log_handler(enum loglevel ll, const char* fmt, va_list ap,
+						void* user)
+{
+	struct worker* w = user;
+	char buf[256];
+
+	if (quiet && ll > LL_WARN) {
+		return;
+	}
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	fprintf(stderr, "[%d] %s\n", w ? w->id : -1, buf);
+}
+
+static void add_mac(const char* str)
+{
+	uint8_t mac[6];
+
+	if (!blz_string_to_mac(str, mac)) {
+		LOG_WARN("ignoring invalid MAC '%s'", str);
+		return;
+	}
+	for (size_t i = 0; i < num_macs; i++) {
+		if (strcasecmp(macs[i], str) == 0) {
+			return;
+		}
+	}
+	if (num_macs == cap_macs) {
+		size_t cap = MAX(cap_macs * 2, 64);
+		void* n = realloc(macs, cap * sizeof(*macs));
+		if (n == NULL) {
+			return;
+		}
+		macs = n;
+		cap_macs = cap;
+	}
+	blz_mac_to_string(mac, macs[num_macs++]);
+}
+
+static bool read_mac_file(const char* name)
+{
+	char line[128];
+	FILE* f = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+
+	if (f == NULL) {
+		LOG_ERR("can't open %s", name);
+		return false;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, " \t\r\n#")] = '\0';
+		if (line[0] != '\0') {
+			add_mac(line);
+		}
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+	return true;
+}
+
+static void scan_cb(const uint8_t* mac, enum blz_addr_type atype, int8_t rssi,
+					const uint8_t* data, size_t len, void* user)
+{
+	char buf[BLZ_MAC_STR_LEN];
+	add_mac(blz_mac_to_string(mac, buf));
+}
+
+static bool scan(int secs)
+{
+	bool stop = false;
+
+	blz* ctx = address ? blz_init_address(address, adapter)
+					   : blz_init(adapter);
+	if (ctx == NULL) {
+		return false;
+	}
+	blz_set_ctx_log_handler(ctx, log_handler, NULL);
+
+	blz_known_devices(ctx, scan_cb, NULL);
+	if (blz_scan_start(ctx, scan_cb, NULL)) {
+		blz_loop_timeout(ctx, &stop, secs * 1000);
+		blz_scan_stop(ctx);
+	}
+	blz_fini(ctx);
+	return true;
+}
+
+static void gatt_cb(const struct blz_gatt_attr* attr, void* user)
+{
+	struct device* d = user;
+
+	if (d->count == d->cap) {
+		size_t cap = MAX(d->cap * 2, 32);
+		void* n = realloc(d->attrs, cap * sizeof(struct attr));
+		if (n == NULL) {
+			d->oom = true;
+			return;
+		}
+		d->attrs = n;
+		d->cap = cap;
+	}
+
+	struct attr* a = &d->attrs[d->count];
+	a->a = *attr;
+	a->path = strdup(attr->path);
+	a->a.path = a->path;
+	a->len = -1;
+	a->value = NULL;
+	if (a->path == NULL) {
+		d->oom = true;
+		return;
+	}
+	d->count++;
+}
+
+static int cmp_attr(const void* a, const void* b)
+{
+	const struct attr* x = a;
+	const struct attr* y = b;
+	return strcmp(x->path, y->path);
+}
+
+static void read_values(blz_dev* dev, struct device* d)
+{
+	uint8_t buf[VALUE_MAX];
+
+	for (size_t i = 0; i < d->count; i++) {
+		struct attr* a = &d->attrs[i];
+		if ((a->a.type == BLZ_GATT_DESC && read_descs)
+			|| (a->a.type == BLZ_GATT_CHAR && read_chars
+				&& (a->a.flags & BLZ_CHAR_READ))) {
+			int len = blz_attr_read(dev, &a->a, buf, sizeof(buf));
+			if (len >= 0 && (a->value = malloc(MAX(len, 1))) != NULL) {
+				len = MIN(len, VALUE_MAX);
+				memcpy(a->value, buf, len);
+				a->len = len;
+			}
+		}
+	}
+}
+
+static void json_flags(FILE* f, uint32_t flags)
+{
+	static const char* names[] = {"broadcast", "read",
+								  "write-without-response", "write",
+								  "notify", "indicate",
+								  "authenticated-signed-writes",
+								  "extended-properties"};
+	const char* sep = "";
+
+	fprintf(f, ", \"flags\": [");
+	for (size_t i = 0; i < ARRAY_SIZE(names); i++) {
+		if (flags & (1 << i)) {
+			fprintf(f, "%s\"%s\"", sep, names[i]);
+			sep = ", ";
+		}
+	}
+	fprintf(f, "]");
+}
+
+static void json_value(FILE* f, const struct attr* a)
+{
+	if (a->len < 0) {
+		return;
+	}
+	fprintf(f, ", \"value\": \"");
+	for (int i = 0; i < a->len; i++) {
+		fprintf(f, "%02x", a->value[i]);
+	}
+	fprintf(f, "\"");
+}
+
+/** nested GATT tree from the attributes sorted by path */
+static void json_gatt(FILE* f, const struct device* d)
+{
+	bool comma[3] = {false};
+	int depth = 0; /* open lists: services, chars of a service, descs */
+
+	fprintf(f, ", \"services\": [");
+	for (size_t i = 0; i < d->count; i++) {
+		const struct attr* a = &d->attrs[i];
+		/* an orphan (e.g. a descriptor without characteristic) is put at
+		 * the current level */
+		int level = MIN((int)a->a.type, depth);
+
+		for (; depth > level; depth--) {
+			fprintf(f, "]}");
+		}
+		fprintf(f, "%s{\"uuid\": \"%s\"", comma[level] ? ", " : "",
+				a->a.uuid);
+		comma[level] = true;
+		if (a->a.type == BLZ_GATT_CHAR) {
+			json_flags(f, a->a.flags);
+		}
+		json_value(f, a);
+		if (a->a.type == BLZ_GATT_DESC || level == 2) {
+			fprintf(f, "}");
+		} else {
+			fprintf(f, a->a.type == BLZ_GATT_SERVICE ? ", \"chars\": ["
+													  : ", \"descs\": [");
+			depth = level + 1;
+			comma[depth] = false;
+		}
+	}
+	for (; depth > 0; depth--) {
+		fprintf(f, "]}");
+	}
+	fprintf(f, "]");
+}
+
+static bool crawl(blz* ctx, const char* mac)
+{
+	struct device d = {0};
+	double t_connect = 0, t_enum = 0, t_read = 0, t_disc = 0;
+	const char* err = NULL;
+	double start = ms_since(start_us);
+	uint64_t t0 = now_us();
+	uint64_t t = t0;
+	char* buf = NULL;
+	size_t len = 0;
+
+	strcpy(d.mac, mac);
+
+	blz_dev* dev = blz_connect(ctx, mac, BLZ_ADDR_UNKNOWN);
+	t_connect = ms_since(t);
+	if (dev == NULL) {
+		err = "connect";
+		goto out;
+	}
+
+	t = now_us();
+	if (!blz_dev_enumerate(dev, gatt_cb, &d) || d.oom) {
+		err = d.oom ? "memory" : "enumerate";
+	}
+	qsort(d.attrs, d.count, sizeof(struct attr), cmp_attr);
+	t_enum = ms_since(t);
+
+	if (err == NULL && (read_descs || read_chars)) {
+		t = now_us();
+		read_values(dev, &d);
+		t_read = ms_since(t);
+	}
+
+	t = now_us();
+	blz_disconnect(dev);
+	t_disc = ms_since(t);
+
+out:;
+	FILE* f = open_memstream(&buf, &len);
+	if (f != NULL) {
+		fprintf(f,
+				"{\"mac\": \"%s\", \"ok\": %s, \"error\": %s%s%s, "
+				"\"start_ms\": %.1f, \"connect_ms\": %.1f, \"enum_ms\": %.2f, "
+				"\"read_ms\": %.1f, \"disconnect_ms\": %.1f, "
+				"\"total_ms\": %.1f, \"attrs\": %zu",
+				d.mac, err ? "false" : "true", err ? "\"" : "",
+				err ? err : "null", err ? "\"" : "", start, t_connect, t_enum,
+				t_read, t_disc, ms_since(t0), d.count);
+		if (err == NULL) {
+			json_gatt(f, &d);
+		}
+		fprintf(f, "}\n");
+		fclose(f);
+
+		pthread_mutex_lock(&lock);
+		fwrite(buf, 1, len, out);
+		fflush(out);
+		pthread_mutex_unlock(&lock);
+		free(buf);
+	}
+
+	for (size_t i = 0; i < d.count; i++) {
+		free(d.attrs[i].path);
+		free(d.attrs[i].value);
+	}
+	free(d.attrs);
+	return err == NULL;
+}
+
+static void* worker_run(void* arg)
+{
+	struct worker* w = arg;
+
+	blz* ctx = address ? blz_init_address(address, adapter)
+					   : blz_init_private(adapter);
+	if (ctx == NULL) {
+		return NULL;
+	}
+	blz_set_ctx_log_handler(ctx, log_handler, w);
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		size_t i = next_mac++;
+		pthread_mutex_unlock(&lock);
+		if (i >= num_macs) {
+			break;
+		}
+		if (crawl(ctx, macs[i])) {
+			w->ok++;
+		} else {
+			w->failed++;
+		}
+	}
+
+	blz_fini(ctx);
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"blz-crawl [options] [MAC...]\n"
+			"  -a addr   bus address (system bus)\n"
+			"  -i name   adapter (hci0)\n"
+			"  -f file   read MACs from file, one per line ('-' is stdin)\n"
+			"  -S secs   add known devices and scan for secs\n"
+			"  -j num    parallel connections (4)\n"
+			"  -d        read descriptors\n"
+			"  -r        read readable characteristics\n"
+			"  -o file   write NDJSON there instead of stdout\n"
+			"  -v        show library log\n");
+}
+
+int main(int argc, char** argv)
+{
+	struct worker workers[MAX_WORKERS] = {0};
+	int num_workers = 4;
+	int scan_secs = 0;
+	int c;
+
+	out = stdout;
+	while ((c = getopt(argc, argv, "a:i:f:S:j:dro:vh")) != -1) {
+		switch (c) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'i':
+			adapter = optarg;
+			break;
+		case 'f':
+			if (!read_mac_file(optarg)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			scan_secs = MAX(atoi(optarg), 1);
+			break;
+		case 'j':
+			num_workers = MIN(MAX(atoi(optarg), 1), MAX_WORKERS);
+			break;
+		case 'd':
+			read_descs = true;
+			break;
+		case 'r':
+			read_chars = true;
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL) {
+				LOG_ERR("can't open %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'v':
+			quiet = false;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (int i = optind; i < argc; i++) {
+		add_mac(argv[i]);
+	}
+	if (scan_secs > 0 && !scan(scan_secs)) {
+		return EXIT_FAILURE;
+	}
+	if (num_macs == 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	num_workers = MIN((size_t)num_workers, num_macs);
+	start_us = now_us();
+	for (int i = 0; i < num_workers; i++) {
+		workers[i].id = i;
+		pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+	}
+
+	int ok = 0, failed = 0;
+	for (int i = 0; i < num_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ok += workers[i].ok;
+		failed += workers[i].failed;
+	}
+
+	fprintf(stderr, "%d devices, %d failed, %d workers, %.1f s\n", ok + failed,
+			failed, num_workers, ms_since(start_us) / 1000);
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	free(macs);
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
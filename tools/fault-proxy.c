@@ -0,0 +1,553 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Proxy which claims org.bluez on a front bus and forwards everything to
+ * org.bluez on a back bus (usually blz-mock-bluez), to see how blzlib
+ * behaves when BlueZ is slow or misbehaves:
+ *
+ *  - replies are delayed with a configurable distribution
+ *  - signals are dropped or duplicated with a probability
+ *  - method calls fail with a D-Bus error or never get a reply (timeout)
+ *  - all devices connected through the proxy are disconnected periodically
+ *    (disconnect storm)
+ *
+ * Random decisions use a seed so runs can be repeated.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define MAX_ERRORS	8
+#define MAX_DEVICES 1024
+#define PATH_LEN	256
+
+enum dist_type { DIST_NONE, DIST_FIXED, DIST_UNIFORM, DIST_EXP, DIST_PARETO };
+
+struct dist {
+	enum dist_type type;
+	double a;
+	double b;
+};
+
+struct fault {
+	const char* error; /* D-Bus error name or NULL for timeout */
+	double prob;
+	const char* member; /* only for this method or NULL for all */
+};
+
+/* message waiting to be sent after a delay */
+struct delayed {
+	sd_bus_message* msg;
+	sd_event_source* src;
+};
+
+static struct {
+	const char* front;
+	const char* back;
+	struct dist delay;
+	double drop;
+	double dup;
+	struct fault faults[MAX_ERRORS];
+	int num_faults;
+	int storm_ms;
+	long seed;
+} conf = {
+	.seed = 1,
+};
+
+static struct {
+	unsigned long calls;
+	unsigned long replies;
+	unsigned long errors;
+	unsigned long timeouts;
+	unsigned long signals;
+	unsigned long dropped;
+	unsigned long duplicated;
+	unsigned long storms;
+	unsigned long storm_disconnects;
+} stats;
+
+static sd_event* event;
+static sd_bus* front;
+static sd_bus* back;
+static const char* front_name;
+
+/* devices which were connected through the proxy, for disconnect storms */
+static char* devices[MAX_DEVICES];
+static int num_devices;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* --- delay distributions --- */
+
+static bool dist_parse(const char* str, struct dist* d)
+{
+	char name[16];
+
+	int n = sscanf(str, "%15[a-z]:%lf:%lf", name, &d->a, &d->b);
+	if (n >= 2 && strcmp(name, "fixed") == 0) {
+		d->type = DIST_FIXED;
+	} else if (n == 3 && strcmp(name, "uniform") == 0 && d->b >= d->a) {
+		d->type = DIST_UNIFORM;
+	} else if (n >= 2 && strcmp(name, "exp") == 0) {
+		d->type = DIST_EXP;
+	} else if (n == 3 && strcmp(name, "pareto") == 0 && d->b > 0) {
+		d->type = DIST_PARETO;
+	} else {
+		return false;
+	}
+	return d->a >= 0;
+}
+
+/** sample delay in ms */
+static double dist_sample(const struct dist* d)
+{
+	double u = drand48();
+
+	switch (d->type) {
+	case DIST_FIXED:
+		return d->a;
+	case DIST_UNIFORM:
+		return d->a + (d->b - d->a) * u;
+	case DIST_EXP:
+		/* a is the mean */
+		return -d->a * log(1 - u);
+	case DIST_PARETO:
+		/* a is the minimum, b the shape: smaller is a heavier tail */
+		return d->a / pow(1 - u, 1 / d->b);
+	default:
+		return 0;
+	}
+}
+
+/* --- sending --- */
+
+static int delayed_cb(sd_event_source* s, uint64_t usec, void* user)
+{
+	struct delayed* d = user;
+
+	sd_bus_send(front, d->msg, NULL);
+	sd_bus_message_unref(d->msg);
+	sd_event_source_unref(d->src);
+	free(d);
+	return 0;
+}
+
+/** send message on the front bus after a delay from the distribution, takes
+ * over the reference */
+static void send_delayed(sd_bus_message* m)
+{
+	uint64_t delay = dist_sample(&conf.delay) * 1000;
+
+	if (delay == 0) {
+		sd_bus_send(front, m, NULL);
+		sd_bus_message_unref(m);
+		return;
+	}
+
+	struct delayed* d = calloc(1, sizeof(struct delayed));
+	if (d == NULL) {
+		sd_bus_message_unref(m);
+		return;
+	}
+	d->msg = m;
+
+	int r = sd_event_add_time(event, &d->src, CLOCK_MONOTONIC,
+							  now_usec() + delay, 1, delayed_cb, d);
+	if (r < 0) {
+		LOG_ERR("failed to add timer: %s", strerror(-r));
+		sd_bus_message_unref(m);
+		free(d);
+	}
+}
+
+/* --- method calls: front to back --- */
+
+static const struct fault* fault_pick(const char* member)
+{
+	for (int i = 0; i < conf.num_faults; i++) {
+		const struct fault* f = &conf.faults[i];
+		if ((f->member == NULL || strcmp(f->member, member) == 0)
+			&& drand48() < f->prob) {
+			return f;
+		}
+	}
+	return NULL;
+}
+
+static void device_track(const char* path)
+{
+	for (int i = 0; i < num_devices; i++) {
+		if (strcmp(devices[i], path) == 0) {
+			return;
+		}
+	}
+	if (num_devices < MAX_DEVICES) {
+		devices[num_devices++] = strdup(path);
+	}
+}
+
+static int back_reply_cb(sd_bus_message* reply, void* user, sd_bus_error* err)
+{
+	sd_bus_message* call = user;
+	sd_bus_message* m = NULL;
+	int r;
+
+	if (sd_bus_message_is_method_error(reply, NULL)) {
+		r = sd_bus_message_new_method_error(call, &m,
+											sd_bus_message_get_error(reply));
+	} else {
+		r = sd_bus_message_new_method_return(call, &m);
+		if (r >= 0) {
+			r = sd_bus_message_copy(m, reply, true);
+		}
+	}
+
+	sd_bus_message_unref(call);
+	if (r < 0) {
+		LOG_ERR("failed to copy reply: %s", strerror(-r));
+		sd_bus_message_unref(m);
+		return 0;
+	}
+
+	stats.replies++;
+	send_delayed(m);
+	return 0;
+}
+
+static void forward_call(sd_bus_message* call)
+{
+	sd_bus_message* m = NULL;
+	const char* member = sd_bus_message_get_member(call);
+
+	stats.calls++;
+
+	const struct fault* f = fault_pick(member);
+	if (f != NULL && f->error == NULL) {
+		/* never reply */
+		stats.timeouts++;
+		return;
+	} else if (f != NULL) {
+		stats.errors++;
+		if (sd_bus_message_new_method_errorf(call, &m, f->error,
+											 "Injected by fault proxy")
+			>= 0) {
+			send_delayed(m);
+		}
+		return;
+	}
+
+	if (sd_bus_message_is_method_call(call, "org.bluez.Device1", "Connect")) {
+		device_track(sd_bus_message_get_path(call));
+	}
+
+	int r = sd_bus_message_new_method_call(back, &m, "org.bluez",
+										   sd_bus_message_get_path(call),
+										   sd_bus_message_get_interface(call),
+										   member);
+	if (r >= 0) {
+		r = sd_bus_message_copy(m, call, true);
+	}
+	if (r >= 0) {
+		/* reference released in the reply callback */
+		r = sd_bus_call_async(back, NULL, m, back_reply_cb,
+							  sd_bus_message_ref(call), 0);
+		if (r < 0) {
+			sd_bus_message_unref(call);
+		}
+	}
+	sd_bus_message_unref(m);
+
+	if (r < 0) {
+		LOG_ERR("failed to forward %s: %s", member, strerror(-r));
+	}
+}
+
+static int front_filter(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	uint8_t type;
+	const char* dest = sd_bus_message_get_destination(m);
+
+	if (sd_bus_message_get_type(m, &type) < 0
+		|| type != SD_BUS_MESSAGE_METHOD_CALL || dest == NULL
+		|| (strcmp(dest, "org.bluez") != 0
+			&& strcmp(dest, front_name) != 0)) {
+		return 0;
+	}
+
+	forward_call(m);
+	return 1;
+}
+
+/* --- signals: back to front --- */
+
+static int back_signal_cb(sd_bus_message* sig, void* user, sd_bus_error* err)
+{
+	sd_bus_message* m = NULL;
+
+	stats.signals++;
+	if (drand48() < conf.drop) {
+		stats.dropped++;
+		return 0;
+	}
+
+	int r = sd_bus_message_new_signal(front, &m, sd_bus_message_get_path(sig),
+									  sd_bus_message_get_interface(sig),
+									  sd_bus_message_get_member(sig));
+	if (r >= 0) {
+		r = sd_bus_message_copy(m, sig, true);
+	}
+	if (r < 0) {
+		LOG_ERR("failed to copy signal: %s", strerror(-r));
+		sd_bus_message_unref(m);
+		return 0;
+	}
+
+	sd_bus_send(front, m, NULL);
+	if (drand48() < conf.dup) {
+		/* a sent message can't be sent again, send a second copy */
+		sd_bus_message* m2 = NULL;
+		if (sd_bus_message_new_signal(front, &m2,
+									  sd_bus_message_get_path(sig),
+									  sd_bus_message_get_interface(sig),
+									  sd_bus_message_get_member(sig))
+				>= 0
+			&& sd_bus_message_rewind(sig, true) >= 0
+			&& sd_bus_message_copy(m2, sig, true) >= 0) {
+			sd_bus_send(front, m2, NULL);
+			stats.duplicated++;
+		}
+		sd_bus_message_unref(m2);
+	}
+	sd_bus_message_unref(m);
+	return 0;
+}
+
+/* --- disconnect storm --- */
+
+static int storm_cb(sd_event_source* s, uint64_t usec, void* user)
+{
+	stats.storms++;
+	for (int i = 0; i < num_devices; i++) {
+		int r = sd_bus_call_method_async(back, NULL, "org.bluez", devices[i],
+										 "org.bluez.Device1", "Disconnect",
+										 NULL, NULL, "");
+		if (r >= 0) {
+			stats.storm_disconnects++;
+		}
+	}
+
+	sd_event_source_set_time(s, usec + conf.storm_ms * 1000ULL);
+	sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+	return 0;
+}
+
+/* --- setup --- */
+
+static int bus_open(sd_bus** bus, const char* address)
+{
+	int r = sd_bus_new(bus);
+	if (r >= 0) {
+		r = sd_bus_set_address(*bus, address);
+	}
+	if (r >= 0) {
+		sd_bus_set_bus_client(*bus, 1);
+		sd_bus_negotiate_fds(*bus, 1);
+		r = sd_bus_start(*bus);
+	}
+	if (r >= 0) {
+		r = sd_bus_attach_event(*bus, event, SD_EVENT_PRIORITY_NORMAL);
+	}
+	return r;
+}
+
+static bool fault_parse(char* str)
+{
+	static const struct {
+		const char* name;
+		const char* error;
+	} names[] = {
+		{"InProgress", "org.bluez.Error.InProgress"},
+		{"NotConnected", "org.bluez.Error.NotConnected"},
+		{"Failed", "org.bluez.Error.Failed"},
+		{"NotPermitted", "org.bluez.Error.NotPermitted"},
+		{"NoReply", "org.freedesktop.DBus.Error.NoReply"},
+		{"timeout", NULL},
+	};
+
+	if (conf.num_faults >= MAX_ERRORS) {
+		return false;
+	}
+
+	char* name = strtok(str, ":");
+	char* prob = strtok(NULL, ":");
+	char* member = strtok(NULL, ":");
+	if (name == NULL || prob == NULL) {
+		return false;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(names); i++) {
+		if (strcmp(name, names[i].name) == 0) {
+			struct fault* f = &conf.faults[conf.num_faults++];
+			f->error = names[i].error;
+			f->prob = atof(prob);
+			f->member = member;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int signal_cb(sd_event_source* s, const struct signalfd_siginfo* si,
+					 void* user)
+{
+	sd_event_exit(event, 0);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"blz-fault-proxy -f front-address -b back-address [options]\n"
+			"  -d dist      reply delay in ms: fixed:A, uniform:MIN:MAX, exp:MEAN\n"
+			"               or pareto:MIN:SHAPE\n"
+			"  -x prob      drop signals with probability\n"
+			"  -X prob      duplicate signals with probability\n"
+			"  -E err:prob[:method]\n"
+			"               reply with error instead of forwarding, err is one\n"
+			"               of InProgress, NotConnected, Failed, NotPermitted,\n"
+			"               NoReply or timeout (no reply at all). Repeatable\n"
+			"  -S ms        disconnect all devices connected via proxy every ms\n"
+			"  -r seed      random seed (1)\n");
+}
+
+int main(int argc, char** argv)
+{
+	sd_event_source* storm = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:b:d:x:X:E:S:r:h")) != -1) {
+		switch (c) {
+		case 'f':
+			conf.front = optarg;
+			break;
+		case 'b':
+			conf.back = optarg;
+			break;
+		case 'd':
+			if (!dist_parse(optarg, &conf.delay)) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'x':
+			conf.drop = atof(optarg);
+			break;
+		case 'X':
+			conf.dup = atof(optarg);
+			break;
+		case 'E':
+			if (!fault_parse(optarg)) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			conf.storm_ms = MAX(atoi(optarg), 0);
+			break;
+		case 'r':
+			conf.seed = atol(optarg);
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (conf.front == NULL || conf.back == NULL) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	srand48(conf.seed);
+
+	sigset_t ss;
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGINT);
+	sigaddset(&ss, SIGTERM);
+	sigprocmask(SIG_BLOCK, &ss, NULL);
+
+	int r = sd_event_new(&event);
+	if (r >= 0) {
+		r = bus_open(&back, conf.back);
+	}
+	if (r >= 0) {
+		r = bus_open(&front, conf.front);
+	}
+	if (r >= 0) {
+		r = sd_bus_get_unique_name(front, &front_name);
+	}
+	if (r < 0) {
+		LOG_ERR("failed to connect to buses: %s", strerror(-r));
+		return EXIT_FAILURE;
+	}
+
+	r = sd_bus_add_match(back, NULL, "type='signal',sender='org.bluez'",
+						 back_signal_cb, NULL);
+	if (r >= 0) {
+		r = sd_bus_add_filter(front, NULL, front_filter, NULL);
+	}
+	if (r >= 0) {
+		r = sd_bus_request_name(front, "org.bluez", 0);
+	}
+	if (r < 0) {
+		LOG_ERR("failed to set up proxy: %s", strerror(-r));
+		return EXIT_FAILURE;
+	}
+
+	sd_event_add_signal(event, NULL, SIGINT, signal_cb, NULL);
+	sd_event_add_signal(event, NULL, SIGTERM, signal_cb, NULL);
+	if (conf.storm_ms > 0) {
+		sd_event_add_time(event, &storm, CLOCK_MONOTONIC,
+						  now_usec() + conf.storm_ms * 1000ULL, 1, storm_cb,
+						  NULL);
+	}
+
+	r = sd_event_loop(event);
+
+	LOG_INF("calls %lu replies %lu errors %lu timeouts %lu signals %lu "
+			"dropped %lu duplicated %lu storms %lu (%lu disconnects)",
+			stats.calls, stats.replies, stats.errors, stats.timeouts,
+			stats.signals, stats.dropped, stats.duplicated, stats.storms,
+			stats.storm_disconnects);
+
+	sd_event_source_unref(storm);
+	sd_bus_flush_close_unref(front);
+	sd_bus_flush_close_unref(back);
+	sd_event_unref(event);
+	for (int i = 0; i < num_devices; i++) {
+		free(devices[i]);
+	}
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
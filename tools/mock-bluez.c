@@ -0,0 +1,1744 @@
+/*
+ * blzlib - Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This source code is licensed under the GNU Lesser General Public License,
+ * Version 3. See the file COPYING for more details.
+ */
+
+/*
+ * Stand-in for the BlueZ daemon on a private bus, for tests and benchmarks
+ * without Bluetooth hardware. It exports Adapter1, Device1, GattService1,
+ * GattCharacteristic1 and GattDescriptor1 objects with a configurable number
+ * of devices and GATT layout. GATT objects appear on connect and disappear
+ * on disconnect like with BlueZ. Replies can be delayed and notifying
+ * characteristics send values at a fixed rate.
+ *
+ * The GATT layout is the same for each device: service k has the UUID
+ * 6e40XX00-b5a3-f393-e0a9-e50e24dcca9e with XX = k + 1 and characteristic j
+ * of it 6e40XXYY-... with YY = j + 1. Characteristics have these flags,
+ * repeating: 0: read, write, write-without-response; 1: read, notify;
+ * 2: read. Each characteristic has a user description descriptor (2901).
+ *
+ * GattManager1 takes one application (GATT server) at a time. The mock then
+ * acts as a client of it: it reads and writes every characteristic and
+ * subscribes to the notifying ones, through AcquireWrite and AcquireNotify
+ * when the application supports them.
+ *
+ * LEAdvertisingManager1 takes a few advertisements. Their properties are read
+ * before RegisterAdvertisement is replied, like with BlueZ, and the
+ * PropertiesChanged signals of the registered ones are counted as updates of
+ * the advertising data.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blzlib_log.h"
+#include "blzlib_util.h"
+
+#define PATH_LEN	64
+#define VALUE_MAX	512
+#define MOCK_MTU	247
+#define MAX_FLAGS	4
+#define NO_ECHO		-1
+
+struct mdev;
+struct mserv;
+
+struct mchar {
+	struct mserv*	 serv;
+	char			 path[PATH_LEN];
+	char			 uuid[BLZ_UUID_STR_LEN];
+	char			 desc_path[PATH_LEN];
+	char			 desc_value[32];
+	const char*		 flags[MAX_FLAGS + 1];
+	uint8_t			 value[VALUE_MAX];
+	size_t			 len;
+	int				 notifying;
+	int				 reading; /* reply pending, like BlueZ only one */
+	int				 writing;
+	uint32_t		 seq;
+	int				 write_fd; /* our end of AcquireWrite socket */
+	sd_event_source* write_src;
+	int				 notify_fd; /* our end of AcquireNotify socket */
+	sd_event_source* notify_src;
+	sd_bus_slot*	 slot;
+	sd_bus_slot*	 desc_slot;
+};
+
+struct mserv {
+	struct mdev*  dev;
+	char		  path[PATH_LEN];
+	char		  uuid[BLZ_UUID_STR_LEN];
+	struct mchar* chars;
+	sd_bus_slot*  slot;
+};
+
+struct mdev {
+	char		  path[PATH_LEN];
+	char		  address[BLZ_MAC_STR_LEN];
+	char		  name[16];
+	int16_t		  rssi;
+	int			  connected;
+	int			  resolved;
+	struct mserv* servs;
+	sd_bus_slot*  slot;
+};
+
+/* reply waiting to be sent after the configured latency */
+struct pending {
+	sd_bus_message* reply;
+	void (*after)(void* user);
+	void* user;
+};
+
+static struct {
+	const char* address;
+	const char* adapter;
+	int num_devs;
+	int num_servs;
+	int num_chars;
+	int notify_hz;
+	int payload;
+	int latency_ms;
+	int jitter_ms;
+	int connect_ms;
+	bool echo;
+	bool app_signals;
+} conf = {
+	.adapter = "hci0",
+	.num_devs = 10,
+	.num_servs = 3,
+	.num_chars = 4,
+	.notify_hz = 0,
+	.payload = 20,
+	.latency_ms = 0,
+	.jitter_ms = 0,
+	.connect_ms = 0,
+	.echo = false,
+};
+
+static struct {
+	unsigned long calls;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long fd_writes;
+	unsigned long notifications;
+	unsigned long connects;
+	unsigned long in_progress;
+	unsigned long apps;
+	unsigned long app_reads;
+	unsigned long app_writes;
+	unsigned long app_fd_writes;
+	unsigned long app_notifications;
+	unsigned long app_errors;
+	unsigned long advs;
+	unsigned long adv_updates;
+} stats;
+
+static sd_bus* bus;
+static sd_event* event;
+static char adapter_path[PATH_LEN];
+static int powered = 1;
+static int discovering;
+static struct mdev* devs;
+static sd_event_source* notify_timer;
+static sd_event_source* scan_timer;
+static int scan_idx;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int pending_cb(sd_event_source* s, uint64_t usec, void* user)
+{
+	struct pending* p = user;
+
+	sd_bus_send(bus, p->reply, NULL);
+	sd_bus_message_unref(p->reply);
+	if (p->after) {
+		p->after(p->user);
+	}
+	sd_event_source_unref(s);
+	free(p);
+	return 0;
+}
+
+/** send reply after latency (plus extra_ms), then call after(user) */
+static int reply_delayed(sd_bus_message* reply, int extra_ms,
+						 void (*after)(void* user), void* user)
+{
+	uint64_t delay = conf.latency_ms + extra_ms;
+
+	if (conf.jitter_ms > 0) {
+		delay += rand() % (conf.jitter_ms + 1);
+	}
+
+	if (delay == 0) {
+		int r = sd_bus_send(bus, reply, NULL);
+		sd_bus_message_unref(reply);
+		if (after) {
+			after(user);
+		}
+		return r < 0 ? r : 1;
+	}
+
+	sd_event_source* src;
+	struct pending* p = calloc(1, sizeof(struct pending));
+	if (p == NULL) {
+		sd_bus_message_unref(reply);
+		return -ENOMEM;
+	}
+	p->reply = reply;
+	p->after = after;
+	p->user = user;
+
+	int r = sd_event_add_time(event, &src, CLOCK_MONOTONIC,
+							  now_usec() + delay * 1000, 1, pending_cb, p);
+	if (r < 0) {
+		sd_bus_message_unref(reply);
+		free(p);
+	}
+	return r < 0 ? r : 1;
+}
+
+/** empty method return, delayed */
+static int reply_empty(sd_bus_message* m, int extra_ms,
+					   void (*after)(void* user), void* user)
+{
+	sd_bus_message* reply = NULL;
+	int r = sd_bus_message_new_method_return(m, &reply);
+	if (r < 0) {
+		return r;
+	}
+	return reply_delayed(reply, extra_ms, after, user);
+}
+
+static int reply_error(sd_bus_message* m, const char* name, const char* msg)
+{
+	sd_bus_message* reply = NULL;
+	int r = sd_bus_message_new_method_errorf(m, &reply, name, "%s", msg);
+	if (r < 0) {
+		return r;
+	}
+	return reply_delayed(reply, 0, NULL, NULL);
+}
+
+/* --- property getters --- */
+
+static int get_str(sd_bus* b, const char* path, const char* intf,
+				   const char* prop, sd_bus_message* reply, void* user,
+				   sd_bus_error* err)
+{
+	/* sd-bus already added the offset given in the vtable to user */
+	return sd_bus_message_append_basic(reply, 's', user);
+}
+
+static int get_char_serv(sd_bus* b, const char* path, const char* intf,
+						 const char* prop, sd_bus_message* reply, void* user,
+						 sd_bus_error* err)
+{
+	struct mchar* ch = user;
+	return sd_bus_message_append_basic(reply, 'o', ch->serv->path);
+}
+
+static int get_serv_dev(sd_bus* b, const char* path, const char* intf,
+						const char* prop, sd_bus_message* reply, void* user,
+						sd_bus_error* err)
+{
+	struct mserv* srv = user;
+	return sd_bus_message_append_basic(reply, 'o', srv->dev->path);
+}
+
+static int get_bool(sd_bus* b, const char* path, const char* intf,
+					const char* prop, sd_bus_message* reply, void* user,
+					sd_bus_error* err)
+{
+	return sd_bus_message_append_basic(reply, 'b', user);
+}
+
+static int get_int16(sd_bus* b, const char* path, const char* intf,
+					 const char* prop, sd_bus_message* reply, void* user,
+					 sd_bus_error* err)
+{
+	return sd_bus_message_append_basic(reply, 'n', user);
+}
+
+static int get_const_str(sd_bus* b, const char* path, const char* intf,
+						 const char* prop, sd_bus_message* reply, void* user,
+						 sd_bus_error* err)
+{
+	if (strcmp(prop, "AddressType") == 0) {
+		return sd_bus_message_append(reply, "s", "public");
+	}
+	return sd_bus_message_append(reply, "s", "00:00:00:00:00:00");
+}
+
+static int get_true(sd_bus* b, const char* path, const char* intf,
+					const char* prop, sd_bus_message* reply, void* user,
+					sd_bus_error* err)
+{
+	return sd_bus_message_append(reply, "b", 1);
+}
+
+static int get_adapter_bool(sd_bus* b, const char* path, const char* intf,
+							const char* prop, sd_bus_message* reply, void* user,
+							sd_bus_error* err)
+{
+	int v = strcmp(prop, "Powered") == 0 ? powered : discovering;
+	return sd_bus_message_append_basic(reply, 'b', &v);
+}
+
+static int set_powered(sd_bus* b, const char* path, const char* intf,
+					   const char* prop, sd_bus_message* value, void* user,
+					   sd_bus_error* err)
+{
+	int r = sd_bus_message_read(value, "b", &powered);
+	if (r < 0) {
+		return r;
+	}
+	return sd_bus_emit_properties_changed(bus, adapter_path,
+										  "org.bluez.Adapter1", "Powered",
+										  NULL);
+}
+
+static int get_dev_uuids(sd_bus* b, const char* path, const char* intf,
+						 const char* prop, sd_bus_message* reply, void* user,
+						 sd_bus_error* err)
+{
+	struct mdev* dev = user;
+
+	int r = sd_bus_message_open_container(reply, 'a', "s");
+	for (int i = 0; r >= 0 && i < conf.num_servs; i++) {
+		r = sd_bus_message_append_basic(reply, 's', dev->servs[i].uuid);
+	}
+	return r < 0 ? r : sd_bus_message_close_container(reply);
+}
+
+static int get_flags(sd_bus* b, const char* path, const char* intf,
+					 const char* prop, sd_bus_message* reply, void* user,
+					 sd_bus_error* err)
+{
+	struct mchar* ch = user;
+	return sd_bus_message_append_strv(reply, (char**)ch->flags);
+}
+
+static int get_value(sd_bus* b, const char* path, const char* intf,
+					 const char* prop, sd_bus_message* reply, void* user,
+					 sd_bus_error* err)
+{
+	struct mchar* ch = user;
+	return sd_bus_message_append_array(reply, 'y', ch->value, ch->len);
+}
+
+static int get_desc_value(sd_bus* b, const char* path, const char* intf,
+						  const char* prop, sd_bus_message* reply, void* user,
+						  sd_bus_error* err)
+{
+	struct mchar* ch = user;
+	return sd_bus_message_append_array(reply, 'y', ch->desc_value,
+									   strlen(ch->desc_value));
+}
+
+static int get_desc_char(sd_bus* b, const char* path, const char* intf,
+						 const char* prop, sd_bus_message* reply, void* user,
+						 sd_bus_error* err)
+{
+	struct mchar* ch = user;
+	return sd_bus_message_append_basic(reply, 'o', ch->path);
+}
+
+static int get_desc_uuid(sd_bus* b, const char* path, const char* intf,
+						 const char* prop, sd_bus_message* reply, void* user,
+						 sd_bus_error* err)
+{
+	return sd_bus_message_append(reply, "s",
+								 "00002901-0000-1000-8000-00805f9b34fb");
+}
+
+/* --- notifications --- */
+
+static bool char_has_flag(struct mchar* ch, const char* flag)
+{
+	for (int i = 0; ch->flags[i] != NULL; i++) {
+		if (strcmp(ch->flags[i], flag) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/** send value as notification: over the acquired socket if there is one,
+ * otherwise as PropertiesChanged signal */
+static void char_notify(struct mchar* ch, const uint8_t* data, size_t len)
+{
+	len = MIN(len, VALUE_MAX);
+	memcpy(ch->value, data, len);
+	ch->len = len;
+
+	if (ch->notify_fd >= 0) {
+		if (write(ch->notify_fd, data, len) < 0 && errno != EAGAIN) {
+			LOG_WARN("notify socket write failed: %s", strerror(errno));
+		}
+	} else {
+		sd_bus_emit_properties_changed(bus, ch->path,
+									   "org.bluez.GattCharacteristic1",
+									   "Value", NULL);
+	}
+	stats.notifications++;
+}
+
+static int notify_timer_cb(sd_event_source* s, uint64_t usec, void* user)
+{
+	uint8_t buf[VALUE_MAX] = {0};
+	size_t len = MIN(MAX(conf.payload, 8), VALUE_MAX);
+
+	for (int d = 0; d < conf.num_devs; d++) {
+		if (!devs[d].connected) {
+			continue;
+		}
+		for (int s = 0; s < conf.num_servs; s++) {
+			for (int c = 0; c < conf.num_chars; c++) {
+				struct mchar* ch = &devs[d].servs[s].chars[c];
+				if (!ch->notifying && ch->notify_fd < 0) {
+					continue;
+				}
+				/* sequence number and send timestamp for the receiver */
+				uint64_t ts = now_usec();
+				ch->seq++;
+				memcpy(buf, &ch->seq, 4);
+				memcpy(buf + 4, &ts, MIN(len - 4, 8));
+				char_notify(ch, buf, len);
+			}
+		}
+	}
+
+	/* keep the rate but don't try to catch up when we fell behind */
+	sd_event_source_set_time(s, MAX(usec + 1000000 / conf.notify_hz,
+									now_usec()));
+	sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+	return 0;
+}
+
+/** on write, notify the same data on the first notifying characteristic of
+ * the service if echo is enabled */
+static void char_echo(struct mchar* ch, const uint8_t* data, size_t len)
+{
+	if (!conf.echo) {
+		return;
+	}
+
+	struct mserv* srv = ch->serv;
+	for (int c = 0; c < conf.num_chars; c++) {
+		struct mchar* e = &srv->chars[c];
+		if (e->notifying || e->notify_fd >= 0) {
+			char_notify(e, data, len);
+			return;
+		}
+	}
+}
+
+/* --- GattCharacteristic1 --- */
+
+static int reply_in_progress(sd_bus_message* m)
+{
+	stats.in_progress++;
+	return reply_error(m, "org.bluez.Error.InProgress",
+					   "Operation already in progress");
+}
+
+static void read_done(void* user)
+{
+	struct mchar* ch = user;
+	ch->reading = 0;
+}
+
+static void write_done(void* user)
+{
+	struct mchar* ch = user;
+	ch->writing = 0;
+}
+
+static int method_read_value(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	struct mchar* ch = user;
+	sd_bus_message* reply = NULL;
+
+	stats.calls++;
+	stats.reads++;
+
+	if (!ch->serv->dev->connected) {
+		return reply_error(m, "org.bluez.Error.Failed", "Not connected");
+	}
+	if (ch->reading) {
+		return reply_in_progress(m);
+	}
+
+	int r = sd_bus_message_new_method_return(m, &reply);
+	if (r >= 0) {
+		r = sd_bus_message_append_array(reply, 'y', ch->value, ch->len);
+	}
+	if (r < 0) {
+		sd_bus_message_unref(reply);
+		return r;
+	}
+	ch->reading = 1;
+	return reply_delayed(reply, 0, read_done, ch);
+}
+
+static int method_write_value(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	struct mchar* ch = user;
+	const void* ptr;
+	size_t len;
+
+	stats.calls++;
+	stats.writes++;
+
+	int r = sd_bus_message_read_array(m, 'y', &ptr, &len);
+	if (r < 0) {
+		return r;
+	}
+
+	if (!ch->serv->dev->connected) {
+		return reply_error(m, "org.bluez.Error.Failed", "Not connected");
+	}
+	if (ch->writing) {
+		return reply_in_progress(m);
+	}
+
+	len = MIN(len, VALUE_MAX);
+	memcpy(ch->value, ptr, len);
+	ch->len = len;
+	char_echo(ch, ptr, len);
+
+	ch->writing = 1;
+	return reply_empty(m, 0, write_done, ch);
+}
+
+static void notifying_changed(void* user)
+{
+	struct mchar* ch = user;
+	sd_bus_emit_properties_changed(bus, ch->path,
+								   "org.bluez.GattCharacteristic1",
+								   "Notifying", NULL);
+}
+
+static int method_start_notify(sd_bus_message* m, void* user,
+							   sd_bus_error* err)
+{
+	struct mchar* ch = user;
+
+	stats.calls++;
+	if (!char_has_flag(ch, "notify")) {
+		return reply_error(m, "org.bluez.Error.NotSupported",
+						   "Operation is not supported");
+	}
+	if (ch->notifying) {
+		return reply_error(m, "org.bluez.Error.InProgress",
+						   "Operation already in progress");
+	}
+	ch->notifying = 1;
+	return reply_empty(m, 0, notifying_changed, ch);
+}
+
+static int method_stop_notify(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	struct mchar* ch = user;
+
+	stats.calls++;
+	if (!ch->notifying) {
+		return reply_error(m, "org.bluez.Error.Failed", "No notify session");
+	}
+	ch->notifying = 0;
+	return reply_empty(m, 0, notifying_changed, ch);
+}
+
+static int write_fd_cb(sd_event_source* s, int fd, uint32_t revents,
+					   void* user)
+{
+	struct mchar* ch = user;
+	uint8_t buf[VALUE_MAX];
+
+	ssize_t len = read(fd, buf, sizeof(buf));
+	if (len <= 0) {
+		/* closed by client */
+		ch->write_src = sd_event_source_unref(ch->write_src);
+		close(ch->write_fd);
+		ch->write_fd = -1;
+		return 0;
+	}
+
+	stats.fd_writes++;
+	memcpy(ch->value, buf, len);
+	ch->len = len;
+	char_echo(ch, buf, len);
+	return 0;
+}
+
+static int notify_fd_cb(sd_event_source* s, int fd, uint32_t revents,
+						void* user)
+{
+	struct mchar* ch = user;
+
+	/* client closed its end, notification session ends */
+	ch->notify_src = sd_event_source_unref(ch->notify_src);
+	close(ch->notify_fd);
+	ch->notify_fd = -1;
+	return 0;
+}
+
+/** reply with one end of a new socket pair, watch the other end */
+static int reply_acquire(sd_bus_message* m, struct mchar* ch, int* our_fd,
+						 sd_event_source** src, sd_event_io_handler_t cb,
+						 uint32_t events)
+{
+	sd_bus_message* reply = NULL;
+	int sv[2];
+
+	if (*our_fd >= 0) {
+		return reply_error(m, "org.bluez.Error.NotPermitted",
+						   "Already acquired");
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+				   sv)
+		< 0) {
+		return reply_error(m, "org.bluez.Error.Failed", strerror(errno));
+	}
+
+	int r = sd_bus_message_new_method_return(m, &reply);
+	if (r >= 0) {
+		r = sd_bus_message_append(reply, "hq", sv[1], (uint16_t)MOCK_MTU);
+	}
+	/* message holds a duplicate */
+	close(sv[1]);
+	if (r < 0) {
+		close(sv[0]);
+		sd_bus_message_unref(reply);
+		return r;
+	}
+
+	*our_fd = sv[0];
+	sd_event_add_io(event, src, sv[0], events, cb, ch);
+	return reply_delayed(reply, 0, NULL, NULL);
+}
+
+static int method_acquire_write(sd_bus_message* m, void* user,
+								sd_bus_error* err)
+{
+	struct mchar* ch = user;
+
+	stats.calls++;
+	if (!char_has_flag(ch, "write-without-response")) {
+		return reply_error(m, "org.bluez.Error.NotSupported",
+						   "Operation is not supported");
+	}
+	return reply_acquire(m, ch, &ch->write_fd, &ch->write_src, write_fd_cb,
+						 EPOLLIN);
+}
+
+static int method_acquire_notify(sd_bus_message* m, void* user,
+								 sd_bus_error* err)
+{
+	struct mchar* ch = user;
+
+	stats.calls++;
+	if (!char_has_flag(ch, "notify") || ch->notifying) {
+		return reply_error(m, "org.bluez.Error.NotSupported",
+						   "Operation is not supported");
+	}
+	return reply_acquire(m, ch, &ch->notify_fd, &ch->notify_src, notify_fd_cb,
+						 EPOLLHUP);
+}
+
+static int method_desc_read(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	struct mchar* ch = user;
+	sd_bus_message* reply = NULL;
+
+	stats.calls++;
+	int r = sd_bus_message_new_method_return(m, &reply);
+	if (r >= 0) {
+		r = sd_bus_message_append_array(reply, 'y', ch->desc_value,
+										strlen(ch->desc_value));
+	}
+	if (r < 0) {
+		sd_bus_message_unref(reply);
+		return r;
+	}
+	return reply_delayed(reply, 0, NULL, NULL);
+}
+
+/* clang-format off */
+static const sd_bus_vtable char_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("UUID", "s", get_str, offsetof(struct mchar, uuid), SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Service", "o", get_char_serv, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Value", "ay", get_value, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("Notifying", "b", get_bool, offsetof(struct mchar, notifying), SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("Flags", "as", get_flags, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_METHOD("ReadValue", "a{sv}", "ay", method_read_value, 0),
+	SD_BUS_METHOD("WriteValue", "aya{sv}", "", method_write_value, 0),
+	SD_BUS_METHOD("StartNotify", "", "", method_start_notify, 0),
+	SD_BUS_METHOD("StopNotify", "", "", method_stop_notify, 0),
+	SD_BUS_METHOD("AcquireWrite", "a{sv}", "hq", method_acquire_write, 0),
+	SD_BUS_METHOD("AcquireNotify", "a{sv}", "hq", method_acquire_notify, 0),
+	SD_BUS_VTABLE_END
+};
+
+static const sd_bus_vtable desc_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("UUID", "s", get_desc_uuid, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Characteristic", "o", get_desc_char, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Value", "ay", get_desc_value, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_METHOD("ReadValue", "a{sv}", "ay", method_desc_read, 0),
+	SD_BUS_VTABLE_END
+};
+
+static const sd_bus_vtable serv_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("UUID", "s", get_str, offsetof(struct mserv, uuid), SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Primary", "b", get_true, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Device", "o", get_serv_dev, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_VTABLE_END
+};
+/* clang-format on */
+
+/* --- Device1 --- */
+
+static int gatt_add(struct mdev* dev)
+{
+	int r = 0;
+
+	for (int s = 0; r >= 0 && s < conf.num_servs; s++) {
+		struct mserv* srv = &dev->servs[s];
+		r = sd_bus_add_object_vtable(bus, &srv->slot, srv->path,
+									 "org.bluez.GattService1", serv_vtable,
+									 srv);
+		for (int c = 0; r >= 0 && c < conf.num_chars; c++) {
+			struct mchar* ch = &srv->chars[c];
+			r = sd_bus_add_object_vtable(bus, &ch->slot, ch->path,
+										 "org.bluez.GattCharacteristic1",
+										 char_vtable, ch);
+			if (r >= 0) {
+				r = sd_bus_add_object_vtable(bus, &ch->desc_slot,
+											 ch->desc_path,
+											 "org.bluez.GattDescriptor1",
+											 desc_vtable, ch);
+			}
+		}
+	}
+
+	for (int s = 0; r >= 0 && s < conf.num_servs; s++) {
+		struct mserv* srv = &dev->servs[s];
+		sd_bus_emit_object_added(bus, srv->path);
+		for (int c = 0; c < conf.num_chars; c++) {
+			sd_bus_emit_object_added(bus, srv->chars[c].path);
+			sd_bus_emit_object_added(bus, srv->chars[c].desc_path);
+		}
+	}
+
+	if (r < 0) {
+		LOG_ERR("failed to add GATT objects: %s", strerror(-r));
+	}
+	return r;
+}
+
+static void gatt_remove(struct mdev* dev)
+{
+	for (int s = 0; s < conf.num_servs; s++) {
+		struct mserv* srv = &dev->servs[s];
+		if (srv->slot == NULL) {
+			continue;
+		}
+		for (int c = 0; c < conf.num_chars; c++) {
+			struct mchar* ch = &srv->chars[c];
+			sd_bus_emit_object_removed(bus, ch->desc_path);
+			sd_bus_emit_object_removed(bus, ch->path);
+			ch->desc_slot = sd_bus_slot_unref(ch->desc_slot);
+			ch->slot = sd_bus_slot_unref(ch->slot);
+			ch->notifying = 0;
+			if (ch->write_fd >= 0) {
+				ch->write_src = sd_event_source_unref(ch->write_src);
+				close(ch->write_fd);
+				ch->write_fd = -1;
+			}
+			if (ch->notify_fd >= 0) {
+				ch->notify_src = sd_event_source_unref(ch->notify_src);
+				close(ch->notify_fd);
+				ch->notify_fd = -1;
+			}
+		}
+		sd_bus_emit_object_removed(bus, srv->path);
+		srv->slot = sd_bus_slot_unref(srv->slot);
+	}
+}
+
+static void dev_set_connected(struct mdev* dev, int connected)
+{
+	if (dev->connected == connected) {
+		return;
+	}
+
+	dev->connected = connected;
+	sd_bus_emit_properties_changed(bus, dev->path, "org.bluez.Device1",
+								   "Connected", NULL);
+	if (!connected) {
+		gatt_remove(dev);
+		dev->resolved = 0;
+		sd_bus_emit_properties_changed(bus, dev->path, "org.bluez.Device1",
+									   "ServicesResolved", NULL);
+	}
+}
+
+/* after the Connect reply: export GATT objects, then ServicesResolved */
+static void dev_resolve(void* user)
+{
+	struct mdev* dev = user;
+
+	if (!dev->connected || dev->resolved) {
+		return;
+	}
+	if (gatt_add(dev) < 0) {
+		return;
+	}
+	dev->resolved = 1;
+	sd_bus_emit_properties_changed(bus, dev->path, "org.bluez.Device1",
+								   "ServicesResolved", NULL);
+}
+
+static void dev_connected(void* user)
+{
+	struct mdev* dev = user;
+	dev_set_connected(dev, 1);
+	dev_resolve(dev);
+}
+
+static int dev_connect(sd_bus_message* m, struct mdev* dev,
+					   sd_bus_message* reply)
+{
+	stats.calls++;
+	stats.connects++;
+
+	if (dev->connected) {
+		/* BlueZ replies immediately when already connected */
+		return reply_delayed(reply, 0, NULL, NULL);
+	}
+	return reply_delayed(reply, conf.connect_ms, dev_connected, dev);
+}
+
+static int method_connect(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	sd_bus_message* reply = NULL;
+	int r = sd_bus_message_new_method_return(m, &reply);
+	if (r < 0) {
+		return r;
+	}
+	return dev_connect(m, user, reply);
+}
+
+static int method_disconnect(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	struct mdev* dev = user;
+
+	stats.calls++;
+	dev_set_connected(dev, 0);
+	return reply_empty(m, 0, NULL, NULL);
+}
+
+/* clang-format off */
+static const sd_bus_vtable dev_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("Address", "s", get_str, offsetof(struct mdev, address), SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("AddressType", "s", get_const_str, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Name", "s", get_str, offsetof(struct mdev, name), SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("RSSI", "n", get_int16, offsetof(struct mdev, rssi), SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("UUIDs", "as", get_dev_uuids, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("Connected", "b", get_bool, offsetof(struct mdev, connected), SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("ServicesResolved", "b", get_bool, offsetof(struct mdev, resolved), SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_METHOD("Connect", "", "", method_connect, 0),
+	SD_BUS_METHOD("Disconnect", "", "", method_disconnect, 0),
+	SD_BUS_VTABLE_END
+};
+/* clang-format on */
+
+/* --- Adapter1 --- */
+
+static int scan_timer_cb(sd_event_source* s, uint64_t usec, void* user)
+{
+	/* announce one device per tick, round robin, like advertisements */
+	struct mdev* dev = &devs[scan_idx++ % conf.num_devs];
+
+	sd_bus_emit_interfaces_added(bus, dev->path, "org.bluez.Device1", NULL);
+	sd_event_source_set_time(s, usec + 10000);
+	sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+	return 0;
+}
+
+static void discovering_changed(void* user)
+{
+	sd_bus_emit_properties_changed(bus, adapter_path, "org.bluez.Adapter1",
+								   "Discovering", NULL);
+	sd_event_source_set_enabled(scan_timer,
+								discovering ? SD_EVENT_ONESHOT : SD_EVENT_OFF);
+}
+
+static int method_start_discovery(sd_bus_message* m, void* user,
+								  sd_bus_error* err)
+{
+	stats.calls++;
+	discovering = 1;
+	sd_event_source_set_time(scan_timer, now_usec());
+	return reply_empty(m, 0, discovering_changed, NULL);
+}
+
+static int method_stop_discovery(sd_bus_message* m, void* user,
+								 sd_bus_error* err)
+{
+	stats.calls++;
+	discovering = 0;
+	return reply_empty(m, 0, discovering_changed, NULL);
+}
+
+static int method_connect_device(sd_bus_message* m, void* user,
+								 sd_bus_error* err)
+{
+	const char* key;
+	const char* addr = NULL;
+	sd_bus_message* reply = NULL;
+
+	/* find Address in dictionary */
+	int r = sd_bus_message_enter_container(m, 'a', "{sv}");
+	while (r >= 0
+		   && (r = sd_bus_message_enter_container(m, 'e', "sv")) > 0) {
+		r = sd_bus_message_read(m, "s", &key);
+		if (r >= 0 && strcmp(key, "Address") == 0) {
+			r = sd_bus_message_read(m, "v", "s", &addr);
+		} else if (r >= 0) {
+			r = sd_bus_message_skip(m, "v");
+		}
+		if (r >= 0) {
+			r = sd_bus_message_exit_container(m);
+		}
+	}
+	if (r < 0) {
+		return r;
+	}
+
+	for (int i = 0; addr != NULL && i < conf.num_devs; i++) {
+		if (strcasecmp(devs[i].address, addr) == 0) {
+			r = sd_bus_message_new_method_return(m, &reply);
+			if (r >= 0) {
+				r = sd_bus_message_append(reply, "o", devs[i].path);
+			}
+			if (r < 0) {
+				sd_bus_message_unref(reply);
+				return r;
+			}
+			return dev_connect(m, &devs[i], reply);
+		}
+	}
+
+	stats.calls++;
+	return reply_error(m, "org.bluez.Error.Failed", "Device not available");
+}
+
+/* clang-format off */
+static const sd_bus_vtable adapter_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("Address", "s", get_const_str, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_WRITABLE_PROPERTY("Powered", "b", get_adapter_bool, set_powered, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("Discovering", "b", get_adapter_bool, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_METHOD("StartDiscovery", "", "", method_start_discovery, 0),
+	SD_BUS_METHOD("StopDiscovery", "", "", method_stop_discovery, 0),
+	SD_BUS_METHOD("ConnectDevice", "a{sv}", "o", method_connect_device, 0),
+	SD_BUS_VTABLE_END
+};
+/* clang-format on */
+
+/* --- GattManager1 --- */
+
+/* one registered application, see the top of the file. What arrives from
+ * it is counted */
+
+#define APP_PATH_LEN  256
+#define APP_CHARS_MAX 64
+
+struct mapp_char {
+	char path[APP_PATH_LEN];
+	bool read;
+	bool write;
+	bool write_acquire;
+	bool notify;
+	bool notify_acquire;
+	int notify_fd;
+	sd_event_source* notify_src;
+	sd_bus_slot* notify_slot;
+};
+
+static struct {
+	bool registered;
+	char sender[64];
+	char path[APP_PATH_LEN];
+	sd_bus_message* call; /* RegisterApplication, until replied */
+	sd_bus_slot* slot;
+	int num_servs;
+	int num_chars;
+	struct mapp_char chars[APP_CHARS_MAX];
+} app;
+
+static void app_release(void)
+{
+	for (int i = 0; i < app.num_chars; i++) {
+		struct mapp_char* c = &app.chars[i];
+		sd_event_source_unref(c->notify_src);
+		sd_bus_slot_unref(c->notify_slot);
+		if (c->notify_fd >= 0) {
+			close(c->notify_fd);
+		}
+	}
+	sd_bus_slot_unref(app.slot);
+	sd_bus_message_unref(app.call);
+	memset(&app, 0, sizeof(app));
+}
+
+static int app_reply_cb(sd_bus_message* reply, void* user, sd_bus_error* err)
+{
+	unsigned long* count = user;
+
+	if (sd_bus_message_is_method_error(reply, NULL)) {
+		stats.app_errors++;
+	} else if (count != NULL) {
+		(*count)++;
+	}
+	return 0;
+}
+
+/** fd of an Acquire* reply, duplicated as it belongs to the message */
+static int app_reply_fd(sd_bus_message* reply)
+{
+	int fd;
+	uint16_t mtu;
+
+	if (sd_bus_message_is_method_error(reply, NULL)
+		|| sd_bus_message_read(reply, "hq", &fd, &mtu) < 0
+		|| (fd = fcntl(fd, F_DUPFD_CLOEXEC, 3)) < 0) {
+		stats.app_errors++;
+		return -1;
+	}
+	return fd;
+}
+
+static int app_write_fd_cb(sd_bus_message* reply, void* user,
+						   sd_bus_error* err)
+{
+	int fd = app_reply_fd(reply);
+	if (fd < 0) {
+		return 0;
+	}
+	if (write(fd, "mock-fd", 7) == 7) {
+		stats.app_fd_writes++;
+	}
+	/* the application sees the end of the socket */
+	close(fd);
+	return 0;
+}
+
+static int app_notify_fd_read_cb(sd_event_source* s, int fd, uint32_t revents,
+								 void* user)
+{
+	struct mapp_char* c = user;
+	uint8_t buf[VALUE_MAX];
+
+	ssize_t len = read(fd, buf, sizeof(buf));
+	if (len > 0) {
+		stats.app_notifications++;
+	} else if (len == 0 || errno != EAGAIN) {
+		/* closed by the application */
+		c->notify_src = sd_event_source_unref(c->notify_src);
+		close(c->notify_fd);
+		c->notify_fd = -1;
+	}
+	return 0;
+}
+
+static int app_notify_fd_cb(sd_bus_message* reply, void* user,
+							sd_bus_error* err)
+{
+	struct mapp_char* c = user;
+
+	c->notify_fd = app_reply_fd(reply);
+	if (c->notify_fd >= 0) {
+		sd_event_add_io(event, &c->notify_src, c->notify_fd, EPOLLIN,
+						app_notify_fd_read_cb, c);
+	}
+	return 0;
+}
+
+static int app_value_changed_cb(sd_bus_message* m, void* user,
+								sd_bus_error* err)
+{
+	const char* intf;
+	const char* key;
+
+	int r = sd_bus_message_read(m, "s", &intf);
+	if (r < 0 || strcmp(intf, "org.bluez.GattCharacteristic1") != 0) {
+		return 0;
+	}
+
+	/* also Notifying changes */
+	r = sd_bus_message_enter_container(m, 'a', "{sv}");
+	while (r >= 0
+		   && (r = sd_bus_message_enter_container(m, 'e', "sv")) > 0) {
+		r = sd_bus_message_read(m, "s", &key);
+		if (r >= 0 && strcmp(key, "Value") == 0) {
+			stats.app_notifications++;
+		}
+		if (r >= 0) {
+			r = sd_bus_message_skip(m, "v");
+		}
+		if (r >= 0) {
+			r = sd_bus_message_exit_container(m);
+		}
+	}
+	return 0;
+}
+
+static void app_call(const char* path, const char* member,
+					 sd_bus_message_handler_t cb, void* user,
+					 const char* types, ...)
+{
+	sd_bus_message* call = NULL;
+	va_list ap;
+
+	int r = sd_bus_message_new_method_call(bus, &call, app.sender, path,
+										   "org.bluez.GattCharacteristic1",
+										   member);
+	if (r >= 0) {
+		va_start(ap, types);
+		r = sd_bus_message_appendv(call, types, ap);
+		va_end(ap);
+	}
+	if (r >= 0) {
+		r = sd_bus_call_async(bus, NULL, call, cb, user, 0);
+	}
+	if (r < 0) {
+		stats.app_errors++;
+	}
+	sd_bus_message_unref(call);
+}
+
+/** act as a client of the application */
+static void app_exercise(void* user)
+{
+	for (int i = 0; i < app.num_chars; i++) {
+		struct mapp_char* c = &app.chars[i];
+
+		if (c->read) {
+			app_call(c->path, "ReadValue", app_reply_cb, &stats.app_reads,
+					 "a{sv}", 0);
+		}
+		if (c->write) {
+			app_call(c->path, "WriteValue", app_reply_cb, &stats.app_writes,
+					 "aya{sv}", 4, 'm', 'o', 'c', 'k', 0);
+		}
+		if (c->write_acquire) {
+			app_call(c->path, "AcquireWrite", app_write_fd_cb, NULL, "a{sv}",
+					 1, "mtu", "q", (uint16_t)MOCK_MTU);
+		}
+		if (c->notify && c->notify_acquire && !conf.app_signals) {
+			app_call(c->path, "AcquireNotify", app_notify_fd_cb, c, "a{sv}", 1,
+					 "mtu", "q", (uint16_t)MOCK_MTU);
+		} else if (c->notify) {
+			sd_bus_match_signal(bus, &c->notify_slot, app.sender, c->path,
+								"org.freedesktop.DBus.Properties",
+								"PropertiesChanged", app_value_changed_cb,
+								NULL);
+			app_call(c->path, "StartNotify", app_reply_cb, NULL, "");
+		}
+	}
+}
+
+/** properties of a GattCharacteristic1 of the application */
+static int app_parse_char(sd_bus_message* m, struct mapp_char* c)
+{
+	const char* key;
+	char** flags = NULL;
+
+	int r = sd_bus_message_enter_container(m, 'a', "{sv}");
+	while (r >= 0
+		   && (r = sd_bus_message_enter_container(m, 'e', "sv")) > 0) {
+		r = sd_bus_message_read(m, "s", &key);
+		if (r >= 0 && strcmp(key, "Flags") == 0) {
+			r = sd_bus_message_enter_container(m, 'v', "as");
+			if (r >= 0) {
+				r = sd_bus_message_read_strv(m, &flags);
+			}
+			if (r >= 0) {
+				r = sd_bus_message_exit_container(m);
+			}
+		} else if (r >= 0) {
+			c->write_acquire |= strcmp(key, "WriteAcquired") == 0;
+			c->notify_acquire |= strcmp(key, "NotifyAcquired") == 0;
+			r = sd_bus_message_skip(m, "v");
+		}
+		if (r >= 0) {
+			r = sd_bus_message_exit_container(m);
+		}
+	}
+	if (r >= 0) {
+		r = sd_bus_message_exit_container(m);
+	}
+
+	for (int i = 0; flags != NULL && flags[i] != NULL; i++) {
+		c->read |= strcmp(flags[i], "read") == 0;
+		c->write |= strcmp(flags[i], "write") == 0;
+		c->notify |= strcmp(flags[i], "notify") == 0
+					 || strcmp(flags[i], "indicate") == 0;
+		free(flags[i]);
+	}
+	free(flags);
+	return r;
+}
+
+/** GetManagedObjects of the application */
+static int app_parse_objects(sd_bus_message* m)
+{
+	const char* path;
+	const char* intf;
+
+	int r = sd_bus_message_enter_container(m, 'a', "{oa{sa{sv}}}");
+	while (r >= 0
+		   && (r = sd_bus_message_enter_container(m, 'e', "oa{sa{sv}}")) > 0) {
+		r = sd_bus_message_read(m, "o", &path);
+		if (r >= 0) {
+			r = sd_bus_message_enter_container(m, 'a', "{sa{sv}}");
+		}
+		while (r >= 0
+			   && (r = sd_bus_message_enter_container(m, 'e', "sa{sv}")) > 0) {
+			r = sd_bus_message_read(m, "s", &intf);
+			if (r >= 0 && strcmp(intf, "org.bluez.GattCharacteristic1") == 0
+				&& app.num_chars < APP_CHARS_MAX) {
+				struct mapp_char* c = &app.chars[app.num_chars++];
+				snprintf(c->path, APP_PATH_LEN, "%s", path);
+				c->notify_fd = -1;
+				r = app_parse_char(m, c);
+			} else if (r >= 0) {
+				app.num_servs += strcmp(intf, "org.bluez.GattService1") == 0;
+				r = sd_bus_message_skip(m, "a{sv}");
+			}
+			if (r >= 0) {
+				r = sd_bus_message_exit_container(m);
+			}
+		}
+		if (r >= 0) {
+			r = sd_bus_message_exit_container(m);
+		}
+		if (r >= 0) {
+			r = sd_bus_message_exit_container(m);
+		}
+	}
+	if (r >= 0) {
+		r = sd_bus_message_exit_container(m);
+	}
+	return r;
+}
+
+static int app_objects_cb(sd_bus_message* reply, void* user,
+						  sd_bus_error* err)
+{
+	sd_bus_message* call = app.call;
+	int r;
+
+	app.slot = sd_bus_slot_unref(app.slot);
+	app.call = NULL;
+
+	if (sd_bus_message_is_method_error(reply, NULL)
+		|| app_parse_objects(reply) < 0 || app.num_servs == 0) {
+		r = reply_error(call, "org.bluez.Error.InvalidArguments",
+						"No object received");
+		app_release();
+	} else {
+		LOG_INF("application %s %s: %d services, %d characteristics",
+				app.sender, app.path, app.num_servs, app.num_chars);
+		stats.apps++;
+		app.registered = true;
+		r = reply_empty(call, 0, app_exercise, NULL);
+	}
+	sd_bus_message_unref(call);
+	return r;
+}
+
+static int method_register_app(sd_bus_message* m, void* user,
+							   sd_bus_error* err)
+{
+	const char* path;
+
+	stats.calls++;
+	int r = sd_bus_message_read(m, "o", &path);
+	if (r < 0) {
+		return r;
+	}
+	if (app.registered || app.call != NULL) {
+		return reply_error(m, "org.bluez.Error.AlreadyExists",
+						   "Already Exists");
+	}
+
+	snprintf(app.sender, sizeof(app.sender), "%s",
+			 sd_bus_message_get_sender(m));
+	snprintf(app.path, APP_PATH_LEN, "%s", path);
+	app.call = sd_bus_message_ref(m);
+
+	/* replied when the objects have been read, like BlueZ */
+	r = sd_bus_call_method_async(bus, &app.slot, app.sender, app.path,
+								 "org.freedesktop.DBus.ObjectManager",
+								 "GetManagedObjects", app_objects_cb, NULL,
+								 "");
+	if (r < 0) {
+		app_release();
+		return r;
+	}
+	return 1;
+}
+
+static int method_unregister_app(sd_bus_message* m, void* user,
+								 sd_bus_error* err)
+{
+	const char* path;
+
+	stats.calls++;
+	int r = sd_bus_message_read(m, "o", &path);
+	if (r < 0) {
+		return r;
+	}
+	if (!app.registered || strcmp(path, app.path) != 0) {
+		return reply_error(m, "org.bluez.Error.DoesNotExist",
+						   "Does Not Exist");
+	}
+	app_release();
+	return reply_empty(m, 0, NULL, NULL);
+}
+
+/* clang-format off */
+static const sd_bus_vtable gatt_manager_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("RegisterApplication", "oa{sv}", "", method_register_app, 0),
+	SD_BUS_METHOD("UnregisterApplication", "o", "", method_unregister_app, 0),
+	SD_BUS_VTABLE_END
+};
+/* clang-format on */
+
+/* --- LEAdvertisingManager1 --- */
+
+#define ADVS_MAX 4
+
+struct madv {
+	bool used;
+	bool registered;
+	char sender[64];
+	char path[APP_PATH_LEN];
+	sd_bus_message* call; /* RegisterAdvertisement, until replied */
+	sd_bus_slot* slot;
+	sd_bus_slot* changed_slot;
+};
+
+static struct madv advs[ADVS_MAX];
+
+static void adv_release(struct madv* a)
+{
+	sd_bus_slot_unref(a->slot);
+	sd_bus_slot_unref(a->changed_slot);
+	sd_bus_message_unref(a->call);
+	memset(a, 0, sizeof(*a));
+}
+
+static int adv_changed_cb(sd_bus_message* m, void* user, sd_bus_error* err)
+{
+	const char* intf;
+
+	int r = sd_bus_message_read(m, "s", &intf);
+	if (r >= 0 && strcmp(intf, "org.bluez.LEAdvertisement1") == 0) {
+		stats.adv_updates++;
+	}
+	return 0;
+}
+
+/** GetAll of the advertisement, which needs at least a Type */
+static int adv_parse(sd_bus_message* m)
+{
+	const char* key;
+	bool type = false;
+
+	int r = sd_bus_message_enter_container(m, 'a', "{sv}");
+	while (r >= 0
+		   && (r = sd_bus_message_enter_container(m, 'e', "sv")) > 0) {
+		r = sd_bus_message_read(m, "s", &key);
+		if (r >= 0) {
+			type |= strcmp(key, "Type") == 0;
+			r = sd_bus_message_skip(m, "v");
+		}
+		if (r >= 0) {
+			r = sd_bus_message_exit_container(m);
+		}
+	}
+	if (r >= 0) {
+		r = sd_bus_message_exit_container(m);
+	}
+	return r < 0 ? r : type ? 0 : -EINVAL;
+}
+
+static int adv_props_cb(sd_bus_message* reply, void* user, sd_bus_error* err)
+{
+	struct madv* a = user;
+	sd_bus_message* call = a->call;
+	int r;
+
+	a->slot = sd_bus_slot_unref(a->slot);
+	a->call = NULL;
+
+	if (sd_bus_message_is_method_error(reply, NULL) || adv_parse(reply) < 0) {
+		r = reply_error(call, "org.bluez.Error.InvalidArguments",
+						"Invalid Arguments");
+		adv_release(a);
+	} else {
+		LOG_INF("advertisement %s %s", a->sender, a->path);
+		stats.advs++;
+		a->registered = true;
+		sd_bus_match_signal(bus, &a->changed_slot, a->sender, a->path,
+							"org.freedesktop.DBus.Properties",
+							"PropertiesChanged", adv_changed_cb, a);
+		r = reply_empty(call, 0, NULL, NULL);
+	}
+	sd_bus_message_unref(call);
+	return r;
+}
+
+static struct madv* adv_find(const char* sender, const char* path)
+{
+	for (int i = 0; i < ADVS_MAX; i++) {
+		if (advs[i].used && strcmp(advs[i].sender, sender) == 0
+			&& strcmp(advs[i].path, path) == 0) {
+			return &advs[i];
+		}
+	}
+	return NULL;
+}
+
+static int method_register_adv(sd_bus_message* m, void* user,
+							   sd_bus_error* err)
+{
+	const char* path;
+	struct madv* a = NULL;
+
+	stats.calls++;
+	int r = sd_bus_message_read(m, "o", &path);
+	if (r < 0) {
+		return r;
+	}
+	if (adv_find(sd_bus_message_get_sender(m), path) != NULL) {
+		return reply_error(m, "org.bluez.Error.AlreadyExists",
+						   "Already Exists");
+	}
+	for (int i = 0; i < ADVS_MAX && a == NULL; i++) {
+		a = advs[i].used ? NULL : &advs[i];
+	}
+	if (a == NULL) {
+		return reply_error(m, "org.bluez.Error.NotPermitted",
+						   "Maximum advertisements reached");
+	}
+
+	a->used = true;
+	snprintf(a->sender, sizeof(a->sender), "%s", sd_bus_message_get_sender(m));
+	snprintf(a->path, APP_PATH_LEN, "%s", path);
+	a->call = sd_bus_message_ref(m);
+
+	r = sd_bus_call_method_async(bus, &a->slot, a->sender, a->path,
+								 "org.freedesktop.DBus.Properties", "GetAll",
+								 adv_props_cb, a, "s",
+								 "org.bluez.LEAdvertisement1");
+	if (r < 0) {
+		adv_release(a);
+		return r;
+	}
+	return 1;
+}
+
+static int method_unregister_adv(sd_bus_message* m, void* user,
+								 sd_bus_error* err)
+{
+	const char* path;
+
+	stats.calls++;
+	int r = sd_bus_message_read(m, "o", &path);
+	if (r < 0) {
+		return r;
+	}
+	struct madv* a = adv_find(sd_bus_message_get_sender(m), path);
+	if (a == NULL || !a->registered) {
+		return reply_error(m, "org.bluez.Error.DoesNotExist",
+						   "Does Not Exist");
+	}
+	adv_release(a);
+	return reply_empty(m, 0, NULL, NULL);
+}
+
+/* clang-format off */
+static const sd_bus_vtable adv_manager_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("RegisterAdvertisement", "oa{sv}", "", method_register_adv, 0),
+	SD_BUS_METHOD("UnregisterAdvertisement", "o", "", method_unregister_adv, 0),
+	SD_BUS_VTABLE_END
+};
+/* clang-format on */
+
+/* --- setup --- */
+
+static const char* char_flags[3][MAX_FLAGS + 1] = {
+	{"read", "write", "write-without-response", NULL},
+	{"read", "notify", NULL},
+	{"read", NULL},
+};
+
+static int objects_create(void)
+{
+	int r;
+
+	devs = calloc(conf.num_devs, sizeof(struct mdev));
+	if (devs == NULL) {
+		return -ENOMEM;
+	}
+
+	for (int d = 0; d < conf.num_devs; d++) {
+		struct mdev* dev = &devs[d];
+		uint8_t mac[6] = {d & 0xff, d >> 8, 0, 0, 0, 0};
+
+		blz_mac_to_string(mac, dev->address);
+		snprintf(dev->path, PATH_LEN, "%s/dev_00_00_00_00_%02X_%02X",
+				 adapter_path, mac[1], mac[0]);
+		snprintf(dev->name, sizeof(dev->name), "mock%d", d);
+		dev->rssi = -40 - d % 50;
+
+		dev->servs = calloc(conf.num_servs, sizeof(struct mserv));
+		if (dev->servs == NULL) {
+			return -ENOMEM;
+		}
+
+		for (int s = 0; s < conf.num_servs; s++) {
+			struct mserv* srv = &dev->servs[s];
+			srv->dev = dev;
+			snprintf(srv->path, PATH_LEN, "%s/service%04x", dev->path, s + 1);
+			snprintf(srv->uuid, BLZ_UUID_STR_LEN,
+					 "6e40%02x00-b5a3-f393-e0a9-e50e24dcca9e", s + 1);
+
+			srv->chars = calloc(conf.num_chars, sizeof(struct mchar));
+			if (srv->chars == NULL) {
+				return -ENOMEM;
+			}
+
+			for (int c = 0; c < conf.num_chars; c++) {
+				struct mchar* ch = &srv->chars[c];
+				ch->serv = srv;
+				ch->write_fd = ch->notify_fd = -1;
+				snprintf(ch->path, PATH_LEN, "%s/char%04x", srv->path, c + 1);
+				snprintf(ch->desc_path, PATH_LEN, "%s/desc0001", ch->path);
+				snprintf(ch->uuid, BLZ_UUID_STR_LEN,
+						 "6e40%02x%02x-b5a3-f393-e0a9-e50e24dcca9e", s + 1,
+						 c + 1);
+				snprintf(ch->desc_value, sizeof(ch->desc_value), "char %d.%d",
+						 s + 1, c + 1);
+				memcpy(ch->flags, char_flags[c % 3], sizeof(ch->flags));
+				ch->len = snprintf((char*)ch->value, VALUE_MAX, "%s %d.%d",
+								   dev->name, s + 1, c + 1);
+			}
+		}
+
+		r = sd_bus_add_object_vtable(bus, &dev->slot, dev->path,
+									 "org.bluez.Device1", dev_vtable, dev);
+		if (r < 0) {
+			return r;
+		}
+	}
+
+	r = sd_bus_add_object_vtable(bus, NULL, adapter_path,
+								 "org.bluez.Adapter1", adapter_vtable, NULL);
+	if (r < 0) {
+		return r;
+	}
+	r = sd_bus_add_object_vtable(bus, NULL, adapter_path,
+								 "org.bluez.GattManager1", gatt_manager_vtable,
+								 NULL);
+	if (r < 0) {
+		return r;
+	}
+	return sd_bus_add_object_vtable(bus, NULL, adapter_path,
+									"org.bluez.LEAdvertisingManager1",
+									adv_manager_vtable, NULL);
+}
+
+static int signal_cb(sd_event_source* s, const struct signalfd_siginfo* si,
+					 void* user)
+{
+	sd_event_exit(event, 0);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"blz-mock-bluez -a bus-address [options]\n"
+			"  -i name   adapter name (hci0)\n"
+			"  -d num    number of devices (10)\n"
+			"  -s num    services per device (3)\n"
+			"  -c num    characteristics per service (4)\n"
+			"  -n hz     notification rate of notifying characteristics (0)\n"
+			"  -p bytes  notification payload size (20)\n"
+			"  -l ms     reply latency (0)\n"
+			"  -j ms     additional random reply latency (0)\n"
+			"  -C ms     additional connect latency (0)\n"
+			"  -e        echo writes as notification\n"
+			"  -S        subscribe to notifications of applications with\n"
+			"            StartNotify instead of AcquireNotify\n");
+}
+
+int main(int argc, char** argv)
+{
+	int c, r;
+
+	while ((c = getopt(argc, argv, "a:i:d:s:c:n:p:l:j:C:eSh")) != -1) {
+		switch (c) {
+		case 'a':
+			conf.address = optarg;
+			break;
+		case 'i':
+			conf.adapter = optarg;
+			break;
+		case 'd':
+			conf.num_devs = MAX(atoi(optarg), 1);
+			break;
+		case 's':
+			conf.num_servs = MIN(MAX(atoi(optarg), 1), 0xff);
+			break;
+		case 'c':
+			conf.num_chars = MIN(MAX(atoi(optarg), 1), 0xff);
+			break;
+		case 'n':
+			conf.notify_hz = MAX(atoi(optarg), 0);
+			break;
+		case 'p':
+			conf.payload = atoi(optarg);
+			break;
+		case 'l':
+			conf.latency_ms = MAX(atoi(optarg), 0);
+			break;
+		case 'j':
+			conf.jitter_ms = MAX(atoi(optarg), 0);
+			break;
+		case 'C':
+			conf.connect_ms = MAX(atoi(optarg), 0);
+			break;
+		case 'e':
+			conf.echo = true;
+			break;
+		case 'S':
+			conf.app_signals = true;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (conf.address == NULL || conf.num_devs > 0xffff) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	snprintf(adapter_path, PATH_LEN, "/org/bluez/%s", conf.adapter);
+
+	sigset_t ss;
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGINT);
+	sigaddset(&ss, SIGTERM);
+	sigprocmask(SIG_BLOCK, &ss, NULL);
+
+	r = sd_event_new(&event);
+	if (r >= 0) {
+		r = sd_bus_new(&bus);
+	}
+	if (r >= 0) {
+		r = sd_bus_set_address(bus, conf.address);
+	}
+	if (r >= 0) {
+		sd_bus_set_bus_client(bus, 1);
+		sd_bus_negotiate_fds(bus, 1);
+		r = sd_bus_start(bus);
+	}
+	if (r < 0) {
+		LOG_ERR("failed to connect to bus: %s", strerror(-r));
+		return EXIT_FAILURE;
+	}
+
+	r = sd_bus_add_object_manager(bus, NULL, "/");
+	if (r >= 0) {
+		r = objects_create();
+	}
+	if (r >= 0) {
+		r = sd_bus_request_name(bus, "org.bluez", 0);
+	}
+	if (r < 0) {
+		LOG_ERR("failed to set up objects: %s", strerror(-r));
+		return EXIT_FAILURE;
+	}
+
+	sd_event_add_signal(event, NULL, SIGINT, signal_cb, NULL);
+	sd_event_add_signal(event, NULL, SIGTERM, signal_cb, NULL);
+	sd_event_add_time(event, &scan_timer, CLOCK_MONOTONIC, 0, 1,
+					  scan_timer_cb, NULL);
+	sd_event_source_set_enabled(scan_timer, SD_EVENT_OFF);
+	if (conf.notify_hz > 0) {
+		sd_event_add_time(event, &notify_timer, CLOCK_MONOTONIC, now_usec(),
+						  1, notify_timer_cb, NULL);
+	}
+	sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+
+	LOG_INF("mock org.bluez: %d devices, %d services, %d characteristics",
+			conf.num_devs, conf.num_servs, conf.num_chars);
+
+	r = sd_event_loop(event);
+
+	LOG_INF("calls %lu reads %lu writes %lu fd-writes %lu notifications %lu "
+			"connects %lu in-progress %lu",
+			stats.calls, stats.reads, stats.writes, stats.fd_writes,
+			stats.notifications, stats.connects, stats.in_progress);
+	if (stats.apps > 0) {
+		LOG_INF("applications %lu reads %lu writes %lu fd-writes %lu "
+				"notifications %lu errors %lu",
+				stats.apps, stats.app_reads, stats.app_writes,
+				stats.app_fd_writes, stats.app_notifications,
+				stats.app_errors);
+	}
+	if (stats.advs > 0) {
+		LOG_INF("advertisements %lu updates %lu", stats.advs,
+				stats.adv_updates);
+	}
+
+	sd_bus_flush_close_unref(bus);
+	sd_event_unref(event);
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}